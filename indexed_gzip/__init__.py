@@ -12,7 +12,13 @@ from .indexed_gzip import (_IndexedGzipFile,     # noqa
                            open,
                            NotCoveredError,
                            NoHandleError,
-                           ZranError)
+                           ZranError,
+                           CrcError,
+                           set_global_window_budget,
+                           global_window_bytes,
+                           set_span_cache_budget,
+                           set_disk_cache,
+                           span_cache_info)
 
 
 SafeIndexedGzipFile = IndexedGzipFile
@@ -29,7 +29,8 @@ from cpython.mem                cimport (PyMem_Malloc,
 from cpython.buffer             cimport (PyObject_GetBuffer,
                                          PyBuffer_Release,
                                          PyBUF_ANY_CONTIGUOUS,
-                                         PyBUF_SIMPLE)
+                                         PyBUF_SIMPLE,
+                                         PyBUF_WRITABLE)
 
 from cpython.ref                cimport (PyObject,
                                          Py_XDECREF)
@@ -110,6 +111,86 @@ cdef get_python_exception():
     return None
 
 
+cdef zran.zran_reader_t **open_readers(zran.zran_index_t *index,
+                                       filename,
+                                       errname,
+                                       uint32_t           nreaders) except *:
+    """Creates ``nreaders`` readers for the given index, each with its own
+    handle to ``filename``, for use by multi-threaded ``zran`` functions.
+    The readers must be freed with :func:`close_readers`.
+    """
+    cdef zran.zran_reader_t **readers
+    cdef uint32_t             i
+    cdef FILE                *fd
+
+    readers = <zran.zran_reader_t **>PyMem_Malloc(
+        nreaders * sizeof(zran.zran_reader_t *))
+    if readers is NULL:
+        raise MemoryError('PyMem_Malloc fail')
+
+    for i in range(nreaders):
+        readers[i] = NULL
+
+    try:
+        for i in range(nreaders):
+            fd = fopen(filename.encode(), 'rb')
+            if fd is NULL:
+                raise IOError('Could not open {}'.format(filename))
+
+            readers[i] = zran.zran_reader_create(index, fd, NULL)
+            if readers[i] is NULL:
+                fclose(fd)
+                raise ZranError('zran_reader_create returned error '
+                                '(file: {})'.format(errname))
+    except Exception:
+        close_readers(readers, nreaders)
+        raise
+
+    return readers
+
+
+cdef void close_readers(zran.zran_reader_t **readers, uint32_t nreaders):
+    """Closes and frees readers created by :func:`open_readers`. """
+    cdef uint32_t i
+    if readers is NULL:
+        return
+    for i in range(nreaders):
+        if readers[i] is not NULL:
+            fclose(readers[i].fd)
+            zran.zran_reader_free(readers[i])
+    PyMem_Free(readers)
+
+
+def iter_chunks(fobj, chunksize, offset, length, threads):
+    """Used by the ``iter_chunks`` methods of :class:`IndexedGzipFile` and
+    :class:`_IndexedGzipFile`. Yields successive chunks of data read with
+    ``fobj.read_parallel``.
+    """
+
+    if chunksize is None:
+        chunksize = max(fobj.spacing, 1048576) * threads * 4
+    if chunksize < 1:
+        raise ValueError('chunksize must be >= 1')
+
+    while length != 0:
+        if length < 0: nbytes = chunksize
+        else:          nbytes = min(chunksize, length)
+
+        chunk = fobj.read_parallel(offset, nbytes, threads)
+
+        if len(chunk) == 0:
+            break
+
+        yield chunk
+
+        if len(chunk) < nbytes:
+            break
+
+        offset += len(chunk)
+        if length > 0:
+            length -= len(chunk)
+
+
 class IndexedGzipFile(io.BufferedReader):
     """The ``IndexedGzipFile`` class allows for fast random access of a gzip
     file by using the ``zran`` library to build and maintain an index of seek
@@ -121,7 +202,9 @@ class IndexedGzipFile(io.BufferedReader):
     through buffering, and access to the I/O methods is made thread-safe.
 
     A :meth:`pread` method is also implemented, as it is not implemented by
-    the ``io.BufferedReader``.
+    the ``io.BufferedReader``. Once the index has been completely built,
+    calls to :meth:`pread` from different threads are performed in
+    parallel (see :meth:`_IndexedGzipFile.reader`).
     """
 
 
@@ -168,6 +251,42 @@ class IndexedGzipFile(io.BufferedReader):
                                if provided, passed through to
                                :meth:`import_index`.
 
+        :arg lazy_index:       Defaults to ``False``. If ``True``, the
+                               ``index_file`` is imported lazily - see
+                               :meth:`import_index`.
+
+        :arg huge_pages:       Defaults to ``False``. If ``True``, the kernel
+                               is asked to back the memory used to store
+                               index seek point data with transparent huge
+                               pages, where supported.
+
+        :arg compress_windows: Defaults to ``False``. If ``True``, the data
+                               stored with each index seek point is kept
+                               compressed in memory, and decompressed when
+                               it is needed. This reduces the memory used by
+                               the index, at the cost of slower seeks.
+
+        :arg sparse_windows:   Defaults to ``False``. If ``True``, only the
+                               parts of the data stored with each index seek
+                               point which are actually needed to resume
+                               decompression from that point are kept. This
+                               reduces the size of the index, both in memory
+                               and when exported, at the cost of a slower
+                               index build.
+
+        :arg window_budget:    Maximum number of bytes of seek point data to
+                               keep in memory. Defaults to ``None`` (no
+                               limit). When the limit is exceeded, the data
+                               of infrequently used seek points is discarded,
+                               and seeks near those points start decompressing
+                               from an earlier seek point instead. See also
+                               :func:`set_global_window_budget`.
+
+        :arg readahead:        Defaults to ``False``. If ``True``, data is
+                               decompressed ahead of sequential and
+                               strided reads on a background thread - see
+                               :meth:`_IndexedGzipFile.set_readahead`.
+
         :arg buffer_size:      Optional, must be passed as a keyword argument.
                                Passed through to
                                ``io.BufferedReader.__init__``. If not provided,
@@ -175,10 +294,11 @@ class IndexedGzipFile(io.BufferedReader):
                                is given else 4 MiB is used.
         """
 
-        # Use 4x spacing because each raw read seeks from the last index point
-        # even if the position did not change since the last read call. On
-        # average, this incurs an overhead of spacing / 2. For 4x spacing, this
-        # overhead would be 1/8 = 12.5%, which should be negligible. The
+        # Raw reads which start where the previous one finished carry on
+        # inflating from there, so sequential reads incur no overhead. But
+        # a raw read after a seek has to start from the last index point,
+        # which on average incurs an overhead of spacing / 2. We use 4x
+        # spacing so that this overhead is at most 1/8 = 12.5%. The
         # increased memory-usage is not an issue because internally many buffers
         # are also allocated with 4 * spacing size.
         # Note that setting the buffer_size too high might incur performance
@@ -189,12 +309,13 @@ class IndexedGzipFile(io.BufferedReader):
 
         fobj               = _IndexedGzipFile(*args, **kwargs)
         self.__file_lock   = threading.RLock()
+        self.__no_readers  = threading.Condition(self.__file_lock)
+        self.__nreaders    = 0
+        self.__readers     = threading.local()
+        self.__allreaders  = []
         self.__igz_fobj    = fobj
         self.__buffer_size = buffer_size
 
-        self.build_full_index = fobj.build_full_index
-        self.import_index     = fobj.import_index
-        self.export_index     = fobj.export_index
         self.fileobj          = fobj.fileobj
         self.drop_handles     = fobj.drop_handles
         self.seek_points      = fobj.seek_points
@@ -202,15 +323,169 @@ class IndexedGzipFile(io.BufferedReader):
         super(IndexedGzipFile, self).__init__(fobj, buffer_size)
 
 
+    @contextlib.contextmanager
+    def __exclusive(self):
+        """Context manager used by methods which modify the index. Waits
+        until all in-progress concurrent :meth:`pread` calls have finished,
+        and prevents new ones from starting.
+        """
+        with self.__file_lock:
+            while self.__nreaders > 0:
+                self.__no_readers.wait()
+            yield
+
+
+    def __reader(self):
+        """Returns a :class:`_IndexedGzipReader` for use by the calling
+        thread, or ``None`` if concurrent reads are not possible, because
+        the index has not been completely built, or because this
+        ``IndexedGzipFile`` was not created with a file name.
+
+        Must be called with the file lock held.
+        """
+        fobj = self.__igz_fobj
+
+        if fobj.filename is None or not fobj.index_complete:
+            return None
+
+        reader = getattr(self.__readers, 'reader', None)
+        if reader is None:
+            reader = fobj.reader()
+            self.__readers.reader = reader
+            self.__allreaders.append(reader)
+
+        return reader
+
+
     def pread(self, nbytes, offset):
-        """Seeks to ``offset``, then reads and returns up to ``nbytes``.
-        The calls to seek and read are protected by a ``threading.RLock``.
+        """Reads and returns up to ``nbytes`` bytes, starting from ``offset``.
+
+        If the index has been completely built, and this ``IndexedGzipFile``
+        was created with a file name, the read is performed with a
+        :class:`_IndexedGzipReader` owned by the calling thread, so that
+        calls from different threads are performed in parallel, and the
+        current seek location is not changed. Otherwise this method seeks
+        to ``offset`` and then reads, with the calls to seek and read
+        protected by a ``threading.RLock``.
         """
+
+        reader = None
+
+        if nbytes >= 0:
+            with self.__file_lock:
+                reader = self.__reader()
+                if reader is not None:
+                    self.__nreaders += 1
+
+        if reader is not None:
+            try:
+                return reader.pread(nbytes, offset)
+            finally:
+                with self.__file_lock:
+                    self.__nreaders -= 1
+                    if self.__nreaders == 0:
+                        self.__no_readers.notify_all()
+
         with self.__file_lock:
             self.seek(offset)
             return self.read(nbytes)
 
 
+    def export_index(self,
+                     filename=None,
+                     fileobj=None,
+                     compact=False,
+                     format='gzidx'):
+        """Exports the file index. See :meth:`_IndexedGzipFile.export_index`.
+        """
+        with self.__file_lock:
+            self.__igz_fobj.export_index(filename, fileobj, compact, format)
+
+
+    def build_full_index(self, threads=1):
+        """Re-builds the full file index. See
+        :meth:`_IndexedGzipFile.build_full_index`.
+        """
+        with self.__exclusive():
+            self.__igz_fobj.build_full_index(threads=threads)
+
+
+    def verify(self, threads=1):
+        """Verifies the CRC32 and size of every GZIP stream in the file. See
+        :meth:`_IndexedGzipFile.verify`.
+        """
+        with self.__exclusive():
+            self.__igz_fobj.verify(threads=threads)
+
+
+    @property
+    def spacing(self):
+        """Returns the index point spacing. """
+        return self.__igz_fobj.spacing
+
+
+    def read_parallel(self, offset=0, length=-1, threads=1):
+        """Reads data from any part of the file using multiple threads. See
+        :meth:`_IndexedGzipFile.read_parallel`.
+        """
+        with self.__exclusive():
+            return self.__igz_fobj.read_parallel(offset, length, threads)
+
+
+    def iter_chunks(self, chunksize=None, offset=0, length=-1, threads=1):
+        """Iterates over data read using multiple threads. See
+        :meth:`_IndexedGzipFile.iter_chunks`.
+        """
+        return iter_chunks(self, chunksize, offset, length, threads)
+
+
+    def read_ranges(self, ranges, bufs=None, threads=1):
+        """Reads several ranges of data in one pass. See
+        :meth:`_IndexedGzipFile.read_ranges`.
+        """
+        with self.__exclusive():
+            return self.__igz_fobj.read_ranges(ranges, bufs, threads)
+
+
+    def set_readahead(self, enable=True):
+        """Enables or disables readahead. See
+        :meth:`_IndexedGzipFile.set_readahead`.
+        """
+        with self.__exclusive():
+            self.__igz_fobj.set_readahead(enable)
+
+
+    @property
+    def readahead_bytes(self):
+        """Returns the number of bytes which have been read from the
+        readahead buffers. See :meth:`_IndexedGzipFile.readahead_bytes`.
+        """
+        return self.__igz_fobj.readahead_bytes
+
+
+    def import_index(self, filename=None, fileobj=None, lazy=False):
+        """Import index data from the given file. See
+        :meth:`_IndexedGzipFile.import_index`.
+        """
+        with self.__exclusive():
+            self.__igz_fobj.import_index(filename=filename,
+                                         fileobj=fileobj,
+                                         lazy=lazy)
+
+
+    def close(self):
+        """Closes this ``IndexedGzipFile``, after waiting for any in-progress
+        concurrent :meth:`pread` calls to finish. The readers used by
+        :meth:`pread` are also closed.
+        """
+        with self.__exclusive():
+            for reader in self.__allreaders:
+                reader.close()
+            self.__allreaders = []
+            self.__readers    = threading.local()
+            super(IndexedGzipFile, self).close()
+
+
     def __reduce_ex__(self, protocol):
         """Used to pickle an ``IndexedGzipFile``.
 
@@ -250,6 +525,10 @@ class IndexedGzipFile(io.BufferedReader):
             'readbuf_size'     : fobj.readbuf_size,
             'readall_buf_size' : fobj.readall_buf_size,
             'buffer_size'      : self.__buffer_size,
+            'compress_windows' : fobj.compress_windows,
+            'sparse_windows'   : fobj.sparse_windows,
+            'window_budget'    : fobj.window_budget,
+            'readahead'        : fobj.readahead,
             'tell'             : self.tell(),
             'index'            : index}
 
@@ -320,6 +599,24 @@ cdef class _IndexedGzipFile:
     """Copy of the ``drop_handles`` flag as passed to :meth:`__cinit__`. """
 
 
+    cdef readonly bint compress_windows
+    """Flag which is set to ``True`` if seek point data is stored
+    compressed.
+    """
+
+
+    cdef readonly bint sparse_windows
+    """Flag which is set to ``True`` if only the parts of each seek point
+    window which are needed are stored.
+    """
+
+
+    cdef readonly object window_budget
+    """Maximum number of bytes of seek point data to keep in memory, as
+    passed to :meth:`__init__`, or ``None`` if there is no limit.
+    """
+
+
     cdef object pyfid
     """A reference to the python file handle. """
 
@@ -330,6 +627,12 @@ cdef class _IndexedGzipFile:
     """
 
 
+    cdef FILE *readahead_fd
+    """File handle used by the readahead thread, if readahead is active
+    (see :meth:`set_readahead`).
+    """
+
+
     def __init__(self,
                  filename=None,
                  fileobj=None,
@@ -341,7 +644,13 @@ cdef class _IndexedGzipFile:
                  readall_buf_size=16777216,
                  drop_handles=True,
                  index_file=None,
-                 skip_crc_check=False):
+                 lazy_index=False,
+                 skip_crc_check=False,
+                 huge_pages=False,
+                 compress_windows=False,
+                 sparse_windows=False,
+                 window_budget=None,
+                 readahead=False):
         """Create an ``_IndexedGzipFile``. The file may be specified either
         with an open file handle (``fileobj``), or with a ``filename``. If the
         former, the file is assumed have been opened for reading in binary
@@ -362,8 +671,10 @@ cdef class _IndexedGzipFile:
         :arg skip_crc_check:   Defaults to ``False``. If ``True``, CRC/size
                                validation of the uncompressed data is not
                                performed. Automatically enabled if an
-                               ``index_file`` is provided, or if
-                               :meth:`import_index` is called.
+                               index file which does not contain the CRCs
+                               of the data between its seek points is
+                               imported (either via ``index_file``, or
+                               :meth:`import_index`).
 
         :arg spacing:          Number of bytes between index seek points.
 
@@ -386,6 +697,42 @@ cdef class _IndexedGzipFile:
         :arg index_file:       Pre-generated index for this ``gz`` file -
                                if provided, passed through to
                                :meth:`import_index`.
+
+        :arg lazy_index:       Defaults to ``False``. If ``True``, the
+                               ``index_file`` is imported lazily - see
+                               :meth:`import_index`.
+
+        :arg huge_pages:       Defaults to ``False``. If ``True``, the kernel
+                               is asked to back the memory used to store
+                               index seek point data with transparent huge
+                               pages, where supported.
+
+        :arg compress_windows: Defaults to ``False``. If ``True``, the data
+                               stored with each index seek point is kept
+                               compressed in memory, and decompressed when
+                               it is needed. This reduces the memory used by
+                               the index, at the cost of slower seeks.
+
+        :arg sparse_windows:   Defaults to ``False``. If ``True``, only the
+                               parts of the data stored with each index seek
+                               point which are actually needed to resume
+                               decompression from that point are kept. This
+                               reduces the size of the index, both in memory
+                               and when exported, at the cost of a slower
+                               index build.
+
+        :arg window_budget:    Maximum number of bytes of seek point data to
+                               keep in memory. Defaults to ``None`` (no
+                               limit). When the limit is exceeded, the data
+                               of infrequently used seek points is discarded,
+                               and seeks near those points start decompressing
+                               from an earlier seek point instead. See also
+                               :func:`set_global_window_budget`.
+
+        :arg readahead:        Defaults to ``False``. If ``True``, data is
+                               decompressed ahead of sequential and
+                               strided reads on a background thread - see
+                               :meth:`_IndexedGzipFile.set_readahead`.
         """
 
         cdef FILE *fd = NULL
@@ -457,11 +804,17 @@ cdef class _IndexedGzipFile:
         self.filename         = filename
         self.own_file         = own_file
         self.pyfid            = fileobj
+        self.compress_windows = compress_windows
+        self.sparse_windows   = sparse_windows
+        self.window_budget    = window_budget
 
         flags = 0
 
-        if auto_build:     flags |= zran.ZRAN_AUTO_BUILD
-        if skip_crc_check: flags |= zran.ZRAN_SKIP_CRC_CHECK
+        if auto_build:       flags |= zran.ZRAN_AUTO_BUILD
+        if skip_crc_check:   flags |= zran.ZRAN_SKIP_CRC_CHECK
+        if huge_pages:       flags |= zran.ZRAN_HUGE_PAGES
+        if compress_windows: flags |= zran.ZRAN_COMPRESS_WINDOWS
+        if sparse_windows:   flags |= zran.ZRAN_SPARSE_WINDOWS
 
         # Set index.fd here just for the initial
         # call, as __file_handle may otherwise
@@ -479,6 +832,11 @@ cdef class _IndexedGzipFile:
                 raise ZranError('zran_init returned error (file: '
                                 '{})'.format(self.errname)) from exc
 
+        if window_budget is not None:
+            if zran.zran_set_window_budget(&self.index, window_budget):
+                raise ZranError('zran_set_window_budget returned error '
+                                '(file: {})'.format(self.errname))
+
         log.debug('%s.__init__(%s, %s, %s, %s, %s, %s, %s)',
                   type(self).__name__,
                   fileobj,
@@ -490,7 +848,10 @@ cdef class _IndexedGzipFile:
                   drop_handles)
 
         if index_file is not None:
-            self.import_index(index_file)
+            self.import_index(index_file, lazy=lazy_index)
+
+        if readahead:
+            self.set_readahead(True)
 
 
     @contextlib.contextmanager
@@ -532,8 +893,7 @@ cdef class _IndexedGzipFile:
         uncompressed and compressed offsets for one seek point in the index.
         """
         for i in range(self.index.npoints):
-            point = self.index.list[i]
-            yield (point.uncmp_offset, point.cmp_offset)
+            yield (self.index.uncmp_offsets[i], self.index.cmp_offsets[i])
 
 
     def fileno(self):
@@ -574,6 +934,37 @@ cdef class _IndexedGzipFile:
         return self.index.npoints
 
 
+    @property
+    def index_complete(self):
+        """Returns ``True`` if the index covers the whole file, ``False``
+        otherwise.
+        """
+        if self.index.npoints == 0 or self.index.uncompressed_size == 0:
+            return False
+        last = self.index.uncmp_offsets[self.index.npoints - 1]
+        return last == self.index.uncompressed_size
+
+
+    def reader(self):
+        """Creates and returns a :class:`_IndexedGzipReader`, which can be used
+        to read from this file concurrently with other readers, e.g. from
+        different threads. The reader uses the index of this
+        ``_IndexedGzipFile``, but has its own file handle.
+
+        Readers never expand the index. The index must not be modified (e.g.
+        by :meth:`build_full_index` or :meth:`import_index`, or by
+        :meth:`seek` or :meth:`read` if ``auto_build`` is active and the
+        index is not complete) while a reader is in use.
+
+        Raises a :exc:`NoHandleError` if this ``_IndexedGzipFile`` was
+        created with an open file object, rather than a file name.
+        """
+        if self.filename is None:
+            raise NoHandleError('Readers can only be created for '
+                                'files that were opened by name')
+        return _IndexedGzipReader(self)
+
+
     @property
     def mode(self):
         """Returns the mode that this file was opened in. Currently always
@@ -592,6 +983,7 @@ cdef class _IndexedGzipFile:
         if   self.own_file and self.pyfid    is not None: self.pyfid.close()
         elif self.own_file and self.index.fd is not NULL: fclose(self.index.fd)
 
+        self.set_readahead(False)
         zran.zran_free(&self.index)
 
         self.index.f   = NULL
@@ -658,11 +1050,45 @@ cdef class _IndexedGzipFile:
             self.close()
 
 
-    def build_full_index(self):
-        """Re-builds the full file index. """
+    def build_full_index(self, threads=1):
+        """Re-builds the full file index.
 
-        with self.__file_handle():
-            ret = zran.zran_build_index(&self.index, 0, 0)
+        If ``threads`` is greater than one, and this ``_IndexedGzipFile`` was
+        created with a file name, the index is built concurrently, with each
+        thread decoding a different part of the file (see
+        ``zran_build_index_parallel``). This is only possible for files
+        which contain a single GZIP stream - other files are indexed in the
+        calling thread.
+
+        :arg threads: Number of threads to use
+
+        .. note:: This method releases the GIL while ``zran_build_index`` is
+                  running.
+        """
+
+        cdef zran.zran_index_t   *index    = &self.index
+        cdef zran.zran_reader_t **readers  = NULL
+        cdef uint32_t             nreaders = 0
+        cdef int                  ret
+
+        if threads < 1:
+            raise ValueError('threads must be >= 1')
+
+        if threads > 1 and self.filename is not None:
+            readers  = open_readers(index, self.filename, self.errname, threads)
+            nreaders = threads
+
+        try:
+            if nreaders > 0:
+                with self.__file_handle(), nogil:
+                    ret = zran.zran_build_index_parallel(index,
+                                                         readers,
+                                                         nreaders)
+            else:
+                with self.__file_handle():
+                    ret = zran.zran_build_index(index, 0, 0)
+        finally:
+            close_readers(readers, nreaders)
 
         if ret != zran.ZRAN_BUILD_INDEX_OK:
             exc = get_python_exception()
@@ -670,7 +1096,357 @@ cdef class _IndexedGzipFile:
                             .format(ZRAN_ERRORS.ZRAN_BUILD[ret],
                                     self.errname)) from exc
 
-        log.debug('%s.build_full_index()', type(self).__name__)
+        log.debug('%s.build_full_index(%s)', type(self).__name__, threads)
+
+
+    def verify(self, threads=1):
+        """Verifies the CRC32 and size of every GZIP stream in the file,
+        building the full index first if necessary.
+
+        The data between each pair of index points is decompressed and
+        checked independently, so the file can be verified concurrently by
+        multiple ``threads``, each with its own file handle. Multiple threads
+        can only be used if this ``_IndexedGzipFile`` was created with a file
+        name - otherwise the file is verified in the calling thread.
+
+        A :exc:`CrcError` is raised if the file is corrupt.
+
+        :arg threads: Number of threads to use
+
+        .. note:: This method releases the GIL while ``zran_verify`` is
+                  running.
+        """
+
+        cdef zran.zran_index_t   *index    = &self.index
+        cdef zran.zran_reader_t **readers  = NULL
+        cdef uint32_t             nreaders = 0
+        cdef int                  ret
+
+        if threads < 1:
+            raise ValueError('threads must be >= 1')
+
+        if threads > 1 and self.filename is not None:
+            readers  = open_readers(index, self.filename, self.errname, threads)
+            nreaders = threads
+
+        try:
+            with self.__file_handle(), nogil:
+                ret = zran.zran_verify(index, readers, nreaders)
+        finally:
+            close_readers(readers, nreaders)
+
+        if ret == zran.ZRAN_VERIFY_CRC_ERROR:
+            raise CrcError('CRC/size validation failed - the '
+                           'GZIP data might be corrupt (file: '
+                           '{})'.format(self.errname))
+
+        elif ret != zran.ZRAN_VERIFY_OK:
+            exc = get_python_exception()
+            raise ZranError('zran_verify returned error: {} (file: {})'
+                            .format(ZRAN_ERRORS.ZRAN_VERIFY[ret],
+                                    self.errname)) from exc
+
+        log.debug('%s.verify(%s)', type(self).__name__, threads)
+
+
+    def read_parallel(self, offset=0, length=-1, threads=1):
+        """Reads and returns ``length`` bytes of uncompressed data, starting
+        at ``offset``. If ``length < 0``, all of the data from ``offset``
+        until EOF is read, and the full index is built first if necessary.
+
+        The range is divided into chunks of index points, which can be
+        decompressed independently - this is done concurrently by multiple
+        ``threads``, each with its own file handle, and the data written
+        directly into one output buffer. Multiple threads can only be used if
+        this ``_IndexedGzipFile`` was created with a file name - otherwise the
+        data is read in the calling thread.
+
+        The current seek location is not changed. If the range extends past
+        EOF, fewer than ``length`` bytes are returned.
+
+        :arg offset:  Uncompressed offset to start reading from
+        :arg length:  Number of bytes to read
+        :arg threads: Number of threads to use
+
+        .. note:: This method releases the GIL while ``zran_read_parallel``
+                  is running.
+        """
+
+        cdef zran.zran_index_t   *index    = &self.index
+        cdef zran.zran_reader_t **readers  = NULL
+        cdef uint32_t             nreaders = 0
+        cdef uint64_t             off
+        cdef uint64_t             nbytes
+        cdef void                *buffer
+        cdef int64_t              ret
+        cdef ReadBuffer           buf
+
+        if threads < 1:
+            raise ValueError('threads must be >= 1')
+        if offset < 0:
+            raise ValueError('offset must be >= 0')
+
+        if length < 0:
+            if not self.index_complete:
+                if not self.auto_build:
+                    raise NotCoveredError('Index does not cover '
+                                          'requested range')
+                self.build_full_index(threads=threads)
+            length = max(0, index.uncompressed_size - offset)
+
+        if length == 0:
+            return bytes()
+
+        buf    = ReadBuffer(length)
+        buffer = buf.buffer
+        off    = offset
+        nbytes = length
+
+        if threads > 1 and self.filename is not None:
+            readers  = open_readers(index, self.filename, self.errname, threads)
+            nreaders = threads
+
+        try:
+            with self.__file_handle(), nogil:
+                ret = zran.zran_read_parallel(
+                    index, readers, nreaders, buffer, off, nbytes)
+        finally:
+            close_readers(readers, nreaders)
+
+        if ret == zran.ZRAN_READ_EOF:
+            return bytes()
+
+        elif ret == zran.ZRAN_READ_NOT_COVERED:
+            raise NotCoveredError('Index does not cover requested range')
+
+        elif ret == zran.ZRAN_READ_CRC_ERROR:
+            raise CrcError('CRC/size validation failed - the '
+                           'GZIP data might be corrupt (file: '
+                           '{})'.format(self.errname))
+
+        elif ret < 0:
+            exc = get_python_exception()
+            raise ZranError('zran_read_parallel returned error: {} (file: '
+                            '{})'.format(ZRAN_ERRORS.ZRAN_READ[ret],
+                                         self.errname)) from exc
+
+        pybuf = <bytes>(<char *>buf.buffer)[:ret]
+
+        log.debug('%s.read_parallel(%s, %s, %s)',
+                  type(self).__name__, offset, len(pybuf), threads)
+
+        return pybuf
+
+
+    def iter_chunks(self, chunksize=None, offset=0, length=-1, threads=1):
+        """Returns a generator which yields the uncompressed data starting
+        at ``offset``, in order, in chunks of ``chunksize`` bytes (the last
+        chunk may be smaller). If ``length < 0``, data is yielded until EOF.
+
+        Each chunk is read with :meth:`read_parallel`, so the data in each
+        chunk is decompressed by multiple ``threads``. ``chunksize`` defaults
+        to four index points for each thread. The current seek location is
+        not changed.
+
+        :arg chunksize: Number of bytes in each chunk
+        :arg offset:    Uncompressed offset to start reading from
+        :arg length:    Total number of bytes to read
+        :arg threads:   Number of threads to use
+        """
+        return iter_chunks(self, chunksize, offset, length, threads)
+
+
+    def read_ranges(self, ranges, bufs=None, threads=1):
+        """Reads several ranges of uncompressed data, given as a sequence of
+        ``(offset, length)`` tuples.
+
+        The ranges are sorted and coalesced, so that ranges which overlap,
+        or which are close together (with no index point between them), are
+        decompressed in one pass, and the data is then copied into a
+        separate buffer for each range. Separate groups of ranges can be read
+        concurrently by multiple ``threads``, each with its own file handle,
+        if this ``_IndexedGzipFile`` was created with a file name.
+
+        If ``bufs`` is provided, it must contain a writable ``bytes``-like
+        object (e.g. a ``bytearray`` or ``memoryview``) for each range, which
+        is at least as long as the range. The data is read into the buffers,
+        and a list containing the number of bytes read into each buffer is
+        returned. Otherwise, a list containing the data for each range is
+        returned. Ranges which extend past EOF are truncated. The current
+        seek location is not changed.
+
+        :arg ranges:  Sequence of ``(offset, length)`` tuples
+        :arg bufs:    Buffers to read the data into
+        :arg threads: Number of threads to use
+
+        .. note:: This method releases the GIL while ``zran_read_multi``
+                  is running.
+        """
+
+        cdef zran.zran_index_t   *index    = &self.index
+        cdef zran.zran_reader_t **readers  = NULL
+        cdef uint32_t             nreaders = 0
+        cdef zran.zran_range_t   *cranges  = NULL
+        cdef Py_buffer           *pbufs    = NULL
+        cdef uint32_t             nranges
+        cdef uint32_t             nbufs    = 0
+        cdef uint32_t             i
+        cdef int64_t              ret
+
+        ranges  = [(int(o), int(l)) for o, l in ranges]
+        nranges = len(ranges)
+        retdata = bufs is None
+
+        if threads < 1:
+            raise ValueError('threads must be >= 1')
+        if any(o < 0 or l < 0 for o, l in ranges):
+            raise ValueError('Range offsets and lengths must be >= 0')
+
+        if retdata:
+            bufs = [bytearray(l) for _, l in ranges]
+        else:
+            bufs = list(bufs)
+            if len(bufs) != nranges:
+                raise ValueError('One buffer must be given for each range')
+
+        if nranges == 0:
+            return []
+
+        cranges = <zran.zran_range_t *>PyMem_Malloc(
+            nranges * sizeof(zran.zran_range_t))
+        pbufs   = <Py_buffer *>PyMem_Malloc(nranges * sizeof(Py_buffer))
+
+        if cranges is NULL or pbufs is NULL:
+            PyMem_Free(cranges)
+            PyMem_Free(pbufs)
+            raise MemoryError('PyMem_Malloc fail')
+
+        try:
+            for i in range(nranges):
+                PyObject_GetBuffer(bufs[i],
+                                   &pbufs[i],
+                                   PyBUF_SIMPLE          |
+                                   PyBUF_ANY_CONTIGUOUS  |
+                                   PyBUF_WRITABLE)
+                nbufs += 1
+
+                if pbufs[i].len < ranges[i][1]:
+                    raise ValueError('Buffer {} is smaller than '
+                                     'its range'.format(i))
+
+                cranges[i].offset = ranges[i][0]
+                cranges[i].len    = ranges[i][1]
+                cranges[i].buf    = pbufs[i].buf
+                cranges[i].nread  = 0
+
+            if threads > 1 and self.filename is not None:
+                readers  = open_readers(index,
+                                        self.filename,
+                                        self.errname,
+                                        threads)
+                nreaders = threads
+
+            try:
+                with self.__file_handle(), nogil:
+                    ret = zran.zran_read_multi(
+                        index, readers, nreaders, cranges, nranges)
+            finally:
+                close_readers(readers, nreaders)
+
+            nread = [cranges[i].nread for i in range(nranges)]
+
+        finally:
+            for i in range(nbufs):
+                PyBuffer_Release(&pbufs[i])
+            PyMem_Free(cranges)
+            PyMem_Free(pbufs)
+
+        if ret == zran.ZRAN_READ_NOT_COVERED:
+            raise NotCoveredError('Index does not cover requested range')
+
+        elif ret == zran.ZRAN_READ_CRC_ERROR:
+            raise CrcError('CRC/size validation failed - the '
+                           'GZIP data might be corrupt (file: '
+                           '{})'.format(self.errname))
+
+        elif ret < 0:
+            exc = get_python_exception()
+            raise ZranError('zran_read_multi returned error: {} (file: '
+                            '{})'.format(ZRAN_ERRORS.ZRAN_READ[ret],
+                                         self.errname)) from exc
+
+        log.debug('%s.read_ranges(%s, %s)',
+                  type(self).__name__, nranges, threads)
+
+        if retdata:
+            return [bytes(b[:n]) for b, n in zip(bufs, nread)]
+        return nread
+
+
+    def set_readahead(self, enable=True):
+        """Enables or disables readahead. When enabled, a background thread
+        watches the reads made via :meth:`read` and :meth:`readinto` - if
+        they are sequential, or separated by a constant stride, the thread
+        decompresses the data which is expected to be read next, while the
+        caller is busy with the data it has already read.
+
+        Only data which is covered by the index is read ahead, so readahead
+        is most effective once the index has been built or imported. The
+        readahead thread has its own handle to the file, which is kept open
+        while readahead is enabled.
+
+        Raises a :exc:`NoHandleError` if this ``_IndexedGzipFile`` was
+        created with an open file object, rather than a file name.
+
+        .. note:: This method releases the GIL while waiting for the
+                  readahead thread to stop.
+        """
+
+        cdef zran.zran_index_t *index = &self.index
+        cdef FILE              *fd
+
+        if not enable:
+            if self.readahead_fd is not NULL:
+                with nogil:
+                    zran.zran_readahead_stop(index, NULL)
+                fclose(self.readahead_fd)
+                self.readahead_fd = NULL
+            return
+
+        if self.readahead_fd is not NULL:
+            return
+
+        if self.filename is None:
+            raise NoHandleError('Readahead can only be used with '
+                                'files that were opened by name')
+
+        fd = fopen(self.filename.encode(), 'rb')
+        if fd is NULL:
+            raise IOError('Could not open {}'.format(self.filename))
+
+        if zran.zran_readahead_start(index, NULL, fd) != 0:
+            fclose(fd)
+            raise ZranError('zran_readahead_start returned error '
+                            '(file: {})'.format(self.errname))
+
+        self.readahead_fd = fd
+
+
+    @property
+    def readahead(self):
+        """Returns ``True`` if readahead is enabled (see
+        :meth:`set_readahead`), ``False`` otherwise.
+        """
+        return self.readahead_fd is not NULL
+
+
+    @property
+    def readahead_bytes(self):
+        """Returns the number of bytes which have been read from the
+        readahead buffers since readahead was enabled (see
+        :meth:`set_readahead`).
+        """
+        return zran.zran_readahead_bytes(&self.index, NULL)
 
 
     def seek(self, offset, whence=SEEK_SET):
@@ -864,6 +1640,13 @@ cdef class _IndexedGzipFile:
         elif ret == zran.ZRAN_READ_NOT_COVERED:
             raise NotCoveredError('Index does not cover current offset')
 
+        # CRC or size check failed - data
+        # might be corrupt
+        elif ret == zran.ZRAN_READ_CRC_ERROR:
+            raise CrcError('CRC/size validation failed - the '
+                           'GZIP data might be corrupt (file: '
+                           '{})'.format(self.errname))
+
         # No bytes were read, and there are
         # no more bytes to read. This will
         # happen when the seek point was at
@@ -993,15 +1776,41 @@ cdef class _IndexedGzipFile:
         pass
 
 
-    def export_index(self, filename=None, fileobj=None):
+    def export_index(self,
+                     filename=None,
+                     fileobj=None,
+                     compact=False,
+                     format='gzidx'):
         """Export index data to the given file. Either ``filename`` or
         ``fileobj`` should be specified, but not both. ``fileobj`` should be
         opened in 'wb' mode.
 
         :arg filename: Name of the file.
         :arg fileobj:  Open file handle.
+        :arg compact:  Write a compact index file, with delta-coded offsets
+                       and compressed windows. Compact index files are
+                       much smaller, but cannot be read by older
+                       versions of ``indexed_gzip``.
+        :arg format:   File format - ``'gzidx'`` (the default) for an
+                       ``indexed_gzip`` index file, ``'bgzip'`` for a
+                       ``bgzip`` ``.gzi`` file (only possible for BGZF
+                       files), or ``'gztool'`` for a ``gztool`` index
+                       file. ``compact`` is ignored for the latter two.
         """
 
+        cdef int ret = zran.ZRAN_EXPORT_OK
+
+        formats = {'gzidx'  : 0,
+                   'bgzip'  : zran.ZRAN_EXPORT_BGZIP,
+                   'gztool' : zran.ZRAN_EXPORT_GZTOOL}
+
+        if format not in formats:
+            raise ValueError('Unknown index file format: {}'.format(format))
+
+        flags = formats[format]
+        if compact and format == 'gzidx':
+            flags |= zran.ZRAN_EXPORT_COMPACT
+
         if filename is None and fileobj is None:
             raise ValueError('One of filename or fileobj must be specified')
 
@@ -1027,7 +1836,14 @@ cdef class _IndexedGzipFile:
                 fd = fdopen(fileobj.fileno(), 'wb')
             except io.UnsupportedOperation:
                 fd = NULL
-            ret = zran.zran_export_index(&self.index, fd, <PyObject*>fileobj)
+            # The compressed file may need to be
+            # read, to re-create evicted windows
+            with self.__file_handle():
+                ret = zran.zran_export_index_flags(
+                    &self.index,
+                    fd,
+                    <PyObject*>fileobj,
+                    flags)
             if ret != zran.ZRAN_EXPORT_OK:
                 exc = get_python_exception()
                 raise ZranError('export_index returned error: {} (file: '
@@ -1044,15 +1860,27 @@ cdef class _IndexedGzipFile:
                   fileobj)
 
 
-    def import_index(self, filename=None, fileobj=None):
+    def import_index(self, filename=None, fileobj=None, lazy=False):
         """Import index data from the given file. Either ``filename`` or
         ``fileobj`` should be specified, but not both. ``fileobj`` should be
         opened in 'rb' mode.
 
+        ``bgzip`` (``.gzi``) and ``gztool`` index files can also be
+        imported - the format is detected automatically.
+
         :arg filename: Name of the file.
         :arg fileobj:  Open file handle.
+        :arg lazy:     If ``True``, the index file is mapped into memory,
+                       and only the seek point offsets are read - the data
+                       for each seek point is read from the file when it
+                       is needed. The index file must not be modified
+                       while this ``_IndexedGzipFile`` is open. Ignored
+                       if the file cannot be mapped into memory (e.g.
+                       when ``fileobj`` is not a real file).
         """
 
+        cdef int ret = zran.ZRAN_IMPORT_OK
+
         if filename is None and fileobj is None:
             raise ValueError('One of filename or fileobj must be specified')
 
@@ -1078,14 +1906,25 @@ cdef class _IndexedGzipFile:
                 fd = fdopen(fileobj.fileno(), 'rb')
             except io.UnsupportedOperation:
                 fd = NULL
-            ret = zran.zran_import_index(&self.index, fd, <PyObject*>fileobj)
+            # The compressed file is read when
+            # a bgzip index file is imported
+            with self.__file_handle():
+                ret = zran.zran_import_index_flags(
+                    &self.index,
+                    fd,
+                    <PyObject*>fileobj,
+                    zran.ZRAN_IMPORT_LAZY if lazy else 0)
             if ret != zran.ZRAN_IMPORT_OK:
                 exc = get_python_exception()
                 raise ZranError('import_index returned error: {} (file: '
                                 '{})'.format(ZRAN_ERRORS.ZRAN_IMPORT[ret],
                                              self.errname)) from exc
 
-            self.skip_crc_check = True
+            # CRC validation is disabled if the
+            # index file does not contain the
+            # CRCs of the data between its points
+            self.skip_crc_check = \
+                bool(self.index.flags & zran.ZRAN_SKIP_CRC_CHECK)
 
         finally:
             if close_file:
@@ -1097,6 +1936,151 @@ cdef class _IndexedGzipFile:
                   fileobj)
 
 
+cdef class _IndexedGzipReader:
+    """The ``_IndexedGzipReader`` class reads from the same file as an
+    :class:`_IndexedGzipFile`, using its index, but with its own file handle
+    and seek location. Multiple readers can therefore be used concurrently
+    from different threads. Readers are created via
+    :meth:`_IndexedGzipFile.reader`.
+    """
+
+
+    cdef zran.zran_reader_t *reader
+    """A reference to the ``zran_reader`` struct. """
+
+
+    cdef _IndexedGzipFile igzfile
+    """The ``_IndexedGzipFile`` which owns the index. """
+
+
+    def __cinit__(self, _IndexedGzipFile igzfile):
+        """Create an ``_IndexedGzipReader``. If ``igzfile`` was created with
+        ``drop_handles=False``, a file handle is opened and kept open until
+        this reader is closed, otherwise a handle is opened and closed on
+        every access.
+        """
+
+        cdef FILE *fd = NULL
+
+        self.igzfile = igzfile
+
+        if not igzfile.drop_handles:
+            fd = fopen(igzfile.filename.encode(), 'rb')
+            if fd is NULL:
+                raise IOError('Could not open {}'.format(igzfile.filename))
+
+        self.reader = zran.zran_reader_create(&igzfile.index, fd, NULL)
+
+        if self.reader is NULL:
+            if fd is not NULL:
+                fclose(fd)
+            raise ZranError('zran_reader_create returned error (file: '
+                            '{})'.format(igzfile.errname))
+
+
+    @contextlib.contextmanager
+    def __file_handle(self):
+        """Context manager used whenever access to the file is required -
+        opens and closes a file handle if necessary.
+        """
+        if self.reader.fd is not NULL:
+            yield
+        else:
+            self.reader.fd = fopen(self.igzfile.filename.encode(), 'rb')
+            if self.reader.fd is NULL:
+                raise IOError('Could not open '
+                              '{}'.format(self.igzfile.filename))
+            try:
+                yield
+            finally:
+                fclose(self.reader.fd)
+                self.reader.fd = NULL
+
+
+    def pread(self, nbytes, offset):
+        """Reads and returns up to ``nbytes`` bytes, starting from ``offset``
+        in the uncompressed data stream. If ``offset`` is at or beyond EOF,
+        ``b''`` is returned.
+
+        .. note:: This method releases the GIL while ``zran_reader_seek``
+                  and ``zran_reader_read`` are running.
+        """
+
+        if self.reader is NULL or self.igzfile.closed:
+            raise IOError('_IndexedGzipReader is closed')
+
+        if nbytes < 0:
+            raise ValueError('nbytes must be >= 0')
+
+        if nbytes == 0:
+            return bytes()
+
+        buf = ReadBuffer(nbytes)
+
+        cdef zran.zran_reader_t *reader = self.reader
+        cdef int64_t             off    = offset
+        cdef uint64_t            bufsz  = buf.size
+        cdef void               *buffer = buf.buffer
+        cdef int                 sret
+        cdef int64_t             ret    = 0
+
+        with self.__file_handle():
+            with nogil:
+                sret = zran.zran_reader_seek(reader, off, SEEK_SET)
+                if sret == zran.ZRAN_SEEK_OK:
+                    ret = zran.zran_reader_read(reader, buffer, bufsz)
+
+        if sret == zran.ZRAN_SEEK_EOF or ret == zran.ZRAN_READ_EOF:
+            return bytes()
+
+        elif sret == zran.ZRAN_SEEK_NOT_COVERED or \
+             ret  == zran.ZRAN_READ_NOT_COVERED:
+            raise NotCoveredError('Index does not cover '
+                                  'offset {}'.format(offset))
+
+        elif sret == zran.ZRAN_SEEK_CRC_ERROR or \
+             ret  == zran.ZRAN_READ_CRC_ERROR:
+            raise CrcError('CRC/size validation failed - the '
+                           'GZIP data might be corrupt (file: '
+                           '{})'.format(self.igzfile.errname))
+
+        elif sret != zran.ZRAN_SEEK_OK:
+            raise ZranError('zran_reader_seek returned error: {} (file: {})'
+                            .format(ZRAN_ERRORS.ZRAN_SEEK[sret],
+                                    self.igzfile.errname))
+
+        elif ret < 0:
+            raise ZranError('zran_reader_read returned error: {} (file: {})'
+                            .format(ZRAN_ERRORS.ZRAN_READ[ret],
+                                    self.igzfile.errname))
+
+        return <bytes>(<char *>buf.buffer)[:ret]
+
+
+    def tell(self):
+        """Returns the current seek offset of this reader into the
+        uncompressed data stream.
+        """
+        if self.reader is NULL:
+            raise IOError('_IndexedGzipReader is closed')
+        return zran.zran_reader_tell(self.reader)
+
+
+    def close(self):
+        """Closes this ``_IndexedGzipReader``, closing its file handle. """
+        if self.reader is NULL:
+            return
+        if self.reader.fd is not NULL:
+            fclose(self.reader.fd)
+        zran.zran_reader_free(self.reader)
+        self.reader = NULL
+
+
+    def __dealloc__(self):
+        """Frees the memory used by this ``_IndexedGzipReader``. """
+        self.close()
+
+
 cdef class ReadBuffer:
     """Wrapper around a chunk of memory.
 
@@ -1147,6 +2131,96 @@ cdef class ReadBuffer:
         log.debug('ReadBuffer.__dealloc__()')
 
 
+def set_global_window_budget(nbytes):
+    """Limits the total number of bytes of seek point data that is kept in
+    memory by all ``_IndexedGzipFile`` objects in this process. The limit is
+    enforced whenever an index is expanded - if the total is over the limit,
+    the index being expanded discards the data of its infrequently used seek
+    points. Pass ``None`` or ``0`` to remove the limit.
+    """
+    if nbytes is None:
+        nbytes = 0
+    if nbytes < 0:
+        raise ValueError('nbytes must be >= 0')
+    zran.zran_set_global_window_budget(nbytes)
+
+
+def global_window_bytes():
+    """Returns the total number of bytes of seek point data that is currently
+    kept in memory by all ``_IndexedGzipFile`` objects in this process.
+    """
+    return zran.zran_global_window_bytes()
+
+
+def set_span_cache_budget(nbytes):
+    """Sets the size of a cache of decompressed data which is shared by all
+    ``_IndexedGzipFile`` objects in this process. When the cache is enabled,
+    the data between each pair of seek points is cached when it is first
+    read, so that repeated small reads of the same region are served from
+    memory. The least recently used data is discarded when the cache is
+    full. Pass ``None`` or ``0`` (the default) to disable the cache.
+    """
+    if nbytes is None:
+        nbytes = 0
+    if nbytes < 0:
+        raise ValueError('nbytes must be >= 0')
+    zran.zran_set_span_cache_budget(nbytes)
+
+
+def set_disk_cache(directory, nbytes):
+    """Enables a disk-backed cache of decompressed data, which is shared by
+    all ``_IndexedGzipFile`` objects in this process. The data between each
+    pair of seek points is stored in a file in ``directory`` when it is first
+    read, and is read back from that file, rather than being decompressed
+    again. The least recently used files are deleted when their total size
+    exceeds ``nbytes``.
+
+    Files are identified by their location, modification time, size and
+    contents, so a directory can be shared by several processes, and re-used
+    by later processes. Only files which are opened by name, or which have a
+    file descriptor, are cached. Data which is read back from the cache is
+    validated against the checksums in the index, so data whose checksums
+    are not known (e.g. when ``skip_crc_check`` is enabled) is not cached.
+    Pass ``None`` as the ``directory``, or ``0`` as ``nbytes``, to disable
+    the cache (the files in the directory are not deleted).
+    """
+    if directory is None or nbytes is None:
+        directory = None
+        nbytes    = 0
+    if nbytes < 0:
+        raise ValueError('nbytes must be >= 0')
+
+    if directory is None:
+        zran.zran_set_disk_cache(NULL, 0)
+    elif zran.zran_set_disk_cache(os.fsencode(directory), nbytes) != 0:
+        raise IOError('Cannot use {} as a cache directory'.format(directory))
+
+
+def span_cache_info(reset=False):
+    """Returns a dict containing the ``budget`` of the cache of decompressed
+    data (see :func:`set_span_cache_budget`), the number of ``bytes`` and
+    ``spans`` that it currently contains, and the number of ``hits`` and
+    ``misses`` since the counters were last reset. The same values for the
+    disk cache (see :func:`set_disk_cache`) are included with a ``disk_``
+    prefix. If ``reset`` is ``True``, the counters are reset after they
+    have been read.
+    """
+    cdef zran.zran_span_cache_stats_t stats
+    zran.zran_span_cache_stats(&stats)
+    if reset:
+        zran.zran_reset_span_cache_stats()
+    return {'budget'      : stats.budget,
+            'bytes'       : stats.bytes,
+            'spans'       : stats.nspans,
+            'hits'        : stats.hits,
+            'misses'      : stats.misses,
+            'disk_budget' : stats.disk_budget,
+            'disk_bytes'  : stats.disk_bytes,
+            'disk_spans'  : stats.disk_nspans,
+            'disk_hits'   : stats.disk_hits,
+            'disk_misses' : stats.disk_misses}
+
+
 def unpickle(state):
     """Create a new ``IndexedGzipFile`` from a pickled state.
 
@@ -1222,8 +2296,13 @@ class ZRAN_ERRORS(object):
         zran.ZRAN_READ_FAIL        : 'ZRAN_READ_FAIL',
         zran.ZRAN_READ_CRC_ERROR   : 'ZRAN_READ_CRC_ERROR'
     }
+    ZRAN_VERIFY = {
+        zran.ZRAN_VERIFY_FAIL      : 'ZRAN_VERIFY_FAIL',
+        zran.ZRAN_VERIFY_CRC_ERROR : 'ZRAN_VERIFY_CRC_ERROR'
+    }
     ZRAN_EXPORT = {
-        zran.ZRAN_EXPORT_WRITE_ERROR : 'ZRAN_EXPORT_WRITE_ERROR'
+        zran.ZRAN_EXPORT_WRITE_ERROR : 'ZRAN_EXPORT_WRITE_ERROR',
+        zran.ZRAN_EXPORT_UNSUPPORTED : 'ZRAN_EXPORT_UNSUPPORTED'
     }
     ZRAN_IMPORT = {
         zran.ZRAN_IMPORT_OK                  : 'ZRAN_IMPORT_OK',
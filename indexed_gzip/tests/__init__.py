@@ -10,6 +10,8 @@ import                    os
 import                    sys
 import                    time
 import                    gzip
+import                    zlib
+import                    struct
 import                    shutil
 import                    operator
 import                    tempfile
@@ -180,6 +182,36 @@ def compress_inmem(data, concat):
     return bytearray(compressed), cmpoffsets
 
 
+def compress_bgzf(data, blocksize=65280):
+    """Compress the given data (assumed to be bytes) into a series of BGZF
+    blocks, in the same way as bgzip, and return it as a bytearray. Also
+    returns the compressed offsets of the start of each block.
+    """
+
+    blocks  = []
+    offsets = []
+    offset  = 0
+
+    for i in range(0, len(data), blocksize):
+        raw     = data[i:i + blocksize]
+        deflate = zlib.compressobj(6, zlib.DEFLATED, -15)
+        cmp     = deflate.compress(raw) + deflate.flush()
+        header  = b'\x1f\x8b\x08\x04\x00\x00\x00\x00\x00\xff' + \
+                  struct.pack('<HBBHH', 6, 66, 67, 2, len(cmp) + 25)
+        footer  = struct.pack('<II', zlib.crc32(raw), len(raw))
+
+        blocks .append(header + cmp + footer)
+        offsets.append(offset)
+        offset += len(blocks[-1])
+
+    # empty block which marks
+    # the end of the file
+    blocks.append(bytes.fromhex('1f8b08040000000000ff060042430200'
+                                '1b0003000000000000000000'))
+
+    return bytearray(b''.join(blocks)), offsets
+
+
 def gen_test_data(filename, nelems, concat):
     """Make some data to test with. """
 
@@ -0,0 +1,137 @@
+#!/usr/bin/env python
+#
+# benchmark_seek.py - benchmark the cost of seeking as the index grows
+#
+
+
+from __future__ import print_function
+
+import            os
+import os.path as op
+import            sys
+import            gzip
+import            time
+import            shutil
+import            struct
+import            tempfile
+import            argparse
+import            contextlib
+
+import numpy as np
+
+import indexed_gzip as igzip
+
+
+@contextlib.contextmanager
+def tempdir():
+    testdir = tempfile.mkdtemp()
+    prevdir = os.getcwd()
+    try:
+        os.chdir(testdir)
+        yield testdir
+
+    finally:
+        os.chdir(prevdir)
+        shutil.rmtree(testdir)
+
+
+def gen_file(fname, nbytes):
+    """Generates a gzip file containing nbytes of random (i.e.
+    incompressible) data.
+    """
+    data = np.random.randint(0, 256, nbytes, dtype=np.uint8).tobytes()
+    with gzip.open(fname, 'wb') as f:
+        f.write(data)
+
+
+def gen_index(fname, npoints, cmpsize, spacing=1048576, window=32768):
+    """Generates a synthetic index file containing npoints index points,
+    without any window data. The index is not valid for decompression,
+    but can be used to seek.
+    """
+
+    uncmpsize = npoints * spacing
+    cmpstep   = cmpsize // npoints
+    header    = struct.pack('<5sBBQQIII', b'GZIDX', 1, 0,
+                            cmpsize, uncmpsize, spacing, window, npoints)
+
+    with open(fname, 'wb') as f:
+        f.write(header)
+        for i in range(npoints):
+            f.write(struct.pack('<QQBB', i * cmpstep, i * spacing, 0, 0))
+
+    return uncmpsize
+
+
+def benchmark(filename, npoints, nseeks, spacing=1048576):
+    """Times nseeks random seeks, and nseeks sequential seeks, on a file
+    with an index containing npoints points. Returns the average time
+    per seek, in microseconds.
+    """
+
+    cmpsize   = op.getsize(filename)
+    idxfile   = 'index.gzidx'
+    uncmpsize = gen_index(idxfile, npoints, cmpsize, spacing)
+    seeks     = np.random.randint(0, uncmpsize - spacing, nseeks)
+    seqseeks  = np.linspace(0, uncmpsize - spacing, nseeks, dtype=np.int64)
+
+    with igzip._IndexedGzipFile(filename,
+                                auto_build=False,
+                                drop_handles=False,
+                                spacing=spacing,
+                                index_file=idxfile) as f:
+
+        assert f.npoints == npoints
+
+        start = time.time()
+        for s in seeks:
+            f.seek(int(s))
+        rand = time.time() - start
+
+        start = time.time()
+        for s in seqseeks:
+            f.seek(int(s))
+        seq = time.time() - start
+
+    return 1e6 * rand / nseeks, 1e6 * seq / nseeks
+
+
+if __name__ == '__main__':
+
+    parser = argparse.ArgumentParser('indexed_gzip seek benchmark')
+
+    parser.add_argument('-s',
+                        '--seeks',
+                        type=int,
+                        help='Number of seeks',
+                        default=100000)
+    parser.add_argument('-p',
+                        '--points',
+                        type=int,
+                        nargs='+',
+                        help='Index sizes (number of points) to test',
+                        default=[1000, 10000, 100000, 1000000])
+    parser.add_argument('-r',
+                        '--randomseed',
+                        type=int,
+                        help='Seed for random number generator')
+
+    namespace = parser.parse_args()
+
+    if namespace.randomseed is not None:
+        np.random.seed(namespace.randomseed)
+
+    with tempdir():
+
+        nbytes = max(namespace.points) * 2
+        print('Generating test data ({:0.2f} MiB)...'.format(
+            nbytes / (1024 * 1024)))
+        sys.stdout.flush()
+        gen_file('test.gz', nbytes)
+
+        print('{:>10s}  {:>14s}  {:>14s}'.format(
+            'npoints', 'random (us)', 'sequential (us)'))
+
+        for npoints in namespace.points:
+            rand, seq = benchmark('test.gz', npoints, namespace.seeks)
+            print('{:>10d}  {:>14.3f}  {:>14.3f}'.format(npoints, rand, seq))
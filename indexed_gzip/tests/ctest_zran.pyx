@@ -14,6 +14,7 @@ import subprocess      as sp
 import                    sys
 import                    time
 import                    gzip
+import                    zlib
 import                    shutil
 import                    random
 import                    hashlib
@@ -41,9 +42,15 @@ from libc.stdio  cimport (SEEK_SET,
                           SEEK_END,
                           FILE,
                           fdopen,
+                          ftell,
                           fwrite)
 
-from libc.stdint cimport int64_t
+from libc.stdint cimport (int64_t,
+                          uint8_t,
+                          uint16_t,
+                          uint32_t,
+                          uint64_t,
+                          uintptr_t)
 
 from libc.string cimport memset, memcmp
 
@@ -62,7 +69,7 @@ from posix.mman cimport (mmap,
                          MAP_SHARED)
 
 
-from . import poll, check_data_valid, tempdir, compress_inmem
+from . import poll, check_data_valid, tempdir, compress_inmem, compress_bgzf
 
 
 cdef extern from "sys/mman.h":
@@ -499,8 +506,18 @@ def test_no_auto_build(testfile, no_fds, nelems):
 
         assert check_data_valid(data, 0)
 
+        # A subsequent read carries on from
+        # where the first one finished, so
+        # doesn't need the index
         if bufSize < filesize:
-            assert zran.zran_read(&index, buffer, bufSize) == zran.ZRAN_READ_NOT_COVERED
+            gotread = zran.zran_read(&index, buffer, bufSize)
+            assert gotread > 0
+            assert zran.zran_tell(&index) == bufSize + gotread
+
+            pybuf = <bytes>(<char *>buffer)[:gotread]
+            data  = np.ndarray(gotread // 8, np.uint64, pybuf)
+
+            assert check_data_valid(data, bufSize // 8, bufSize // 8 + len(data))
 
 
 def test_seek_to_end(testfile, no_fds, nelems):
@@ -766,6 +783,73 @@ def test_random_seek(testfile, no_fds, nelems, niters, seed):
         zran.zran_free(&index)
 
 
+def test_get_point(testfile, no_fds, nelems, niters, seed):
+
+    cdef zran.zran_index_t index
+    cdef zran.zran_point_t point
+    cdef zran.zran_point_t prev
+    cdef zran.zran_point_t seekpoint
+
+    filesize     = nelems * 8
+    seekpoints   = [random.randint(1, filesize - 1) for i in range(niters)]
+    indexSpacing = max(524288, filesize // 1000)
+
+    with open(testfile, 'rb') as pyfid:
+        cfid = fdopen(pyfid.fileno(), 'rb')
+
+        assert not zran.zran_init(&index,
+                                  NULL if no_fds else cfid,
+                                  <PyObject*>pyfid if no_fds else NULL,
+                                  indexSpacing,
+                                  32768,
+                                  131072,
+                                  zran.ZRAN_AUTO_BUILD)
+
+        assert zran.zran_get_point(&index, 0, &point) != 0
+        assert not zran.zran_build_index(&index, 0, 0)
+        assert index.npoints > 1
+
+        # The first point is at the start of the
+        # stream, and has no window. All others
+        # have a window, and the offsets of
+        # each point are increasing.
+        assert zran.zran_get_point(&index, 0, &point) == 0
+        assert point.cmp_offset   == index.cmp_offsets[0]
+        assert point.uncmp_offset == 0
+        assert point.data         == NULL
+
+        for i in range(1, index.npoints):
+            prev = point
+            assert zran.zran_get_point(&index, i, &point) == 0
+            assert point.cmp_offset   == index.cmp_offsets[i]
+            assert point.uncmp_offset == index.uncmp_offsets[i]
+            assert point.cmp_offset   >  prev.cmp_offset
+            assert point.uncmp_offset >  prev.uncmp_offset
+            assert point.bits         <  8
+            assert point.data         != NULL
+
+        assert zran.zran_get_point(&index, index.npoints, &point) != 0
+
+        # zran_seek gives us a copy of the
+        # point that precedes the offset
+        for sp in seekpoints:
+
+            assert zran.zran_seek(&index, sp, SEEK_SET, &seekpoint) == 0
+
+            i = 0
+            while i + 1 < index.npoints and index.uncmp_offsets[i + 1] <= sp:
+                i += 1
+
+            zran.zran_get_point(&index, i, &point)
+
+            assert seekpoint.cmp_offset   == point.cmp_offset
+            assert seekpoint.uncmp_offset == point.uncmp_offset
+            assert seekpoint.bits         == point.bits
+            assert seekpoint.data         == point.data
+
+        zran.zran_free(&index)
+
+
 def test_read_all(testfile, no_fds, nelems, use_mmap):
 
     filesize = nelems * 8
@@ -940,6 +1024,85 @@ def test_read_all_sequential(testfile, no_fds, nelems):
         zran.zran_free(&index)
 
 
+def test_read_sequential_chunks(testfile, no_fds, nelems, seed):
+
+    cdef zran.zran_index_t index
+    cdef void             *buffer
+
+    filesize     = nelems * 8
+    indexSpacing = max(524288, filesize // 1000)
+    bufSize      = 262144
+    buf          = ReadBuffer(bufSize)
+    buffer       = buf.buffer
+
+    # Without an index, sequential reads
+    # are only possible because each read
+    # carries on from where the previous
+    # one finished
+    with open(testfile, 'rb') as pyfid:
+        cfid = fdopen(pyfid.fileno(), 'rb')
+
+        assert not zran.zran_init(&index,
+                                  NULL if no_fds else cfid,
+                                  <PyObject*>pyfid if no_fds else NULL,
+                                  indexSpacing,
+                                  32768,
+                                  131072,
+                                  0)
+
+        offset = 0
+        while offset < filesize:
+            chunk   = np.random.randint(1, bufSize // 8) * 8
+            gotread = zran.zran_read(&index, buffer, chunk)
+
+            assert gotread == min(chunk, filesize - offset)
+
+            pybuf = <bytes>(<char *>buffer)[:gotread]
+            data  = np.ndarray(gotread // 8, np.uint64, pybuf)
+            assert check_data_valid(data, offset // 8, (offset + gotread) // 8)
+
+            offset += gotread
+            assert zran.zran_tell(&index) == offset
+
+        assert zran.zran_read(&index, buffer, bufSize) == zran.ZRAN_READ_EOF
+        zran.zran_free(&index)
+
+    # Skipping forward a little bit between
+    # reads should also carry on from the
+    # previous read, rather than from an
+    # index point
+    with open(testfile, 'rb') as pyfid:
+        cfid = fdopen(pyfid.fileno(), 'rb')
+
+        assert not zran.zran_init(&index,
+                                  NULL if no_fds else cfid,
+                                  <PyObject*>pyfid if no_fds else NULL,
+                                  indexSpacing,
+                                  32768,
+                                  131072,
+                                  zran.ZRAN_AUTO_BUILD)
+
+        offset = 0
+        while offset < filesize:
+            chunk   = np.random.randint(1, bufSize // 8) * 8
+            skip    = np.random.randint(0, 1024) * 8
+            gotread = zran.zran_read(&index, buffer, chunk)
+
+            assert gotread == min(chunk, filesize - offset)
+
+            pybuf = <bytes>(<char *>buffer)[:gotread]
+            data  = np.ndarray(gotread // 8, np.uint64, pybuf)
+            assert check_data_valid(data, offset // 8, (offset + gotread) // 8)
+
+            offset += gotread + skip
+            if offset >= filesize:
+                break
+            assert zran.zran_seek(&index, skip, SEEK_CUR, NULL) == zran.ZRAN_SEEK_OK
+            assert zran.zran_tell(&index) == offset
+
+        zran.zran_free(&index)
+
+
 def test_build_then_read(testfile, no_fds, nelems, seed, use_mmap):
 
     filesize = nelems * 8
@@ -987,6 +1150,54 @@ def test_build_then_read(testfile, no_fds, nelems, seed, use_mmap):
         zran.zran_free(&index)
 
 
+def test_rebuild_index(testfile, no_fds, nelems, seed):
+    """Partially re-build an index, and check that it ends up the same as
+    an index that was only built once. Window data is rewound, and then
+    re-allocated, when the index is re-built.
+    """
+
+    cdef zran.zran_index_t index1
+    cdef zran.zran_index_t index2
+
+    filesize     = nelems * 8
+    indexSpacing = max(524288, filesize // 1000)
+
+    with open(testfile, 'rb') as pyfid:
+        cfid = fdopen(pyfid.fileno(), 'rb')
+
+        assert not zran.zran_init(&index1,
+                                  NULL if no_fds else cfid,
+                                  <PyObject*>pyfid if no_fds else NULL,
+                                  indexSpacing,
+                                  32768,
+                                  131072,
+                                  zran.ZRAN_AUTO_BUILD)
+        assert not zran.zran_init(&index2,
+                                  NULL if no_fds else cfid,
+                                  <PyObject*>pyfid if no_fds else NULL,
+                                  indexSpacing,
+                                  32768,
+                                  131072,
+                                  zran.ZRAN_AUTO_BUILD |
+                                  zran.ZRAN_HUGE_PAGES)
+
+        assert not zran.zran_build_index(&index1, 0, 0)
+        assert not zran.zran_build_index(&index2, 0, 0)
+        assert index1.npoints > 2
+
+        for i in range(5):
+            pt = random.randint(1, index2.npoints - 1)
+            assert not zran.zran_build_index(&index2,
+                                             index2.cmp_offsets[pt], 0)
+            _compare_indexes(&index1, &index2)
+
+        assert not zran.zran_build_index(&index2, 0, 0)
+        _compare_indexes(&index1, &index2)
+
+        zran.zran_free(&index1)
+        zran.zran_free(&index2)
+
+
 def test_readbuf_spacing_sizes(testfile, no_fds, nelems, niters, seed):
 
     cdef zran.zran_index_t index
@@ -1038,11 +1249,161 @@ def test_readbuf_spacing_sizes(testfile, no_fds, nelems, niters, seed):
             zran.zran_free(&index)
 
 
+def test_readers(testfile, no_fds, nelems, niters, seed):
+
+    cdef zran.zran_index_t   index
+    cdef zran.zran_reader_t *reader
+    cdef zran.zran_reader_t *readers[4]
+    cdef np.uint64_t         val
+
+    val          = 0
+    filesize     = nelems * 8
+    indexSpacing = max(524288, filesize // 1000)
+    seekelems    = np.random.randint(0, nelems, niters)
+
+    with open(testfile, 'rb') as pyfid:
+        cfid = fdopen(pyfid.fileno(), 'rb')
+
+        assert not zran.zran_init(&index,
+                                  NULL if no_fds else cfid,
+                                  <PyObject*>pyfid if no_fds else NULL,
+                                  indexSpacing,
+                                  32768,
+                                  131072,
+                                  zran.ZRAN_AUTO_BUILD)
+
+        # Readers never expand the index,
+        # but can read from the start
+        reader = zran.zran_reader_create(&index,
+                                         NULL if no_fds else cfid,
+                                         <PyObject*>pyfid if no_fds else NULL)
+        assert reader is not NULL
+        assert zran.zran_reader_seek(reader, 8, SEEK_SET) == \
+            zran.ZRAN_SEEK_NOT_COVERED
+        assert zran.zran_reader_seek(reader, 0, SEEK_SET) == zran.ZRAN_SEEK_OK
+        assert zran.zran_reader_read(reader, &val, 8) == 8
+        assert val == 0
+        assert zran.zran_reader_tell(reader) == 8
+        assert index.npoints == 0
+        zran.zran_reader_free(reader)
+
+        assert zran.zran_build_index(&index, 0, 0) == 0
+
+        # Each reader has its own file handle,
+        # and its own seek location, and can
+        # be used in conjunction with the
+        # index's own seek/read functions
+        pyfids = [open(testfile, 'rb') for i in range(4)]
+        for i, f in enumerate(pyfids):
+            readers[i] = zran.zran_reader_create(
+                &index,
+                NULL if no_fds else fdopen(f.fileno(), 'rb'),
+                <PyObject*>f if no_fds else NULL)
+            assert readers[i] is not NULL
+
+        try:
+            for i, se in enumerate(seekelems):
+                reader = readers[i % 4]
+                assert zran.zran_reader_seek(reader, se * 8, SEEK_SET) == \
+                    zran.ZRAN_SEEK_OK
+                assert zran.zran_reader_read(reader, &val, 8) == 8
+                assert val == se
+                assert zran.zran_reader_tell(reader) == se * 8 + 8
+
+                assert read_element(&index, nelems - se - 1, nelems) == \
+                    nelems - se - 1
+
+            for i in range(4):
+                assert zran.zran_reader_seek(readers[i], -8, SEEK_END) == \
+                    zran.ZRAN_SEEK_OK
+                assert zran.zran_reader_read(readers[i], &val, 8) == 8
+                assert val == nelems - 1
+                assert zran.zran_reader_read(readers[i], &val, 8) == \
+                    zran.ZRAN_READ_EOF
+
+        finally:
+            for i, f in enumerate(pyfids):
+                zran.zran_reader_free(readers[i])
+                f.close()
+
+        zran.zran_free(&index)
+
+
+def test_readers_shared_fd(testfile, nelems, niters, seed):
+    """Readers which use a real file keep their own position in the
+    compressed data, so several readers (and the index) can share one
+    file handle, without the FILE position ever being moved.
+    """
+
+    cdef zran.zran_index_t   index
+    cdef zran.zran_reader_t *readers[4]
+    cdef np.uint64_t         val
+
+    val          = 0
+    filesize     = nelems * 8
+    indexSpacing = max(524288, filesize // 1000)
+    seekelems    = np.random.randint(0, nelems - 1, niters)
+
+    with open(testfile, 'rb') as pyfid:
+        cfid = fdopen(pyfid.fileno(), 'rb')
+
+        assert not zran.zran_init(&index,
+                                  cfid,
+                                  NULL,
+                                  indexSpacing,
+                                  32768,
+                                  131072,
+                                  zran.ZRAN_AUTO_BUILD)
+        assert zran.zran_build_index(&index, 0, 0) == 0
+
+        pos = ftell(cfid)
+
+        for i in range(4):
+            readers[i] = zran.zran_reader_create(&index, cfid, NULL)
+            assert readers[i] is not NULL
+
+        try:
+            # Each reader carries on from where it
+            # left off, after the other readers,
+            # and the index, have used the file
+            for i in range(0, niters, 4):
+                elems = seekelems[i:i + 4]
+                for r, se in enumerate(elems):
+                    assert zran.zran_reader_seek(
+                        readers[r], se * 8, SEEK_SET) == zran.ZRAN_SEEK_OK
+                    assert zran.zran_reader_read(readers[r], &val, 8) == 8
+                    assert val == se
+
+                se = elems[0]
+                assert read_element(&index, nelems - se - 1, nelems) == \
+                    nelems - se - 1
+
+                for r, se in enumerate(elems):
+                    assert zran.zran_reader_read(readers[r], &val, 8) == 8
+                    assert val == se + 1
+                    assert zran.zran_reader_tell(readers[r]) == se * 8 + 16
+
+            assert ftell(cfid) == pos
+
+        finally:
+            for i in range(4):
+                zran.zran_reader_free(readers[i])
+
+        zran.zran_free(&index)
+
+
 cdef _compare_indexes(zran.zran_index_t *index1,
-                      zran.zran_index_t *index2):
-    """Check that two indexes are equivalent. """
-    cdef zran.zran_point_t *p1
-    cdef zran.zran_point_t *p2
+                      zran.zran_index_t *index2,
+                      sparse=False):
+    """Check that two indexes are equivalent. Window data is compared via
+    zran_get_window, as either index may be storing compressed windows.
+    If sparse is True, index2 may be storing sparse windows, so its windows
+    are only compared against the non-zero bytes of index1 windows.
+    """
+    cdef zran.zran_point_t p1
+    cdef zran.zran_point_t p2
+    cdef uint8_t          *w1
+    cdef uint8_t          *w2
 
     assert index2.compressed_size   == index1.compressed_size
     assert index2.uncompressed_size == index1.uncompressed_size
@@ -1051,20 +1412,33 @@ cdef _compare_indexes(zran.zran_index_t *index1,
     assert index2.npoints           == index1.npoints
 
     ws = index1.window_size
+    w1 = <uint8_t *>PyMem_Malloc(ws)
+    w2 = <uint8_t *>PyMem_Malloc(ws)
 
-    for i in range(index1.npoints):
+    try:
+        for i in range(index1.npoints):
 
-        p1 = &index1.list[i]
-        p2 = &index2.list[i]
-        msg = 'Error at point %d' % i
+            zran.zran_get_point(index1, i, &p1)
+            zran.zran_get_point(index2, i, &p2)
+            msg = 'Error at point %d' % i
 
-        assert p2.cmp_offset   == p1.cmp_offset, msg
-        assert p2.uncmp_offset == p1.uncmp_offset, msg
-        assert p2.bits         == p1.bits, msg
-        if (not p1.data):
-            assert p1.data == p2.data, msg
-        else:
-            assert not memcmp(p2.data, p1.data, ws), msg
+            assert p2.cmp_offset   == p1.cmp_offset, msg
+            assert p2.uncmp_offset == p1.uncmp_offset, msg
+            assert p2.bits         == p1.bits, msg
+            if (not p1.data):
+                assert p1.data == p2.data, msg
+            else:
+                assert zran.zran_get_window(index1, i, w1) == 0, msg
+                assert zran.zran_get_window(index2, i, w2) == 0, msg
+                if sparse:
+                    a1 = np.frombuffer((<char *>w1)[:ws], dtype=np.uint8)
+                    a2 = np.frombuffer((<char *>w2)[:ws], dtype=np.uint8)
+                    assert np.all((a2 == a1) | (a2 == 0)), msg
+                else:
+                    assert not memcmp(w2, w1, ws), msg
+    finally:
+        PyMem_Free(w1)
+        PyMem_Free(w2)
 
 
 def test_export_then_import(testfile, no_fds):
@@ -1119,6 +1493,1069 @@ def test_export_then_import(testfile, no_fds):
         zran.zran_free(&index2)
 
 
+def test_compress_windows(testfile, no_fds, nelems, niters, seed):
+    """Test an index which is storing compressed windows - it should
+    behave identically to one which is not, and should be able to be
+    exported, and imported into an index of either type.
+    """
+
+    cdef zran.zran_index_t index1
+    cdef zran.zran_index_t index2
+    cdef zran.zran_index_t index3
+
+    filesize     = nelems * 8
+    indexSpacing = max(524288, filesize // 1000)
+    seekelems    = np.random.randint(0, nelems, niters)
+    idxfile      = testfile + '.cmp.idx.tmp'
+
+    with open(testfile, 'rb') as pyfid:
+        cfid = fdopen(pyfid.fileno(), 'rb')
+
+        assert not zran.zran_init(&index1,
+                                  NULL if no_fds else cfid,
+                                  <PyObject*>pyfid if no_fds else NULL,
+                                  indexSpacing,
+                                  32768,
+                                  131072,
+                                  zran.ZRAN_AUTO_BUILD)
+        assert not zran.zran_init(&index2,
+                                  NULL if no_fds else cfid,
+                                  <PyObject*>pyfid if no_fds else NULL,
+                                  indexSpacing,
+                                  32768,
+                                  131072,
+                                  zran.ZRAN_AUTO_BUILD |
+                                  zran.ZRAN_COMPRESS_WINDOWS)
+
+        # seek/read before and after
+        # the index is fully built
+        for se in seekelems[:niters // 2]:
+            assert read_element(&index2, se, nelems, True) == se
+
+        assert not zran.zran_build_index(&index1, 0, 0)
+        assert not zran.zran_build_index(&index2, 0, 0)
+        _compare_indexes(&index1, &index2)
+
+        for se in seekelems[niters // 2:]:
+            assert read_element(&index2, se, nelems, True) == se
+
+        with open(idxfile, 'wb') as pyexportfid:
+            cfid = fdopen(pyexportfid.fileno(), 'ab')
+            assert not zran.zran_export_index(
+                &index2,
+                NULL if no_fds else cfid,
+                <PyObject*>pyexportfid if no_fds else NULL)
+
+        for flags in [0, zran.ZRAN_COMPRESS_WINDOWS]:
+            cfid = fdopen(pyfid.fileno(), 'rb')
+            assert not zran.zran_init(&index3,
+                                      NULL if no_fds else cfid,
+                                      <PyObject*>pyfid if no_fds else NULL,
+                                      indexSpacing,
+                                      32768,
+                                      131072,
+                                      flags)
+
+            with open(idxfile, 'rb') as pyexportfid:
+                cfid = fdopen(pyexportfid.fileno(), 'rb')
+                assert not zran.zran_import_index(
+                    &index3,
+                    NULL if no_fds else cfid,
+                    <PyObject*>pyexportfid if no_fds else NULL)
+
+            _compare_indexes(&index1, &index3)
+
+            for se in seekelems:
+                assert read_element(&index3, se, nelems, True) == se
+
+            zran.zran_free(&index3)
+
+        zran.zran_free(&index1)
+        zran.zran_free(&index2)
+
+
+def test_sparse_windows(testfile, no_fds, nelems, niters, seed):
+    """Test an index which is storing sparse windows - it should behave
+    identically to one which is not, should be smaller when exported, and
+    should be able to be imported into an index of any type.
+    """
+
+    cdef zran.zran_index_t index1
+    cdef zran.zran_index_t index2
+    cdef zran.zran_index_t index3
+    cdef zran.zran_index_t *idx
+
+    filesize     = nelems * 8
+    indexSpacing = max(524288, filesize // 1000)
+    seekelems    = np.random.randint(0, nelems, niters)
+    fullfile     = testfile + '.full.idx.tmp'
+    sparsefile   = testfile + '.sparse.idx.tmp'
+
+    with open(testfile, 'rb') as pyfid:
+
+        for flags in [zran.ZRAN_SPARSE_WINDOWS,
+                      zran.ZRAN_SPARSE_WINDOWS | zran.ZRAN_COMPRESS_WINDOWS]:
+
+            cfid = fdopen(pyfid.fileno(), 'rb')
+            assert not zran.zran_init(&index1,
+                                      NULL if no_fds else cfid,
+                                      <PyObject*>pyfid if no_fds else NULL,
+                                      indexSpacing,
+                                      32768,
+                                      131072,
+                                      zran.ZRAN_AUTO_BUILD)
+            assert not zran.zran_init(&index2,
+                                      NULL if no_fds else cfid,
+                                      <PyObject*>pyfid if no_fds else NULL,
+                                      indexSpacing,
+                                      32768,
+                                      131072,
+                                      zran.ZRAN_AUTO_BUILD | flags)
+
+            # seek/read before and after
+            # the index is fully built
+            for se in seekelems[:niters // 2]:
+                assert read_element(&index2, se, nelems, True) == se
+
+            assert not zran.zran_build_index(&index1, 0, 0)
+            assert not zran.zran_build_index(&index2, 0, 0)
+            _compare_indexes(&index1, &index2, sparse=True)
+
+            for se in seekelems[niters // 2:]:
+                assert read_element(&index2, se, nelems, True) == se
+
+            for fname in [fullfile, sparsefile]:
+                idx = &index1 if fname == fullfile else &index2
+                with open(fname, 'wb') as pyexportfid:
+                    cfid = fdopen(pyexportfid.fileno(), 'ab')
+                    assert not zran.zran_export_index(
+                        idx,
+                        NULL if no_fds else cfid,
+                        <PyObject*>pyexportfid if no_fds else NULL)
+
+            # A sparse index is written with
+            # format version 2, a full index
+            # with version 1.
+            with open(fullfile, 'rb') as f:
+                assert f.read(6)[5] == 1
+            with open(sparsefile, 'rb') as f:
+                assert f.read(6)[5] == 2
+
+            assert op.getsize(sparsefile) < op.getsize(fullfile)
+
+            for importflags in [0,
+                                zran.ZRAN_COMPRESS_WINDOWS,
+                                zran.ZRAN_SPARSE_WINDOWS,
+                                zran.ZRAN_SPARSE_WINDOWS |
+                                zran.ZRAN_COMPRESS_WINDOWS]:
+                cfid = fdopen(pyfid.fileno(), 'rb')
+                assert not zran.zran_init(&index3,
+                                          NULL if no_fds else cfid,
+                                          <PyObject*>pyfid if no_fds else NULL,
+                                          indexSpacing,
+                                          32768,
+                                          131072,
+                                          importflags)
+
+                with open(sparsefile, 'rb') as pyexportfid:
+                    cfid = fdopen(pyexportfid.fileno(), 'rb')
+                    assert not zran.zran_import_index(
+                        &index3,
+                        NULL if no_fds else cfid,
+                        <PyObject*>pyexportfid if no_fds else NULL)
+
+                _compare_indexes(&index1, &index3, sparse=True)
+                _compare_indexes(&index2, &index3)
+
+                for se in seekelems:
+                    assert read_element(&index3, se, nelems, True) == se
+
+                zran.zran_free(&index3)
+
+            zran.zran_free(&index1)
+            zran.zran_free(&index2)
+
+
+cdef _count_windows(zran.zran_index_t *index):
+    """Returns the number of points in the index which have a window, and
+    the number of distinct windows.
+    """
+    cdef zran.zran_point_t point
+
+    windows = []
+    for i in range(index.npoints):
+        zran.zran_get_point(index, i, &point)
+        if point.data:
+            windows.append(<uintptr_t>point.data)
+
+    return len(windows), len(set(windows))
+
+
+cdef _check_reads(zran.zran_index_t *index, data, void *buffer):
+    """Reads from random locations in the index, and compares against data.
+    The buffer must be at least 8192 bytes long.
+    """
+    for off in np.random.randint(0, len(data) - 8192, 50):
+        assert zran.zran_seek(index, off, SEEK_SET, NULL) == 0
+        assert zran.zran_read(index, buffer, 8192) == 8192
+        assert (<char *>buffer)[:8192] == data[off:off + 8192]
+
+
+def test_window_dedup(no_fds):
+    """Test that identical windows are shared between index points, both in
+    memory and in exported index files, and that shared windows survive
+    a partial re-build of the index.
+    """
+
+    cdef zran.zran_index_t index1
+    cdef zran.zran_index_t index2
+    cdef void             *buffer
+
+    # Mostly zeros, with some random data at the end
+    # of some chunks. Each chunk is sync-flushed, so
+    # that there is a block boundary between chunks.
+    chunksize = 262144
+    nchunks   = 64
+    chunks    = []
+    for i in range(nchunks):
+        chunk = np.zeros(chunksize, dtype=np.uint8)
+        if i % 16 == 0:
+            chunk[-4096:] = np.random.randint(1, 255, 4096, dtype=np.uint8)
+        chunks.append(chunk.tobytes())
+    data = b''.join(chunks)
+
+    cmp = zlib.compressobj(6, zlib.DEFLATED, 31)
+    gz  = [cmp.compress(c) + cmp.flush(zlib.Z_SYNC_FLUSH) for c in chunks]
+    gz  = b''.join(gz) + cmp.flush()
+
+    buf    = ReadBuffer(8192)
+    buffer = buf.buffer
+
+    with tempdir():
+
+        with open('data.gz', 'wb') as f:
+            f.write(gz)
+
+        with open('data.gz', 'rb') as pyfid:
+
+            for flags in [0,
+                          zran.ZRAN_COMPRESS_WINDOWS,
+                          zran.ZRAN_SPARSE_WINDOWS]:
+
+                cfid = fdopen(pyfid.fileno(), 'rb')
+                assert not zran.zran_init(&index1,
+                                          NULL if no_fds else cfid,
+                                          <PyObject*>pyfid if no_fds else NULL,
+                                          chunksize,
+                                          32768,
+                                          131072,
+                                          zran.ZRAN_AUTO_BUILD | flags)
+                assert not zran.zran_build_index(&index1, 0, 0)
+
+                nwindows, ndistinct = _count_windows(&index1)
+                assert nwindows  >= nchunks - 2
+                assert ndistinct <= 8
+
+                _check_reads(&index1, data, buffer)
+
+                with open('data.gzidx', 'wb') as pyidxfid:
+                    cidxfid = fdopen(pyidxfid.fileno(), 'wb')
+                    assert not zran.zran_export_index(
+                        &index1,
+                        NULL if no_fds else cidxfid,
+                        <PyObject*>pyidxfid if no_fds else NULL)
+
+                # Shared windows are written with
+                # format version 3, and are only
+                # written once
+                with open('data.gzidx', 'rb') as f:
+                    assert f.read(6)[5] == 3
+                assert op.getsize('data.gzidx') < 32768 * 10
+
+                cfid = fdopen(pyfid.fileno(), 'rb')
+                assert not zran.zran_init(&index2,
+                                          NULL if no_fds else cfid,
+                                          <PyObject*>pyfid if no_fds else NULL,
+                                          chunksize,
+                                          32768,
+                                          131072,
+                                          flags)
+
+                with open('data.gzidx', 'rb') as pyidxfid:
+                    cidxfid = fdopen(pyidxfid.fileno(), 'rb')
+                    assert not zran.zran_import_index(
+                        &index2,
+                        NULL if no_fds else cidxfid,
+                        <PyObject*>pyidxfid if no_fds else NULL)
+
+                _compare_indexes(&index1, &index2)
+                assert _count_windows(&index2) == (nwindows, ndistinct)
+                _check_reads(&index2, data, buffer)
+
+                # Windows which are still used by the
+                # remaining points must not be released
+                for i in range(5):
+                    pt = random.randint(1, index1.npoints - 1)
+                    assert not zran.zran_build_index(
+                        &index1, index1.cmp_offsets[pt], 0)
+                    _compare_indexes(&index1, &index2)
+                    assert _count_windows(&index1) == (nwindows, ndistinct)
+                    _check_reads(&index1, data, buffer)
+
+                zran.zran_free(&index1)
+                zran.zran_free(&index2)
+
+
+def test_windowless_points(no_fds):
+    """Test that index points which are created at a full flush point, where
+    the data following the point does not refer to the data before it, are
+    created without a window.
+    """
+
+    cdef zran.zran_index_t index1
+    cdef zran.zran_index_t index2
+    cdef zran.zran_point_t point
+    cdef void             *buffer
+
+    chunksize = 65536
+    nchunks   = 64
+    chunks    = [np.random.randint(0, 16, chunksize, dtype=np.uint8).tobytes()
+                 for i in range(nchunks)]
+    data      = b''.join(chunks)
+
+    buf    = ReadBuffer(8192)
+    buffer = buf.buffer
+
+    with tempdir():
+
+        # Sync-flushed chunks still refer back to
+        # the previous chunk, but full-flushed
+        # chunks are independent of each other
+        for flush in [zlib.Z_SYNC_FLUSH, zlib.Z_FULL_FLUSH]:
+
+            cmp = zlib.compressobj(6, zlib.DEFLATED, 31)
+            gz  = [cmp.compress(c) + cmp.flush(flush) for c in chunks]
+            gz  = b''.join(gz) + cmp.flush()
+
+            with open('data.gz', 'wb') as f:
+                f.write(gz)
+
+            with open('data.gz', 'rb') as pyfid:
+                cfid = fdopen(pyfid.fileno(), 'rb')
+                assert not zran.zran_init(&index1,
+                                          NULL if no_fds else cfid,
+                                          <PyObject*>pyfid if no_fds else NULL,
+                                          chunksize,
+                                          32768,
+                                          131072,
+                                          zran.ZRAN_AUTO_BUILD)
+                assert not zran.zran_build_index(&index1, 0, 0)
+
+                # A point just before the (empty) final
+                # block doesn't need a window either
+                windowless = []
+                for i in range(1, index1.npoints):
+                    zran.zran_get_point(&index1, i, &point)
+                    if not point.data and point.uncmp_offset < len(data):
+                        assert point.bits == 0
+                        windowless.append(i)
+
+                if flush == zlib.Z_SYNC_FLUSH:
+                    assert len(windowless) == 0
+                else:
+                    assert len(windowless) > 0
+
+                # Read from each windowless point
+                for i in windowless:
+                    off = index1.uncmp_offsets[i]
+                    assert zran.zran_seek(&index1, off, SEEK_SET, NULL) == 0
+                    nbytes = zran.zran_read(&index1, buffer, 8192)
+                    assert nbytes > 0
+                    assert (<char *>buffer)[:nbytes] == data[off:off + nbytes]
+                _check_reads(&index1, data, buffer)
+
+                with open('data.gzidx', 'wb') as pyidxfid:
+                    cidxfid = fdopen(pyidxfid.fileno(), 'wb')
+                    assert not zran.zran_export_index(
+                        &index1,
+                        NULL if no_fds else cidxfid,
+                        <PyObject*>pyidxfid if no_fds else NULL)
+
+                cfid = fdopen(pyfid.fileno(), 'rb')
+                assert not zran.zran_init(&index2,
+                                          NULL if no_fds else cfid,
+                                          <PyObject*>pyfid if no_fds else NULL,
+                                          chunksize,
+                                          32768,
+                                          131072,
+                                          0)
+
+                with open('data.gzidx', 'rb') as pyidxfid:
+                    cidxfid = fdopen(pyidxfid.fileno(), 'rb')
+                    assert not zran.zran_import_index(
+                        &index2,
+                        NULL if no_fds else cidxfid,
+                        <PyObject*>pyidxfid if no_fds else NULL)
+
+                _compare_indexes(&index1, &index2)
+                for i in windowless:
+                    zran.zran_get_point(&index2, i, &point)
+                    assert not point.data
+                _check_reads(&index2, data, buffer)
+
+                zran.zran_free(&index1)
+                zran.zran_free(&index2)
+
+
+def test_window_budget(no_fds):
+    """Test that windows are evicted when an index exceeds its window
+    budget, that data can still be read from anywhere, and that the
+    evicted windows are re-created when the index is exported.
+    """
+
+    cdef zran.zran_index_t index1
+    cdef zran.zran_index_t index2
+    cdef zran.zran_point_t point
+    cdef void             *buffer
+
+    data   = np.random.randint(0, 16, 4194304, dtype=np.uint8).tobytes()
+    budget = 32768 * 8
+    buf    = ReadBuffer(8192)
+    buffer = buf.buffer
+
+    with tempdir():
+
+        with gzip.open('data.gz', 'wb') as f:
+            f.write(data)
+
+        with open('data.gz', 'rb') as pyfid:
+
+            for flags in [0,
+                          zran.ZRAN_COMPRESS_WINDOWS,
+                          zran.ZRAN_SPARSE_WINDOWS]:
+
+                cfid = fdopen(pyfid.fileno(), 'rb')
+                assert not zran.zran_init(&index1,
+                                          NULL if no_fds else cfid,
+                                          <PyObject*>pyfid if no_fds else NULL,
+                                          65536,
+                                          32768,
+                                          131072,
+                                          zran.ZRAN_AUTO_BUILD | flags)
+                assert not zran.zran_set_window_budget(&index1, budget)
+                assert not zran.zran_build_index(&index1, 0, 0)
+                assert index1.window_bytes <= budget
+
+                # The remaining windows should be
+                # spread throughout the index
+                windows = [i for i in range(index1.npoints)
+                           if not zran.zran_get_point(&index1, i, &point)
+                           and point.data]
+                gaps    = np.diff([0] + windows + [index1.npoints])
+                assert len(windows) < index1.npoints // 2
+                assert max(gaps) <= 4 * index1.npoints // len(windows)
+
+                # A window which has just been used
+                # should be kept in preference to others
+                used = windows[len(windows) // 2]
+                off  = index1.uncmp_offsets[used] + 1
+                assert zran.zran_seek(&index1, off, SEEK_SET, NULL) == 0
+                assert zran.zran_read(&index1, buffer, 8192) == 8192
+                assert not zran.zran_set_window_budget(&index1, budget // 2)
+                assert index1.window_bytes <= budget // 2
+                zran.zran_get_point(&index1, used, &point)
+                assert point.data
+
+                _check_reads(&index1, data, buffer)
+
+                with open('data.gzidx', 'wb') as pyidxfid:
+                    cidxfid = fdopen(pyidxfid.fileno(), 'wb')
+                    assert not zran.zran_export_index(
+                        &index1,
+                        NULL if no_fds else cidxfid,
+                        <PyObject*>pyidxfid if no_fds else NULL)
+
+                # All windows should be in the exported
+                # index, and the index should be brought
+                # within budget when it is imported
+                for budget2 in [0, budget]:
+                    cfid = fdopen(pyfid.fileno(), 'rb')
+                    assert not zran.zran_init(
+                        &index2,
+                        NULL if no_fds else cfid,
+                        <PyObject*>pyfid if no_fds else NULL,
+                        65536,
+                        32768,
+                        131072,
+                        flags)
+                    assert not zran.zran_set_window_budget(&index2, budget2)
+
+                    with open('data.gzidx', 'rb') as pyidxfid:
+                        cidxfid = fdopen(pyidxfid.fileno(), 'rb')
+                        assert not zran.zran_import_index(
+                            &index2,
+                            NULL if no_fds else cidxfid,
+                            <PyObject*>pyidxfid if no_fds else NULL)
+
+                    assert index2.npoints == index1.npoints
+                    if budget2 == 0:
+                        for i in range(1, index2.npoints - 1):
+                            zran.zran_get_point(&index2, i, &point)
+                            assert point.data
+                    else:
+                        assert index2.window_bytes <= budget2
+                    _check_reads(&index2, data, buffer)
+                    zran.zran_free(&index2)
+
+                zran.zran_free(&index1)
+
+            # Process-wide budget
+            total = zran.zran_global_window_bytes()
+            zran.zran_set_global_window_budget(total + budget)
+            try:
+                cfid = fdopen(pyfid.fileno(), 'rb')
+                assert not zran.zran_init(&index1,
+                                          NULL if no_fds else cfid,
+                                          <PyObject*>pyfid if no_fds else NULL,
+                                          65536,
+                                          32768,
+                                          131072,
+                                          zran.ZRAN_AUTO_BUILD)
+                assert not zran.zran_build_index(&index1, 0, 0)
+                assert zran.zran_global_window_bytes() <= total + budget
+                assert index1.window_bytes <= budget
+                _check_reads(&index1, data, buffer)
+                zran.zran_free(&index1)
+                assert zran.zran_global_window_bytes() == total
+            finally:
+                zran.zran_set_global_window_budget(0)
+
+
+cdef _find_point_linear(zran.zran_index_t *index,
+                        uint64_t            offset,
+                        int                 compressed):
+    """Reference implementation of zran_find_point, which searches the
+    index linearly. Returns the expected return code, the position of the
+    last point which precedes the offset, and the position of the point
+    which should be returned (the nearest one with a window).
+    """
+
+    cdef zran.zran_point_t point
+
+    npoints = index.npoints
+
+    if compressed: size = index.compressed_size
+    else:          size = index.uncompressed_size
+
+    if size > 0 and offset >= size:
+        return zran.ZRAN_SEEK_EOF, None, None
+    if npoints == 0:
+        return zran.ZRAN_SEEK_NOT_COVERED, None, None
+
+    # Points which are not byte-aligned
+    # start in the byte before their
+    # compressed offset
+    found = 0
+    for i in range(npoints):
+        zran.zran_get_point(index, i, &point)
+        if compressed: start = point.cmp_offset
+        else:          start = point.uncmp_offset
+        if i == npoints - 1 and offset > start:
+            return zran.ZRAN_SEEK_NOT_COVERED, None, None
+        if compressed and point.bits > 0:
+            start -= 1
+        if start <= offset:
+            found = i
+
+    # Only the first point of a single
+    # stream file has no window, so any
+    # other point without one is evicted
+    use = found
+    while use > 0:
+        zran.zran_get_point(index, use, &point)
+        if point.data != NULL:
+            break
+        use -= 1
+
+    return zran.ZRAN_SEEK_OK, found, use
+
+
+cdef _check_find_point(zran.zran_index_t *index, hints):
+    """Compares zran_find_point against _find_point_linear, for offsets at,
+    around and between every point, with and without the given hints, and
+    with hints around the expected point.
+    """
+
+    cdef zran.zran_point_t  point
+    cdef zran.zran_point_t  expected
+    cdef uint32_t           hint
+    cdef uint32_t          *phint
+
+    for compressed in (0, 1):
+
+        if compressed:
+            offsets = [index.cmp_offsets[i]   for i in range(index.npoints)]
+            size    = index.compressed_size
+        else:
+            offsets = [index.uncmp_offsets[i] for i in range(index.npoints)]
+            size    = index.uncompressed_size
+
+        size    = max(size, offsets[-1] + 1)
+        offsets = set(offsets                            +
+                      [o + 1 for o in offsets]           +
+                      [o - 1 for o in offsets if o > 0]  +
+                      [size - 1, size, size + 1]         +
+                      [int(o) for o in np.random.randint(0, size, 100)])
+
+        for offset in sorted(offsets):
+
+            expret, found, use = _find_point_linear(index, offset, compressed)
+            allhints           = list(hints) + [None]
+
+            if found is not None:
+                allhints += [found + d for d in (-2, -1, 0, 1, 2)
+                             if found + d >= 0]
+
+            for h in allhints:
+
+                if h is None:
+                    phint = NULL
+                else:
+                    hint  = h
+                    phint = &hint
+
+                ret = zran.zran_find_point(index,
+                                           offset,
+                                           compressed,
+                                           phint,
+                                           &point)
+
+                assert ret == expret, (compressed, offset, h)
+
+                if ret != zran.ZRAN_SEEK_OK:
+                    continue
+
+                if h is not None:
+                    assert hint == found, (compressed, offset, h)
+
+                zran.zran_get_point(index, use, &expected)
+                assert point.cmp_offset   == expected.cmp_offset
+                assert point.uncmp_offset == expected.uncmp_offset
+                assert point.bits         == expected.bits
+                assert point.data         == expected.data
+
+
+def test_find_point(no_fds):
+    """Test that zran_find_point finds the same points as a linear search
+    of the index, for compressed and uncompressed offsets, with good, bad
+    and stale hints, and when the windows of some points have been evicted.
+    """
+
+    cdef zran.zran_index_t index
+    cdef zran.zran_point_t point
+
+    data = np.random.randint(0, 16, 4194304, dtype=np.uint8).tobytes()
+
+    with tempdir():
+
+        with gzip.open('data.gz', 'wb') as f:
+            f.write(data)
+
+        with open('data.gz', 'rb') as pyfid:
+
+            cfid = fdopen(pyfid.fileno(), 'rb')
+            assert not zran.zran_init(&index,
+                                      NULL if no_fds else cfid,
+                                      <PyObject*>pyfid if no_fds else NULL,
+                                      65536,
+                                      32768,
+                                      131072,
+                                      0)
+            assert not zran.zran_set_window_budget(&index, 32768 * 8)
+            assert not zran.zran_build_index(&index, 0, 0)
+
+            npoints = index.npoints
+            bits    = []
+            evicted = []
+            for i in range(npoints):
+                zran.zran_get_point(&index, i, &point)
+                bits   .append(point.bits)
+                evicted.append(i > 0 and point.data == NULL)
+
+            # Make sure that all of the
+            # interesting cases are covered
+            assert any(b > 0 for b in bits)
+            assert any(e1 and e2 for e1, e2 in zip(evicted, evicted[1:]))
+            assert not evicted[-1]
+
+            _check_find_point(&index, [0, npoints - 1, npoints, 2 ** 32 - 1])
+
+            # Hints which refer to points
+            # discarded from the index
+            assert not zran.zran_build_index(
+                &index, index.cmp_offsets[npoints // 2], 1)
+            assert 2 < index.npoints < npoints
+
+            _check_find_point(&index, [npoints - 1,
+                                       index.npoints,
+                                       index.npoints + 1,
+                                       npoints // 2 + 1])
+
+            zran.zran_free(&index)
+
+
+def _gen_mixed_data(chunksize, nchunks):
+    """Generates compressible data, with some runs of zeros (so that some
+    windows are shared), and some full flushes (so that some points have
+    no window). Returns the data, and the gzip-compressed data.
+    """
+    chunks = []
+    for i in range(nchunks):
+        if i % 3 == 0:
+            chunk = np.zeros(chunksize, dtype=np.uint8)
+        else:
+            chunk = np.random.randint(0, 16, chunksize, dtype=np.uint8)
+        chunks.append(chunk.tobytes())
+    data = b''.join(chunks)
+
+    cmp = zlib.compressobj(6, zlib.DEFLATED, 31)
+    gz  = [cmp.compress(c) +
+           cmp.flush(zlib.Z_FULL_FLUSH if i % 2 else zlib.Z_SYNC_FLUSH)
+           for i, c in enumerate(chunks)]
+    gz  = b''.join(gz) + cmp.flush()
+
+    return data, gz
+
+
+def test_export_import_compact(no_fds):
+    """Test exporting and importing compact (version 4) index files, from
+    and into indexes which store windows in every possible way.
+    """
+
+    cdef zran.zran_index_t index1
+    cdef zran.zran_index_t index2
+    cdef void             *buffer
+
+    chunksize = 131072
+    data, gz  = _gen_mixed_data(chunksize, 48)
+
+    buf    = ReadBuffer(8192)
+    buffer = buf.buffer
+    ret    = 0
+    allflags = [0,
+                zran.ZRAN_COMPRESS_WINDOWS,
+                zran.ZRAN_SPARSE_WINDOWS,
+                zran.ZRAN_SPARSE_WINDOWS | zran.ZRAN_COMPRESS_WINDOWS]
+
+    with tempdir():
+
+        with open('data.gz', 'wb') as f:
+            f.write(gz)
+
+        with open('data.gz', 'rb') as pyfid:
+
+            for flags, budget in [(f, 0) for f in allflags] + [(0, 262144)]:
+
+                cfid = fdopen(pyfid.fileno(), 'rb')
+                assert not zran.zran_init(&index1,
+                                          NULL if no_fds else cfid,
+                                          <PyObject*>pyfid if no_fds else NULL,
+                                          chunksize,
+                                          32768,
+                                          131072,
+                                          zran.ZRAN_AUTO_BUILD | flags)
+                assert not zran.zran_set_window_budget(&index1, budget)
+                assert not zran.zran_build_index(&index1, 0, 0)
+
+                for fname, eflags in [
+                        ('data.gzidx',    0),
+                        ('compact.gzidx', zran.ZRAN_EXPORT_COMPACT)]:
+                    with open(fname, 'wb') as pyidxfid:
+                        cidxfid = fdopen(pyidxfid.fileno(), 'wb')
+                        assert not zran.zran_export_index_flags(
+                            &index1,
+                            NULL if no_fds else cidxfid,
+                            <PyObject*>pyidxfid if no_fds else NULL,
+                            eflags)
+
+                with open('compact.gzidx', 'rb') as f:
+                    compact = f.read()
+                assert compact[5] == 4
+                assert len(compact) < op.getsize('data.gzidx')
+
+                # A truncated file should be rejected
+                with open('truncated.gzidx', 'wb') as f:
+                    f.write(compact[:len(compact) // 2])
+
+                for fname, importflags in it.product(
+                        ['compact.gzidx', 'truncated.gzidx'], allflags):
+
+                    cfid = fdopen(pyfid.fileno(), 'rb')
+                    assert not zran.zran_init(
+                        &index2,
+                        NULL if no_fds else cfid,
+                        <PyObject*>pyfid if no_fds else NULL,
+                        chunksize,
+                        32768,
+                        131072,
+                        importflags)
+
+                    with open(fname, 'rb') as pyidxfid:
+                        cidxfid = fdopen(pyidxfid.fileno(), 'rb')
+                        ret = zran.zran_import_index(
+                            &index2,
+                            NULL if no_fds else cidxfid,
+                            <PyObject*>pyidxfid if no_fds else NULL)
+
+                    if fname == 'truncated.gzidx':
+                        assert ret != zran.ZRAN_IMPORT_OK
+                        assert index2.npoints == 0
+                    else:
+                        assert ret == zran.ZRAN_IMPORT_OK
+                        # Evicted windows are re-created on
+                        # export, so can't be compared
+                        if budget == 0:
+                            _compare_indexes(&index1, &index2)
+                        assert index2.npoints == index1.npoints
+                        _check_reads(&index2, data, buffer)
+
+                    zran.zran_free(&index2)
+
+                zran.zran_free(&index1)
+
+
+cdef _export_to(zran.zran_index_t *index, fname, eflags, no_fds):
+    """Exports index to fname, with zran_export_index_flags. """
+    with open(fname, 'wb') as pyidxfid:
+        cidxfid = fdopen(pyidxfid.fileno(), 'wb')
+        assert not zran.zran_export_index_flags(
+            index,
+            NULL if no_fds else cidxfid,
+            <PyObject*>pyidxfid if no_fds else NULL,
+            eflags)
+
+
+cdef _lazy_import(zran.zran_index_t *index, pyfid, fname, iflags, no_fds):
+    """Initialises index for pyfid (with 128 KiB spacing and the given
+    flags), and lazily imports fname into it. Returns the return code of
+    zran_import_index_flags.
+    """
+    cfid = fdopen(pyfid.fileno(), 'rb')
+    assert not zran.zran_init(index,
+                              NULL if no_fds else cfid,
+                              <PyObject*>pyfid if no_fds else NULL,
+                              131072,
+                              32768,
+                              131072,
+                              iflags)
+    with open(fname, 'rb') as pyidxfid:
+        cidxfid = fdopen(pyidxfid.fileno(), 'rb')
+        return zran.zran_import_index_flags(
+            index,
+            NULL if no_fds else cidxfid,
+            <PyObject*>pyidxfid if no_fds else NULL,
+            zran.ZRAN_IMPORT_LAZY)
+
+
+def test_import_lazy(no_fds):
+    """Test importing index files lazily, so that windows are read from
+    the mapped index file on demand.
+    """
+
+    cdef zran.zran_index_t index1
+    cdef zran.zran_index_t index2
+    cdef zran.zran_index_t index3
+    cdef void             *buffer
+
+    chunksize = 131072
+    data, gz  = _gen_mixed_data(chunksize, 48)
+
+    buf    = ReadBuffer(8192)
+    buffer = buf.buffer
+    allflags = [0,
+                zran.ZRAN_COMPRESS_WINDOWS,
+                zran.ZRAN_SPARSE_WINDOWS,
+                zran.ZRAN_SPARSE_WINDOWS | zran.ZRAN_COMPRESS_WINDOWS]
+
+    with tempdir():
+
+        with open('data.gz', 'wb') as f:
+            f.write(gz)
+
+        with open('data.gz', 'rb') as pyfid:
+
+            for flags in allflags:
+
+                cfid = fdopen(pyfid.fileno(), 'rb')
+                assert not zran.zran_init(&index1,
+                                          NULL if no_fds else cfid,
+                                          <PyObject*>pyfid if no_fds else NULL,
+                                          chunksize,
+                                          32768,
+                                          131072,
+                                          zran.ZRAN_AUTO_BUILD | flags)
+                assert not zran.zran_build_index(&index1, 0, 0)
+
+                _export_to(&index1, 'data.gzidx', 0, no_fds)
+                _export_to(&index1, 'compact.gzidx', zran.ZRAN_EXPORT_COMPACT,
+                           no_fds)
+
+                for fname, importflags in it.product(
+                        ['data.gzidx', 'compact.gzidx'], allflags):
+
+                    assert _lazy_import(&index2, pyfid, fname, importflags, no_fds) == 0
+
+                    # Files can only be mapped if we have
+                    # a file descriptor - otherwise the
+                    # index is loaded as normal.
+                    if no_fds:
+                        assert index2.nmapped == 0
+                    else:
+                        assert index2.nmapped > 0
+                        assert index2.window_bytes == 0
+
+                    _compare_indexes(&index1, &index2)
+                    _check_reads(&index2, data, buffer)
+
+                    # The windows can be exported again
+                    _export_to(&index2, 'again.gzidx', zran.ZRAN_EXPORT_COMPACT,
+                               no_fds)
+                    assert not _lazy_import(
+                        &index3, pyfid, 'again.gzidx', importflags, no_fds)
+                    _compare_indexes(&index1, &index3)
+
+                    zran.zran_free(&index3)
+                    zran.zran_free(&index2)
+
+                zran.zran_free(&index1)
+
+            # The mapping outlives the file, and
+            # truncated files are rejected
+            with open('compact.gzidx', 'rb') as f:
+                compact = f.read()
+            with open('truncated.gzidx', 'wb') as f:
+                f.write(compact[:-1])
+
+            assert _lazy_import(&index2, pyfid, 'compact.gzidx', 0, no_fds) == 0
+            os.remove('compact.gzidx')
+            _check_reads(&index2, data, buffer)
+            zran.zran_free(&index2)
+
+            assert _lazy_import(&index2, pyfid, 'truncated.gzidx', 0, no_fds) != 0
+            assert index2.npoints == 0
+            zran.zran_free(&index2)
+
+
+def test_import_span_crcs(no_fds):
+    """Test that the CRCs of the data between index points are exported,
+    and are used to validate data which is read via an imported index.
+    """
+
+    cdef zran.zran_index_t index1
+    cdef zran.zran_index_t index2
+    cdef void             *buffer
+
+    # Random data is stored uncompressed, so
+    # a byte can be corrupted without making
+    # the compressed data invalid
+    dsize = 1048576 * 4
+    data  = np.random.randint(0, 256, dsize, dtype=np.uint8)
+    gz    = gzip.compress(data.tobytes(), compresslevel=0)
+    mid   = dsize // 2 + 12345
+    bad   = bytearray(gz)
+    off   = gz.find(data[mid:mid + 32].tobytes())
+    assert off > 0
+    bad[off] = (bad[off] + 1) % 256
+
+    buf    = ReadBuffer(dsize)
+    buffer = buf.buffer
+    i      = 0
+
+    with tempdir():
+
+        with open('data.gz', 'wb') as f:
+            f.write(gz)
+        with open('bad.gz', 'wb') as f:
+            f.write(bad)
+
+        with open('data.gz', 'rb') as pyfid, open('bad.gz', 'rb') as pybad:
+
+            for flags in (0, zran.ZRAN_SKIP_CRC_CHECK):
+
+                cfid = fdopen(pyfid.fileno(), 'rb')
+                assert not zran.zran_init(&index1,
+                                          NULL if no_fds else cfid,
+                                          <PyObject*>pyfid if no_fds else NULL,
+                                          131072,
+                                          32768,
+                                          131072,
+                                          flags)
+                assert not zran.zran_build_index(&index1, 0, 0)
+
+                if flags & zran.ZRAN_SKIP_CRC_CHECK:
+                    assert index1.nspans == 0
+                else:
+                    assert index1.npoints > 2
+                    assert index1.nspans == index1.npoints - 1
+
+                _export_to(&index1, 'data.gzidx', 0, no_fds)
+                _export_to(&index1, 'compact.gzidx', zran.ZRAN_EXPORT_COMPACT,
+                           no_fds)
+
+                for fname, iflags in it.product(['data.gzidx', 'compact.gzidx'],
+                                                [0, zran.ZRAN_IMPORT_LAZY]):
+
+                    cbad = fdopen(pybad.fileno(), 'rb')
+                    assert not zran.zran_init(&index2,
+                                              NULL if no_fds else cbad,
+                                              <PyObject*>pybad if no_fds else NULL,
+                                              131072,
+                                              32768,
+                                              131072,
+                                              0)
+                    with open(fname, 'rb') as pyidxfid:
+                        cidxfid = fdopen(pyidxfid.fileno(), 'rb')
+                        assert not zran.zran_import_index_flags(
+                            &index2,
+                            NULL if no_fds else cidxfid,
+                            <PyObject*>pyidxfid if no_fds else NULL,
+                            iflags)
+
+                    assert index2.nspans == index1.nspans
+                    for i in range(index1.nspans):
+                        assert index2.span_crcs[i] == index1.span_crcs[i]
+
+                    # Validation is only possible if
+                    # the file contains the span CRCs
+                    skipped = (index2.flags & zran.ZRAN_SKIP_CRC_CHECK) != 0
+                    assert skipped == (index1.nspans == 0)
+
+                    # Reading up to the corrupt byte is fine
+                    assert zran.zran_seek(&index2, 0, SEEK_SET, NULL) == 0
+                    assert zran.zran_read(&index2, buffer, mid) == mid
+
+                    # Reading through it is not
+                    assert zran.zran_seek(&index2, 0, SEEK_SET, NULL) == 0
+                    ret = zran.zran_read(&index2, buffer, dsize)
+                    if skipped: assert ret == dsize
+                    else:       assert ret == zran.ZRAN_READ_CRC_ERROR
+
+                    # Data after the corrupt span is fine
+                    for i in range(index2.npoints):
+                        if index2.uncmp_offsets[i] > mid:
+                            break
+                    start = index2.uncmp_offsets[i]
+                    assert start > mid
+                    assert zran.zran_seek(&index2, start, SEEK_SET, NULL) == 0
+                    assert zran.zran_read(&index2, buffer, dsize) == dsize - start
+                    pybuf = <bytes>(<char *>buffer)[:dsize - start]
+                    assert pybuf == data[start:].tobytes()
+
+                    zran.zran_free(&index2)
+
+                zran.zran_free(&index1)
+
+
 def test_export_import_no_points(no_fds):
     """Test exporting and importing an index which does not contain any
     seek points.
@@ -1183,7 +2620,11 @@ def test_export_import_format_v0():
     cdef zran.zran_index_t index2
     cdef int               ret
 
-    data = np.random.randint(1, 255, 1000000, dtype=np.uint8)
+    # Version 0 files have a window for every
+    # point but the first, so the data must be
+    # compressible - the points in incompressible
+    # (stored) data are created without windows
+    data = np.random.randint(1, 16, 1000000, dtype=np.uint8)
     with tempdir():
 
         with gzip.open('data.gz', 'wb') as f:
@@ -1215,7 +2656,7 @@ def test_export_import_format_v0():
 cdef _write_index_file_v0(zran.zran_index_t *index, dest):
     """Write the given index out to a file, index file version 0 format. """
 
-    cdef zran.zran_point_t *point
+    cdef zran.zran_point_t point
 
     with open(dest, 'wb') as f:
         f.write(b'GZIDX\0\0')
@@ -1226,13 +2667,13 @@ cdef _write_index_file_v0(zran.zran_index_t *index, dest):
         f.write(<bytes>(<char *>(&index.npoints))[:4])
 
         for i in range(index.npoints):
-            point = &index.list[i]
+            zran.zran_get_point(index, i, &point)
             f.write(<bytes>(<char *>(&point.cmp_offset))[:8])
             f.write(<bytes>(<char *>(&point.uncmp_offset))[:8])
             f.write(<bytes>(<char *>(&point.bits))[:1])
 
         for i in range(1, index.npoints):
-            point = &index.list[i]
+            zran.zran_get_point(index, i, &point)
             data  = <bytes>point.data[:index.window_size]
             f.write(data)
 
@@ -1345,6 +2786,345 @@ def test_crc_validation(concat, seed):
     _run_crc_tests(data, True, zran.ZRAN_AUTO_BUILD | zran.ZRAN_SKIP_CRC_CHECK)
 
 
+cdef _verify(data, uint16_t flags, uint32_t nreaders):
+    """Used by test_verify. Creates an index and nreaders readers for the
+    given compressed data, and calls zran_verify.
+    """
+    cdef zran.zran_index_t   index
+    cdef zran.zran_reader_t *readers[4]
+    cdef int                 ret
+
+    f  = BytesIO(data)
+    fs = [BytesIO(data) for i in range(nreaders)]
+
+    assert not zran.zran_init(&index,
+                              NULL,
+                              <PyObject*>f,
+                              262144,
+                              32768,
+                              131072,
+                              flags)
+
+    for i, rf in enumerate(fs):
+        readers[i] = zran.zran_reader_create(&index, NULL, <PyObject*>rf)
+        assert readers[i] is not NULL
+
+    # Readers use Python file objects, so
+    # the GIL must be released, otherwise
+    # the verification threads would block
+    with nogil:
+        ret = zran.zran_verify(&index, readers, nreaders)
+
+    # The index is built by zran_verify
+    assert index.npoints > 0
+    assert index.uncmp_offsets[index.npoints - 1] == index.uncompressed_size
+
+    for i in range(nreaders):
+        zran.zran_reader_free(readers[i])
+    zran.zran_free(&index)
+
+    return ret
+
+
+def test_verify(concat, seed):
+    """Test verifying the CRC/size of every stream with zran_verify, using
+    different numbers of readers/threads.
+    """
+
+    dsize             = 1048576 * 10
+    rawdata           = np.random.randint(0, 255, dsize // 4, dtype=np.uint32)
+    cmpdata, strmoffs = compress_inmem(rawdata.tobytes(), concat)
+
+    def wrap(val):
+        return val % 255
+
+    # CRC checking is disabled while the index is
+    # built, so that only zran_verify finds errors
+    flags = zran.ZRAN_SKIP_CRC_CHECK
+
+    for nreaders in (0, 1, 4):
+
+        assert _verify(cmpdata, flags, nreaders) == zran.ZRAN_VERIFY_OK
+        assert _verify(cmpdata, 0,     nreaders) == zran.ZRAN_VERIFY_OK
+
+        # corrupt the size
+        data     = cmpdata.copy()
+        data[-1] = wrap(data[-1] + 1)
+        assert _verify(data, flags, nreaders) == zran.ZRAN_VERIFY_CRC_ERROR
+
+        # corrupt the crc
+        data     = cmpdata.copy()
+        data[-5] = wrap(data[-5] + 1)
+        assert _verify(data, flags, nreaders) == zran.ZRAN_VERIFY_CRC_ERROR
+
+        # corrupt the footers of the other streams
+        for off in strmoffs[1:]:
+            data        = cmpdata.copy()
+            data[off-1] = wrap(data[off-1] + 1)
+            assert _verify(data, flags, nreaders) == zran.ZRAN_VERIFY_CRC_ERROR
+
+
+cdef _build_index_parallel(rawdata,
+                           cmpdata,
+                           uint16_t flags,
+                           uint32_t nreaders):
+    """Used by test_build_index_parallel. Builds an index for the given
+    compressed data with zran_build_index_parallel, and checks that the
+    data read from every index point is correct. Returns the return code,
+    and a list of (compressed, uncompressed) offsets for each index point.
+    """
+    cdef zran.zran_index_t   index
+    cdef zran.zran_reader_t *readers[4]
+    cdef uint32_t            spacing = 1048576
+    cdef uint64_t            off
+    cdef int                 ret
+
+    f   = BytesIO(cmpdata)
+    fs  = [BytesIO(cmpdata) for i in range(nreaders)]
+    buf = ReadBuffer(65536)
+
+    assert not zran.zran_init(&index,
+                              NULL,
+                              <PyObject*>f,
+                              spacing,
+                              32768,
+                              131072,
+                              flags)
+
+    for i, rf in enumerate(fs):
+        readers[i] = zran.zran_reader_create(&index, NULL, <PyObject*>rf)
+        assert readers[i] is not NULL
+
+    # Readers use Python file objects, so
+    # the GIL must be released, otherwise
+    # the worker threads would block
+    with nogil:
+        ret = zran.zran_build_index_parallel(&index, readers, nreaders)
+
+    if ret == zran.ZRAN_BUILD_INDEX_OK:
+
+        assert index.uncompressed_size == len(rawdata)
+        assert index.uncmp_offsets[0]  == 0
+        assert index.cmp_offsets[index.npoints - 1] == len(cmpdata)
+
+        for i in range(1, index.npoints):
+            assert index.uncmp_offsets[i] > index.uncmp_offsets[i - 1]
+            assert index.cmp_offsets[  i] > index.cmp_offsets[  i - 1]
+
+            # the gaps between points must
+            # be no larger than they would
+            # be in a sequential build
+            assert index.uncmp_offsets[i] - index.uncmp_offsets[i - 1] < \
+                2 * spacing
+
+        for i in range(index.npoints - 1):
+            off = index.uncmp_offsets[i]
+            assert zran.zran_seek(&index, off, SEEK_SET, NULL) == \
+                zran.ZRAN_SEEK_OK
+            got = zran.zran_read(&index, buf.buffer, 65536)
+            assert got > 0
+            assert (<char *>buf.buffer)[:got] == rawdata[off:off + got]
+
+    points = [(index.cmp_offsets[i], index.uncmp_offsets[i])
+              for i in range(index.npoints)]
+
+    for i in range(nreaders):
+        zran.zran_reader_free(readers[i])
+    zran.zran_free(&index)
+
+    return ret, points
+
+
+def test_build_index_parallel(concat, seed):
+    """Test building an index with zran_build_index_parallel, using
+    different numbers of readers/threads.
+    """
+
+    # Segments of data which refer back a long
+    # way, so the start of a chunk can't be
+    # decoded until the preceding chunk has
+    # been, interspersed with random data,
+    # which doesn't refer back at all.
+    segments = []
+    for i in range(24):
+        segments.append(np.random.randint(0, 16,  1048576, dtype=np.uint8))
+        segments.append(np.random.randint(0, 256, 65536,   dtype=np.uint8))
+
+    rawdata           = np.concatenate(segments).tobytes()
+    cmpdata, strmoffs = compress_inmem(rawdata, concat)
+
+    def wrap(val):
+        return val % 255
+
+    # With one reader, the index
+    # is built sequentially
+    ret, seqpoints = _build_index_parallel(rawdata, cmpdata, 0, 1)
+    assert ret == zran.ZRAN_BUILD_INDEX_OK
+
+    for nreaders in (2, 4):
+        ret, points = _build_index_parallel(rawdata, cmpdata, 0, nreaders)
+
+        # A point may be lost at the
+        # boundary between chunks
+        assert ret == zran.ZRAN_BUILD_INDEX_OK
+        assert abs(len(points) - len(seqpoints)) <= \
+            2 * len(cmpdata) // 4194304
+
+        ret, points = _build_index_parallel(rawdata,
+                                             cmpdata,
+                                             zran.ZRAN_SPARSE_WINDOWS,
+                                             nreaders)
+        assert ret == zran.ZRAN_BUILD_INDEX_OK
+
+        # corrupt the crc
+        data     = cmpdata.copy()
+        data[-5] = wrap(data[-5] + 1)
+        ret, points = _build_index_parallel(rawdata, data, 0, nreaders)
+        assert ret == zran.ZRAN_BUILD_INDEX_CRC_ERROR
+
+
+def test_build_index_parallel_multi_stream(seed):
+    """Test building an index for a file containing many gzip streams of
+    different sizes with zran_build_index_parallel.
+    """
+
+    # Small streams, some shorter than the
+    # deflate window, big streams which
+    # span multiple chunks, and some null
+    # padding in between.
+    sizes    = [10, 5000, 40000, 300000, 4000000]
+    rawdata  = []
+    cmpdata  = []
+    strmoffs = []
+    uncmp    = 0
+
+    for i in range(200):
+        size = sizes[np.random.randint(0, len(sizes))]
+        data = np.random.randint(0, 16, size, dtype=np.uint8).tobytes()
+
+        rawdata.append(data)
+        cmpdata.append(gzip.compress(data))
+        strmoffs.append((sum(len(c) for c in cmpdata), uncmp))
+        uncmp += size
+
+        if i % 20 == 0:
+            cmpdata.append(b'\0' * 16)
+
+    rawdata = b''.join(rawdata)
+    cmpdata = bytearray(b''.join(cmpdata))
+
+    ret, seqpoints = _build_index_parallel(rawdata, cmpdata, 0, 1)
+    assert ret == zran.ZRAN_BUILD_INDEX_OK
+
+    ret, points = _build_index_parallel(rawdata, cmpdata, 0, 4)
+    assert ret == zran.ZRAN_BUILD_INDEX_OK
+
+    # There should be a point at the
+    # start of every stream
+    seqoffs = set(p[1] for p in seqpoints)
+    offs    = set(p[1] for p in points)
+    for _, off in strmoffs[:-1]:
+        assert off in seqoffs
+        assert off in offs
+
+    # corrupt the crc of a stream in the middle
+    off, _       = strmoffs[len(strmoffs) // 2]
+    cmpdata[off - 5] = (cmpdata[off - 5] + 1) % 255
+    ret, points  = _build_index_parallel(rawdata, cmpdata, 0, 4)
+    assert ret == zran.ZRAN_BUILD_INDEX_CRC_ERROR
+
+
+def test_bgzf_index(seed):
+    """Test that the index for a BGZF file is built from its block headers,
+    with a windowless point at the start of every block.
+    """
+    cdef zran.zran_index_t   index
+    cdef zran.zran_reader_t *readers[4]
+    cdef zran.zran_point_t   point
+    cdef uint64_t            off
+
+    rawdata          = np.random.randint(0, 64, 5000000, dtype=np.uint8)
+    rawdata          = rawdata.tobytes()
+    cmpdata, offsets = compress_bgzf(rawdata)
+    buf              = ReadBuffer(65536)
+
+    for nreaders in (1, 4):
+
+        f  = BytesIO(cmpdata)
+        fs = [BytesIO(cmpdata) for i in range(nreaders)]
+
+        assert not zran.zran_init(&index,
+                                  NULL,
+                                  <PyObject*>f,
+                                  1048576,
+                                  32768,
+                                  131072,
+                                  zran.ZRAN_AUTO_BUILD)
+        assert index.bgzf
+
+        for i, rf in enumerate(fs):
+            readers[i] = zran.zran_reader_create(&index, NULL, <PyObject*>rf)
+
+        with nogil:
+            ret = zran.zran_build_index_parallel(&index, readers, nreaders)
+
+        assert ret == zran.ZRAN_BUILD_INDEX_OK
+        assert index.uncompressed_size == len(rawdata)
+        assert index.npoints           == len(offsets) + 1
+
+        # A point at the start of the deflate
+        # data in each block, and one at EOF
+        for i, off in enumerate(offsets):
+            assert not zran.zran_get_point(&index, i, &point)
+            assert point.cmp_offset   == off + 18
+            assert point.uncmp_offset == i * 65280
+            assert point.bits         == 0
+            assert point.data         == NULL
+
+        assert index.cmp_offsets[  index.npoints - 1] == len(cmpdata) - 10
+        assert index.uncmp_offsets[index.npoints - 1] == len(rawdata)
+
+        for i in range(50):
+            off = np.random.randint(0, len(rawdata))
+            assert zran.zran_seek(&index, off, SEEK_SET, NULL) == \
+                zran.ZRAN_SEEK_OK
+            got = zran.zran_read(&index, buf.buffer, 65536)
+            assert got > 0
+            assert (<char *>buf.buffer)[:got] == rawdata[off:off + got]
+
+        for i in range(nreaders):
+            zran.zran_reader_free(readers[i])
+        zran.zran_free(&index)
+
+    # A file which only starts with BGZF
+    # blocks is indexed in the normal way
+    extra   = np.random.randint(0, 64, 100000, dtype=np.uint8).tobytes()
+    cmpdata = cmpdata + gzip.compress(extra)
+    rawdata = rawdata + extra
+    f       = BytesIO(cmpdata)
+
+    assert not zran.zran_init(&index,
+                              NULL,
+                              <PyObject*>f,
+                              1048576,
+                              32768,
+                              131072,
+                              zran.ZRAN_AUTO_BUILD)
+    assert index.bgzf
+    assert zran.zran_build_index(&index, 0, 0) == zran.ZRAN_BUILD_INDEX_OK
+    assert not index.bgzf
+    assert index.uncompressed_size == len(rawdata)
+
+    for off in (0, len(rawdata) - 200000, len(rawdata) - 50000):
+        assert zran.zran_seek(&index, off, SEEK_SET, NULL) == \
+            zran.ZRAN_SEEK_OK
+        got = zran.zran_read(&index, buf.buffer, 65536)
+        assert got > 0
+        assert (<char *>buf.buffer)[:got] == rawdata[off:off + got]
+
+    zran.zran_free(&index)
+
+
 def test_standard_usage_with_null_padding(concat):
     """Make sure standard usage works with files that have null-padding after
     the GZIP footer.
@@ -19,6 +19,7 @@ import                    time
 import                    gzip
 import                    random
 import                    shutil
+import                    struct
 import                    pickle
 import                    hashlib
 import                    pathlib
@@ -39,6 +40,7 @@ from . import check_data_valid
 from . import tempdir
 from . import touch
 from . import compress
+from . import compress_bgzf
 
 
 SEEK_SET = os.SEEK_SET
@@ -422,10 +424,10 @@ def test_manual_build():
             readval = read_element(f, 0, seek=False)
             assert readval == 0
 
-            # but subsequent reads should fail
-            # (n.b. this might change in the future)
-            with pytest.raises(igzip.NotCoveredError):
-                readval = read_element(f, 1, seek=False)
+            # and subsequent reads should carry
+            # on from where the last one finished
+            readval = read_element(f, 1, seek=False)
+            assert readval == 1
 
             # Seek should still fail even after read
             with pytest.raises(igzip.NotCoveredError):
@@ -446,6 +448,969 @@ def test_manual_build():
                 assert readval == element
 
 
+def test_reader():
+    with tempdir() as td:
+        nelems = 65536
+        fname  = op.join(td, 'test.gz')
+
+        gen_test_data(fname, nelems, False)
+
+        # Readers can only be created
+        # for files opened by name
+        with open(fname, 'rb') as fobj:
+            with igzip._IndexedGzipFile(fobj) as f:
+                with pytest.raises(igzip.NoHandleError):
+                    f.reader()
+
+        with igzip._IndexedGzipFile(fname, auto_build=False) as f:
+
+            assert not f.index_complete
+
+            # Readers never expand the index
+            reader = f.reader()
+            assert np.ndarray(1, np.uint64, reader.pread(8, 0))[0] == 0
+            with pytest.raises(igzip.NotCoveredError):
+                reader.pread(8, 800)
+
+            f.build_full_index()
+            assert f.index_complete
+
+            # Readers have their own seek location
+            f.seek(80)
+            for i in range(5):
+                element = np.random.randint(0, nelems, 1)[0]
+                data    = reader.pread(8, int(element * 8))
+                assert np.ndarray(1, np.uint64, data)[0] == element
+                assert reader.tell() == element * 8 + 8
+            assert f.tell() == 80
+            assert reader.pread(8, nelems * 8) == b''
+            reader.close()
+
+
+def test_compress_windows():
+    with tempdir() as td:
+        nelems = 1048576
+        fname  = op.join(td, 'test.gz')
+        idxf   = op.join(td, 'test.gzidx')
+
+        gen_test_data(fname, nelems, False)
+
+        with igzip._IndexedGzipFile(fname,
+                                    spacing=131072,
+                                    compress_windows=True,
+                                    huge_pages=True) as f:
+            for i in range(50):
+                element = np.random.randint(0, nelems)
+                assert read_element(f, element) == element
+            f.build_full_index()
+            f.export_index(idxf)
+
+        with igzip._IndexedGzipFile(fname,
+                                    spacing=131072,
+                                    index_file=idxf) as f:
+            assert f.index_complete
+            for i in range(50):
+                element = np.random.randint(0, nelems)
+                assert read_element(f, element) == element
+
+
+def test_sparse_windows():
+    with tempdir() as td:
+        nelems    = 1048576
+        fname     = op.join(td, 'test.gz')
+        fullidxf  = op.join(td, 'test_full.gzidx')
+        idxf      = op.join(td, 'test.gzidx')
+
+        gen_test_data(fname, nelems, False)
+
+        with igzip._IndexedGzipFile(fname, spacing=131072) as f:
+            f.build_full_index()
+            f.export_index(fullidxf)
+
+        with igzip._IndexedGzipFile(fname,
+                                    spacing=131072,
+                                    sparse_windows=True) as f:
+            for i in range(50):
+                element = np.random.randint(0, nelems)
+                assert read_element(f, element) == element
+            f.build_full_index()
+            f.export_index(idxf)
+
+        assert op.getsize(idxf) < op.getsize(fullidxf)
+
+        with igzip._IndexedGzipFile(fname,
+                                    spacing=131072,
+                                    index_file=idxf) as f:
+            assert f.index_complete
+            for i in range(50):
+                element = np.random.randint(0, nelems)
+                assert read_element(f, element) == element
+
+
+def test_window_budget():
+    with tempdir() as td:
+        nelems = 1048576
+        budget = 4 * 32768
+        fname  = op.join(td, 'test.gz')
+        idxf   = op.join(td, 'test.gzidx')
+
+        gen_test_data(fname, nelems, False)
+
+        with igzip._IndexedGzipFile(fname,
+                                    spacing=131072,
+                                    window_budget=budget) as f:
+            f.build_full_index()
+            assert igzip.global_window_bytes() > 0
+            for i in range(50):
+                element = np.random.randint(0, nelems)
+                assert read_element(f, element) == element
+            f.export_index(idxf)
+
+        assert igzip.global_window_bytes() == 0
+
+        with igzip._IndexedGzipFile(fname, index_file=idxf) as f:
+            assert f.index_complete
+            for i in range(50):
+                element = np.random.randint(0, nelems)
+                assert read_element(f, element) == element
+
+        with pytest.raises(ValueError):
+            igzip.set_global_window_budget(-1)
+
+
+def test_span_cache():
+    with tempdir() as td:
+        nelems = 1048576
+        fname  = op.join(td, 'test.gz')
+
+        gen_test_data(fname, nelems, False)
+
+        igzip.set_span_cache_budget(1048576 * 4)
+        igzip.span_cache_info(reset=True)
+
+        try:
+            with igzip._IndexedGzipFile(fname, spacing=131072) as f:
+                f.build_full_index()
+                for i in range(200):
+                    element = np.random.randint(0, nelems // 4)
+                    assert read_element(f, element) == element
+
+                info = igzip.span_cache_info()
+                assert info['hits']   > 0
+                assert info['misses'] > 0
+                assert 0 < info['bytes'] <= 1048576 * 4
+                assert info['spans'] > 0
+
+                # sequential reads are also served
+                # correctly through the cache
+                f.seek(0)
+                data = np.frombuffer(f.read(), dtype=np.uint64)
+                assert (data == np.arange(nelems, dtype=np.uint64)).all()
+
+                with igzip._IndexedGzipFile(fname, spacing=131072) as f2:
+                    f2.build_full_index()
+                    for i in range(50):
+                        element = np.random.randint(0, nelems)
+                        assert read_element(f2, element) == element
+                        assert read_element(f,  element) == element
+
+            # spans are discarded when their file is closed
+            assert igzip.span_cache_info()['bytes'] == 0
+
+            with igzip._IndexedGzipFile(fname, spacing=131072) as f:
+                igzip.set_span_cache_budget(131072)
+                for i in range(50):
+                    element = np.random.randint(0, nelems)
+                    assert read_element(f, element) == element
+                assert igzip.span_cache_info()['bytes'] == 0
+
+        finally:
+            igzip.set_span_cache_budget(0)
+
+        info = igzip.span_cache_info(reset=True)
+        assert info['budget'] == 0
+        assert info['bytes']  == 0
+        assert igzip.span_cache_info()['hits'] == 0
+
+        with pytest.raises(ValueError):
+            igzip.set_span_cache_budget(-1)
+
+
+def test_span_cache_replace_shorter():
+    with tempdir() as td:
+        nelems = 1048576
+        fname  = op.join(td, 'test.gz')
+        idxf   = op.join(td, 'test.gzidx')
+
+        gen_test_data(fname, nelems, False)
+
+        with igzip._IndexedGzipFile(fname, spacing=524288) as f:
+            f.build_full_index()
+            f.export_index(idxf)
+            points = list(f.seek_points())
+
+        # An element between the end of the first
+        # span with a small spacing, and the end
+        # of the first span with a larger spacing
+        element = (points[1][0] // 8) - 1
+
+        igzip.set_span_cache_budget(1048576 * 16)
+
+        try:
+            with igzip._IndexedGzipFile(fname, spacing=131072) as f:
+                f.build_full_index()
+                assert read_element(f, 0) == 0
+
+                # The short span cached above must be
+                # replaced by the longer span, which
+                # is then read from the cache
+                f.import_index(idxf)
+                igzip.span_cache_info(reset=True)
+                assert read_element(f, element) == element
+                assert read_element(f, element) == element
+                assert igzip.span_cache_info()['hits'] > 0
+
+        finally:
+            igzip.set_span_cache_budget(0)
+
+
+def test_disk_cache():
+    with tempdir() as td:
+        nelems   = 1048576
+        fname    = op.join(td, 'test.gz')
+        cachedir = op.join(td, 'cache')
+        budget   = 1048576 * 8
+
+        os.mkdir(cachedir)
+        gen_test_data(fname, nelems, False)
+
+        def spanfiles():
+            return [f for f in os.listdir(cachedir) if f.endswith('.span')]
+
+        try:
+            igzip.set_disk_cache(cachedir, budget)
+            igzip.span_cache_info(reset=True)
+
+            with igzip._IndexedGzipFile(fname, spacing=131072) as f:
+                f.build_full_index()
+                for i in range(100):
+                    element = np.random.randint(0, nelems)
+                    assert read_element(f, element) == element
+
+            info = igzip.span_cache_info()
+            assert info['disk_misses'] > 0
+            assert info['disk_spans']  == len(spanfiles())
+            assert 0 < info['disk_bytes'] <= budget
+
+            # spans are read back from disk by another
+            # file, and after the cache is re-opened
+            # (e.g. by another process), both with and
+            # without the memory cache
+            for mem in [0, 1048576 * 4]:
+                igzip.set_disk_cache(None, 0)
+                igzip.set_disk_cache(cachedir, budget)
+                igzip.set_span_cache_budget(mem)
+                igzip.span_cache_info(reset=True)
+                assert igzip.span_cache_info()['disk_spans'] == \
+                    len(spanfiles())
+
+                with igzip._IndexedGzipFile(fname, spacing=131072) as f:
+                    f.build_full_index()
+                    for i in range(100):
+                        element = np.random.randint(0, nelems)
+                        assert read_element(f, element) == element
+                    f.seek(0)
+                    data = np.frombuffer(f.read(), dtype=np.uint64)
+                    assert (data == np.arange(nelems,
+                                              dtype=np.uint64)).all()
+                assert igzip.span_cache_info()['disk_hits'] > 0
+
+            # files are deleted to stay within budget
+            igzip.set_disk_cache(cachedir, 131072 * 8)
+            info = igzip.span_cache_info()
+            assert info['disk_bytes'] <= 131072 * 8
+            assert info['disk_spans'] == len(spanfiles())
+
+            igzip.set_disk_cache(None, 0)
+            assert igzip.span_cache_info()['disk_budget'] == 0
+            assert len(spanfiles()) > 0
+
+            with pytest.raises(IOError):
+                igzip.set_disk_cache(op.join(td, 'nonexistent'), budget)
+            with pytest.raises(ValueError):
+                igzip.set_disk_cache(cachedir, -1)
+
+        finally:
+            igzip.set_disk_cache(None, 0)
+            igzip.set_span_cache_budget(0)
+
+
+def test_disk_cache_identity():
+    with tempdir() as td:
+        fa       = op.join(td, 'a.gz')
+        fb       = op.join(td, 'b.gz')
+        cachedir = op.join(td, 'cache')
+        msize    = 1048576
+        os.mkdir(cachedir)
+
+        # Two files of the same size, with the
+        # same start and end, which only differ
+        # in a member in the middle
+        members = [np.random.randint(0, 256, msize, dtype=np.uint8).tobytes()
+                   for i in range(5)]
+        adata   = b''.join(members[:4])
+        bdata   = b''.join(members[:2] + members[4:] + members[3:4])
+        for fname, data in [(fa, adata), (fb, bdata)]:
+            with open(fname, 'wb') as f:
+                for i in range(0, len(data), msize):
+                    f.write(gzip.compress(data[i:i + msize], compresslevel=0))
+        assert op.getsize(fa) == op.getsize(fb)
+
+        def read_all(fname):
+            with igzip._IndexedGzipFile(fname, spacing=262144) as f:
+                f.build_full_index()
+                return f.read()
+
+        try:
+            igzip.set_disk_cache(cachedir, 1048576 * 64)
+            assert read_all(fa) == adata
+            assert read_all(fb) == bdata
+
+            # A file which is re-written in place,
+            # without its modification time changing
+            st = os.stat(fa)
+            with open(fb, 'rb') as f:
+                bgz = f.read()
+            with open(fa, 'r+b') as f:
+                f.write(bgz)
+            os.utime(fa, ns=(st.st_atime_ns, st.st_mtime_ns))
+            assert read_all(fa) == bdata
+
+        finally:
+            igzip.set_disk_cache(None, 0)
+
+
+def test_disk_cache_mtime_ns():
+    with tempdir() as td:
+        nelems   = 1048576
+        fname    = op.join(td, 'test.gz')
+        cachedir = op.join(td, 'cache')
+        os.mkdir(cachedir)
+
+        gen_test_data(fname, nelems, False)
+
+        def spanfiles():
+            return [f for f in os.listdir(cachedir) if f.endswith('.span')]
+
+        def read_all():
+            with igzip._IndexedGzipFile(fname, spacing=262144) as f:
+                f.build_full_index()
+                return f.read()
+
+        # A file which is modified twice within the
+        # same second gets a new disk cache key
+        sec = os.stat(fname).st_mtime_ns // 1000000000 * 1000000000
+        os.utime(fname, ns=(sec + 100, sec + 100))
+        if os.stat(fname).st_mtime_ns != sec + 100:
+            pytest.skip('File system does not store sub-second mtimes')
+
+        try:
+            igzip.set_disk_cache(cachedir, 1048576 * 64)
+            data   = read_all()
+            nfiles = len(spanfiles())
+            assert nfiles > 0
+
+            os.utime(fname, ns=(sec + 200, sec + 200))
+            assert read_all() == data
+            assert len(spanfiles()) == 2 * nfiles
+
+        finally:
+            igzip.set_disk_cache(None, 0)
+
+
+def test_disk_cache_skip_crc_check():
+    with tempdir() as td:
+        nelems   = 1048576
+        fname    = op.join(td, 'test.gz')
+        cachedir = op.join(td, 'cache')
+        os.mkdir(cachedir)
+
+        gen_test_data(fname, nelems, False)
+
+        # Spans without CRCs cannot be validated
+        # when they are loaded, so are not cached
+        try:
+            igzip.set_disk_cache(cachedir, 1048576 * 64)
+            with igzip._IndexedGzipFile(fname,
+                                        spacing=262144,
+                                        skip_crc_check=True) as f:
+                f.build_full_index()
+                data = np.frombuffer(f.read(), dtype=np.uint64)
+                assert (data == np.arange(nelems, dtype=np.uint64)).all()
+            assert igzip.span_cache_info()['disk_spans'] == 0
+            assert len(os.listdir(cachedir)) == 0
+
+        finally:
+            igzip.set_disk_cache(None, 0)
+
+
+def test_disk_cache_replace_shorter():
+    with tempdir() as td:
+        nelems   = 1048576
+        fname    = op.join(td, 'test.gz')
+        cachedir = op.join(td, 'cache')
+        os.mkdir(cachedir)
+
+        gen_test_data(fname, nelems, False)
+
+        def spanfiles():
+            return [f for f in os.listdir(cachedir) if f.endswith('.span')]
+
+        try:
+            igzip.set_disk_cache(cachedir, 1048576 * 64)
+
+            # A short span is stored
+            # with a small spacing
+            with igzip._IndexedGzipFile(fname, spacing=131072) as f:
+                f.build_full_index()
+                assert read_element(f, 0) == 0
+            assert len(spanfiles()) == 1
+
+            # and then replaced by the longer
+            # span with a larger spacing
+            with igzip._IndexedGzipFile(fname, spacing=524288) as f:
+                f.build_full_index()
+                end     = list(f.seek_points())[1][0]
+                element = end // 8 - 1
+                assert read_element(f, element) == element
+
+            assert len(spanfiles()) == 1
+            span = op.join(cachedir, spanfiles()[0])
+            assert op.getsize(span) == end
+            assert igzip.span_cache_info()['disk_bytes'] == end
+
+            # which is used by later processes
+            igzip.set_disk_cache(None, 0)
+            igzip.set_disk_cache(cachedir, 1048576 * 64)
+            igzip.span_cache_info(reset=True)
+            with igzip._IndexedGzipFile(fname, spacing=524288) as f:
+                f.build_full_index()
+                assert read_element(f, element) == element
+            assert igzip.span_cache_info()['disk_hits'] > 0
+
+        finally:
+            igzip.set_disk_cache(None, 0)
+
+
+def test_readahead():
+    with tempdir() as td:
+        nelems = 1048576
+        fname  = op.join(td, 'test.gz')
+        cname  = op.join(td, 'test_concat.gz')
+        gen_test_data(fname, nelems, False)
+        gen_test_data(cname, nelems, True)
+
+        expected = np.arange(nelems, dtype=np.uint64)
+
+        def check(data, offset):
+            data = np.frombuffer(data, dtype=np.uint64)
+            start = offset // 8
+            assert (data == expected[start:start + len(data)]).all()
+
+        for filename in [fname, cname]:
+
+            with igzip._IndexedGzipFile(filename,
+                                        spacing=131072,
+                                        readahead=True) as f:
+
+                # nothing can be read ahead
+                # until the index is built
+                check(f.read(65536), 0)
+                check(f.read(65536), 65536)
+                f.build_full_index()
+                f.seek(0)
+                assert f.readahead_bytes == 0
+
+                # sequential reads
+                offset = 0
+                while True:
+                    data = f.read(65536)
+                    if len(data) == 0:
+                        break
+                    check(data, offset)
+                    offset += len(data)
+                assert offset == nelems * 8
+                nbytes = f.readahead_bytes
+                assert nbytes > nelems * 4
+
+                # strided reads
+                for offset in range(0, nelems * 8, 300000 * 8):
+                    f.seek(offset)
+                    check(f.read(8192), offset)
+                assert f.readahead_bytes > nbytes
+
+                # random reads
+                for i in range(50):
+                    offset = np.random.randint(0, nelems) * 8
+                    f.seek(offset)
+                    check(f.read(8192), offset)
+
+                f.set_readahead(False)
+                assert f.readahead_bytes == 0
+                f.seek(0)
+                check(f.read(65536), 0)
+
+        with igzip.IndexedGzipFile(cname,
+                                   spacing=131072,
+                                   readahead=True) as f:
+            f.build_full_index()
+            chunks = list(iter(ft.partial(f.read, 65536), b''))
+            check(b''.join(chunks), 0)
+            assert f.readahead_bytes > 0
+
+        with open(fname, 'rb') as fobj:
+            with igzip._IndexedGzipFile(fileobj=fobj) as f:
+                with pytest.raises(igzip.NoHandleError):
+                    f.set_readahead(True)
+
+
+def test_export_compact():
+    with tempdir() as td:
+        nelems   = 1048576
+        fname    = op.join(td, 'test.gz')
+        idxf     = op.join(td, 'test.gzidx')
+        compactf = op.join(td, 'test_compact.gzidx')
+
+        gen_test_data(fname, nelems, False)
+
+        with igzip.IndexedGzipFile(fname, spacing=131072) as f:
+            f.build_full_index()
+            f.export_index(idxf)
+            f.export_index(compactf, compact=True)
+
+        with open(compactf, 'rb') as f:
+            assert f.read(6) == b'GZIDX\x04'
+        assert op.getsize(compactf) < op.getsize(idxf)
+
+        with igzip._IndexedGzipFile(fname, index_file=compactf) as f:
+            assert f.index_complete
+            for i in range(50):
+                element = np.random.randint(0, nelems)
+                assert read_element(f, element) == element
+
+
+@pytest.mark.parametrize('compact', [False, True])
+def test_import_lazy(compact):
+    with tempdir() as td:
+        nelems = 1048576
+        fname  = op.join(td, 'test.gz')
+        idxf   = op.join(td, 'test.gzidx')
+
+        gen_test_data(fname, nelems, False)
+
+        with igzip.IndexedGzipFile(fname, spacing=131072) as f:
+            f.build_full_index()
+            f.export_index(idxf, compact=compact)
+
+        with igzip.IndexedGzipFile(fname,
+                                   index_file=idxf,
+                                   lazy_index=True) as f:
+            for i in range(50):
+                element = np.random.randint(0, nelems)
+                assert read_element(f, element) == element
+
+        with igzip._IndexedGzipFile(fname) as f:
+            with open(idxf, 'rb') as idxfobj:
+                f.import_index(fileobj=idxfobj, lazy=True)
+            assert f.index_complete
+            for i in range(50):
+                element = np.random.randint(0, nelems)
+                assert read_element(f, element) == element
+
+
+@pytest.mark.parametrize('lazy', [False, True])
+def test_import_crc_validation(lazy):
+    with tempdir() as td:
+        fname = op.join(td, 'test.gz')
+        idxf  = op.join(td, 'test.gzidx')
+        dsize = 1048576 * 2
+        data  = np.random.randint(0, 256, dsize, dtype=np.uint8).tobytes()
+
+        # Stored (uncompressed) data can be
+        # corrupted without making the file
+        # impossible to decompress
+        with gzip.open(fname, 'wb', compresslevel=0) as f:
+            f.write(data)
+
+        with igzip._IndexedGzipFile(fname, spacing=262144) as f:
+            f.build_full_index()
+            f.export_index(idxf)
+
+        with open(fname, 'rb') as f:
+            gz = bytearray(f.read())
+        off     = gz.find(data[dsize // 2:dsize // 2 + 32])
+        gz[off] = (gz[off] + 1) % 256
+        with open(fname, 'wb') as f:
+            f.write(gz)
+
+        with igzip._IndexedGzipFile(fname,
+                                    index_file=idxf,
+                                    lazy_index=lazy) as f:
+            assert not f.skip_crc_check
+            assert f.read(dsize // 2) == data[:dsize // 2]
+            f.seek(0)
+            with pytest.raises(igzip.CrcError):
+                f.read()
+
+        # readinto, via the BufferedReader
+        with igzip.IndexedGzipFile(fname,
+                                   index_file=idxf,
+                                   lazy_index=lazy) as f:
+            f.seek(dsize // 2)
+            with pytest.raises(igzip.CrcError):
+                f.read(262144)
+
+
+@pytest.mark.parametrize('threads', [1, 4])
+def test_verify(threads):
+    with tempdir() as td:
+        fname = op.join(td, 'test.gz')
+        dsize = 1048576 * 2
+        data  = np.random.randint(0, 256, dsize, dtype=np.uint8).tobytes()
+
+        with open(fname, 'wb') as f:
+            f.write(gzip.compress(data[:dsize // 2]))
+            f.write(gzip.compress(data[dsize // 2:]))
+
+        with igzip.IndexedGzipFile(fname, spacing=131072) as f:
+            f.verify(threads=threads)
+            assert f.read() == data
+
+        with open(fname, 'rb') as fobj:
+            with igzip.IndexedGzipFile(fileobj=fobj, spacing=131072) as f:
+                f.verify(threads=threads)
+
+        # Corrupt the CRC of the first stream
+        with open(fname, 'rb') as f:
+            gz = bytearray(f.read())
+        off     = len(gzip.compress(data[:dsize // 2])) - 8
+        gz[off] = (gz[off] + 1) % 256
+        with open(fname, 'wb') as f:
+            f.write(gz)
+
+        with igzip.IndexedGzipFile(fname,
+                                   spacing=131072,
+                                   skip_crc_check=True) as f:
+            with pytest.raises(igzip.CrcError):
+                f.verify(threads=threads)
+
+        with igzip.IndexedGzipFile(fname, spacing=131072) as f:
+            with pytest.raises(ValueError):
+                f.verify(threads=0)
+
+
+@pytest.mark.parametrize('threads', [1, 4])
+def test_read_parallel(threads):
+    with tempdir() as td:
+        fname = op.join(td, 'test.gz')
+        dsize = 1048576 * 4
+        data  = np.random.randint(0, 16, dsize, dtype=np.uint8).tobytes()
+
+        with open(fname, 'wb') as f:
+            f.write(gzip.compress(data[:dsize // 3]))
+            f.write(gzip.compress(data[dsize // 3:]))
+
+        with igzip.IndexedGzipFile(fname, spacing=131072) as f:
+
+            # the index is expanded as needed
+            assert f.read_parallel(1000, 300000, threads) == \
+                data[1000:301000]
+            assert f.tell() == 0
+
+            assert f.read_parallel(threads=threads) == data
+            for i in range(20):
+                off = random.randint(0, dsize)
+                n   = random.randint(0, 1048576)
+                got = f.read_parallel(off, n, threads)
+                assert got == data[off:off + n]
+
+            assert f.read_parallel(dsize,      10, threads) == b''
+            assert f.read_parallel(dsize + 10, -1, threads) == b''
+
+            chunks = list(f.iter_chunks(500000, threads=threads))
+            assert all(len(c) == 500000 for c in chunks[:-1])
+            assert b''.join(chunks) == data
+            chunks = list(f.iter_chunks(offset=1234,
+                                        length=2000000,
+                                        threads=threads))
+            assert b''.join(chunks) == data[1234:2001234]
+
+            with pytest.raises(ValueError):
+                f.read_parallel(threads=0)
+
+        with igzip.IndexedGzipFile(fname,
+                                   spacing=131072,
+                                   auto_build=False) as f:
+            with pytest.raises(igzip.NotCoveredError):
+                f.read_parallel(1048576, 10, threads)
+
+
+@pytest.mark.parametrize('threads', [1, 4])
+def test_read_ranges(threads):
+    with tempdir() as td:
+        fname = op.join(td, 'test.gz')
+        dsize = 1048576 * 4
+        data  = np.random.randint(0, 16, dsize, dtype=np.uint8).tobytes()
+
+        with open(fname, 'wb') as f:
+            f.write(gzip.compress(data[:dsize // 3]))
+            f.write(gzip.compress(data[dsize // 3:]))
+
+        # random, overlapping, duplicate, empty,
+        # and past-EOF ranges, in no particular order
+        ranges = [(random.randint(0, dsize), random.randint(0, 100000))
+                  for i in range(200)]
+        ranges += [(5000, 100), (5000, 100), (5050, 20), (0, 0),
+                   (dsize - 10, 100), (dsize + 10, 10)]
+        random.shuffle(ranges)
+        expect = [data[o:o + l] for o, l in ranges]
+
+        with igzip.IndexedGzipFile(fname, spacing=131072) as f:
+            f.seek(1234)
+            assert f.read_ranges(ranges, threads=threads) == expect
+            assert f.tell() == 1234
+            assert f.read_ranges([], threads=threads) == []
+
+            bufs = [bytearray(l + 5) for _, l in ranges]
+            got  = f.read_ranges(ranges, bufs, threads=threads)
+            assert got == [len(e) for e in expect]
+            for b, e in zip(bufs, expect):
+                assert b[:len(e)] == e
+
+            with pytest.raises(ValueError):
+                f.read_ranges([(0, 10)], [bytearray(5)])
+            with pytest.raises(ValueError):
+                f.read_ranges([(-1, 10)])
+            with pytest.raises(ValueError):
+                f.read_ranges([(0, 10)], threads=0)
+
+        with igzip.IndexedGzipFile(fname,
+                                   spacing=131072,
+                                   auto_build=False) as f:
+            with pytest.raises(igzip.NotCoveredError):
+                f.read_ranges([(0, 10), (1048576, 10)], threads=threads)
+
+
+@pytest.mark.parametrize('threads', [1, 4])
+def test_build_full_index_threads(threads):
+    with tempdir() as td:
+        fname = op.join(td, 'test.gz')
+
+        # Must be large enough to be
+        # split into several chunks
+        dsize = 1048576 * 20
+        data  = np.random.randint(0, 16, dsize, dtype=np.uint8).tobytes()
+
+        with open(fname, 'wb') as f:
+            f.write(gzip.compress(data))
+
+        with igzip.IndexedGzipFile(fname, spacing=1048576) as f:
+            f.build_full_index(threads=threads)
+            points = list(f.seek_points())
+            assert points[-1][0] == dsize
+            for uncmp, _ in points[:-1]:
+                f.seek(uncmp)
+                assert f.read(65536) == data[uncmp:uncmp + 65536]
+            f.seek(0)
+            assert f.read() == data
+
+        with igzip.IndexedGzipFile(fname, spacing=1048576) as f:
+            with pytest.raises(ValueError):
+                f.build_full_index(threads=0)
+
+
+@pytest.mark.parametrize('concat,sparse', [[False, False],
+                                            [False, True],
+                                            [True,  False],
+                                            [True,  True]])
+def test_build_full_index_pipelined(concat, sparse):
+    with tempdir() as td:
+        fname = op.join(td, 'test.gz')
+
+        # Large enough for the compressed data
+        # to be read ahead on an I/O thread
+        dsize = 1048576 * 24
+        data  = np.random.randint(0, 16, dsize, dtype=np.uint8).tobytes()
+
+        with open(fname, 'wb') as f:
+            if concat:
+                for off in range(0, dsize, 5000000):
+                    f.write(gzip.compress(data[off:off + 5000000]))
+            else:
+                f.write(gzip.compress(data))
+
+        kwargs = dict(spacing=1048576,
+                      readbuf_size=16384,
+                      sparse_windows=sparse)
+
+        # The index should be identical to one which
+        # is built in small steps (which are read
+        # synchronously)
+        with igzip._IndexedGzipFile(fname, **kwargs) as f:
+            f.build_full_index()
+            points = list(f.seek_points())
+            idx    = BytesIO()
+            f.export_index(fileobj=idx)
+
+        with igzip._IndexedGzipFile(fname, **kwargs) as f:
+            for off in range(0, dsize + 1, 262144):
+                f.seek(off)
+            f.seek(0)
+            assert f.read() == data
+            assert list(f.seek_points()) == points
+            sidx = BytesIO()
+            f.export_index(fileobj=sidx)
+
+        assert idx.getvalue() == sidx.getvalue()
+
+
+def test_bgzf():
+    with tempdir() as td:
+        fname = op.join(td, 'test.gz')
+
+        dsize   = 1048576 * 5
+        data    = np.random.randint(0, 16, dsize, dtype=np.uint8).tobytes()
+        cmp, bo = compress_bgzf(data)
+
+        with open(fname, 'wb') as f:
+            f.write(cmp)
+
+        # every BGZF block should get a seek point
+        with igzip.IndexedGzipFile(fname) as f:
+            f.build_full_index()
+            points = list(f.seek_points())
+            assert len(points) == len(bo) + 1
+            assert points[-1][0] == dsize
+            for i in range(100):
+                off = random.randint(0, dsize)
+                f.seek(off)
+                assert f.read(100000) == data[off:off + 100000]
+            f.seek(0)
+            assert f.read() == data
+
+
+
+def test_import_export_bgzip():
+    with tempdir() as td:
+        fname  = op.join(td, 'test.gz')
+        gzi    = op.join(td, 'test.gz.gzi')
+        ourgzi = op.join(td, 'test_ours.gz.gzi')
+        plain  = op.join(td, 'plain.gz')
+
+        dsize   = 1048576 * 5
+        data    = np.random.randint(0, 16, dsize, dtype=np.uint8).tobytes()
+        cmp, bo = compress_bgzf(data)
+
+        with open(fname, 'wb') as f:
+            f.write(cmp)
+        with open(plain, 'wb') as f:
+            f.write(gzip.compress(data))
+
+        # bgzip index files contain the offsets
+        # of every block apart from the first
+        with open(gzi, 'wb') as f:
+            f.write(struct.pack('<Q', len(bo) - 1))
+            for i, off in enumerate(bo[1:], 1):
+                f.write(struct.pack('<QQ', off, i * 65280))
+
+        with igzip._IndexedGzipFile(fname, index_file=gzi) as f:
+            assert f.index_complete
+            points = list(f.seek_points())
+            assert len(points)   == len(bo) + 1
+            assert points[-1][0] == dsize
+            for i in range(50):
+                off = random.randint(0, dsize)
+                f.seek(off)
+                assert f.read(100000) == data[off:off + 100000]
+            f.export_index(ourgzi, format='bgzip')
+
+        with open(gzi,    'rb') as f: expect = f.read()
+        with open(ourgzi, 'rb') as f: got    = f.read()
+        assert got == expect
+
+        # only possible for BGZF files
+        with igzip.IndexedGzipFile(plain) as f:
+            f.build_full_index()
+            with pytest.raises(igzip.ZranError):
+                f.export_index(ourgzi, format='bgzip')
+            with pytest.raises(igzip.ZranError):
+                f.import_index(gzi)
+
+
+def test_import_export_gztool():
+    with tempdir() as td:
+        nelems = 1048576
+        fname  = op.join(td, 'test.gz')
+        idxf   = op.join(td, 'test.gzi')
+
+        gen_test_data(fname, nelems, False)
+
+        with igzip.IndexedGzipFile(fname, spacing=131072) as f:
+            f.build_full_index()
+            points = list(f.seek_points())
+            f.export_index(idxf, format='gztool')
+
+        with open(idxf, 'rb') as f:
+            assert f.read(16) == b'\0' * 8 + b'gzipindx'
+            assert struct.unpack('>QQ', f.read(16)) == (len(points),
+                                                        len(points))
+
+        with igzip._IndexedGzipFile(fname, index_file=idxf) as f:
+            assert f.index_complete
+            assert list(f.seek_points()) == points
+            for i in range(50):
+                element = np.random.randint(0, nelems)
+                assert read_element(f, element) == element
+
+        with igzip.IndexedGzipFile(fname) as f:
+            with pytest.raises(ValueError):
+                f.export_index(idxf, format='bad')
+
+
+def test_export_gztool_windowless():
+    with tempdir() as td:
+        fname = op.join(td, 'test.gz')
+        idxf  = op.join(td, 'test.gzi')
+        dsize = 1048576 * 2
+        data  = np.random.randint(0, 16, dsize, dtype=np.uint8).tobytes()
+
+        # Points at the start of each gzip
+        # stream are created without a window
+        with open(fname, 'wb') as f:
+            for i in range(0, dsize, 262144):
+                f.write(gzip.compress(data[i:i + 262144]))
+
+        with igzip.IndexedGzipFile(fname, spacing=131072) as f:
+            f.build_full_index()
+            points = list(f.seek_points())
+            f.export_index(idxf, format='gztool')
+
+        # Only the first point may have an
+        # empty window in a gztool index
+        with open(idxf, 'rb') as f:
+            f.read(32)
+            for i in range(len(points)):
+                _, _, _, wlen = struct.unpack('>QQII', f.read(24))
+                assert (i == 0) or (wlen > 0)
+                f.seek(wlen, os.SEEK_CUR)
+
+        with igzip._IndexedGzipFile(fname, index_file=idxf) as f:
+            assert list(f.seek_points()) == points
+            for i in range(50):
+                off = np.random.randint(0, dsize - 16)
+                f.seek(off)
+                assert f.read(16) == data[off:off + 16]
+
 @pytest.mark.parametrize('drop', [False, True])
 def test_read_all(testfile, nelems, use_mmap, drop):
 
@@ -1254,6 +2219,58 @@ def test_picklable():
         del gzf
 
 
+def test_picklable_options():
+
+    # The window and readahead options
+    # should survive a pickle round-trip
+    fname = 'test.gz'
+
+    with tempdir():
+        data = np.random.randint(1, 1000, 1000000, dtype=np.uint32)
+        with gzip.open(fname, 'wb') as f:
+            f.write(data.tobytes())
+        del f
+
+        gzf = igzip.IndexedGzipFile(fname,
+                                    spacing=131072,
+                                    compress_windows=True,
+                                    sparse_windows=True,
+                                    window_budget=65536,
+                                    readahead=True)
+        gzf.build_full_index()
+        gzf.seek(12345)
+        pickled = pickle.dumps(gzf)
+        gzf.close()
+        del gzf
+
+        gzf  = pickle.loads(pickled)
+        fobj = gzf._IndexedGzipFile__igz_fobj
+        assert fobj.compress_windows
+        assert fobj.sparse_windows
+        assert fobj.window_budget == 65536
+        assert fobj.readahead
+        assert gzf.tell() == 12345
+        gzf.seek(0)
+        assert gzf.read() == data.tobytes()
+        gzf.close()
+        del gzf
+
+        # and their defaults likewise
+        gzf     = igzip.IndexedGzipFile(fname)
+        pickled = pickle.dumps(gzf)
+        gzf.close()
+        del gzf
+
+        gzf  = pickle.loads(pickled)
+        fobj = gzf._IndexedGzipFile__igz_fobj
+        assert not fobj.compress_windows
+        assert not fobj.sparse_windows
+        assert fobj.window_budget is None
+        assert not fobj.readahead
+        gzf.close()
+        del gzf
+
+
 def test_copyable():
     fname = 'test.gz'
 
@@ -8,6 +8,7 @@
 from __future__ import print_function
 from __future__ import division
 
+import os
 import sys
 
 import threading
@@ -37,6 +38,15 @@ def test_IndexedGzipFile_pread_threaded(testfile, nelems, concat):
 def test_IndexedGzipFile_pread_threaded_drop_handles(testfile, nelems, concat):
     _test_IndexedGzipFile_pread_threaded(testfile, nelems, True)
 
+@pytest.mark.parametrize('drop', [False, True])
+def test_IndexedGzipFile_pread_concurrent(testfile, nelems, concat, drop):
+    _test_IndexedGzipFile_pread_concurrent(testfile, nelems, drop)
+
+@pytest.mark.skipif(not os.path.isdir('/proc/self/fd'),
+                    reason='requires /proc/self/fd')
+def test_IndexedGzipFile_close_readers(testfile, nelems, concat):
+    _test_IndexedGzipFile_close_readers(testfile, nelems)
+
 
 def _test_IndexedGzipFile_open_close(testfile, drop):
 
@@ -79,3 +89,94 @@ def _test_IndexedGzipFile_pread_threaded(testfile, nelems, drop):
             data = np.ndarray(shape=readelems, dtype=np.uint64,
                               buffer=data)
             assert check_data_valid(data, offset, offset + readelems)
+
+
+def _test_IndexedGzipFile_pread_concurrent(testfile, nelems, drop):
+
+    filesize     = nelems * 8
+    indexSpacing = max(524288, filesize // 2000)
+
+    with igzip.IndexedGzipFile(filename=testfile,
+                               spacing=indexSpacing,
+                               drop_handles=drop) as f:
+
+        # Once the index is complete, preads
+        # are performed concurrently, with
+        # a reader for each thread, and do
+        # not affect the seek location
+        f.build_full_index()
+        f.seek(16)
+
+        readelems = 50
+        readsize  = readelems * 8
+        nthreads  = 8
+        niters    = 20
+        allreads  = []
+        offsets   = np.random.randint(0, nelems - readelems,
+                                      (nthreads, niters))
+
+        def do_pread(offsets):
+            for offset in offsets:
+                data = f.pread(readsize, int(offset * 8))
+                allreads.append((offset, data))
+
+        threads = [threading.Thread(target=do_pread, args=(o, ))
+                   for o in offsets]
+        [t.start() for t in threads]
+        [t.join()  for t in threads]
+
+        assert f.tell() == 16
+        assert f.pread(8, filesize) == b''
+
+        assert len(allreads) == nthreads * niters
+        for offset, data in allreads:
+
+            assert len(data) == readsize
+
+            data = np.ndarray(shape=readelems, dtype=np.uint64,
+                              buffer=data)
+            assert check_data_valid(data, offset, offset + readelems)
+
+
+def _test_IndexedGzipFile_close_readers(testfile, nelems):
+
+    def nfds():
+        return len(os.listdir('/proc/self/fd'))
+
+    filesize     = nelems * 8
+    indexSpacing = max(524288, filesize // 2000)
+    before       = nfds()
+
+    # With drop_handles=False, the reader created
+    # for each thread which calls pread keeps its
+    # own handle open, until the file is closed
+    f = igzip.IndexedGzipFile(filename=testfile,
+                              spacing=indexSpacing,
+                              drop_handles=False)
+    f.build_full_index()
+
+    readsize = 400
+    nthreads = 8
+    allread  = threading.Barrier(nthreads + 1)
+    closed   = threading.Event()
+
+    # The threads are kept alive until the file
+    # is closed, as a reader is also released
+    # when the thread which is using it exits
+    def do_pread(offset):
+        f.pread(readsize, offset)
+        allread.wait()
+        closed.wait()
+
+    threads = [threading.Thread(target=do_pread, args=(i * readsize, ))
+               for i in range(nthreads)]
+    [t.start() for t in threads]
+
+    try:
+        allread.wait()
+        assert nfds() >= before + nthreads
+        f.close()
+        assert nfds() == before
+    finally:
+        closed.set()
+        [t.join() for t in threads]
@@ -89,6 +89,10 @@ if (ctest_zran is not None) and (not sys.platform.startswith("win")):
         for no_fds in (True, False):
             ctest_zran.test_random_seek(testfile, no_fds, nelems, niters, seed)
 
+    def test_get_point(testfile, nelems, niters, seed):
+        for no_fds in (True, False):
+            ctest_zran.test_get_point(testfile, no_fds, nelems, niters, seed)
+
     def test_read_all(testfile, nelems, use_mmap):
         for no_fds in (True, False):
             ctest_zran.test_read_all(testfile, no_fds, nelems, use_mmap)
@@ -109,11 +113,19 @@ if (ctest_zran is not None) and (not sys.platform.startswith("win")):
         for no_fds in (True, False):
             ctest_zran.test_read_all_sequential(testfile, no_fds, nelems)
 
+    def test_read_sequential_chunks(testfile, nelems, seed):
+        for no_fds in (True, False):
+            ctest_zran.test_read_sequential_chunks(testfile, no_fds, nelems, seed)
+
     @pytest.mark.slow_test
     def test_build_then_read(testfile, nelems, seed, use_mmap):
         for no_fds in (True, False):
             ctest_zran.test_build_then_read(testfile, no_fds, nelems, seed, use_mmap)
 
+    def test_rebuild_index(testfile, nelems, seed):
+        for no_fds in (True, False):
+            ctest_zran.test_rebuild_index(testfile, no_fds, nelems, seed)
+
     @pytest.mark.slow_test
     def test_readbuf_spacing_sizes(testfile, nelems, niters, seed):
         for no_fds in (True, False):
@@ -121,10 +133,53 @@ if (ctest_zran is not None) and (not sys.platform.startswith("win")):
                 testfile, no_fds, nelems, niters, seed
             )
 
+    def test_readers(testfile, nelems, niters, seed):
+        for no_fds in (True, False):
+            ctest_zran.test_readers(testfile, no_fds, nelems, niters, seed)
+
+    def test_readers_shared_fd(testfile, nelems, niters, seed):
+        ctest_zran.test_readers_shared_fd(testfile, nelems, niters, seed)
+
     def test_export_then_import(testfile):
         for no_fds in (True, False):
             ctest_zran.test_export_then_import(testfile, no_fds)
 
+    def test_compress_windows(testfile, nelems, niters, seed):
+        for no_fds in (True, False):
+            ctest_zran.test_compress_windows(testfile, no_fds, nelems, niters, seed)
+
+    def test_sparse_windows(testfile, nelems, niters, seed):
+        for no_fds in (True, False):
+            ctest_zran.test_sparse_windows(testfile, no_fds, nelems, niters, seed)
+
+    def test_window_dedup():
+        for no_fds in (True, False):
+            ctest_zran.test_window_dedup(no_fds)
+
+    def test_windowless_points():
+        for no_fds in (True, False):
+            ctest_zran.test_windowless_points(no_fds)
+
+    def test_window_budget():
+        for no_fds in (True, False):
+            ctest_zran.test_window_budget(no_fds)
+
+    def test_find_point():
+        for no_fds in (True, False):
+            ctest_zran.test_find_point(no_fds)
+
+    def test_export_import_compact():
+        for no_fds in (True, False):
+            ctest_zran.test_export_import_compact(no_fds)
+
+    def test_import_lazy():
+        for no_fds in (True, False):
+            ctest_zran.test_import_lazy(no_fds)
+
+    def test_import_span_crcs():
+        for no_fds in (True, False):
+            ctest_zran.test_import_span_crcs(no_fds)
+
     def test_export_import_no_points():
         for no_fds in (True, False):
             ctest_zran.test_export_import_no_points(no_fds)
@@ -135,6 +190,18 @@ if (ctest_zran is not None) and (not sys.platform.startswith("win")):
     def test_crc_validation(concat, seed):
         ctest_zran.test_crc_validation(concat, seed)
 
+    def test_verify(concat, seed):
+        ctest_zran.test_verify(concat, seed)
+
+    def test_build_index_parallel(concat, seed):
+        ctest_zran.test_build_index_parallel(concat, seed)
+
+    def test_build_index_parallel_multi_stream(seed):
+        ctest_zran.test_build_index_parallel_multi_stream(seed)
+
+    def test_bgzf_index(seed):
+        ctest_zran.test_bgzf_index(seed)
+
     def test_skip_crc_with_footer_that_looks_like_new_stream(seed):
         ctest_zran.test_skip_crc_with_footer_that_looks_like_new_stream(seed)
 
@@ -20,6 +20,7 @@
 #ifdef _WIN32
 #include "windows.h"
 #include "io.h"
+#include <process.h>
 static int is_readonly(FILE *fd, PyObject *f)
 {
     /* Can't find a way to do this correctly under
@@ -29,7 +30,13 @@ static int is_readonly(FILE *fd, PyObject *f)
     return 1;
 }
 #else
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 /* Check if file is read-only */
 static int is_readonly(FILE *fd, PyObject *f)
 {
@@ -49,6 +56,7 @@ static uint32_t max(uint32_t a, uint32_t b) {
 
 #include "zran.h"
 #include "zran_file_util.h"
+#include "zran_deflate.h"
 
 
 #ifdef NO_C99
@@ -73,11 +81,184 @@ static double round(double val)
 #endif
 
 
+/*
+ * Process-wide window budget, and the total number of window bytes stored
+ * by all indexes (see zran_set_global_window_budget). Indexes may be
+ * modified concurrently in different threads, so these are accessed
+ * atomically.
+ */
+static uint64_t zran_global_budget = 0;
+static uint64_t zran_global_bytes  = 0;
+
+#ifdef _WIN32
+#define atomic_add_u64(ptr, val) \
+  InterlockedExchangeAdd64((volatile LONG64 *)(ptr),  (LONG64)(val))
+#define atomic_sub_u64(ptr, val) \
+  InterlockedExchangeAdd64((volatile LONG64 *)(ptr), -(LONG64)(val))
+#define atomic_load_u64(ptr) \
+  ((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(ptr), 0, 0))
+#define atomic_store_u64(ptr, val) \
+  InterlockedExchange64((volatile LONG64 *)(ptr), (LONG64)(val))
+#else
+#define atomic_add_u64(ptr, val) \
+  __atomic_fetch_add((ptr), (val), __ATOMIC_RELAXED)
+#define atomic_sub_u64(ptr, val) \
+  __atomic_fetch_sub((ptr), (val), __ATOMIC_RELAXED)
+#define atomic_load_u64(ptr) \
+  __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define atomic_store_u64(ptr, val) \
+  __atomic_store_n((ptr), (val), __ATOMIC_RELAXED)
+#endif
+
+
+/*
+ * Number of hash buckets in the span cache (see
+ * zran_set_span_cache_budget).
+ */
+#define ZRAN_SPAN_CACHE_BUCKETS 4096
+
+
+/*
+ * Spans which are larger than this fraction of the span cache
+ * budget are not cached.
+ */
+#define ZRAN_SPAN_CACHE_MAX_FRACTION 4
+
+
+/*
+ * Spans which are stored in the disk cache (see zran_set_disk_cache) are
+ * named <key>-<offset>.span, where key identifies the compressed file
+ * (see zran_index_t.disk_key), and offset is the uncompressed offset of the
+ * span, both as 16 hexadecimal digits.
+ */
+#define ZRAN_DISK_CACHE_NAME_FORMAT "%016llx-%016llx.span"
+#define ZRAN_DISK_CACHE_NAME_LEN    38
+
+
+/*
+ * Number of bytes at the start and end of a compressed file which are
+ * used, along with its identity and size, to identify it in the disk
+ * cache.
+ */
+#define ZRAN_DISK_KEY_SAMPLE 4096
+
+
+/*
+ * Value of zran_index_t.disk_key for files which cannot be stored in the
+ * disk cache (a disk_key of 0 means that it has not been calculated yet).
+ */
+#define ZRAN_DISK_KEY_NONE UINT64_MAX
+
+
+/*
+ * A span in a span cache, identified by the key of its file, and its
+ * uncompressed offset. In the memory cache, the key is the cache_id of
+ * the index, and data contains the span. In the disk cache, the key is
+ * the disk_key of the index, data is NULL, and the span is stored in a
+ * file in the cache directory. Entries are stored in a hash table (linked
+ * via chain), and in a list ordered by when they were last used (linked
+ * via newer and older).
+ */
+typedef struct _zran_span_entry zran_span_entry_t;
+struct _zran_span_entry {
+    uint64_t           key;
+    uint64_t           start;
+    uint64_t           len;
+    uint8_t           *data;
+    zran_span_entry_t *chain;
+    zran_span_entry_t *newer;
+    zran_span_entry_t *older;
+};
+
+
+/*
+ * A cache of decompressed spans, shared by all indexes. dir is the cache
+ * directory of the disk cache, and NULL for the memory cache. All fields
+ * are protected by zran_span_cache_lock, apart from budget, which is
+ * accessed atomically.
+ */
+typedef struct _zran_span_cache {
+    zran_span_entry_t *buckets[ZRAN_SPAN_CACHE_BUCKETS];
+    zran_span_entry_t *newest;
+    zran_span_entry_t *oldest;
+    char              *dir;
+    uint64_t           budget;
+    uint64_t           bytes;
+    uint64_t           hits;
+    uint64_t           misses;
+    uint32_t           nspans;
+} zran_span_cache_t;
+
+
+/*
+ * The process-wide memory (see zran_set_span_cache_budget) and disk (see
+ * zran_set_disk_cache) span caches, and the last cache_id that was given
+ * to an index.
+ */
+static zran_span_cache_t zran_span_cache;
+static zran_span_cache_t zran_disk_cache;
+static uint64_t          zran_cache_id = 0;
+
+#ifdef _WIN32
+#define zran_getpid() _getpid()
+#else
+#define zran_getpid() getpid()
+#endif
+
+#ifdef _WIN32
+static SRWLOCK zran_span_cache_lock = SRWLOCK_INIT;
+#define zran_span_cache_acquire() \
+  AcquireSRWLockExclusive(&zran_span_cache_lock)
+#define zran_span_cache_release() \
+  ReleaseSRWLockExclusive(&zran_span_cache_lock)
+#else
+static pthread_mutex_t zran_span_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define zran_span_cache_acquire() pthread_mutex_lock(  &zran_span_cache_lock)
+#define zran_span_cache_release() pthread_mutex_unlock(&zran_span_cache_lock)
+#endif
+
+
+/*
+ * Mutexes and condition variables, used by readahead threads (see
+ * zran_readahead_start).
+ */
+#ifdef _WIN32
+typedef SRWLOCK            zran_mutex_t;
+typedef CONDITION_VARIABLE zran_cond_t;
+#define zran_mutex_init(m)     InitializeSRWLock(m)
+#define zran_mutex_destroy(m)
+#define zran_mutex_lock(m)     AcquireSRWLockExclusive(m)
+#define zran_mutex_unlock(m)   ReleaseSRWLockExclusive(m)
+#define zran_cond_init(c)      InitializeConditionVariable(c)
+#define zran_cond_destroy(c)
+#define zran_cond_wait(c, m)   SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define zran_cond_broadcast(c) WakeAllConditionVariable(c)
+#else
+typedef pthread_mutex_t    zran_mutex_t;
+typedef pthread_cond_t     zran_cond_t;
+#define zran_mutex_init(m)     pthread_mutex_init(m, NULL)
+#define zran_mutex_destroy(m)  pthread_mutex_destroy(m)
+#define zran_mutex_lock(m)     pthread_mutex_lock(m)
+#define zran_mutex_unlock(m)   pthread_mutex_unlock(m)
+#define zran_cond_init(c)      pthread_cond_init(c, NULL)
+#define zran_cond_destroy(c)   pthread_cond_destroy(c)
+#define zran_cond_wait(c, m)   pthread_cond_wait(c, m)
+#define zran_cond_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+
 /*
  * Identifier and version number for index files created by zran_export_index.
  */
 const char    ZRAN_INDEX_FILE_ID[]    = {'G', 'Z', 'I', 'D', 'X'};
-const uint8_t ZRAN_INDEX_FILE_VERSION = 1;
+const uint8_t ZRAN_INDEX_FILE_VERSION = 4;
+
+
+/*
+ * Index file flag which is set if the file contains
+ * the CRC32 of the data between each point and the next.
+ */
+uint8_t ZRAN_INDEX_FILE_SPAN_CRCS = 1;
 
 
 /*
@@ -93,7 +274,30 @@ static int _zran_invalidate_index(
 
 
 /*
- * Expands the capacity of the memory used to store the index list.
+ * Changes the capacity of the arrays used to store the index points. The
+ * capacity must not be less than index->npoints.
+ *
+ * Returns 0 on success, non-0 on failure. On failure, the index is left
+ * in a valid state, with its previous capacity.
+ */
+static int _zran_resize_point_list(
+    zran_index_t *index, /* The index    */
+    uint32_t      size   /* New capacity */
+);
+
+
+/*
+ * Frees the memory used to store the index points, including the window
+ * data arena and window table, and sets the point arrays to NULL. The
+ * npoints and size fields are not changed.
+ */
+static void _zran_free_point_list(
+    zran_index_t *index /* The index */
+);
+
+
+/*
+ * Expands the capacity of the memory used to store the index points.
  *
  * Returns 0 on success, non-0 on failure.
  */
@@ -103,8 +307,8 @@ static int _zran_expand_point_list(
 
 
 /*
- * Reduces the capacity of the memory used to store the index list, so that it
- * is only as big as necessary.
+ * Reduces the capacity of the memory used to store the index points, so that
+ * it is only as big as necessary.
  *
  * Returns 0 on success, non-0 on failure.
  */
@@ -112,6 +316,51 @@ static int _zran_free_unused(
     zran_index_t *index  /* The index */
 );
 
+/*
+ * Releases the inflation cursor (the z_stream and read buffer left behind by
+ * zran_read), if it is active. This must be called before anything else
+ * uses the index read buffer.
+ */
+static void _zran_free_cursor(
+    zran_reader_t *reader  /* The reader */
+);
+
+
+/*
+ * Prepares the inflation cursor to continue inflating from where the
+ * previous call to zran_read finished. For seekable files, the file
+ * position is restored to just after the end of the read buffer contents,
+ * as the file may have been seeked since the cursor was last used.
+ *
+ * Returns 0 on success, non-0 on failure.
+ */
+static int _zran_resume_cursor(
+    zran_reader_t *reader  /* The reader */
+);
+
+
+/*
+ * Initialises the given zran_reader_t struct for use with the given index.
+ */
+static void _zran_init_reader(
+    zran_reader_t *reader, /* The reader to initialise */
+    zran_index_t  *index,  /* The index                */
+    FILE          *fd,     /* Handle to the file       */
+    PyObject      *f       /* Handle to the file object */
+);
+
+
+/*
+ * Returns a reference to the reader which is embedded in the index, and is
+ * used by zran_seek, zran_read and _zran_expand_index. The reader file
+ * handles are updated from the index, as they may have been changed since
+ * the last call.
+ */
+static zran_reader_t * _zran_index_reader(
+    zran_index_t *index  /* The index */
+);
+
+
 /*
  * Returns the current limit of the index, i.e. how much of the file is covered
  * by the index.
@@ -131,3045 +380,12637 @@ int ZRAN_GET_POINT_NOT_COVERED =   1;
 int ZRAN_GET_POINT_EOF         =   2;
 
 /*
- * Searches for the zran_point which precedes the given offset. The offset
- * may be specified as being relative to the start of the compressed data,
- * or the uncompressed data.
- *
- * Returns:
- *
- *   - ZRAN_GET_POINT_OK on success.
- *
- *   - ZRAN_GET_POINT_NOT_COVERED if the index does not yet cover the
- *     specified offset.
-
- *   - ZRAN_GET_POINT_EOF if the specified offset is at or beyond the end of
- *     the file.
+ * Returns the bit offset of point i (see zran_index_t.bits).
  */
-static int _zran_get_point_at(
-    zran_index_t  *index,      /* The index */
-
-    uint64_t       offset,     /* The desired offset into the compressed or
-                                  uncompressed data stream */
+static uint8_t _zran_get_point_bits(
+    zran_index_t *index, /* The index              */
+    uint32_t      i      /* Position of the point  */
+);
 
-    uint8_t        compressed, /* Pass in 0 or non-0 to indicate that the
-                                  offset is relative to the uncompressed or
-                                  compressed data streams, respectively. */
 
-    zran_point_t **point       /* If an index point corresponding to the
-                                  specified offset is identified, this pointer
-                                  will be updated to point to it. */
+/*
+ * Sets the bit offset of point i (see zran_index_t.bits).
+ */
+static void _zran_set_point_bits(
+    zran_index_t *index, /* The index              */
+    uint32_t      i,     /* Position of the point  */
+    uint8_t       bits   /* Bit offset (0-7)       */
 );
 
 
 /*
- * If the index has been created without the ZRAN_AUTO_BUILD flag, this
- * function is identical to the _zran_get_point_at function.
+ * Returns the index scratch buffer, which is used to assemble, pack and
+ * compress windows. The buffer is allocated on the first call, and is laid
+ * out as follows:
  *
- * If the index has been created with the ZRAN_AUTO_BUILD flag, and the
- * requested offset is beyond the current range of the index, the index will
- * be expanded to encompass it.
- *
- * The input arguments and return values are identical to the
- * _zran_get_point_at function, however:
- *
- *   - if the index has been initialised with the ZRAN_AUTO_BUILD flag, this
- *     function will never return ZRAN_GET_POINT_NOT_COVERED.
+ *   - window_size bytes, used to assemble windows
+ *   - window_size bytes, used to pack sparse windows
+ *   - compressBound(window_size) bytes, used to compress windows
+ *   - ZRAN_DEFLATE_WINDOW bytes, used to find referenced window bytes
  *
- *   - If a CRC validation error occurs while the index is being expanded,
- *     ZRAN_GET_POINT_CRC_ERROR is returned.
+ * Returns NULL if the allocation fails.
  */
-static int _zran_get_point_with_expand(
-    zran_index_t  *index,      /* The index                           */
-    uint64_t       offset,     /* Desired offset                      */
-    uint8_t        compressed, /* Compressed or uncompressed offset   */
-    zran_point_t **point       /* Place to store the identified point */
+static uint8_t * _zran_window_buf(
+    zran_index_t *index /* The index */
 );
 
 
 /*
- * Estimate an offset in the compressed / uncompressed data stream
- * corresponding to the given offset, which is specified in the uncompressed /
- * compressed data stream.  If the given offset is specified relative to the
- * compressed data stream, the returned value is a location in the
- * uncompressed data stream which approximately corresponds to the given
- * offset.
+ * Windows are stored as-is (window_size bytes), unless the index was created
+ * with ZRAN_COMPRESS_WINDOWS or ZRAN_SPARSE_WINDOWS. In that case, every
+ * stored window begins with a ZRAN_WINDOW_HEADER_SIZE byte header, containing
+ * the length of the data which follows (uint32), and a combination of the
+ * following flags (uint8), describing how the data is encoded:
  *
- * This function is used by the _zran_get_point_with_expand function, if the
- * index has been created with the ZRAN_AUTO_BUILD flag, to determine how far
- * the index needs to be expanded to cover a requested offset that is not yet
- * covered.
+ *   - ZRAN_WINDOW_SPARSE:   The window has been packed by
+ *                           _zran_pack_sparse_window.
+ *   - ZRAN_WINDOW_DEFLATED: The (possibly packed) window has been
+ *                           compressed with zlib.
  */
-static uint64_t _zran_estimate_offset(
-    zran_index_t *index,      /* The index */
+#define ZRAN_WINDOW_HEADER_SIZE 8
+uint8_t ZRAN_WINDOW_DEFLATED = 1;
+uint8_t ZRAN_WINDOW_SPARSE   = 2;
 
-    uint64_t      offset,     /* The offset for which a corresponding offset
-                                 is to be estimated. */
+/* Tests whether windows are stored with a header. */
+#define window_has_header(index) \
+    (((index)->flags & (ZRAN_COMPRESS_WINDOWS | ZRAN_SPARSE_WINDOWS)) > 0)
 
-    uint8_t       compressed  /* Pass in 0 or non-0 to indicate that the given
-                                 offset is specified relative to the
-                                 uncompressed or compressed stream,
-                                 respectively. */
-);
+
+/*
+ * Ranges of referenced window bytes which are separated by fewer than this
+ * many unreferenced bytes are merged when a sparse window is packed, as
+ * each range costs 8 bytes to store.
+ */
+#define ZRAN_SPARSE_WINDOW_GAP 8
 
 
 /*
- * Used by _zran_inflate. Initialises zlib to start decompressing/inflating
- * from either:
- *
- *  - the current seek location in the compressed data, or
- *  - from a location denoted by a specific index point
- *
- * If an index point is provided, the function will seek to the specified
- * compressed data offset before initialising zlib.
- *
- * Otherwise (no index point), inflation is initialised at the current seek
- * location in the input data, and a GZIP header is expected at that location.
- *
- * The index->readbuf and readbuf_size, and the z_stream->avail_in, avail_out,
- * next_in and next_out fields must all be set before this function is called.
- *
- * Returns the number of bytes over the input data that were read (which could
- * be 0), or a negative value on failure.
+ * Maximum amount of compressed data which is re-read from the file by
+ * _zran_find_window_refs, when the read buffer does not contain enough.
  */
-static int _zran_init_zlib_inflate(
-    zran_index_t *index,        /* The index */
+#define ZRAN_FIND_REFS_INPUT_SIZE 65536
 
-    z_stream     *stream,       /* Pointer to a z_stream struct */
 
-    zran_point_t *point         /* Pass in NULL to initialise for inflation
-                                   from the current location in the input file.
-                                   Or pass a pointer to the index point
-                                   corresponding to the location to start
-                                   from. */
+/*
+ * Determines which bytes of the window preceding a new index point are
+ * referenced by the compressed data which follows the point (see
+ * zran_deflate_scan_refs). The compressed data is taken from the reader
+ * read buffer, or is re-read from the file if the read buffer does not
+ * contain enough data (and the file is seekable). This must be called
+ * while the reader is positioned at the point, as it is during
+ * _zran_expand_index.
+ *
+ * Returns:
+ *   - 0 on success, in which case refs contains ZRAN_DEFLATE_WINDOW
+ *     flags, one for each of the last ZRAN_DEFLATE_WINDOW window bytes.
+ *   - 1 if the referenced bytes could not be determined, in which case
+ *     the full window must be stored.
+ *   - -1 if an error occurred.
+ */
+static int _zran_find_window_refs(
+    zran_reader_t *reader,     /* The reader                            */
+    uint64_t       cmp_offset, /* Compressed offset of the point        */
+    uint8_t        bits,       /* Bit offset of the point               */
+    uint8_t       *refs        /* Place to store referenced byte flags  */
 );
 
 
 /*
- * Return codes for _zran_expand_index. These are currently
- * assumed to have identical values to the ZRAN_BUILD_INDEX
- * return codes.
+ * Finds the next range of referenced bytes in refs, starting from *end.
+ * On return, the range is [*start, *end). Returns 0 if there are no more
+ * ranges, non-0 otherwise.
  */
-int ZRAN_EXPAND_INDEX_OK        =  0;
-int ZRAN_EXPAND_INDEX_FAIL      = -1;
-int ZRAN_EXPAND_INDEX_CRC_ERROR = -2;
+static int _zran_next_ref_range(
+    uint8_t  *refs,  /* Referenced byte flags (see _zran_find_window_refs) */
+    uint32_t *start, /* Start of range                                    */
+    uint32_t *end    /* End of range - pass in 0 to find the first range  */
+);
 
 
 /*
- * Expands the index from its current end-point until the given offset (which
- * must be specified relative to the compressed data stream).
- *
- * The index is expanded so that the last point comes after the given offset.
- * If the specified offset is past the last point in the index, a call to this
- * function is guaranteed to create at least one more index point. If there
- * is already an index point which comes after the offset, this function does
- * nothing, and return a success code.
- *
- * We require at least one point to be created, because we want index points
- * to be located at compression block boundaries, but in some data there may
- * be a long distance between block boundaries (longer than the desired index
- * point spacing).
+ * Packs the referenced bytes of a window into buf, as a uint32 range
+ * count, followed by an (offset, length) uint32 pair for each range, and
+ * then the bytes of each range. Unreferenced bytes are discarded, and are
+ * zero-filled when the window is unpacked, which is fine, as they will
+ * never be read during inflation.
  *
- * Returns 0 on success. If a CRC check fails, returns
- * ZRAN_EXPAND_INDEX_CRC_ERROR. For other types of failure, returns
- * ZRAN_EXPAND_INDEX_FAIL.
+ * Returns the length of the packed window, or 0 if the packed window
+ * would not be smaller than the window, in which case nothing is written
+ * to buf.
  */
-static int _zran_expand_index(
-    zran_index_t *index, /* The index */
-    uint64_t      until  /* Expand the index to this point. If 0,
-                            expand the index until EOF is reached. */
+static uint32_t _zran_pack_sparse_window(
+    zran_index_t *index,  /* The index                                   */
+    uint8_t      *window, /* The window                                  */
+    uint8_t      *refs,   /* Referenced byte flags                       */
+    uint8_t      *buf     /* Place to store the packed window - must be
+                             at least window_size bytes long             */
 );
 
 
 /*
- * Adds a new point to the end of the index.
+ * Unpacks a window which was packed by _zran_pack_sparse_window into buf,
+ * which must be window_size bytes long.
+ *
+ * Returns 0 on success, non-0 if the packed window is invalid.
  */
-static int _zran_add_point(
-    zran_index_t *index,        /* The index */
-
-    uint8_t       bits,         /* If the compressed and uncompressed offsets
-                                   are not byte-aligned, this is the number
-                                   of bits in the compressed data, before the
-                                   cmp_offset, where the point is located. */
-
-    uint64_t      cmp_offset,   /* Offset into the compressed data. */
+static int _zran_unpack_sparse_window(
+    zran_index_t *index,   /* The index                     */
+    uint8_t      *packed,  /* The packed window             */
+    uint32_t      len,     /* Length of the packed window   */
+    uint8_t      *buf      /* Place to store the window     */
+);
 
-    uint64_t      uncmp_offset, /* Offset into the uncompressed data. */
 
-    uint32_t      data_offset,  /* Offset into the data pointer specifying the
-                                   point at which the uncompressed data
-                                   associated with this point begins - see
-                                   _zran_expand_index. It is assumed that the
-                                   uncompressed data wraps around this
-                                   offset. */
+/*
+ * Stores a copy of the given window (window_size bytes of uncompressed data)
+ * in the index arena, packing it if the index was created with
+ * ZRAN_SPARSE_WINDOWS and refs is provided, and compressing it if the index
+ * was created with ZRAN_COMPRESS_WINDOWS. The given window may be the index
+ * scratch buffer.
+ *
+ * Returns a pointer to the stored window data, which is to be stored in
+ * index->windows, or NULL on failure.
+ */
+static uint8_t * _zran_store_window(
+    zran_index_t *index,  /* The index                                   */
+    uint8_t      *window, /* The window                                  */
+    uint8_t      *refs    /* Referenced byte flags (see
+                             _zran_find_window_refs), or NULL if the
+                             whole window is to be stored                */
+);
 
-    uint32_t      data_size,    /* Number of bytes in data */
 
-    uint8_t      *data          /* Pointer to data_size bytes of uncompressed
-                                   data preceding this index point. */
+/*
+ * Stores a window which has already been encoded (i.e. packed, or not) in
+ * the index arena, with a header, compressing it if the index was created
+ * with ZRAN_COMPRESS_WINDOWS. This is only used for indexes which store
+ * windows with a header. The given data may be in the index scratch
+ * buffer.
+ *
+ * Returns a pointer to the stored window data, or NULL on failure.
+ */
+static uint8_t * _zran_store_encoded_window(
+    zran_index_t *index,  /* The index                                 */
+    uint8_t      *data,   /* The encoded window                        */
+    uint32_t      len,    /* Length of the encoded window              */
+    uint8_t       flags   /* ZRAN_WINDOW_SPARSE, or 0                  */
 );
 
 
-/* _zran_read_data return codes */
-int ZRAN_READ_DATA_EOF   = -1;
-int ZRAN_READ_DATA_ERROR = -2;
-
 /*
- * This function is a sub-function of _zran_inflate, used to read data from
- * the input file to be passed to zlib:inflate for decompression.
- *
- * Up to index->readbuf_size bytes are read from the input file into
- * index->readbuf, and the z_stream counters/pointers are updated accordingly.
- *
- * On success, returns 0.
+ * Stores window data which has already been encoded, and compressed if
+ * flags contains ZRAN_WINDOW_DEFLATED, in the index arena, with a header.
+ * This is only used for indexes which store windows with a header.
  *
- * If there are no more bytes left to read from the input file (i.e. we are at
- * EOF), ZRAN_READ_DATA_EOF is returned. If an error occurs, returns
- * ZRAN_READ_DATA_ERROR.
+ * Returns a pointer to the stored window data, or NULL on failure.
  */
-static int _zran_read_data_from_file(
-    zran_index_t *index,        /* The index                               */
-    z_stream     *stream,       /* The z_stream struct                     */
-    uint64_t      cmp_offset,   /* Current offset in the compressed data   */
-    uint64_t      uncmp_offset, /* Current offset in the uncompressed data */
-    uint32_t      need_atleast  /* Skip read if the read buffer already has
-                                   this many bytes */
+static uint8_t * _zran_store_window_data(
+    zran_index_t *index,  /* The index                                 */
+    uint8_t      *data,   /* The encoded (and maybe compressed) window */
+    uint32_t      len,    /* Length of the data                        */
+    uint8_t       flags   /* ZRAN_WINDOW_* flags describing the data   */
 );
 
 
-/* _zran_find_next_stream return codes */
-int ZRAN_FIND_STREAM_ERROR     = -2;
-int ZRAN_FIND_STREAM_NOT_FOUND = -1;
+/*
+ * Returns the encoded form of some stored window data (i.e. the window,
+ * or the packed window if it is sparse), decompressing it into buf (which
+ * must be window_size bytes long) if necessary. The length of the encoded
+ * window, and its flags (ZRAN_WINDOW_SPARSE, or 0), are returned via len
+ * and flags.
+ *
+ * Returns NULL if the window cannot be decompressed.
+ */
+static uint8_t * _zran_encoded_window(
+    zran_index_t *index,  /* The index                                  */
+    uint8_t      *data,   /* Stored window data                         */
+    uint8_t      *buf,    /* Buffer to decompress into, if necessary    */
+    uint32_t     *len,    /* Place to store the encoded window length   */
+    uint8_t      *flags   /* Place to store the encoded window flags    */
+);
 
 
 /*
- * This function is a sub-function of _zran_inflate, used to search for a new
- * GZIP stream in a series of concatenated streams.  It searches through the
- * compressed data (pointed to by stream->next_in) to find the location of the
- * next compressed stream.
- *
- * If a new stream was found, the z_stream struct is re-initialised to
- * decompress data from the new stream, using _zran_init_zlib_inflate. In
- * this case, the value returned by that function is returned.
- *
- * Otherwise (if a compressed stream was not found), this function returns
- * ZRAN_FIND_STREAM_NOT_FOUND.
- *
- * The number of bytes that were skipped over before the new stream was found
- * is added to the provided offset pointer.
+ * Decodes (decompressing and unpacking as needed) window data which was
+ * stored by _zran_store_window into buf, which must be window_size bytes
+ * long.
  *
- * If an error occurs, ZRAN_FIND_STREAM_ERROR is returned.
+ * Returns 0 on success, non-0 on failure.
  */
-static int _zran_find_next_stream(
-    zran_index_t *index,  /* The index                                      */
-    z_stream     *stream, /* The z_stream struct                            */
-    int          *offset  /* Used to store the number of bytes skipped over */
+static int _zran_inflate_window(
+    zran_index_t *index, /* The index                     */
+    uint8_t      *data,  /* Stored window data            */
+    uint8_t      *buf    /* Place to store the window     */
 );
 
 
-/* _zran_validate_stream return codes */
-int ZRAN_VALIDATE_STREAM_ERROR   = -2;
-int ZRAN_VALIDATE_STREAM_INVALID = -1;
+/*
+ * Returns non-zero if the given stored window data is a sparse window,
+ * 0 otherwise (including if data is NULL).
+ */
+static int _zran_window_is_sparse(
+    zran_index_t *index, /* The index          */
+    uint8_t      *data   /* Stored window data */
+);
 
 
 /*
- * This function is a sub-function of _zran_inflate, called when the end of a
- * gzip stream is reached. It reads the CRC32 and uncompressed file size from
- * the end of the stream, and compares them to the CRC32 and size that was
- * incrementally calculated by _zran_inflate (which are stored in
- * index->stream_crc32 and index->stream_size),
+ * Returns the number of bytes occupied by the given stored window data.
+ */
+static size_t _zran_stored_window_size(
+    zran_index_t *index, /* The index          */
+    uint8_t      *data   /* Stored window data */
+);
+
+
+/*
+ * Returns the mapped window described by the given window data (an entry
+ * in index->windows), or NULL if the window data is not a mapped window
+ * (see ZRAN_IMPORT_LAZY), but is stored in the index.
+ */
+static zran_mapped_window_t * _zran_mapped_window(
+    zran_index_t *index, /* The index   */
+    uint8_t      *data   /* Window data */
+);
+
+
+/*
+ * Returns the first point which uses the given window data, which may be
+ * shared with other points. Returns point if the window is not known to be
+ * shared.
+ */
+static uint32_t _zran_window_owner(
+    zran_index_t *index, /* The index                          */
+    uint8_t      *data,  /* Window data                        */
+    uint32_t      point  /* A point which uses the window data */
+);
+
+
+/*
+ * Searches the window table for the given stored window data. If by_content
+ * is non-zero, an entry for any stored window with identical contents is
+ * returned, otherwise the entry for that specific window is returned. The
+ * hash of the window data (see zran_window_entry_t) must be provided.
  *
- * The number of bytes that were read before the new stream was found is
- * added to the provided offset pointer.
+ * Returns a pointer to the entry, or NULL if there is no such entry.
+ */
+static zran_window_entry_t * _zran_find_window_entry(
+    zran_index_t *index,     /* The index                       */
+    uint8_t      *data,      /* Stored window data              */
+    uint32_t      hash,      /* Hash of the stored window data  */
+    uint8_t       by_content /* Match by content or by pointer  */
+);
+
+
+/*
+ * Returns the window table entry for the given stored window data, or NULL
+ * if there is no such entry.
+ */
+static zran_window_entry_t * _zran_get_window_entry(
+    zran_index_t *index, /* The index          */
+    uint8_t      *data   /* Stored window data */
+);
+
+
+/*
+ * Changes the number of slots in the window table, which must be a power
+ * of two, and large enough to hold all of the current entries.
  *
- * If ZRAN_SKIP_CRC_CHECK is active, this function updates the stream buffer
- * offsets to skip over the CRC32 and file size bytes, and then returns without
- * doing anything else.
+ * Returns 0 on success, non-0 on failure.
+ */
+static int _zran_resize_window_table(
+    zran_index_t *index, /* The index          */
+    uint32_t      size   /* New number of slots */
+);
+
+
+/*
+ * Removes an entry from the window table.
+ */
+static void _zran_remove_window_entry(
+    zran_index_t        *index, /* The index            */
+    zran_window_entry_t *entry  /* Entry to be removed  */
+);
+
+
+/*
+ * Called whenever a window has been stored for a new point. If an identical
+ * window is already stored, the new window is released from the arena (it
+ * must be the most recent allocation), and the existing window is shared
+ * with the new point. Otherwise the new window is added to the window table.
  *
- * If an error occurs, ZRAN_VALIDATE_STREAM_ERROR is returned.
+ * Returns the stored window data to be used for the point, or NULL on
+ * failure, in which case the new window is not released.
  */
-static int _zran_validate_stream(
-    zran_index_t *index,  /* The index                                      */
-    z_stream     *stream, /* The z_stream struct                            */
-    int          *offset  /* Used to store the number of bytes skipped over */
+static uint8_t * _zran_share_window(
+    zran_index_t *index,  /* The index                           */
+    uint8_t      *stored, /* Newly stored window data            */
+    uint32_t      point   /* Position of the point it belongs to */
 );
 
 
-/* _zran_inflate return codes */
-int ZRAN_INFLATE_CRC_ERROR      = -6;
-int ZRAN_INFLATE_ERROR          = -5;
-int ZRAN_INFLATE_NOT_COVERED    = -4;
-int ZRAN_INFLATE_OUTPUT_FULL    = -3;
-int ZRAN_INFLATE_BLOCK_BOUNDARY = -2;
-int ZRAN_INFLATE_EOF            = -1;
-int ZRAN_INFLATE_OK             =  0;
+/*
+ * Releases the windows of all points from the given point onwards. A
+ * window which is shared with an earlier point is kept. The window
+ * pointers of the released points are set to NULL.
+ */
+static void _zran_release_windows(
+    zran_index_t *index, /* The index                   */
+    uint32_t      from   /* First point to be released  */
+);
+
 
 /*
- * _zran_inflate input flags.
- * Bit position, as a power of 2
+ * Frees the memory used by the window table.
  */
-uint32_t ZRAN_INFLATE_INIT_Z_STREAM         = 1;
-uint32_t ZRAN_INFLATE_FREE_Z_STREAM         = 2;
-uint32_t ZRAN_INFLATE_INIT_READBUF          = 4;
-uint32_t ZRAN_INFLATE_FREE_READBUF          = 8;
-uint32_t ZRAN_INFLATE_USE_OFFSET            = 16;
-uint32_t ZRAN_INFLATE_CLEAR_READBUF_OFFSETS = 32;
-uint32_t ZRAN_INFLATE_STOP_AT_BLOCK         = 64;
+static void _zran_free_window_table(
+    zran_index_t *index /* The index */
+);
 
 
-/* Macros used by _zran_inflate for testing flags. */
-#define inflate_init_stream(  flags) ((flags & ZRAN_INFLATE_INIT_Z_STREAM) > 0)
-#define inflate_free_stream(  flags) ((flags & ZRAN_INFLATE_FREE_Z_STREAM) > 0)
-#define inflate_init_readbuf( flags) ((flags & ZRAN_INFLATE_INIT_READBUF)  > 0)
-#define inflate_free_readbuf( flags) ((flags & ZRAN_INFLATE_FREE_READBUF)  > 0)
-#define inflate_use_offset(   flags) ((flags & ZRAN_INFLATE_USE_OFFSET)    > 0)
-#define inflate_stop_at_block(flags) ((flags & ZRAN_INFLATE_STOP_AT_BLOCK) > 0)
-#define inflate_clear_readbuf_offsets(flags) \
-    ((flags & ZRAN_INFLATE_CLEAR_READBUF_OFFSETS) > 0)
+/*
+ * Returns non-0 if the window of point i has been evicted.
+ */
+static uint8_t _zran_point_evicted(
+    zran_index_t *index, /* The index              */
+    uint32_t      i      /* Position of the point  */
+);
 
 
 /*
- * Inflate (decompress) the specified number of bytes, or until the next
- * Z_BLOCK/Z_STREAM_END is reached.
- *
- * This is a complicated function which implements the core decompression
- * routine, and is used by both _zran_expand_index, and zran_read. It reads
- * compressed data from the file, starting from the specified compressed
- * offset, inflates (a.k.a. decompresses) it, and copies the decompressed
- * data to the provided output buffer.
- *
- * This function is complicated because it is used in three different
- * situations:
- *   - When generating the index (by zran_expand_index)
- *   - When starting from an index seek point and discarding compressed data
- *     to find a requested seek location (by zran_read)
- *   - When actually reading and decompressing data (by zran_read).
+ * Marks the window of point i as evicted. The flag is cleared by
+ * _zran_set_point_bits.
+ */
+static void _zran_set_point_evicted(
+    zran_index_t *index, /* The index              */
+    uint32_t      i      /* Position of the point  */
+);
+
+
+/*
+ * Returns non-0 if the index, or all indexes in the process, are storing
+ * more window data than their budget (see zran_set_window_budget). If
+ * target is non-0, the test is against 7/8 of the budget instead, which is
+ * the level that eviction brings the window data down to.
+ */
+static int _zran_window_budget_exceeded(
+    zran_index_t *index, /* The index                            */
+    uint8_t       target /* Test against the eviction target     */
+);
+
+
+/*
+ * Reference to a stored window, used by _zran_enforce_window_budget and
+ * _zran_compact_windows to process the windows in the window table in
+ * point order.
+ */
+struct _zran_window_ref {
+    uint8_t *data;  /* Stored window data                          */
+    uint8_t *moved; /* New location of the window, when compacting */
+    uint32_t hash;  /* Hash of the window (see zran_window_entry_t) */
+    uint32_t owner; /* Point which owns the window                 */
+    uint32_t slot;  /* Slot of the window in the window table      */
+};
+typedef struct _zran_window_ref zran_window_ref_t;
+
+
+/*
+ * qsort/bsearch comparison functions for zran_window_ref_t structs, which
+ * order them by owner, or by the location of their window data.
+ */
+static int _zran_cmp_window_owner(const void *a, const void *b);
+static int _zran_cmp_window_data( const void *a, const void *b);
+
+
+/*
+ * Evicts windows from the index if it is over budget (see
+ * zran_set_window_budget), and then compacts the remaining windows.
  *
- * This function may be used in a re-entrant or non-re-entrant manner,
- * depending on the flags which are used. In the latter (more likely) case,
- * various pieces of information representing the current inflation state are
- * stored in fields of the zran_index_t struct.
+ * Returns 0 on success, non-0 on failure.
+ */
+static int _zran_enforce_window_budget(
+    zran_index_t *index /* The index */
+);
+
+
+/*
+ * Copies all stored windows into a new arena, in point order, so that
+ * the memory used by evicted windows is released.
  *
- * Specifically, this function does the following:
+ * Returns 0 on success, non-0 on failure, in which case the index is
+ * left unchanged.
+ */
+static int _zran_compact_windows(
+    zran_index_t *index /* The index */
+);
+
+
+/*
+ * Re-creates the window of point i, by decompressing the window_size
+ * bytes which precede it (starting from the nearest earlier point which
+ * has a window), and copies it into buf.
  *
- *   1. Figures out the starting offsets into the compressed/uncompressed
- *      streams. If the ZRAN_INFLATE_USE_OFFSET flag is active, the index
- *      point preceding the specified offset is used as the starting point.
- *      If there is no such point, ZRAN_INFLATE_NOT_COVERED is returned.  If
- *      ZRAN_INFLATE_USE_OFFSET is not active, index->inflate_cmp_offset and
- *      index->inflate_uncmp_offset are used as the starting point.
+ * Returns 0 on success, non-0 on failure.
+ */
+static int _zran_regenerate_window(
+    zran_index_t *index, /* The index                   */
+    uint32_t      i,     /* Position of the point       */
+    uint8_t      *buf    /* Place to store the window   */
+);
+
+
+/*
+ * Used by zran_import_index to read a sparse window from an index file,
+ * and store it in the given index. Sparse windows are kept sparse if the
+ * index was created with ZRAN_SPARSE_WINDOWS, otherwise they are unpacked
+ * and stored in full.
  *
- *   2. Create a read buffer, if ZRAN_INFLATE_INIT_READBUF is active. A
- *      reference to the read buffer is stored at index->readbuf.  If
- *      ZRAN_INFLATE_INIT_READBUF is not set, the function assumes that the
- *      read buffer already exists.
+ * Returns ZRAN_IMPORT_OK on success, or one of the other ZRAN_IMPORT
+ * return codes on failure.
+ */
+static int _zran_import_sparse_window(
+    zran_index_t  *index,  /* The index                                  */
+    uint8_t      **stored, /* Place to store the stored window data      */
+    uint8_t        last,   /* Non-0 if this is the last window in the
+                              file, in which case EOF is not an error    */
+    FILE          *fd,     /* Open handle to import file                 */
+    PyObject      *f       /* Open handle to import file object          */
+);
+
+
+/*
+ * Compact (version 4) index files store offsets and lengths as variable
+ * length integers - seven bits per byte, least significant first, with
+ * the high bit set on every byte but the last. A uint64 takes at most
+ * ZRAN_VARINT_MAX bytes.
+ */
+#define ZRAN_VARINT_MAX 10
+
+
+/*
+ * In the point table of a compact index file, the bit offset and the data
+ * flag of each point (see zran_export_index) are packed into one byte,
+ * with the data flag in the upper bits. ZRAN_COMPACT_DEFLATED is added to
+ * the data flag of points whose window record is compressed.
+ */
+#define ZRAN_COMPACT_FLAG_SHIFT 3
+#define ZRAN_COMPACT_DEFLATED   4
+
+
+/*
+ * Writes value to buf as a variable length integer, returning the number
+ * of bytes written.
+ */
+static uint32_t _zran_put_varint(
+    uint8_t  *buf,  /* Place to write the value - must have space for
+                       ZRAN_VARINT_MAX bytes                          */
+    uint64_t  value /* The value                                      */
+);
+
+
+/*
+ * Reads a variable length integer from buf, starting at *pos, and
+ * advances *pos past it.
  *
- *   3. If the ZRAN_INFLATE_CLEAR_READBUF_OFFSETS flag is active, the read
- *      buffer offset (index->readbuf_offset) and length (index->readbuf_end)
- *      fields are both set to 0. Otherwise, the function assumes that the
- *      current offset/length values are valid.
+ * Returns 0 on success, non-0 if the integer runs past len, or is too
+ * long.
+ */
+static int _zran_get_varint(
+    uint8_t  *buf,   /* The buffer               */
+    uint64_t  len,   /* Length of the buffer     */
+    uint64_t *pos,   /* Position in the buffer   */
+    uint64_t *value  /* Place to store the value */
+);
 
- *   4. Initialises the z_stream struct, if ZRAN_INFLATE_INIT_Z_STREAM is
- *      active. Otherwise, the function assumes that the z_stream struct is
- *      already initialised and ready to be used.
+
+/*
+ * Used by zran_export_index to write the point table and window records of
+ * a compact (version 4) index file, which follow the file header. Window
+ * records are compressed where that makes them smaller, and windows which
+ * are already stored compressed are written as they are. ZRAN_COMPACT_-
+ * DEFLATED is added to the dataflags of points with compressed records.
  *
- *   5. Read some compressed data from the file into the read buffer as needed.
+ * Returns ZRAN_EXPORT_OK on success, ZRAN_EXPORT_WRITE_ERROR on failure.
+ */
+static int _zran_export_compact_index(
+    zran_index_t *index,     /* The index                        */
+    uint8_t      *dataflags, /* Data flag for each point         */
+    FILE         *fd,        /* Open handle to export file       */
+    PyObject     *f          /* Open handle to export file object */
+);
+
+
+/*
+ * Used by zran_import_index to read the point table of a compact (version
+ * 4) index file into the point arrays of the given index. The data flag
+ * of each point is stored in dataflags, and the length of its window
+ * record, or the owner of its window if it is shared, in extra.
  *
- *   6. Pass that data to the zlib inflate function, and store the resulting
- *      uncompressed data in the provided data buffer. If the end of a GZIP
- *      stream is reached for the first time, it is validated against the
- *      CRC/file size stored in the GZIP footer (unless ZRAN_SKIP_CRC_CHECK
- *      is active).
+ * Returns ZRAN_IMPORT_OK on success, or one of the other ZRAN_IMPORT
+ * return codes on failure.
+ */
+static int _zran_import_compact_points(
+    zran_index_t *index,     /* The index (with space for npoints points) */
+    uint32_t      npoints,   /* Number of points                           */
+    uint8_t      *dataflags, /* Place to store the data flags              */
+    uint32_t     *extra,     /* Place to store record lengths / owners     */
+    FILE         *fd,        /* Open handle to import file                 */
+    PyObject     *f          /* Open handle to import file object          */
+);
+
+
+/*
+ * Used by zran_import_index to read a window record from a compact (version
+ * 4) index file, and store it in the given index. Compressed records are
+ * stored as they are if the index was created with ZRAN_COMPRESS_WINDOWS,
+ * and sparse windows are kept sparse if the index was created with
+ * ZRAN_SPARSE_WINDOWS.
  *
- *   7. Repeat steps 5 and 6 until one of the following is true:
+ * Returns ZRAN_IMPORT_OK on success, or one of the other ZRAN_IMPORT
+ * return codes on failure.
+ */
+static int _zran_import_window_record(
+    zran_index_t  *index,    /* The index                                  */
+    uint8_t      **stored,   /* Place to store the stored window data      */
+    uint32_t       len,      /* Length of the record                       */
+    uint8_t        dataflag, /* Data flag of the point                     */
+    uint8_t        last,     /* Non-0 if this is the last point in the
+                                file, in which case EOF is not an error    */
+    FILE          *fd,       /* Open handle to import file                 */
+    PyObject      *f         /* Open handle to import file object          */
+);
+
+
+/*
+ * Reads and writes unsigned integers of nbytes bytes, stored in little- or
+ * big-endian byte order. Used for index files written by other tools.
+ */
+static uint64_t _zran_get_uint(
+    uint8_t *buf,       /* Buffer to read from                   */
+    uint8_t  nbytes,    /* Size of the integer                   */
+    uint8_t  bigendian  /* Non-0 if stored most significant first */
+);
+static void _zran_put_uint(
+    uint8_t  *buf,      /* Buffer to write to                    */
+    uint64_t  value,    /* Value to write                        */
+    uint8_t   nbytes,   /* Size of the integer                   */
+    uint8_t   bigendian /* Non-0 to store most significant first */
+);
+
+
+/*
+ * Used by zran_export_index to write a bgzip index (.gzi) file, for an
+ * index of a BGZF file. A bgzip index file contains the number of entries
+ * (uint64), followed by the compressed and uncompressed offset (uint64) of
+ * the start of every BGZF block apart from the first, all little-endian.
  *
- *       - The requested number of bytes have been read
+ * Returns ZRAN_EXPORT_OK on success, ZRAN_EXPORT_UNSUPPORTED if a point of
+ * the index is not at the start of a BGZF block, or ZRAN_EXPORT_WRITE_ERROR
+ * on failure.
+ */
+static int _zran_export_bgzip_index(
+    zran_index_t *index, /* The index                         */
+    FILE         *fd,    /* Open handle to export file        */
+    PyObject     *f      /* Open handle to export file object */
+);
+
+
+/*
+ * Used by zran_export_index to write a gztool index file. A gztool index
+ * file has a 16 byte header (8 zero bytes, and "gzipindx"), followed by
+ * the number of points (uint64, twice). Each point is stored as its
+ * uncompressed offset (uint64), compressed offset (uint64), bit offset
+ * (uint32), window length (uint32), and the last 32KB of its window,
+ * compressed with zlib. The uncompressed size (uint64) comes last. All
+ * integers are big-endian. Only the first point may have an empty window
+ * in a gztool index, so the windows of any other points which do not have
+ * one (or whose windows have been evicted) are regenerated.
  *
- *       - The output buffer is full
+ * Returns ZRAN_EXPORT_OK on success, ZRAN_EXPORT_WRITE_ERROR on failure.
+ */
+static int _zran_export_gztool_index(
+    zran_index_t *index, /* The index                         */
+    FILE         *fd,    /* Open handle to export file        */
+    PyObject     *f      /* Open handle to export file object */
+);
+
+
+/*
+ * Used by zran_import_index to read an index file which was not written by
+ * zran_export_index - a gztool index file, or a bgzip index file (see
+ * _zran_export_gztool_index and _zran_export_bgzip_index). The file must
+ * be seekable. Version 1 gztool files, which also contain line numbers, are
+ * accepted. The points are loaded into the point arrays and windows of
+ * new_index.
  *
- *       - End of file is reached
+ * bgzip index files have no identifier, so are only accepted for BGZF files,
+ * and the block header at every offset in the file is checked. The blocks
+ * after the last entry are read to find out the uncompressed size.
  *
- *       - ZRAN_INFLATE_STOP_AT_BLOCK is active, and a block is reached
+ * Returns ZRAN_IMPORT_OK on success, or one of the other ZRAN_IMPORT
+ * return codes on failure.
+ */
+static int _zran_import_foreign_index(
+    zran_index_t *index,             /* The index being imported into     */
+    zran_index_t *new_index,         /* Index to load the points into     */
+    uint64_t     *uncompressed_size, /* Place to store the uncompressed
+                                        size, or 0 if it is not known     */
+    FILE         *fd,                /* Open handle to import file        */
+    PyObject     *f                  /* Open handle to import file object */
+);
+
+
+/*
+ * Used by zran_import_index to map the window data of an index file into
+ * memory (see ZRAN_IMPORT_LAZY), instead of loading it. Must be called
+ * once the point table has been read, while fd is positioned at the
+ * start of the window data. The windows of the given index are set to
+ * point to its mapped_windows.
  *
- *   8. If ZRAN_INFLATE_FREE_READBUF is active, the file read buffer is
- *      de-allocated.
+ * Returns:
+ *   - ZRAN_IMPORT_OK on success.
+ *   - 1 if the file cannot be mapped, in which case the windows must be
+ *     loaded as normal.
+ *   - One of the other ZRAN_IMPORT return codes if the window data is
+ *     invalid.
+ */
+static int _zran_map_windows(
+    zran_index_t *index,     /* The index (with npoints points)         */
+    uint8_t       version,   /* Index file format version               */
+    uint8_t      *dataflags, /* Data flag for each point                */
+    uint32_t     *extra,     /* Record lengths / owners (version 4)     */
+    FILE         *fd         /* Open handle to import file              */
+);
+
+
+/*
+ * Releases the index file mapping created by _zran_map_windows, if
+ * there is one.
+ */
+static void _zran_unmap_windows(
+    zran_index_t *index /* The index */
+);
+
+
+/*
+ * Returns the uncompressed window corresponding to the given stored window
+ * data (i.e. an entry in index->windows). If the window is compressed or
+ * sparse, it is decoded into the reader window cache, unless it is already
+ * there.
+ * The returned pointer is only valid until the next call to this function
+ * with the same reader.
  *
- *   9. If ZRAN_INFLATE_FREE_Z_STREAM is active, the memory used by the
- *      z_stream struct is de-allocated (via the zlib inflateEnd function).
+ * Returns NULL if data is NULL, or if the window cannot be decoded.
+ */
+static uint8_t * _zran_load_window(
+    zran_reader_t *reader, /* The reader          */
+    uint8_t       *data    /* Stored window data  */
+);
+
+
+/*
+ * Frees the memory used by the window cache of the given reader.
+ */
+static void _zran_free_window_cache(
+    zran_reader_t *reader /* The reader */
+);
+
+
+/*
+ * Returns non-zero if decompression for the given offset can be started
+ * from point i, i.e. if the point is located at or before the offset, 0
+ * otherwise.
+ */
+static int _zran_point_precedes(
+    zran_index_t *index,      /* The index */
+    uint32_t      i,          /* Position of the point */
+    uint64_t      offset,     /* Offset into the compressed or
+                                 uncompressed data stream */
+    uint8_t       compressed  /* Compressed or uncompressed offset */
+);
+
+
+/*
+ * Searches for the zran_point which precedes the given offset. The offset
+ * may be specified as being relative to the start of the compressed data,
+ * or the uncompressed data.
  *
- * The control flags can be a combination (bitwise OR) of the following:
+ * The search is a binary search over the point list. A hint may also be
+ * provided, containing the position of the point that was found on a
+ * previous search - that point, and the one which follows it, are checked
+ * before the binary search is performed, so that sequential/localised
+ * accesses are fast.
  *
- *   - ZRAN_INFLATE_INIT_Z_STREAM:         Initialise the z_stream struct
- *                                         before inflation.
+ * Returns:
  *
- *   - ZRAN_INFLATE_FREE_Z_STREAM:         Clean up the z_stream struct
- *                                         after inflation.
+ *   - ZRAN_GET_POINT_OK on success.
  *
- *   - ZRAN_INFLATE_INIT_READBUF:          Allocate a read buffer before
- *                                         inflation.
+ *   - ZRAN_GET_POINT_NOT_COVERED if the index does not yet cover the
+ *     specified offset.
+
+ *   - ZRAN_GET_POINT_EOF if the specified offset is at or beyond the end of
+ *     the file.
+ */
+static int _zran_get_point_at(
+    zran_index_t  *index,      /* The index */
+
+    uint64_t       offset,     /* The desired offset into the compressed or
+                                  uncompressed data stream */
+
+    uint8_t        compressed, /* Pass in 0 or non-0 to indicate that the
+                                  offset is relative to the uncompressed or
+                                  compressed data streams, respectively. */
+
+    uint32_t      *hint,       /* Position, in the index, of the point
+                                  found on a previous search. Updated to
+                                  contain the position of the point that is
+                                  found. May be NULL. */
+
+    zran_point_t  *point       /* If an index point corresponding to the
+                                  specified offset is identified, it is
+                                  copied into this struct. */
+);
+
+
+/*
+ * If the index has been created without the ZRAN_AUTO_BUILD flag, this
+ * function is identical to the _zran_get_point_at function.
  *
- *   - ZRAN_INFLATE_FREE_READBUF:          Free the read buffer after
- *                                         inflation.
+ * If the index has been created with the ZRAN_AUTO_BUILD flag, and the
+ * requested offset is beyond the current range of the index, the index will
+ * be expanded to encompass it.
  *
- *   - ZRAN_INFLATE_USE_OFFSET:            If set, use the provided offset
- *                                         parameter; otherwise, use the
- *                                         offsets stored in the index
- *                                         struct.
+ * The input arguments and return values are identical to the
+ * _zran_get_point_at function, however:
  *
- *   - ZRAN_INFLATE_CLEAR_READBUF_OFFSETS: If set, clear the read buffer
- *                                         offset/length stored in the index
- *                                         struct, otherwise assume that they
- *                                         are valid.
+ *   - if the index has been initialised with the ZRAN_AUTO_BUILD flag, this
+ *     function will never return ZRAN_GET_POINT_NOT_COVERED.
  *
- *   - ZRAN_INFLATE_STOP_AT_BLOCK:         If set, stop inflation when a
- *                                         deflate block boundary is reached
- *                                         (the Z_BLOCK flag is passed to the
- *                                         zlib inflate function). Otherwise,
- *                                         inflation will continue until one
- *                                         of the conditions in step 7, above,
- *                                         are met.
+ *   - If a CRC validation error occurs while the index is being expanded,
+ *     ZRAN_GET_POINT_CRC_ERROR is returned.
+ */
+static int _zran_get_point_with_expand(
+    zran_index_t  *index,      /* The index                           */
+    uint64_t       offset,     /* Desired offset                      */
+    uint8_t        compressed, /* Compressed or uncompressed offset   */
+    uint32_t      *hint,       /* Position of previously found point  */
+    zran_point_t  *point       /* Place to store the identified point */
+);
+
+
+/*
+ * Estimate an offset in the compressed / uncompressed data stream
+ * corresponding to the given offset, which is specified in the uncompressed /
+ * compressed data stream.  If the given offset is specified relative to the
+ * compressed data stream, the returned value is a location in the
+ * uncompressed data stream which approximately corresponds to the given
+ * offset.
  *
- * This function returns one of the following codes. Furthermore, if an error
- * did not occur (i.e. anything but ZRAN_INFLATE_ERROR or
- * ZRAN_INFLATE_NOT_COVERED was returned), the total_consumed and total_output
- * parameters are respectively updated to contain the total number of
- * compressed bytes that were read from the file, and total number of
- * decompressed bytes that were copied to the data buffer.
+ * This function is used by the _zran_get_point_with_expand function, if the
+ * index has been created with the ZRAN_AUTO_BUILD flag, to determine how far
+ * the index needs to be expanded to cover a requested offset that is not yet
+ * covered.
+ */
+static uint64_t _zran_estimate_offset(
+    zran_index_t *index,      /* The index */
+
+    uint64_t      offset,     /* The offset for which a corresponding offset
+                                 is to be estimated. */
+
+    uint8_t       compressed  /* Pass in 0 or non-0 to indicate that the given
+                                 offset is specified relative to the
+                                 uncompressed or compressed stream,
+                                 respectively. */
+);
+
+
+/*
+ * Used by _zran_inflate. Initialises zlib to start decompressing/inflating
+ * from either:
  *
- *   - ZRAN_INFLATE_OK:             Inflation was successful and the requested
- *                                  number of bytes were copied to the provided
- *                                  data buffer.
+ *  - the current seek location in the compressed data, or
+ *  - from a location denoted by a specific index point
  *
- *   - ZRAN_INFLATE_NOT_COVERED:    The requested compressed data offset is not
- *                                  covered by the index.
+ * If an index point is provided, the function will seek to the specified
+ * compressed data offset before initialising zlib.
  *
- *   - ZRAN_INFLATE_OUTPUT_FULL:    The provided data buffer has been filled.
+ * Otherwise (no index point), inflation is initialised at the current seek
+ * location in the input data, and a GZIP header is expected at that location.
  *
- *   - ZRAN_INFLATE_BLOCK_BOUNDARY: A deflate block boundary was encountered.
- *                                  This will only be returned if the
- *                                  ZRAN_INFLATE_STOP_AT_BLOCK flag is active.
+ * The index->readbuf and readbuf_size, and the z_stream->avail_in, avail_out,
+ * next_in and next_out fields must all be set before this function is called.
  *
- *   - ZRAN_INFLATE_EOF:            The end of file has been reached.
+ * Returns the number of bytes over the input data that were read (which could
+ * be 0), or a negative value on failure.
+ */
+static int _zran_init_zlib_inflate(
+    zran_reader_t *reader,      /* The reader */
+
+    z_stream     *stream,       /* Pointer to a z_stream struct */
+
+    zran_point_t *point         /* Pass in NULL to initialise for inflation
+                                   from the current location in the input file.
+                                   Or pass a pointer to the index point
+                                   corresponding to the location to start
+                                   from. */
+);
+
+
+/*
+ * Return codes for _zran_expand_index. These are currently
+ * assumed to have identical values to the ZRAN_BUILD_INDEX
+ * return codes.
+ */
+int ZRAN_EXPAND_INDEX_OK        =  0;
+int ZRAN_EXPAND_INDEX_FAIL      = -1;
+int ZRAN_EXPAND_INDEX_CRC_ERROR = -2;
+
+
+/*
+ * Expands the index from its current end-point until the given offset (which
+ * must be specified relative to the compressed data stream).
  *
- *   - ZRAN_INFLATE_CRC_ERROR:      The CRC or uncompressed data size in the
- *                                  GZIP footer does not match the CRC/size
- *                                  that was calculated.
+ * The index is expanded so that the last point comes after the given offset.
+ * If the specified offset is past the last point in the index, a call to this
+ * function is guaranteed to create at least one more index point. If there
+ * is already an index point which comes after the offset, this function does
+ * nothing, and return a success code.
  *
- *   - ZRAN_INFLATE_ERROR:          A critical error has occurred.
+ * We require at least one point to be created, because we want index points
+ * to be located at compression block boundaries, but in some data there may
+ * be a long distance between block boundaries (longer than the desired index
+ * point spacing).
+ *
+ * Returns 0 on success. If a CRC check fails, returns
+ * ZRAN_EXPAND_INDEX_CRC_ERROR. For other types of failure, returns
+ * ZRAN_EXPAND_INDEX_FAIL.
  */
-static int _zran_inflate(
-    zran_index_t *index,            /* Pointer to the index. */
+static int _zran_expand_index(
+    zran_index_t *index, /* The index */
+    uint64_t      until  /* Expand the index to this point. If 0,
+                            expand the index until EOF is reached. */
+);
 
-    z_stream     *strm,             /* Pointer to a z_stream struct. */
 
-    uint64_t      offset,           /* Compressed data offset to start
-                                       inflation from. */
+/*
+ * Adds a new point to the end of the index.
+ */
+static int _zran_add_point(
+    zran_index_t *index,        /* The index */
 
-    uint16_t      flags,            /* Control flags. */
+    uint8_t       bits,         /* If the compressed and uncompressed offsets
+                                   are not byte-aligned, this is the number
+                                   of bits in the compressed data, before the
+                                   cmp_offset, where the point is located. */
 
-    uint32_t     *total_consumed,   /* Pointer which is updated to contain the
-                                       total number of bytes that were read
-                                       from the input file. */
+    uint64_t      cmp_offset,   /* Offset into the compressed data. */
 
-    uint32_t     *total_output,     /* Pointer which is updated to contain the
-                                       total number of bytes that were
-                                       inflated, and stored in data. */
+    uint64_t      uncmp_offset, /* Offset into the uncompressed data. */
 
-    uint32_t      len,              /* Maximum number of bytes to inflate. May
-                                       be 0. */
+    uint32_t      data_offset,  /* Offset into the data pointer specifying the
+                                   point at which the uncompressed data
+                                   associated with this point begins - see
+                                   _zran_expand_index. It is assumed that the
+                                   uncompressed data wraps around this
+                                   offset. */
 
-    uint8_t      *data,             /* Place to store the inflated bytes. */
+    uint32_t      data_size,    /* Number of bytes in data */
 
-    int           add_stream_points /* Add index points at the beginning of
-                                       every gzip stream, including the first
-                                       one at the beginning of the input file
-                                     */
+    uint8_t      *data,         /* Pointer to data_size bytes of uncompressed
+                                   data preceding this index point, or NULL
+                                   if the point does not need a window. */
+
+    uint8_t      *refs          /* Window bytes which are referenced after
+                                   this point (see _zran_find_window_refs),
+                                   or NULL if the whole window is needed. */
 );
 
 
-/* Initialise a zran_index_t struct for use with the given GZIP file. */
-int zran_init(zran_index_t *index,
-              FILE         *fd,
-              PyObject     *f,
-              uint32_t      spacing,
-              uint32_t      window_size,
-              uint32_t      readbuf_size,
-              uint16_t      flags)
-{
+/*
+ * Size of the fixed part of a GZIP header (up to and including the XLEN
+ * field), size of the BGZF extra subfield which holds the block size, and
+ * number of bytes to read when looking for the next BGZF block - this
+ * includes the ISIZE field of the previous block.
+ */
+#define ZRAN_BGZF_HEADER_SIZE 12
+#define ZRAN_BGZF_FIELD_SIZE  6
+#define ZRAN_BGZF_READ_SIZE   256
 
-    zran_point_t *point_list = NULL;
-    int64_t       compressed_size;
 
-    zran_log("zran_init(%u, %u, %u, %u)\n",
-             spacing, window_size, readbuf_size, flags);
+/* Return codes for _zran_bgzf_block and _zran_expand_bgzf_index. */
+#define ZRAN_BGZF_OK        0
+#define ZRAN_BGZF_NOT_BGZF  1
+#define ZRAN_BGZF_ERROR    -1
 
-    if (spacing      == 0) spacing      = 1048576;
-    if (window_size  == 0) window_size  = 32768;
-    if (readbuf_size == 0) readbuf_size = 16384;
 
-    /*
-     * The zlib manual specifies that a window
-     * size of 32KB is 'always enough' to
-     * initialise inflation/deflation with a
-     * set dictionary. Less than that is not
-     * guaranteed to be enough.
-     */
-    if (window_size < 32768)
-        goto fail;
-
-    /*
-     * Small read-buffers make code complicated.
-     * The absolute minimum we need is enough to
-     * store a GZIP footer, null padding bytes at
-     * the end of a stream, and the subsequent
-     * GZIP header. There are no bounds on the
-     * number of padding bytes, or the size of a
-     * GZIP header, so this constraint is
-     * arbitrary (but should be good enough).
-     */
-    if (readbuf_size < 128)
-        goto fail;
+/*
+ * Parses the BGZF block header at the start of the given buffer. A BGZF
+ * file is a series of GZIP streams (blocks), each of which contains the
+ * size of the block in a "BC" extra subfield (see the SAM/BAM format
+ * specification).
+ *
+ * Returns ZRAN_BGZF_OK if the buffer starts with a BGZF block header, in
+ * which case the header size and block size are stored in hlen and bsize,
+ * or ZRAN_BGZF_NOT_BGZF otherwise.
+ */
+static int _zran_bgzf_block(
+    uint8_t  *buf,   /* Data to parse                          */
+    uint32_t  len,   /* Number of bytes in buf                 */
+    uint32_t *hlen,  /* Place to store the size of the header  */
+    uint32_t *bsize  /* Place to store the size of the block   */
+);
 
-    /*
-     * window_size bytes of uncompressed data are
-     * stored with each seek point in the index.
-     * So it's a bit silly to have the distance
-     * between consecutive points less than the
-     * window size.
-     */
-    if (spacing <= window_size)
-        goto fail;
 
-    /* The file must be opened in read-only mode */
-    if (!is_readonly(fd, f))
-        goto fail;
+/*
+ * Builds the full index for a BGZF file. Every BGZF block can be inflated
+ * on its own, so a windowless point is created at the start of every block.
+ * Only the block headers and footers are read - the block sizes give the
+ * location of each block, and the ISIZE footer fields give the amount of
+ * uncompressed data in each one.
+ *
+ * The whole index is built in one go, as this is cheap, so until is only
+ * used to check whether the index already covers the requested offset.
+ *
+ * Returns ZRAN_BGZF_OK on success, ZRAN_BGZF_NOT_BGZF if a part of the file
+ * which does not look like a BGZF block is found (in which case the index
+ * is left empty), or ZRAN_BGZF_ERROR if an error occurs.
+ */
+static int _zran_expand_bgzf_index(
+    zran_index_t *index, /* The index                          */
+    uint64_t      until  /* Expand the index to this point, or
+                            0 to expand it until EOF.          */
+);
 
-    /*
-     * Calculate the size of the compressed file
-     */
-    if (seekable_(fd, f)) {
-        if (fseek_(fd, f, 0, SEEK_END) != 0)
-            goto fail;
 
-        compressed_size = ftell_(fd, f);
+/*
+ * Reads the header of the BGZF block at the given offset of a compressed
+ * file, and the ISIZE field from its footer, if isize is not NULL.
+ *
+ * Returns ZRAN_BGZF_OK on success, ZRAN_BGZF_NOT_BGZF if there is no BGZF
+ * block at the offset, or ZRAN_BGZF_ERROR if the file could not be read.
+ */
+static int _zran_read_bgzf_block(
+    FILE     *fd,     /* Open handle to the compressed file        */
+    PyObject *f,      /* Open handle to the compressed file object */
+    uint64_t  offset, /* Offset of the block                       */
+    uint32_t *hlen,   /* Place to store the size of the header     */
+    uint32_t *bsize,  /* Place to store the size of the block      */
+    uint32_t *isize   /* Place to store the uncompressed size of
+                         the block, or NULL                        */
+);
 
-        if (compressed_size < 0)
-            goto fail;
 
-        if (fseek_(fd, f, 0, SEEK_SET) != 0)
-            goto fail;
-    } else {
-        /*
-         * File is not seekable, so don't calculate
-         * compressed_size.  It will be updated in
-         * _zran_read_data_from_file when the EOF
-         * is reached
-         */
-        compressed_size = 0;
-    }
+/* _zran_read_data return codes */
+int ZRAN_READ_DATA_EOF   = -1;
+int ZRAN_READ_DATA_ERROR = -2;
 
-    /*
-     * Allocate some initial space
-     * for the index point list
-     */
-    point_list = calloc(1, sizeof(zran_point_t) * 8);
-    if (point_list == NULL) {
-        goto fail;
-    }
+/*
+ * This function is a sub-function of _zran_inflate, used to read data from
+ * the input file to be passed to zlib:inflate for decompression.
+ *
+ * Up to index->readbuf_size bytes are read from the input file into
+ * index->readbuf, and the z_stream counters/pointers are updated accordingly.
+ *
+ * On success, returns 0.
+ *
+ * If there are no more bytes left to read from the input file (i.e. we are at
+ * EOF), ZRAN_READ_DATA_EOF is returned. If an error occurs, returns
+ * ZRAN_READ_DATA_ERROR.
+ */
+static int _zran_read_data_from_file(
+    zran_reader_t *reader,       /* The reader                              */
+    z_stream      *stream,       /* The z_stream struct                     */
+    uint64_t       cmp_offset,   /* Current offset in the compressed data   */
+    uint64_t       uncmp_offset, /* Current offset in the uncompressed data */
+    uint32_t       need_atleast  /* Skip read if the read buffer already has
+                                    this many bytes */
+);
 
-    /* initialise the index struct */
-    index->fd                   = fd;
-    index->f                    = f;
-    index->flags                = flags;
-    index->compressed_size      = compressed_size;
-    index->uncompressed_size    = 0;
-    index->spacing              = spacing;
-    index->window_size          = window_size;
-    index->log_window_size      = (int)round(log10(window_size) / log10(2));
-    index->readbuf_size         = readbuf_size;
-    index->readbuf_offset       = 0;
-    index->readbuf_end          = 0;
-    index->readbuf              = NULL;
-    index->npoints              = 0;
-    index->size                 = 8;
-    index->uncmp_seek_offset    = 0;
-    index->inflate_cmp_offset   = 0;
-    index->inflate_uncmp_offset = 0;
-    index->validating           = 0;
-    index->last_stream_ended    = 0;
-    index->stream_size          = 0;
-    index->stream_crc32         = 0;
-    index->list                 = point_list;
 
-    return 0;
+/* _zran_find_next_stream return codes */
+int ZRAN_FIND_STREAM_ERROR     = -2;
+int ZRAN_FIND_STREAM_NOT_FOUND = -1;
 
-fail:
-    free(point_list);
-    return -1;
-}
 
+/*
+ * This function is a sub-function of _zran_inflate, used to search for a new
+ * GZIP stream in a series of concatenated streams.  It searches through the
+ * compressed data (pointed to by stream->next_in) to find the location of the
+ * next compressed stream.
+ *
+ * If a new stream was found, the z_stream struct is re-initialised to
+ * decompress data from the new stream, using _zran_init_zlib_inflate. In
+ * this case, the value returned by that function is returned.
+ *
+ * Otherwise (if a compressed stream was not found), this function returns
+ * ZRAN_FIND_STREAM_NOT_FOUND.
+ *
+ * The number of bytes that were skipped over before the new stream was found
+ * is added to the provided offset pointer.
+ *
+ * If an error occurs, ZRAN_FIND_STREAM_ERROR is returned.
+ */
+static int _zran_find_next_stream(
+    zran_reader_t *reader, /* The reader                                     */
+    z_stream      *stream, /* The z_stream struct                            */
+    int           *offset  /* Used to store the number of bytes skipped over */
+);
 
-/* Returns the compressed or uncompressed index limit. */
-uint64_t _zran_index_limit(zran_index_t *index, uint8_t compressed) {
 
-    if (index->npoints == 0)
-        return 0;
+/* _zran_validate_stream return codes */
+int ZRAN_VALIDATE_STREAM_ERROR   = -2;
+int ZRAN_VALIDATE_STREAM_INVALID = -1;
 
-    if (compressed) return index->list[index->npoints - 1].cmp_offset;
-    else            return index->list[index->npoints - 1].uncmp_offset;
-}
 
+/*
+ * This function is a sub-function of _zran_inflate, called when the end of a
+ * gzip stream is reached. It reads the CRC32 and uncompressed file size from
+ * the end of the stream, and compares them to the CRC32 and size that was
+ * incrementally calculated by _zran_inflate (which are stored in
+ * index->stream_crc32 and index->stream_size),
+ *
+ * The number of bytes that were read before the new stream was found is
+ * added to the provided offset pointer.
+ *
+ * If ZRAN_SKIP_CRC_CHECK is active, this function updates the stream buffer
+ * offsets to skip over the CRC32 and file size bytes, and then returns without
+ * doing anything else.
+ *
+ * If an error occurs, ZRAN_VALIDATE_STREAM_ERROR is returned.
+ */
+static int _zran_validate_stream(
+    zran_reader_t *reader, /* The reader                                     */
+    z_stream      *stream, /* The z_stream struct                            */
+    int           *offset  /* Used to store the number of bytes skipped over */
+);
 
-/* Expands the memory used to store the index points. */
-int _zran_expand_point_list(zran_index_t *index) {
-    zran_point_t *new_list;
-    uint32_t new_size = index->size * 2;
 
-    zran_log("_zran_expand_point_list(%i -> %i)\n", index->size, new_size);
+/*
+ * Sub-function of _zran_inflate, called when inflation is initialised from
+ * the given point (or from the start of the file, if start is NULL). Starts
+ * calculating the CRC32 of the span of data which follows the point, unless
+ * ZRAN_SKIP_CRC_CHECK is active.
+ */
+static void _zran_start_span(
+    zran_reader_t *reader, /* The reader                         */
+    zran_point_t  *start   /* Point that inflation starts from   */
+);
 
-    new_list = realloc(index->list, sizeof(zran_point_t) * new_size);
 
-    if (new_list == NULL) {
-        /* old list is still valid */
-        return -1;
-    }
+/*
+ * Sub-function of _zran_inflate, called on the data which is output by
+ * each call to inflate. Updates the CRC32 of the span that is being
+ * inflated, and compares the CRC32 of each span that is completed against
+ * the CRC32 stored in the index, if it has one.
+ *
+ * Returns 0 on success, or -1 if the CRC32 of a span does not match.
+ */
+static int _zran_update_span(
+    zran_reader_t *reader, /* The reader                         */
+    uint8_t       *data,   /* Uncompressed data                  */
+    uint32_t       len,    /* Number of bytes of data            */
+    uint64_t       offset  /* Uncompressed offset of the data    */
+);
 
-    index->list = new_list;
-    index->size = new_size;
 
-    return 0;
-}
+/*
+ * Used by _zran_seek and _zran_read to find the index point corresponding
+ * to the given offset. If the reader is the one embedded in the index, this
+ * function is identical to _zran_get_point_with_expand. Otherwise (for
+ * readers created with zran_reader_create), the index is never expanded,
+ * and this function is identical to _zran_get_point_at.
+ */
+static int _zran_reader_get_point(
+    zran_reader_t  *reader,     /* The reader                          */
+    uint64_t        offset,     /* Desired offset                      */
+    uint8_t         compressed, /* Compressed or uncompressed offset   */
+    zran_point_t   *point       /* Place to store the identified point */
+);
 
 
-/* Frees any unused memory allocated for index storage. */
-int _zran_free_unused(zran_index_t *index) {
+/*
+ * Implementation of zran_seek and zran_reader_seek - the
+ * arguments and return values are identical to zran_seek.
+ */
+static int _zran_seek(
+    zran_reader_t  *reader, /* The reader                      */
+    int64_t         offset, /* Uncompressed offset to seek to  */
+    uint8_t         whence, /* SEEK_SET, SEEK_CUR, or SEEK_END */
+    zran_point_t   *point   /* Optional place to store a copy
+                               of the corresponding point      */
+);
 
-    zran_point_t *new_list;
-    size_t        new_size;
 
-    zran_log("_zran_free_unused\n");
+/*
+ * Implementation of zran_read and zran_reader_read - the
+ * arguments and return values are identical to zran_read.
+ */
+static int64_t _zran_read(
+    zran_reader_t *reader, /* The reader                */
+    void          *buf,    /* Buffer to store len bytes */
+    uint64_t       len     /* Number of bytes to read   */
+);
 
-    if (index->npoints < 8) new_size = 8;
-    else                    new_size = index->npoints;
 
-    new_list = realloc(index->list, sizeof(zran_point_t) * new_size);
+/*
+ * The CRC32 and size in the footer of a gzip stream, recorded by
+ * _zran_log_footer while zran_verify is running, along with the CRC32 of
+ * the data between the previous event (the end of a span or of another
+ * stream) and the end of the stream.
+ */
+typedef struct _zran_footer {
+    uint64_t offset;    /* Uncompressed offset of the end of the stream */
+    uint32_t crc;       /* CRC32 from the footer                        */
+    uint32_t size;      /* Size from the footer                         */
+    uint32_t span;      /* Span that the stream ends in                 */
+    uint32_t piece_crc; /* CRC32 of the data before the end             */
+    uint64_t piece_len; /* Length of the data before the end            */
+} zran_footer_t;
 
-    if (new_list == NULL) {
-        return -1;
-    }
 
-    index->list = new_list;
-    index->size = new_size;
+/*
+ * A list of footers. Only footers of streams which end after from, and at
+ * or before to, are recorded - from is -1 for the chunk of spans at the
+ * start of the file.
+ */
+struct _zran_footer_log {
+    zran_footer_t *footers;
+    uint32_t       nfooters;
+    uint32_t       size;
+    int64_t        from;
+    uint64_t       to;
+};
 
-    return 0;
-}
 
+/*
+ * State shared by the threads started by zran_verify. The spans of the
+ * index are divided into nchunks chunks of chunk_spans spans, which are
+ * claimed by each thread in turn via next_chunk. The CRC32 and length of
+ * the data in each span which is not part of an earlier stream are stored
+ * in span_crcs and span_lens, and the footers found in each chunk are
+ * stored in logs.
+ */
+typedef struct _zran_verify {
+    zran_index_t      *index;
+    uint32_t           nspans;
+    uint32_t           nchunks;
+    uint32_t           chunk_spans;
+    uint64_t           next_chunk;
+    uint64_t           failed;
+    uint32_t          *span_crcs;
+    uint64_t          *span_lens;
+    zran_footer_log_t *logs;
+} zran_verify_t;
+
+
+/* One zran_verify thread, and the reader that it uses. */
+typedef struct _zran_verify_worker {
+    zran_verify_t *verify;
+    zran_reader_t *reader;
+    int            ret;
+} zran_verify_worker_t;
+
+
+/* A thread started by _zran_run_threads. */
+typedef struct _zran_thread {
+    void     (*fn)(void *);
+    void      *arg;
+    uint8_t    started;
+#ifdef _WIN32
+    HANDLE     handle;
+#else
+    pthread_t  handle;
+#endif
+} zran_thread_t;
 
-/* Deallocate memory used by a zran_index_t struct. */
-void zran_free(zran_index_t *index) {
 
-    uint32_t      i;
-    zran_point_t *pt;
+/*
+ * Starts a new thread, which calls thread->fn(thread->arg). Sets
+ * thread->started, and returns 0 on success, or -1 on failure.
+ */
+static int _zran_start_thread(
+    zran_thread_t *thread /* The thread */
+);
 
-    zran_log("zran_free\n");
 
-    for (i = 0; i < index->npoints; i++) {
-        pt = &(index->list[i]);
+/*
+ * Waits for a thread that was started by _zran_start_thread to finish.
+ */
+static void _zran_join_thread(
+    zran_thread_t *thread /* The thread */
+);
 
-        /*
-         * points at compression stream boundaries
-         * have no data associated with them
-         */
-        if (pt->data != NULL) {
-            free(pt->data);
-        }
-    }
 
-    free(index->list);
+/*
+ * Calls fn once for each of the n elements of args (each of which is
+ * argsize bytes long), concurrently. The first call is made in the calling
+ * thread, and the rest in new threads - if a thread cannot be created,
+ * its call is made in the calling thread instead. Returns once all of the
+ * calls have returned.
+ */
+static void _zran_run_threads(
+    void   (*fn)(void *), /* Function to call             */
+    void    *args,        /* Array of arguments           */
+    size_t   argsize,     /* Size of each argument        */
+    uint32_t n            /* Number of arguments/threads  */
+);
 
-    index->fd                = NULL;
-    index->f                 = NULL;
-    index->spacing           = 0;
-    index->window_size       = 0;
-    index->readbuf_size      = 0;
-    index->npoints           = 0;
-    index->size              = 0;
-    index->list              = NULL;
-    index->uncmp_seek_offset = 0;
-}
 
+/*
+ * Sub-function of _zran_inflate, called at the end of each gzip stream if
+ * reader->footers is not NULL. Records the CRC32 and size from the footer
+ * at the start of stream->next_in.
+ *
+ * Returns 0 on success, or -1 if memory could not be allocated.
+ */
+static int _zran_log_footer(
+    zran_reader_t *reader, /* The reader                                 */
+    z_stream      *stream, /* The z_stream struct                        */
+    uint64_t       offset  /* Uncompressed offset of the end of the stream */
+);
 
-/* Discard all points in the index after the specified compressed offset. */
-int _zran_invalidate_index(zran_index_t *index, uint64_t from)
-{
-    uint64_t      i;
-    zran_point_t *p;
 
-    if (index->npoints == 0)
-        return 0;
+/*
+ * Used by zran_verify. Claims and verifies chunks of spans with the given
+ * worker's reader, until there are no chunks left, or an error occurs.
+ * The result is stored in worker->ret.
+ */
+static void _zran_verify_worker(
+    void *worker /* The worker (a zran_verify_worker_t) */
+);
 
-    for (i = 0; i < index->npoints; i++) {
 
-        p = &(index->list[i]);
+/*
+ * Sub-function of _zran_verify_worker. Reads all of the data in the given
+ * chunk, and calculates the CRC32 of each span, and of each piece of a
+ * span which precedes the end of a stream.
+ *
+ * Returns ZRAN_VERIFY_OK on success, ZRAN_VERIFY_CRC_ERROR if the reader
+ * finds corrupt data, or ZRAN_VERIFY_FAIL if an error occurs.
+ */
+static int _zran_verify_chunk(
+    zran_verify_t *verify, /* Verification state          */
+    zran_reader_t *reader, /* The reader                  */
+    uint32_t       chunk,  /* The chunk to verify         */
+    uint8_t       *buf,    /* Buffer to read data into    */
+    uint32_t       bufsz   /* Size of buf                 */
+);
 
-        if (p->cmp_offset >= from)
-            break;
-    }
 
-    /*
-     * The index doesn't cover
-     * the requested offest
-     */
-    if (i == index->npoints)
-        return 0;
+/*
+ * Sub-function of zran_verify, called once all chunks have been verified.
+ * Combines the CRC32s of all spans and pieces, in order, and compares the
+ * CRC32 and size of each stream against those in its footer. If the index
+ * does not already contain the CRC32 of every span, they are stored in
+ * the index.
+ *
+ * Returns ZRAN_VERIFY_OK, ZRAN_VERIFY_CRC_ERROR, or ZRAN_VERIFY_FAIL.
+ */
+static int _zran_verify_combine(
+    zran_verify_t *verify /* Verification state */
+);
 
-    if (i <= 1) index->npoints = 0;
-    else        index->npoints = i - 1;
 
-    return _zran_free_unused(index);
-}
+/*
+ * Returns the span cache hash bucket for the given span.
+ */
+static uint32_t _zran_span_cache_bucket(
+    uint64_t key,  /* Key of the file                  */
+    uint64_t start /* Uncompressed offset of the span */
+);
 
 
-/* (Re-)Builds the full index. */
-int zran_build_index(zran_index_t *index, uint64_t from, uint64_t until)
-{
+/*
+ * Returns the entry for the given span in the given cache, or NULL if it
+ * is not present. Must be called with zran_span_cache_lock held.
+ */
+static zran_span_entry_t * _zran_span_cache_find(
+    zran_span_cache_t *cache, /* The cache                       */
+    uint64_t           key,   /* Key of the file                 */
+    uint64_t           start  /* Uncompressed offset of the span */
+);
 
-    if (_zran_invalidate_index(index, from) != 0)
-        return ZRAN_BUILD_INDEX_FAIL;
 
-    return _zran_expand_index(index, until);
-}
+/*
+ * Marks the given entry as the most recently used. Must be called with
+ * zran_span_cache_lock held.
+ */
+static void _zran_span_cache_touch(
+    zran_span_cache_t *cache, /* The cache */
+    zran_span_entry_t *entry  /* The entry */
+);
 
 
-/* Searches for and returns the index at the specified offset. */
-int _zran_get_point_at(
-    zran_index_t  *index,
-    uint64_t       offset,
-    uint8_t        compressed,
-    zran_point_t **point)
-{
-    uint64_t      cmp_max;
-    uint64_t      uncmp_max;
-    zran_point_t *last;
-    zran_point_t *prev;
-    zran_point_t *curr;
-    uint8_t       bit;
-    uint32_t      i;
+/*
+ * Adds a span to the given cache, evicting the least recently used spans
+ * to stay within its budget. Must be called with zran_span_cache_lock
+ * held, and only if the span is not already present.
+ *
+ * Returns 0 on success, non-0 if the span is too big for the cache, or
+ * memory could not be allocated.
+ */
+static int _zran_span_cache_add(
+    zran_span_cache_t *cache, /* The cache                       */
+    uint64_t           key,   /* Key of the file                 */
+    uint64_t           start, /* Uncompressed offset of the span */
+    uint64_t           len,   /* Length of the span              */
+    uint8_t           *data   /* Span data, or NULL              */
+);
 
-    *point = NULL;
 
-    /*
-     * Bad input - past the end of the compressed or
-     * uncompressed streams (if their sizes are known).
-     */
-    if (compressed                 &&
-        index->compressed_size > 0 &&
-        offset >= index->compressed_size)
-        goto eof;
+/*
+ * Looks up the span which starts at start, in the memory cache. If it is
+ * present, len bytes from offset pos are copied into buf, and the span is
+ * marked as the most recently used. The hit/miss counters are updated.
+ *
+ * Returns 1 if the span was found, 0 otherwise.
+ */
+static int _zran_span_cache_copy(
+    uint64_t  id,    /* cache_id of the index              */
+    uint64_t  start, /* Uncompressed offset of the span    */
+    uint64_t  pos,   /* Uncompressed offset to copy from   */
+    uint8_t  *buf,   /* Buffer to copy into                */
+    uint64_t  len    /* Number of bytes to copy            */
+);
 
-    if (!compressed                  &&
-        index->uncompressed_size > 0 &&
-        offset >= index->uncompressed_size)
-        goto eof;
 
-    if (index->npoints == 0)
-        goto not_covered;
+/*
+ * Adds a span to the memory cache, replacing any shorter span which
+ * starts at the same offset (e.g. one which was cached before the index
+ * was re-imported with a different spacing). The cache takes ownership of
+ * data - it is freed if the span cannot be added (e.g. if it, or a longer
+ * span, is already present).
+ */
+static void _zran_span_cache_insert(
+    uint64_t  id,    /* cache_id of the index           */
+    uint64_t  start, /* Uncompressed offset of the span */
+    uint64_t  len,   /* Length of the span              */
+    uint8_t  *data   /* Span data, allocated by malloc  */
+);
 
-    zran_log("_zran_get_point_at(%llu, c=%u)\n", offset, compressed);
 
-    /*
-     * Figure out how much of the compressed
-     * and uncompressed data the index currently
-     * covers -  the offsets of the last point
-     * in the index.
-     */
-    last      = &(index->list[index->npoints - 1]);
-    uncmp_max = last->uncmp_offset;
-    cmp_max   = last->cmp_offset;
+/*
+ * Removes the given entry from the given cache, and frees it. The file
+ * of a disk cache entry is deleted. Must be called with
+ * zran_span_cache_lock held.
+ */
+static void _zran_span_cache_remove(
+    zran_span_cache_t *cache, /* The cache            */
+    zran_span_entry_t *entry  /* The entry to remove */
+);
 
-    if ( compressed && offset > cmp_max)   goto not_covered;
-    if (!compressed && offset > uncmp_max) goto not_covered;
 
-    /*
-     * We should have an index point
-     * which corresponds to this offset,
-     * so let's search for it.
-     */
-    prev = index->list;
-    for (i = 1; i < index->npoints; i++) {
+/*
+ * Removes all entries from the given cache, without deleting any files.
+ * Must be called with zran_span_cache_lock held.
+ */
+static void _zran_span_cache_clear(
+    zran_span_cache_t *cache /* The cache */
+);
 
-        curr = &(index->list[i]);
 
-        if (compressed) {
+/*
+ * Removes all spans belonging to the given index from the memory cache.
+ */
+static void _zran_span_cache_purge(
+    uint64_t id /* cache_id of the index */
+);
 
-            /*
-             * Adjust the offset for non
-             * byte-aligned seek points.
-             */
-            if (curr->bits > 0) bit = 1;
-            else                bit = 0;
 
-            if (curr->cmp_offset > offset + bit)
-                break;
+/*
+ * Returns the key which identifies the compressed file of the given reader
+ * in the disk cache - a hash of the identity of the file (its device,
+ * inode and modification time), its size, and its first and last
+ * ZRAN_DISK_KEY_SAMPLE bytes. The position of the reader is restored.
+ *
+ * Returns ZRAN_DISK_KEY_NONE if the reader does not have a real file (the
+ * identity of Python file-likes is unknown), or the file cannot be read.
+ */
+static uint64_t _zran_disk_key(
+    zran_reader_t *reader /* The reader */
+);
 
-        }
-        else {
-            if (curr->uncmp_offset > offset)
-                break;
-        }
 
-        prev = curr;
-    }
+/*
+ * Allocates and returns the path of the disk cache file for the given
+ * span (or NULL if memory could not be allocated). Must be called with
+ * zran_span_cache_lock held.
+ */
+static char * _zran_disk_cache_path(
+    uint64_t key,  /* disk_key of the index           */
+    uint64_t start /* Uncompressed offset of the span */
+);
 
-    *point = prev;
-    return ZRAN_GET_POINT_OK;
 
-not_covered:
-    *point = NULL;
-    return ZRAN_GET_POINT_NOT_COVERED;
+/*
+ * Reads the first len bytes of the given span from the disk cache into
+ * buf, and checks them against crc - if they do not match, the span file
+ * is deleted, and treated as a miss. The hit/miss counters of the disk
+ * cache are updated.
+ *
+ * Returns 1 if the span was found, 0 otherwise.
+ */
+static int _zran_disk_cache_load(
+    uint64_t  key,   /* disk_key of the index           */
+    uint64_t  start, /* Uncompressed offset of the span */
+    uint8_t  *buf,   /* Buffer to read into             */
+    uint64_t  len,   /* Number of bytes to read         */
+    uint32_t  crc    /* Expected CRC-32 of the bytes    */
+);
 
-eof:
-    *point = NULL;
-    return ZRAN_GET_POINT_EOF;
-}
+
+/*
+ * Writes the given span to a file in the disk cache, and adds it to the
+ * cache, replacing the file of any shorter span which starts at the same
+ * offset (e.g. one which was stored by a process which used a smaller
+ * spacing). Failures are ignored - the span is just not cached.
+ */
+static void _zran_disk_cache_store(
+    uint64_t  key,   /* disk_key of the index           */
+    uint64_t  start, /* Uncompressed offset of the span */
+    uint64_t  len,   /* Length of the span              */
+    uint8_t  *data   /* Span data                       */
+);
 
 
 /*
- * Get the index point corresponding to the given offset, expanding
- * the index as needed if ZRAN_AUTO_BUILD is active.
+ * Adds all span files which are in the disk cache directory to the disk
+ * cache, from the least to the most recently modified, and evicts the
+ * least recently modified files until the cache is within its budget.
+ * Must be called with zran_span_cache_lock held.
+ *
+ * Returns 0 on success, non-0 if the directory could not be read.
  */
-int _zran_get_point_with_expand(zran_index_t  *index,
-                                uint64_t       offset,
-                                uint8_t        compressed,
-                                zran_point_t **point)
-{
+static int _zran_disk_cache_scan(void);
 
-    int      result;
-    uint64_t expand;
-    uint64_t limit;
 
-    zran_log("_zran_get_point_with_expand(%llu, %u, autobuild=%u)\n",
-             offset,
-             compressed,
-             index->flags & ZRAN_AUTO_BUILD);
+/* A span file found by _zran_disk_cache_scan. */
+typedef struct _zran_disk_file {
+    uint64_t key;
+    uint64_t start;
+    uint64_t len;
+    int64_t  mtime;
+} zran_disk_file_t;
 
-    /*
-     * See if there is an index point that
-     * covers the specified offset. If there's
-     * not, we're going to expand the index
-     * until there is.
-     */
-    result = _zran_get_point_at(index, offset, compressed, point);
 
-    /*
-     * Don't expand the index if
-     * auto_build is not active
-     */
-    if ((index->flags & ZRAN_AUTO_BUILD) == 0) {
-        return result;
-    }
+/*
+ * qsort comparison function for zran_disk_file_t structs, which orders
+ * them by modification time.
+ */
+static int _zran_cmp_disk_file(const void *a, const void *b);
 
-    while (result == ZRAN_GET_POINT_NOT_COVERED) {
 
-        /*
-         * If result == ZRAN_GET_POINT_NOT_COVERED,
-         * get_point says that an index point for
-         * this offset doesn't yet exist. So let's
-         * expand the index.
-         *
-         * Guess how far we need to expand the index,
-         * and expand it by that much.
-         */
-        if (compressed == 0) expand = _zran_estimate_offset(index, offset, 0);
-        else                 expand = offset;
+/*
+ * Implementation of zran_read and zran_reader_read. If the span cache is
+ * enabled, data in spans which are covered by the index is copied from
+ * the cache, and spans which are not in the cache are decompressed in full
+ * and added to it. Otherwise (and for data past the last index point),
+ * the data is read with _zran_read.
+ */
+static int64_t _zran_cached_read(
+    zran_reader_t *reader, /* The reader                */
+    void          *buf,    /* Buffer to store len bytes */
+    uint64_t       len     /* Number of bytes to read   */
+);
 
-        /*
-         * If _zran_estimate_offset was unable to
-         * estimate a sensible compressed offset
-         * (i.e. smaller or at the current index
-         * extent), we force it past the limit,
-         * so that the expand_index function will
-         * create at least one point.
-         */
-        limit = _zran_index_limit(index, 1);
-        if (expand <= limit)
-            expand = limit + 10;
 
-        zran_log("Estimated mapping from uncompressed offset "
-                 "%lu into compressed data: %lu\n", offset, expand);
+/*
+ * State shared by the threads started by zran_read_parallel. The data
+ * between offset and end is read into buf. It is covered by nspans spans,
+ * starting with the span after index point first, which are divided into
+ * nchunks chunks of chunk_spans spans, and claimed by each thread in turn
+ * via next_chunk.
+ */
+typedef struct _zran_read_parallel {
+    zran_index_t *index;
+    uint8_t      *buf;
+    uint64_t      offset;
+    uint64_t      end;
+    uint32_t      first;
+    uint32_t      nspans;
+    uint32_t      nchunks;
+    uint32_t      chunk_spans;
+    uint64_t      next_chunk;
+    uint64_t      failed;
+} zran_read_parallel_t;
+
+
+/* One zran_read_parallel thread, and the reader that it uses. */
+typedef struct _zran_read_parallel_worker {
+    zran_read_parallel_t *state;
+    zran_reader_t        *reader;
+    int64_t               ret;
+} zran_read_parallel_worker_t;
 
-        /*
-         * Expand the index
-         */
-        result = _zran_expand_index(index, expand);
-        if      (result == ZRAN_EXPAND_INDEX_CRC_ERROR) { goto crcerror; }
-        else if (result != 0)                           { goto fail; }
 
-        /*
-         * Index has been expanded, so
-         * there should now be a point
-         * which covers the requested
-         * offset.
-         */
-        result = _zran_get_point_at(index, offset, compressed, point);
+/*
+ * Used by zran_read_parallel. Claims and reads chunks of spans with the
+ * given worker's reader, until there are no chunks left, or an error
+ * occurs. The result (0, or a ZRAN_READ error code) is stored in
+ * worker->ret.
+ */
+static void _zran_read_parallel_worker(
+    void *worker /* The worker (a zran_read_parallel_worker_t) */
+);
 
-        /*
-         * If we've made it to EOF, return
-         * a ref to the eof point.
-         */
-        if (result == ZRAN_GET_POINT_EOF) {
-            *point = &index->list[index->npoints - 1];
 
-            if (offset < index->uncompressed_size) {
-                result = ZRAN_GET_POINT_OK;
-            }
-        }
-    }
+/*
+ * Sub-function of _zran_read_parallel_worker. Reads the data in the given
+ * chunk directly into its place in the output buffer.
+ *
+ * Returns 0 on success, ZRAN_READ_CRC_ERROR if the reader finds corrupt
+ * data, or ZRAN_READ_FAIL if an error occurs.
+ */
+static int64_t _zran_read_parallel_chunk(
+    zran_read_parallel_t *state,  /* Shared state     */
+    zran_reader_t        *reader, /* The reader       */
+    uint32_t              chunk   /* The chunk to read */
+);
 
-    return result;
 
-crcerror:
-    return ZRAN_GET_POINT_CRC_ERROR;
-fail:
-    return ZRAN_GET_POINT_FAIL;
-}
+/*
+ * A group of ranges passed to zran_read_multi, which are read in one pass
+ * from start to end. ranges points into the sorted array of all ranges.
+ */
+typedef struct _zran_range_group {
+    uint64_t       start;
+    uint64_t       end;
+    zran_range_t **ranges;
+    uint32_t       nranges;
+} zran_range_group_t;
 
 
 /*
- * Given an offset in one stream, estimates the corresponding offset into the
- * other stream.
+ * State shared by the threads started by zran_read_multi - the range
+ * groups are claimed by each thread in turn via next_group.
  */
-uint64_t _zran_estimate_offset(
-    zran_index_t *index,
-    uint64_t      offset,
-    uint8_t       compressed)
-{
+typedef struct _zran_read_multi {
+    zran_range_group_t *groups;
+    uint32_t            ngroups;
+    uint64_t            next_group;
+    uint64_t            failed;
+} zran_read_multi_t;
 
-    zran_point_t *last;
-    uint64_t      estimate;
 
-    /*
-     * The first index in the list maps
-     * indices 0 and 0, which won't help
-     * us here. So we need at least two
-     * index points.
-     */
-    if (index->npoints <= 1) last = NULL;
-    else                     last = &(index->list[index->npoints - 1]);
+/* One zran_read_multi thread, and the reader that it uses. */
+typedef struct _zran_read_multi_worker {
+    zran_read_multi_t *state;
+    zran_reader_t     *reader;
+    int64_t            ret;
+} zran_read_multi_worker_t;
 
-    /*
-     * We have no reference. At least two
-     * index points need to have been created.
-     * The assumed correspondences between
-     * the compressed streams are arbitrary.
-     */
-    if (last == NULL) {
-        if (compressed) estimate = offset * 2.0;
-        else            estimate = offset * 0.8;
-    }
 
-    /*
-     * I'm just assuming a roughly linear correspondence
-     * between the compressed/uncompressed data streams.
-     */
-    else if (compressed) {
-        estimate = round(offset *
-                         ((float)last->uncmp_offset / last->cmp_offset));
-    }
-    else {
-        estimate = round(offset *
-                         ((float)last->cmp_offset / last->uncmp_offset));
-    }
+/*
+ * qsort comparison function for pointers to zran_range_t structs, which
+ * orders them by offset.
+ */
+static int _zran_cmp_range(const void *a, const void *b);
 
 
-    zran_log("_zran_estimate_offset(%llu, %u) = %llu\n",
-             offset, compressed, estimate);
+/*
+ * Returns the index of the last point in the index whose uncompressed
+ * offset is less than or equal to the given offset (or 0, if there is no
+ * such point).
+ */
+static uint32_t _zran_find_span(
+    zran_index_t *index, /* The index              */
+    uint64_t      offset /* Uncompressed offset    */
+);
 
-    return estimate;
-}
 
+/*
+ * Used by zran_read_multi. Claims and reads range groups with the given
+ * worker's reader, until there are none left, or an error occurs. The
+ * result (0, or a ZRAN_READ error code) is stored in worker->ret.
+ */
+static void _zran_read_multi_worker(
+    void *worker /* The worker (a zran_read_multi_worker_t) */
+);
 
 
-/* Add a new point to the index. */
-int _zran_add_point(zran_index_t  *index,
-                    uint8_t        bits,
-                    uint64_t       cmp_offset,
-                    uint64_t       uncmp_offset,
-                    uint32_t       data_offset,
-                    uint32_t       data_size,
-                    uint8_t       *data) {
+/*
+ * Sub-function of _zran_read_multi_worker. Reads all of the data in the
+ * given group in one pass, via buf, and copies it into the buffer of
+ * every range that it overlaps with.
+ *
+ * Returns 0 on success, ZRAN_READ_CRC_ERROR if the reader finds corrupt
+ * data, or ZRAN_READ_FAIL if an error occurs.
+ */
+static int64_t _zran_read_multi_group(
+    zran_range_group_t *group,  /* The group to read           */
+    zran_reader_t      *reader, /* The reader                  */
+    uint8_t            *buf,    /* Buffer to read data into    */
+    uint32_t            bufsz   /* Size of buf                 */
+);
 
-    uint8_t      *point_data = NULL;
-    zran_point_t *next       = NULL;
 
-    #ifdef ZRAN_VERBOSE
-    zran_log("_zran_add_point(%i, c=%lld + %i, u=%lld, data=%u / %u)\n",
-             index->npoints,
-             cmp_offset,
-             bits > 0,
-             uncmp_offset,
-             data_offset,
-             data_size);
+/* Number of buffers used by each readahead thread. */
+#define ZRAN_READAHEAD_BUFFERS 2
 
-    if (data != NULL)
-        zran_log("Window data: [%02x %02x %02x %02x ...]\n",
-                 data[(data_offset - index->window_size + 0) % data_size],
-                 data[(data_offset - index->window_size + 1) % data_size],
-                 data[(data_offset - index->window_size + 2) % data_size],
-                 data[(data_offset - index->window_size + 3) % data_size]);
-    #endif
 
-    /* if list is full, make it bigger */
-    if (index->npoints == index->size) {
-        if (_zran_expand_point_list(index) != 0) {
-            goto fail;
-        }
-    }
+/*
+ * Minimum and maximum amount of uncompressed data that is read ahead into
+ * one buffer. Buffers are sized to hold the amount of data that is
+ * expected to be read next (i.e. the size of the most recent read), and
+ * always start and (unless the maximum is reached) end at index points.
+ */
+#define ZRAN_READAHEAD_MIN_SIZE 1048576
+#define ZRAN_READAHEAD_MAX_SIZE 67108864
 
-    /*
-     * Allocate memory to store the
-     * uncompressed data (the "window")
-     * associated with this point. Index
-     * points corresponding to the beginning
-     * of a gzip stream (including at start
-     * of file) do not have any window data
-     * associated with them.
-     */
-    if (data == NULL) {
-        point_data = NULL;
-    }
-    else {
-        point_data = calloc(1, index->window_size);
-        if (point_data == NULL)
-            goto fail;
-    }
 
-    next               = &(index->list[index->npoints]);
-    next->bits         = bits;
-    next->cmp_offset   = cmp_offset;
-    next->uncmp_offset = uncmp_offset;
-    next->data         = point_data;
+/* States of a readahead buffer. */
+#define ZRAN_READAHEAD_EMPTY   0 /* Not in use                 */
+#define ZRAN_READAHEAD_PENDING 1 /* Waiting for the thread     */
+#define ZRAN_READAHEAD_BUSY    2 /* Being filled by the thread */
+#define ZRAN_READAHEAD_READY   3 /* Filled                     */
+#define ZRAN_READAHEAD_FAILED  4 /* Could not be filled        */
 
-    /*
-     * The uncompressed data may not start at
-     * the beginning of the data pointer, but
-     * rather from an arbitrary point. So we
-     * copy the beginning of the window from
-     * the end of data, and the end of the
-     * window from the beginning of data. Does
-     * that make sense?
-     */
-    if (data != NULL) {
-        if (data_offset >= index->window_size) {
 
-            memcpy(point_data,
-                   data + (data_offset - index->window_size),
-                   index->window_size);
+/* The CRC32 of a span of data in a readahead buffer. */
+typedef struct _zran_readahead_crc {
+    uint64_t start;
+    uint64_t end;
+    uint32_t crc;
+} zran_readahead_crc_t;
 
-            zran_log("Copy %u bytes from %u to %u\n",
-                     index->window_size,
-                     data_offset - index->window_size,
-                     data_offset);
-        }
-        else {
-            memcpy(point_data,
-                   data + (data_size - (index->window_size - data_offset)),
-                   (index->window_size - data_offset));
 
-            memcpy(point_data + (index->window_size - data_offset),
-                   data,
-                   data_offset);
+/*
+ * A readahead buffer, which holds the uncompressed data between start and
+ * end. The data is decompressed from the index point at start, a copy of
+ * which (cmp_offset, bits, and window, if has_window is set) is stored in
+ * the buffer, so the readahead thread never needs to access the index.
+ * The CRCs of the complete spans in the buffer are checked, where they
+ * are known. Buffers are only modified by the thread while they are
+ * ZRAN_READAHEAD_BUSY, and by the reader while they are not.
+ */
+typedef struct _zran_readahead_buf {
+    uint64_t              start;
+    uint64_t              end;
+    uint64_t              cmp_offset;
+    uint8_t               bits;
+    uint8_t               has_window;
+    uint8_t               state;
+    uint8_t              *window;
+    uint8_t              *data;
+    uint64_t              size;
+    zran_readahead_crc_t *crcs;
+    uint32_t              ncrcs;
+    uint32_t              crcsize;
+} zran_readahead_buf_t;
 
-            zran_log("Copy %u bytes from %u to %u, %u bytes from %u to %u\n",
-                     (index->window_size - data_offset),
-                     (data_size - (index->window_size - data_offset)),
-                     data_size,
-                     data_offset,
-                     0,
-                     data_offset);
-        }
-    }
 
-    index->npoints++;
+/*
+ * A readahead thread (see zran_readahead_start), and its buffers. The
+ * buffer states and the stop flag are protected by lock, and changes to
+ * them are signalled via cond. The remaining fields are only used by the
+ * reader, and describe its most recent read.
+ */
+struct _zran_readahead {
+    FILE                 *fd;
+    uint32_t              window_size;
+    uint32_t              log_window_size;
+    uint32_t              readbuf_size;
+    uint8_t              *readbuf;
+    zran_readahead_buf_t  bufs[ZRAN_READAHEAD_BUFFERS];
+    uint8_t               stop;
+    zran_mutex_t          lock;
+    zran_cond_t           cond;
+    zran_thread_t         thread;
+    uint64_t              last_offset;
+    uint64_t              last_end;
+    uint64_t              last_step;
+    uint64_t              bytes;
+};
 
-    return 0;
 
-fail:
-    free(point_data);
+/*
+ * Entry point for readahead threads. Fills pending buffers, nearest
+ * first, until the stop flag is set.
+ */
+static void _zran_readahead_main(
+    void *ra /* The readahead thread (a zran_readahead_t) */
+);
 
-    return -1;
-}
 
+/*
+ * Called by the readahead thread to fill a buffer, by decompressing
+ * data from the point stored in the buffer, with the thread's own file
+ * handle. Concatenated gzip streams are followed, and the CRCs of
+ * complete spans are checked.
+ *
+ * Returns 0 on success, or -1 if the data could not be decompressed, or
+ * a CRC does not match - the reader then reads the data itself, and
+ * reports any error.
+ */
+static int _zran_readahead_fill(
+    zran_readahead_t     *ra, /* The readahead thread */
+    zran_readahead_buf_t *buf /* The buffer to fill   */
+);
 
-/* Initialise the given z_stream struct for decompression/inflation. */
-int _zran_init_zlib_inflate(zran_index_t *index,
-                            z_stream     *strm,
-                            zran_point_t *point) {
 
-    int           ret;
-    int           window;
-    int64_t       seek_loc;
-    unsigned long bytes_read;
+/*
+ * Called by the reader to prepare buf to be filled with the data from the
+ * index point at or before offset, for at least size bytes (subject to
+ * ZRAN_READAHEAD_MIN_SIZE and ZRAN_READAHEAD_MAX_SIZE) - the point, its
+ * window, and the known span CRCs are copied into the buffer.
+ *
+ * Returns 0 on success, or -1 if the data at offset cannot be read ahead
+ * (e.g. it is not covered by the index).
+ */
+static int _zran_readahead_prepare(
+    zran_index_t         *index,  /* The index                      */
+    zran_readahead_buf_t *buf,    /* The buffer                     */
+    uint64_t              offset, /* Uncompressed offset to include */
+    uint64_t              size    /* Amount of data to read ahead   */
+);
 
-    bytes_read   = strm->avail_in;
-    window       = index->log_window_size;
-    strm->zalloc = Z_NULL;
-    strm->zfree  = Z_NULL;
-    strm->opaque = Z_NULL;
 
-    /*
-     * If we're starting from the the current location in
-     * the compressed data, we assume that there is a gzip
-     * header present. Initialise inflation, then read
-     * past the header.
+/*
+ * Returns the buffer which contains (or will contain) the given
+ * uncompressed offset, or NULL if there is no such buffer. Must be called
+ * with ra->lock held.
+ */
+static zran_readahead_buf_t * _zran_readahead_find(
+    zran_readahead_t *ra,    /* The readahead thread */
+    uint64_t          offset /* Uncompressed offset  */
+);
 
-     * Below, we will re-initialise for raw inflation.
-     */
-    if (point == NULL) {
 
-        zran_log("_zran_init_zlib_inflate from current "
-                 "seek location (expecting GZIP header)\n");
-        if (inflateInit2(strm, window + 32) != Z_OK) { goto fail; }
-        if (inflate(strm, Z_BLOCK)          != Z_OK) { goto fail_free_strm; }
-        if (inflateEnd(strm)                != Z_OK) { goto fail; }
-    }
+/*
+ * Called after every read made with a reader which has a readahead thread.
+ * Compares the read with the previous one - if they are sequential, or
+ * separated by the same stride as the previous pair, buffers are assigned
+ * to the data which is expected to be read next, and the thread is woken.
+ */
+static void _zran_readahead_schedule(
+    zran_reader_t *reader, /* The reader                     */
+    uint64_t       offset, /* Uncompressed offset of the read */
+    uint64_t       len     /* Number of bytes that were read  */
+);
 
-    /*
-     * If starting from an index point, seek to the
-     * required location in the compressed data stream.
-     *
-     * The compressed offset for index points correspond
-     * to the first full byte of compressed data. So if
-     * the index point is not byte-aligned (bits > 0), we
-     * need to seek to the previous byte, and tell zlib
-     * about it (via the inflatePrime call below).
-     */
-    else {
-        seek_loc = point->cmp_offset - (point->bits > 0);
 
-        zran_log("_zran_init_zlib_inflate from index point (%li, %li, %li)\n",
-                 seek_loc,
-                 point->cmp_offset,
-                 point->uncmp_offset);
+/*
+ * Used in place of _zran_cached_read for readers which have a readahead
+ * thread. Copies as much of the requested data as possible from the
+ * readahead buffers (waiting for them to be filled if necessary), reads
+ * the rest via _zran_cached_read, and then calls
+ * _zran_readahead_schedule.
+ */
+static int64_t _zran_readahead_read(
+    zran_reader_t *reader, /* The reader                */
+    void          *buf,    /* Buffer to store len bytes */
+    uint64_t       len     /* Number of bytes to read   */
+);
 
-        if (fseek_(index->fd, index->f, seek_loc, SEEK_SET) != 0) {
-            goto fail;
-        }
-    }
 
-    /*
-     * Now initialise for raw inflation. This tells zlib
-     * not to expect any GZIP headers, and not to read
-     * the GZIP footer (as we do our own CRC validation
-     * in _zran_inflate).
-     */
+/*
+ * Frees a readahead thread (which must not be running) and its buffers.
+ */
+static void _zran_free_readahead(
+    zran_readahead_t *ra /* The readahead thread */
+);
 
-    if (inflateInit2(strm, -window) != Z_OK) {
-        goto fail;
-    }
 
-    /*
-     * If starting from an index point, initialise
-     * the inflation dictionary from the uncompressed
-     * data associated with the index point.
-     */
-    if (point != NULL && point->data != NULL) {
+/*
+ * Number and size of the blocks of compressed data that are read ahead by
+ * an I/O pipeline (see _zran_start_pipeline).
+ */
+#define ZRAN_PIPELINE_BLOCKS     4
+#define ZRAN_PIPELINE_BLOCK_SIZE 1048576
 
-        /*
-         * The starting index point is not byte-aligned,
-         * so we'll insert the initial bits into the
-         * inflate stream using inflatePrime (above,
-         * we seeked one byte back to accommodate this).
-         */
-        if (point->bits > 0) {
 
-            ret = getc_(index->fd, index->f);
+/*
+ * Index expansions which cover less than this much compressed data (other
+ * than expansions to the end of the file) are not pipelined, as the I/O
+ * thread would mostly read data that is not needed.
+ */
+#define ZRAN_PIPELINE_MIN_SIZE 8388608
 
-            if (ret == -1 && ferror_(index->fd, index->f)) {
-                goto fail_free_strm;
-            }
 
-            if (inflatePrime(strm,
-                             point->bits, ret >> (8 - point->bits)) != Z_OK)
-                goto fail_free_strm;
-        }
+/*
+ * An I/O pipeline, used while the index is being expanded. An I/O thread
+ * reads consecutive blocks of compressed data into a ring of buffers,
+ * which are consumed in order by _zran_read_data_from_file. Blocks
+ * [tail, head) of the ring are full - the thread waits while the ring is
+ * full, or after reaching EOF or an error. If the reader needs data from
+ * anywhere else (e.g. after a seek), the ring is emptied, and the thread
+ * restarts from there - the generation is incremented, so that a block
+ * which was being read at the time is discarded. All fields other than
+ * fd and blocks are protected by lock, and changes are signalled via
+ * cond.
+ */
+struct _zran_pipeline {
+    int           fd;
+    uint8_t      *blocks;
+    uint64_t      offsets[ZRAN_PIPELINE_BLOCKS];
+    uint32_t      lens[   ZRAN_PIPELINE_BLOCKS];
+    uint64_t      head;
+    uint64_t      tail;
+    uint64_t      next;
+    uint64_t      generation;
+    uint8_t       eof;
+    uint8_t       error;
+    uint8_t       stop;
+    zran_mutex_t  lock;
+    zran_cond_t   cond;
+    zran_thread_t thread;
+};
 
-        /*
-         * Initialise the inflate stream
-         * with the index point data.
-         */
-        if (inflateSetDictionary(strm,
-                                 point->data,
-                                 index->window_size) != Z_OK)
-            goto fail_free_strm;
-    }
 
-    /*
-     * Reset CRC/size validation counters when
-     * we start reading a new gzip stream
-     */
-    index->validating   = (point == NULL);
-    index->stream_size  = 0;
-    index->stream_crc32 = 0;
+/*
+ * Starts an I/O pipeline for the given reader. Pipelines are only used
+ * with real files (i.e. when reader->fd is not NULL), on platforms which
+ * support positional reads - the I/O thread reads from the file
+ * descriptor underlying reader->fd with pread, ahead of the position of
+ * the reader (see _zran_fread).
+ *
+ * Returns 0 on success, or -1 if a pipeline could not be started, in
+ * which case data is read synchronously, as normal.
+ */
+static int _zran_start_pipeline(
+    zran_reader_t *reader /* The reader */
+);
 
-    zran_log("_zran_zlib_init_inflate: initialised, read %i bytes\n",
-             bytes_read - strm->avail_in);
 
-    /*
-     * Return the number of bytes of compressed
-     * data, if any that were read over
-     */
-    return bytes_read - strm->avail_in;
+/*
+ * Stops the I/O pipeline of the given reader, if it has one, and frees
+ * its buffers.
+ */
+static void _zran_stop_pipeline(
+    zran_reader_t *reader /* The reader */
+);
+
 
 /*
- * Something has gone wrong, but
- * inflateInit2 has been called,
- * so we need to call inflateEnd.
- * Falls through to the fail:
- * clause.
+ * Entry point for I/O pipeline threads. Reads blocks into the ring until
+ * the stop flag is set.
  */
-fail_free_strm:
-    inflateEnd(strm);
-/* Something has gone wrong */
-fail:
-    return -1;
-}
+static void _zran_pipeline_main(
+    void *pipeline /* The pipeline (a zran_pipeline_t) */
+);
 
 
 /*
- * Read data from the GZIP file, and copy it into the read buffer for
- * decompression.
+ * Used by _zran_read_data_from_file in place of fread_, when the reader
+ * has an I/O pipeline. Copies up to len bytes of compressed data, from
+ * the current position of the reader, out of the ring (waiting for the
+ * I/O thread if necessary), and then moves the reader past them.
+ *
+ * Returns the number of bytes copied (which is only less than len at
+ * EOF), or -1 if an error occurs.
  */
-static int _zran_read_data_from_file(zran_index_t *index,
-                                     z_stream     *stream,
-                                     uint64_t      cmp_offset,
-                                     uint64_t      uncmp_offset,
-                                     uint32_t      need_atleast) {
+static int64_t _zran_pipeline_read(
+    zran_reader_t *reader, /* The reader                 */
+    uint8_t       *buf,    /* Buffer to copy data into   */
+    uint64_t       len     /* Number of bytes to copy    */
+);
 
-    size_t f_ret;
 
-    if (stream->avail_in >= need_atleast) {
-        return 0;
-    }
+#ifndef _WIN32
+/*
+ * Reads up to len bytes from the given file descriptor, starting at the
+ * given offset, with pread. Returns the number of bytes read (which is
+ * only less than len at EOF), or -1 if an error occurs.
+ */
+static int64_t _zran_pread(
+    int       fd,     /* File descriptor             */
+    void     *buf,    /* Buffer to read data into    */
+    uint64_t  len,    /* Number of bytes to read     */
+    uint64_t  offset  /* Offset to start reading from */
+);
+#endif
 
-    /*
-     * If there are any unprocessed bytes
-     * left over, put them at the beginning
-     * of the read buffer.
-     *
-     * TODO: In times gone by, we would only
-     * attempt to read data (and therefore
-     * rotate memory here) when the read
-     * buffer was empty. But now, to keep
-     * the code in _zran_inflate clean-ish,
-     * we do this repeatedly, even when we
-     * are at EOF, to ensure that there is
-     * enough data to validate one stream,
-     * and find the next. We could improve
-     * things here, by only rotating memory
-     * here if needed.
-     */
-    if (stream->avail_in > 0) {
-        memmove(index->readbuf, stream->next_in, stream->avail_in);
-    }
 
-    zran_log("Reading from file %llu "
-             "[into readbuf offset %u]\n",
-             cmp_offset + stream->avail_in,
-             stream->avail_in);
+/*
+ * The following functions are used in place of fseek_, ftell_, fread_,
+ * getc_, ferror_ and feof_ for all access to the compressed data through
+ * a reader. When the reader has a real file (reader->fd is not NULL), and
+ * positional reads are supported, the reader keeps its own position in
+ * the compressed data (reader->cmp_pos), and reads from the underlying
+ * file descriptor with pread. So seeking does not involve a system call,
+ * stdio buffering is bypassed, and the FILE position is never used, which
+ * means that multiple readers may share one file handle. Otherwise (on
+ * Windows, and for Python file-likes), they just call the corresponding
+ * zran_file_util.h function.
+ */
 
-    /*
-     * Read a block of compressed data
-     * (offsetting past any left over
-     * bytes that we may have copied to
-     * the beginning of the read buffer
-     * above).
-     */
-    f_ret = fread_(index->readbuf + stream->avail_in,
-                   1,
-                   index->readbuf_size - stream->avail_in,
-                   index->fd,
-                   index->f);
 
-    if (ferror_(index->fd, index->f)) {
-        goto fail;
-    }
+/*
+ * Sets the position of the reader in the compressed data. Returns 0 on
+ * success, non-0 on failure.
+ */
+static int _zran_fseek(
+    zran_reader_t *reader, /* The reader                          */
+    uint64_t       offset  /* New position, from start of the file */
+);
 
-    /*
-     * No bytes left to read, and there are
-     * only 8 bytes left to process (size of
-     * gzip footer) - we've reached EOF.
-     */
-    if (f_ret == 0 && stream->avail_in <= 8) {
-        if (feof_(index->fd, index->f, f_ret)) {
 
-            zran_log("End of file, stopping inflation\n");
+/*
+ * Returns the position of the reader in the compressed data, or -1 on
+ * failure.
+ */
+static int64_t _zran_ftell(
+    zran_reader_t *reader /* The reader */
+);
 
-            /*
-             * Reset next_in pointer to beginning of
-             * read buffer, as we rotated it above,
-             * and the area that next_in was pointing
-             * to may have been overwritten by memmove.
-             */
-            stream->next_in = index->readbuf;
 
-            /*
-             * we have uncompressed everything,
-             * so we now know its size.
-             */
-            if (index->uncompressed_size == 0) {
-                zran_log("Updating uncompressed data "
-                         "size: %llu\n", uncmp_offset);
-                index->uncompressed_size = uncmp_offset;
-            }
-            if (index->compressed_size == 0) {
-                zran_log("Updating compressed data "
-                         "size: %llu\n", cmp_offset);
-                index->compressed_size = cmp_offset + 8;
-            }
-            goto eof;
-        }
-        /*
-         * Or something went wrong (this
-         * should never happen if ferror
-         * does the right thing).
-         */
-        else {
-            goto fail;
-        }
-    }
+/*
+ * Reads up to len bytes of compressed data from the current position of
+ * the reader, and moves the reader past them. Returns the number of bytes
+ * that were read - _zran_ferror and _zran_feof can be used to find out
+ * why fewer than len bytes were read.
+ */
+static size_t _zran_fread(
+    zran_reader_t *reader, /* The reader                  */
+    void          *buf,    /* Buffer to read data into    */
+    size_t         len     /* Number of bytes to read     */
+);
 
-    zran_log("Read %lu bytes from file [c=%llu, u=%llu] "
-             "[%02x %02x %02x %02x ...]\n",
-             f_ret, cmp_offset, uncmp_offset,
-             index->readbuf[stream->avail_in],
-             index->readbuf[stream->avail_in + 1],
-             index->readbuf[stream->avail_in + 2],
-             index->readbuf[stream->avail_in + 3]);
+
+/*
+ * Reads one byte from the current position of the reader. Returns the
+ * byte, or -1 on EOF or failure.
+ */
+static int _zran_getc(
+    zran_reader_t *reader /* The reader */
+);
+
+
+/*
+ * Returns non-0 if the most recent read by the reader failed.
+ */
+static int _zran_ferror(
+    zran_reader_t *reader /* The reader */
+);
+
+
+/*
+ * Returns non-0 if the most recent read by the reader reached EOF. f_ret
+ * is the return value of that read (see feof_).
+ */
+static int _zran_feof(
+    zran_reader_t *reader, /* The reader                          */
+    size_t         f_ret   /* Number of bytes returned by the read */
+);
+
+
+/*
+ * An index point found by a zran_build_index_parallel worker. The window
+ * (the ZRAN_DEFLATE_WINDOW bytes preceding the point) is followed by
+ * ZRAN_DEFLATE_WINDOW referenced byte flags if refs is non-0 (see
+ * _zran_find_window_refs). If the point was found before the window of
+ * the chunk was free of markers, the window is filled in from markers by
+ * _zran_pbuild_stitch.
+ */
+typedef struct _zran_pbuild_point {
+    uint64_t  bitpos;       /* Bit offset into the compressed data       */
+    uint64_t  uncmp_offset; /* Offset relative to the start of the chunk */
+    uint8_t   refs;         /* Whether window is followed by refs        */
+    uint8_t  *window;       /* Window data                               */
+    uint16_t *markers;      /* Window symbols, or NULL                   */
+} zran_pbuild_point_t;
+
+
+/*
+ * A chunk of compressed data, decoded by a zran_build_index_parallel
+ * worker. The chunk starts at the first deflate block (that could be
+ * found) at or after bit offset from, and ends at the first block
+ * boundary at or after bit offset to. Offsets are measured in bits, from
+ * the start of the file. A chunk may span the end of one gzip stream and
+ * the start of the next - a chunk never ends in between two streams, but
+ * at the first block of the next stream. The final window is the last
+ * ZRAN_DEFLATE_WINDOW symbols (see zran_deflate_markers_t) that were
+ * decoded, oldest first.
+ */
+typedef struct _zran_pbuild_chunk {
+    uint64_t             from;      /* Nominal start of the chunk         */
+    uint64_t             to;        /* Nominal end of the chunk           */
+    uint64_t             start;     /* First block in the chunk           */
+    uint64_t             end;       /* Block boundary at end of the chunk */
+    uint64_t             size;      /* Uncompressed size of the chunk     */
+    uint8_t              valid;     /* Whether the chunk could be decoded */
+    uint8_t              last;      /* Whether the chunk ends at the end
+                                       of the final gzip stream           */
+    uint16_t            *window;    /* Final window                       */
+    zran_pbuild_point_t *points;    /* Points found in the chunk          */
+    uint32_t             npoints;   /* Number of points                   */
+    uint32_t             pointsize; /* Capacity of points                 */
+} zran_pbuild_chunk_t;
+
+
+/* State shared by the zran_build_index_parallel threads. */
+typedef struct _zran_pbuild {
+    zran_index_t        *index;
+    uint64_t             header;
+    zran_pbuild_chunk_t *chunks;
+    uint32_t             nchunks;
+    uint64_t             next_chunk;
+    uint64_t             failed;
+} zran_pbuild_t;
+
+
+/* One zran_build_index_parallel thread, and the reader that it uses. */
+typedef struct _zran_pbuild_worker {
+    zran_pbuild_t *pbuild;
+    zran_reader_t *reader;
+    int            ret;
+} zran_pbuild_worker_t;
+
+
+/*
+ * Used by zran_build_index_parallel. Claims and decodes chunks with the
+ * given worker's reader, until there are no chunks left, or an error
+ * occurs. The result is stored in worker->ret.
+ */
+static void _zran_pbuild_worker(
+    void *worker /* The worker (a zran_pbuild_worker_t) */
+);
+
+
+/*
+ * Sub-function of _zran_pbuild_worker. Decodes a chunk of the compressed
+ * data. The first chunk is decoded from the start of the deflate stream.
+ * For all other chunks, the first block is located with
+ * zran_deflate_find_block, or is the first block of a gzip stream whose
+ * header is found in the chunk (see _zran_pbuild_find_stream) - in the
+ * latter case, the chunk is decoded with zlib. Otherwise it is decoded with
+ * zran_deflate_decode_markers, until the window no longer contains any
+ * markers (adding points with a window of markers along the way) - the
+ * rest of the chunk is then decoded with zlib (see _zran_pbuild_inflate).
+ * If the start of the chunk cannot be found, or the chunk cannot be
+ * decoded, it is marked as invalid, and is decoded sequentially by
+ * _zran_pbuild_stitch instead.
+ *
+ * Returns 0 on success, or -1 if an error occurs.
+ */
+static int _zran_pbuild_chunk(
+    zran_pbuild_t       *pbuild, /* Build state */
+    zran_reader_t       *reader, /* The reader  */
+    zran_pbuild_chunk_t *chunk   /* The chunk   */
+);
+
+
+/*
+ * _zran_pbuild_inflate, _zran_pbuild_find_stream, and
+ * _zran_pbuild_next_stream return codes
+ */
+#define ZRAN_PBUILD_OK          0
+#define ZRAN_PBUILD_NO_STREAM   1
+#define ZRAN_PBUILD_ERROR      -1
+#define ZRAN_PBUILD_DATA_ERROR -2
+
+
+/*
+ * Searches the given buffer, from byte offset from up to (but not
+ * including) byte offset to, for something which looks like a gzip header
+ * (1f 8b 08, with none of the reserved flags set), and which zlib is able
+ * to parse. The offsets of the start and end of the header are stored in
+ * start and end.
+ *
+ * Returns ZRAN_PBUILD_OK if a header is found, or ZRAN_PBUILD_NO_STREAM
+ * otherwise.
+ */
+static int _zran_pbuild_find_stream(
+    uint8_t  *buf,   /* Compressed data                 */
+    size_t    len,   /* Length of buf                   */
+    uint64_t  from,  /* Offset to start searching from  */
+    uint64_t  to,    /* Offset to stop searching at     */
+    uint64_t *start, /* Place to store start of header  */
+    uint64_t *end    /* Place to store end of header    */
+);
+
+
+/*
+ * Finds the gzip stream which starts at or after the given byte offset,
+ * skipping over any data before it in the same way that
+ * _zran_find_next_stream does, and stores the bit offset of its first
+ * deflate block in bitpos.
+ *
+ * Returns ZRAN_PBUILD_OK on success, ZRAN_PBUILD_NO_STREAM if there are
+ * no more streams, ZRAN_PBUILD_DATA_ERROR if the stream header is invalid,
+ * or ZRAN_PBUILD_ERROR if an I/O or memory error occurs.
+ */
+static int _zran_pbuild_next_stream(
+    zran_reader_t *reader, /* Reader to read compressed data with */
+    uint64_t       offset, /* Offset to start searching from     */
+    uint64_t      *bitpos  /* Place to store the stream start    */
+);
+
+
+/*
+ * Decodes compressed data with zlib, starting from the block at bit offset
+ * bitpos, and continuing up to the first block boundary at or after bit
+ * offset limit, or the end of the final gzip stream. If a gzip stream
+ * ends before limit, decoding continues from the start of the next
+ * stream, and a point is added there.
+ *
+ * If bitpos is in the middle of a stream, window must contain the
+ * ZRAN_DEFLATE_WINDOW bytes which precede bitpos (or be NULL at the start
+ * of the file). If bitpos is at the start of a stream, symbols must
+ * instead contain the ZRAN_DEFLATE_WINDOW symbols which precede bitpos
+ * (see zran_deflate_markers_t), and a point is added at bitpos. Points
+ * are added to the chunk every spacing bytes, and the chunk end, size,
+ * and final window are updated.
+ *
+ * Returns ZRAN_PBUILD_OK on success, ZRAN_PBUILD_DATA_ERROR if the data
+ * could not be decoded, or ZRAN_PBUILD_ERROR if another error occurs.
+ */
+static int _zran_pbuild_inflate(
+    zran_pbuild_chunk_t *chunk,   /* Chunk to store the results in      */
+    zran_reader_t       *reader,  /* Reader to read compressed data with */
+    uint64_t             bitpos,  /* Bit offset to start from           */
+    uint8_t             *window,  /* Window preceding bitpos            */
+    uint16_t            *symbols, /* Symbols preceding bitpos           */
+    uint64_t             outcnt,  /* Chunk size before bitpos           */
+    uint64_t             limit,   /* Bit offset to stop at              */
+    uint32_t             spacing  /* Distance between points            */
+);
+
+
+/*
+ * Sub-function of zran_build_index_parallel, called once all chunks have
+ * been decoded. Adds the points found in each chunk to the index, in
+ * order, checking that each chunk starts where the previous one ended.
+ * Any parts of the data that are not covered by a valid chunk are decoded
+ * sequentially with the given reader.
+ *
+ * Returns 0 on success, or -1 if an error occurs.
+ */
+static int _zran_pbuild_stitch(
+    zran_pbuild_t *pbuild, /* Build state                    */
+    zran_reader_t *reader  /* Reader to decode any gaps with */
+);
+
+
+/* _zran_inflate return codes */
+int ZRAN_INFLATE_CRC_ERROR      = -6;
+int ZRAN_INFLATE_ERROR          = -5;
+int ZRAN_INFLATE_NOT_COVERED    = -4;
+int ZRAN_INFLATE_OUTPUT_FULL    = -3;
+int ZRAN_INFLATE_BLOCK_BOUNDARY = -2;
+int ZRAN_INFLATE_EOF            = -1;
+int ZRAN_INFLATE_OK             =  0;
+
+/*
+ * _zran_inflate input flags.
+ * Bit position, as a power of 2
+ */
+uint32_t ZRAN_INFLATE_INIT_Z_STREAM         = 1;
+uint32_t ZRAN_INFLATE_FREE_Z_STREAM         = 2;
+uint32_t ZRAN_INFLATE_INIT_READBUF          = 4;
+uint32_t ZRAN_INFLATE_FREE_READBUF          = 8;
+uint32_t ZRAN_INFLATE_USE_OFFSET            = 16;
+uint32_t ZRAN_INFLATE_CLEAR_READBUF_OFFSETS = 32;
+uint32_t ZRAN_INFLATE_STOP_AT_BLOCK         = 64;
+
+
+/* Macros used by _zran_inflate for testing flags. */
+#define inflate_init_stream(  flags) ((flags & ZRAN_INFLATE_INIT_Z_STREAM) > 0)
+#define inflate_free_stream(  flags) ((flags & ZRAN_INFLATE_FREE_Z_STREAM) > 0)
+#define inflate_init_readbuf( flags) ((flags & ZRAN_INFLATE_INIT_READBUF)  > 0)
+#define inflate_free_readbuf( flags) ((flags & ZRAN_INFLATE_FREE_READBUF)  > 0)
+#define inflate_use_offset(   flags) ((flags & ZRAN_INFLATE_USE_OFFSET)    > 0)
+#define inflate_stop_at_block(flags) ((flags & ZRAN_INFLATE_STOP_AT_BLOCK) > 0)
+#define inflate_clear_readbuf_offsets(flags) \
+    ((flags & ZRAN_INFLATE_CLEAR_READBUF_OFFSETS) > 0)
+
+
+/*
+ * Inflate (decompress) the specified number of bytes, or until the next
+ * Z_BLOCK/Z_STREAM_END is reached.
+ *
+ * This is a complicated function which implements the core decompression
+ * routine, and is used by both _zran_expand_index, and zran_read. It reads
+ * compressed data from the file, starting from the specified compressed
+ * offset, inflates (a.k.a. decompresses) it, and copies the decompressed
+ * data to the provided output buffer.
+ *
+ * This function is complicated because it is used in three different
+ * situations:
+ *   - When generating the index (by zran_expand_index)
+ *   - When starting from an index seek point and discarding compressed data
+ *     to find a requested seek location (by zran_read)
+ *   - When actually reading and decompressing data (by zran_read).
+ *
+ * This function may be used in a re-entrant or non-re-entrant manner,
+ * depending on the flags which are used. In the latter (more likely) case,
+ * various pieces of information representing the current inflation state are
+ * stored in fields of the zran_index_t struct.
+ *
+ * Specifically, this function does the following:
+ *
+ *   1. Figures out the starting offsets into the compressed/uncompressed
+ *      streams. If the ZRAN_INFLATE_USE_OFFSET flag is active, the index
+ *      point preceding the specified offset is used as the starting point.
+ *      If there is no such point, ZRAN_INFLATE_NOT_COVERED is returned.  If
+ *      ZRAN_INFLATE_USE_OFFSET is not active, index->inflate_cmp_offset and
+ *      index->inflate_uncmp_offset are used as the starting point.
+ *
+ *   2. Create a read buffer, if ZRAN_INFLATE_INIT_READBUF is active. A
+ *      reference to the read buffer is stored at index->readbuf.  If
+ *      ZRAN_INFLATE_INIT_READBUF is not set, the function assumes that the
+ *      read buffer already exists.
+ *
+ *   3. If the ZRAN_INFLATE_CLEAR_READBUF_OFFSETS flag is active, the read
+ *      buffer offset (index->readbuf_offset) and length (index->readbuf_end)
+ *      fields are both set to 0. Otherwise, the function assumes that the
+ *      current offset/length values are valid.
+
+ *   4. Initialises the z_stream struct, if ZRAN_INFLATE_INIT_Z_STREAM is
+ *      active. Otherwise, the function assumes that the z_stream struct is
+ *      already initialised and ready to be used.
+ *
+ *   5. Read some compressed data from the file into the read buffer as needed.
+ *
+ *   6. Pass that data to the zlib inflate function, and store the resulting
+ *      uncompressed data in the provided data buffer. If the end of a GZIP
+ *      stream is reached for the first time, it is validated against the
+ *      CRC/file size stored in the GZIP footer (unless ZRAN_SKIP_CRC_CHECK
+ *      is active).
+ *
+ *   7. Repeat steps 5 and 6 until one of the following is true:
+ *
+ *       - The requested number of bytes have been read
+ *
+ *       - The output buffer is full
+ *
+ *       - End of file is reached
+ *
+ *       - ZRAN_INFLATE_STOP_AT_BLOCK is active, and a block is reached
+ *
+ *   8. If ZRAN_INFLATE_FREE_READBUF is active, the file read buffer is
+ *      de-allocated.
+ *
+ *   9. If ZRAN_INFLATE_FREE_Z_STREAM is active, the memory used by the
+ *      z_stream struct is de-allocated (via the zlib inflateEnd function).
+ *
+ * The control flags can be a combination (bitwise OR) of the following:
+ *
+ *   - ZRAN_INFLATE_INIT_Z_STREAM:         Initialise the z_stream struct
+ *                                         before inflation.
+ *
+ *   - ZRAN_INFLATE_FREE_Z_STREAM:         Clean up the z_stream struct
+ *                                         after inflation.
+ *
+ *   - ZRAN_INFLATE_INIT_READBUF:          Allocate a read buffer before
+ *                                         inflation.
+ *
+ *   - ZRAN_INFLATE_FREE_READBUF:          Free the read buffer after
+ *                                         inflation.
+ *
+ *   - ZRAN_INFLATE_USE_OFFSET:            If set, use the provided offset
+ *                                         parameter; otherwise, use the
+ *                                         offsets stored in the index
+ *                                         struct.
+ *
+ *   - ZRAN_INFLATE_CLEAR_READBUF_OFFSETS: If set, clear the read buffer
+ *                                         offset/length stored in the index
+ *                                         struct, otherwise assume that they
+ *                                         are valid.
+ *
+ *   - ZRAN_INFLATE_STOP_AT_BLOCK:         If set, stop inflation when a
+ *                                         deflate block boundary is reached
+ *                                         (the Z_BLOCK flag is passed to the
+ *                                         zlib inflate function). Otherwise,
+ *                                         inflation will continue until one
+ *                                         of the conditions in step 7, above,
+ *                                         are met.
+ *
+ * This function returns one of the following codes. Furthermore, if an error
+ * did not occur (i.e. anything but ZRAN_INFLATE_ERROR or
+ * ZRAN_INFLATE_NOT_COVERED was returned), the total_consumed and total_output
+ * parameters are respectively updated to contain the total number of
+ * compressed bytes that were read from the file, and total number of
+ * decompressed bytes that were copied to the data buffer.
+ *
+ *   - ZRAN_INFLATE_OK:             Inflation was successful and the requested
+ *                                  number of bytes were copied to the provided
+ *                                  data buffer.
+ *
+ *   - ZRAN_INFLATE_NOT_COVERED:    The requested compressed data offset is not
+ *                                  covered by the index.
+ *
+ *   - ZRAN_INFLATE_OUTPUT_FULL:    The provided data buffer has been filled.
+ *
+ *   - ZRAN_INFLATE_BLOCK_BOUNDARY: A deflate block boundary was encountered.
+ *                                  This will only be returned if the
+ *                                  ZRAN_INFLATE_STOP_AT_BLOCK flag is active.
+ *
+ *   - ZRAN_INFLATE_EOF:            The end of file has been reached.
+ *
+ *   - ZRAN_INFLATE_CRC_ERROR:      The CRC or uncompressed data size in the
+ *                                  GZIP footer does not match the CRC/size
+ *                                  that was calculated.
+ *
+ *   - ZRAN_INFLATE_ERROR:          A critical error has occurred.
+ */
+static int _zran_inflate(
+    zran_reader_t *reader,          /* Pointer to the reader, which refers
+                                       to the index. */
+
+    z_stream     *strm,             /* Pointer to a z_stream struct. */
+
+    uint64_t      offset,           /* Compressed data offset to start
+                                       inflation from. */
+
+    uint16_t      flags,            /* Control flags. */
+
+    uint32_t     *total_consumed,   /* Pointer which is updated to contain the
+                                       total number of bytes that were read
+                                       from the input file. */
+
+    uint32_t     *total_output,     /* Pointer which is updated to contain the
+                                       total number of bytes that were
+                                       inflated, and stored in data. */
+
+    uint32_t      len,              /* Maximum number of bytes to inflate. May
+                                       be 0. */
+
+    uint8_t      *data,             /* Place to store the inflated bytes. */
+
+    int           add_stream_points /* Add index points at the beginning of
+                                       every gzip stream, including the first
+                                       one at the beginning of the input file
+                                     */
+);
+
+
+/* Initialise a zran_index_t struct for use with the given GZIP file. */
+int zran_init(zran_index_t *index,
+              FILE         *fd,
+              PyObject     *f,
+              uint32_t      spacing,
+              uint32_t      window_size,
+              uint32_t      readbuf_size,
+              uint16_t      flags)
+{
+
+    int64_t  compressed_size;
+    uint8_t  header[ZRAN_BGZF_READ_SIZE];
+    uint32_t hlen;
+    uint32_t bsize;
+    size_t   nread;
+    uint8_t  bgzf = 0;
+
+    zran_log("zran_init(%u, %u, %u, %u)\n",
+             spacing, window_size, readbuf_size, flags);
+
+    if (spacing      == 0) spacing      = 1048576;
+    if (window_size  == 0) window_size  = 32768;
+    if (readbuf_size == 0) readbuf_size = 16384;
+
+    /*
+     * The zlib manual specifies that a window
+     * size of 32KB is 'always enough' to
+     * initialise inflation/deflation with a
+     * set dictionary. Less than that is not
+     * guaranteed to be enough.
+     */
+    if (window_size < 32768)
+        goto fail;
+
+    /*
+     * Small read-buffers make code complicated.
+     * The absolute minimum we need is enough to
+     * store a GZIP footer, null padding bytes at
+     * the end of a stream, and the subsequent
+     * GZIP header. There are no bounds on the
+     * number of padding bytes, or the size of a
+     * GZIP header, so this constraint is
+     * arbitrary (but should be good enough).
+     */
+    if (readbuf_size < 128)
+        goto fail;
+
+    /*
+     * window_size bytes of uncompressed data are
+     * stored with each seek point in the index.
+     * So it's a bit silly to have the distance
+     * between consecutive points less than the
+     * window size.
+     */
+    if (spacing <= window_size)
+        goto fail;
+
+    /* The file must be opened in read-only mode */
+    if (!is_readonly(fd, f))
+        goto fail;
+
+    /*
+     * Calculate the size of the compressed file
+     */
+    if (seekable_(fd, f)) {
+        if (fseek_(fd, f, 0, SEEK_END) != 0)
+            goto fail;
+
+        compressed_size = ftell_(fd, f);
+
+        if (compressed_size < 0)
+            goto fail;
+
+        if (fseek_(fd, f, 0, SEEK_SET) != 0)
+            goto fail;
+
+        /*
+         * If the file starts with a BGZF block, its
+         * index can be built from the block headers
+         * (see _zran_expand_bgzf_index). Read errors
+         * are left for later, as the file might not
+         * be readable yet (see is_readonly).
+         */
+        nread = fread_(header, 1, ZRAN_BGZF_READ_SIZE, fd, f);
+        if (ferror_(fd, f)) {
+            clearerr_(fd, f);
+            nread = 0;
+        }
+
+        bgzf = _zran_bgzf_block(header, nread, &hlen, &bsize) ==
+               ZRAN_BGZF_OK;
+
+        if (fseek_(fd, f, 0, SEEK_SET) != 0)
+            goto fail;
+    } else {
+        /*
+         * File is not seekable, so don't calculate
+         * compressed_size.  It will be updated in
+         * _zran_read_data_from_file when the EOF
+         * is reached
+         */
+        compressed_size = 0;
+    }
+
+    /* initialise the index struct */
+    index->fd                   = fd;
+    index->f                    = f;
+    index->flags                = flags;
+    index->compressed_size      = compressed_size;
+    index->uncompressed_size    = 0;
+    index->bgzf                 = bgzf;
+    index->cache_id             = atomic_add_u64(&zran_cache_id, 1);
+    index->disk_key             = 0;
+    index->spacing              = spacing;
+    index->window_size          = window_size;
+    index->log_window_size      = (int)round(log10(window_size) / log10(2));
+    index->readbuf_size         = readbuf_size;
+    index->npoints              = 0;
+    index->size                 = 0;
+    index->cmp_offsets          = NULL;
+    index->uncmp_offsets        = NULL;
+    index->bits                 = NULL;
+    index->windows              = NULL;
+    index->span_crcs            = NULL;
+    index->nspans               = 0;
+    index->window_table         = NULL;
+    index->window_table_size    = 0;
+    index->window_table_count   = 0;
+    index->map                  = NULL;
+    index->map_size             = 0;
+    index->mapped_windows       = NULL;
+    index->nmapped              = 0;
+    index->window_budget        = 0;
+    index->window_bytes         = 0;
+    index->evict_stride         = 1;
+    index->generation           = 0;
+    index->window_buf           = NULL;
+
+    zran_arena_init(&(index->arena), 0, (flags & ZRAN_HUGE_PAGES) != 0);
+
+    /*
+     * Allocate some initial space
+     * for the index points
+     */
+    if (_zran_resize_point_list(index, 8) != 0) {
+        _zran_free_point_list(index);
+        goto fail;
+    }
+
+    _zran_init_reader(&(index->reader), index, fd, f);
+
+    return 0;
+
+fail:
+    return -1;
+}
+
+
+/* Returns the compressed or uncompressed index limit. */
+uint64_t _zran_index_limit(zran_index_t *index, uint8_t compressed) {
+
+    if (index->npoints == 0)
+        return 0;
+
+    if (compressed) return index->cmp_offsets[  index->npoints - 1];
+    else            return index->uncmp_offsets[index->npoints - 1];
+}
+
+
+/* Changes the capacity of the index point arrays. */
+int _zran_resize_point_list(zran_index_t *index, uint32_t size) {
+
+    uint64_t  *cmp_offsets;
+    uint64_t  *uncmp_offsets;
+    uint8_t   *bits;
+    uint8_t  **windows;
+    uint32_t  *span_crcs;
+    uint32_t   nbits;
+    uint32_t   oldnbits;
+
+    zran_log("_zran_resize_point_list(%u -> %u)\n", index->size, size);
+
+    /*
+     * Each array is re-allocated in turn. If
+     * one fails, the arrays which have already
+     * been re-allocated are still valid, as the
+     * new size is never smaller than npoints,
+     * and we only update index->size once all
+     * of them have succeeded.
+     */
+    nbits    = (size        + 1) / 2;
+    oldnbits = (index->size + 1) / 2;
+
+    cmp_offsets = realloc(index->cmp_offsets, sizeof(uint64_t) * size);
+    if (cmp_offsets == NULL)
+        return -1;
+    index->cmp_offsets = cmp_offsets;
+
+    uncmp_offsets = realloc(index->uncmp_offsets, sizeof(uint64_t) * size);
+    if (uncmp_offsets == NULL)
+        return -1;
+    index->uncmp_offsets = uncmp_offsets;
+
+    bits = realloc(index->bits, nbits);
+    if (bits == NULL)
+        return -1;
+    index->bits = bits;
+
+    windows = realloc(index->windows, sizeof(uint8_t *) * size);
+    if (windows == NULL)
+        return -1;
+    index->windows = windows;
+
+    span_crcs = realloc(index->span_crcs, sizeof(uint32_t) * size);
+    if (span_crcs == NULL)
+        return -1;
+    index->span_crcs = span_crcs;
+
+    /*
+     * Bits are packed, so clear any new
+     * bytes, in order for _zran_set_point_bits
+     * to be able to update a single nibble.
+     */
+    if (nbits > oldnbits)
+        memset(bits + oldnbits, 0, nbits - oldnbits);
+
+    index->size = size;
+
+    return 0;
+}
+
+
+/* Expands the memory used to store the index points. */
+int _zran_expand_point_list(zran_index_t *index) {
+
+    zran_log("_zran_expand_point_list(%i -> %i)\n",
+             index->size, index->size * 2);
+
+    return _zran_resize_point_list(index, index->size * 2);
+}
+
+
+/* Frees any unused memory allocated for index storage. */
+int _zran_free_unused(zran_index_t *index) {
+
+    uint32_t new_size;
+
+    zran_log("_zran_free_unused\n");
+
+    if (index->npoints < 8) new_size = 8;
+    else                    new_size = index->npoints;
+
+    return _zran_resize_point_list(index, new_size);
+}
+
+
+/* Frees the index point arrays, and the window data of every point. */
+void _zran_free_point_list(zran_index_t *index) {
+
+    zran_arena_free(&(index->arena));
+    _zran_free_window_table(index);
+    _zran_unmap_windows(index);
+
+    free(index->cmp_offsets);
+    free(index->uncmp_offsets);
+    free(index->bits);
+    free(index->windows);
+    free(index->span_crcs);
+
+    index->cmp_offsets   = NULL;
+    index->uncmp_offsets = NULL;
+    index->bits          = NULL;
+    index->windows       = NULL;
+    index->span_crcs     = NULL;
+    index->nspans        = 0;
+}
+
+
+/* Returns the bit offset of point i. */
+uint8_t _zran_get_point_bits(zran_index_t *index, uint32_t i) {
+
+    return (index->bits[i / 2] >> (4 * (i % 2))) & 0x07;
+}
+
+
+/* Sets the bit offset of point i. */
+void _zran_set_point_bits(zran_index_t *index, uint32_t i, uint8_t bits) {
+
+    uint8_t shift = 4 * (i % 2);
+
+    index->bits[i / 2] = (index->bits[i / 2] & ~(0x0F << shift)) |
+                         ((bits & 0x07) << shift);
+}
+
+
+/* Returns non-0 if the window of point i has been evicted. */
+uint8_t _zran_point_evicted(zran_index_t *index, uint32_t i) {
+
+    return (index->bits[i / 2] >> (4 * (i % 2))) & 0x08;
+}
+
+
+/* Marks the window of point i as evicted. */
+void _zran_set_point_evicted(zran_index_t *index, uint32_t i) {
+
+    index->bits[i / 2] |= 0x08 << (4 * (i % 2));
+}
+
+
+/* Returns the index scratch buffer, allocating it if necessary. */
+uint8_t * _zran_window_buf(zran_index_t *index) {
+
+    if (index->window_buf == NULL) {
+        index->window_buf = malloc(2 * index->window_size +
+                                   compressBound(index->window_size) +
+                                   ZRAN_DEFLATE_WINDOW);
+    }
+
+    return index->window_buf;
+}
+
+
+/* Find the window bytes which are referenced after a new point. */
+int _zran_find_window_refs(zran_reader_t *reader,
+                           uint64_t       cmp_offset,
+                           uint8_t        bits,
+                           uint8_t       *refs) {
+
+    uint8_t *buf   = NULL;
+    uint8_t *in;
+    size_t   inlen;
+    size_t   f_ret;
+    uint8_t  first = 0;
+    int64_t  pos;
+    int      ret;
+
+    memset(refs, 0, ZRAN_DEFLATE_WINDOW);
+
+    /*
+     * The compressed data following the point
+     * starts at readbuf_offset (and includes
+     * the last bits of the preceding byte if
+     * the point is not byte-aligned).
+     */
+    if (reader->readbuf != NULL && (bits == 0 || reader->readbuf_offset > 0)) {
+
+        in    = reader->readbuf     + reader->readbuf_offset;
+        inlen = reader->readbuf_end - reader->readbuf_offset;
+
+        if (bits > 0)
+            first = in[-1] >> (8 - bits);
+
+        ret = zran_deflate_scan_refs(in, inlen, first, bits, refs);
+
+        if (ret == ZRAN_DEFLATE_SCAN_OK)    return 0;
+        if (ret != ZRAN_DEFLATE_SCAN_NO_INPUT) return 1;
+    }
+
+    /*
+     * Not enough data in the read buffer -
+     * read some more from the file, and
+     * then put the file position back to
+     * where _zran_inflate expects it to be.
+     */
+    if (!seekable_(reader->fd, reader->f))
+        return 1;
+
+    buf = malloc(ZRAN_FIND_REFS_INPUT_SIZE);
+    if (buf == NULL)
+        goto fail;
+
+    pos = _zran_ftell(reader);
+    if (pos < 0)
+        goto fail;
+
+    if (_zran_fseek(reader, cmp_offset - (bits > 0)) != 0)
+        goto fail;
+
+    f_ret = _zran_fread(reader, buf, ZRAN_FIND_REFS_INPUT_SIZE);
+
+    if (_zran_ferror(reader))
+        goto fail;
+
+    if (_zran_fseek(reader, pos) != 0)
+        goto fail;
+
+    zran_log("_zran_find_window_refs(%llu, %u): re-read %zu bytes\n",
+             cmp_offset, bits, f_ret);
+
+    ret = 1;
+
+    if (f_ret > (bits > 0)) {
+
+        if (bits > 0)
+            first = buf[0] >> (8 - bits);
+
+        memset(refs, 0, ZRAN_DEFLATE_WINDOW);
+
+        if (zran_deflate_scan_refs(buf   + (bits > 0),
+                                   f_ret - (bits > 0),
+                                   first,
+                                   bits,
+                                   refs) == ZRAN_DEFLATE_SCAN_OK)
+            ret = 0;
+    }
+
+    free(buf);
+    return ret;
+
+fail:
+    free(buf);
+    return -1;
+}
+
+
+/* Find the next range of referenced bytes. */
+int _zran_next_ref_range(uint8_t *refs, uint32_t *start, uint32_t *end) {
+
+    uint32_t i = *end;
+    uint32_t next;
+
+    while (i < ZRAN_DEFLATE_WINDOW && !refs[i])
+        i++;
+
+    if (i == ZRAN_DEFLATE_WINDOW)
+        return 0;
+
+    *start = i;
+
+    /* Extend the range across any short gaps */
+    while (i < ZRAN_DEFLATE_WINDOW) {
+
+        while (i < ZRAN_DEFLATE_WINDOW && refs[i])
+            i++;
+
+        next = i;
+        while (next < ZRAN_DEFLATE_WINDOW &&
+               next - i < ZRAN_SPARSE_WINDOW_GAP &&
+               !refs[next])
+            next++;
+
+        if (next == ZRAN_DEFLATE_WINDOW || !refs[next])
+            break;
+
+        i = next;
+    }
+
+    *end = i;
+    return 1;
+}
+
+
+/* Pack the referenced bytes of a window. */
+uint32_t _zran_pack_sparse_window(zran_index_t *index,
+                                  uint8_t      *window,
+                                  uint8_t      *refs,
+                                  uint8_t      *buf) {
+
+    /*
+     * refs only covers the end of the window -
+     * anything before that can't be referenced.
+     */
+    uint32_t base    = index->window_size - ZRAN_DEFLATE_WINDOW;
+    uint32_t nranges = 0;
+    uint32_t nbytes  = 0;
+    uint32_t start;
+    uint32_t end;
+    uint32_t offset;
+    uint32_t length;
+    uint64_t packed_len;
+    uint8_t *ranges;
+    uint8_t *bytes;
+
+    end = 0;
+    while (_zran_next_ref_range(refs, &start, &end)) {
+        nranges++;
+        nbytes += end - start;
+    }
+
+    packed_len = sizeof(uint32_t) + 2 * sizeof(uint32_t) * nranges + nbytes;
+
+    if (packed_len >= index->window_size)
+        return 0;
+
+    memcpy(buf, &nranges, sizeof(uint32_t));
+
+    ranges = buf    + sizeof(uint32_t);
+    bytes  = ranges + 2 * sizeof(uint32_t) * nranges;
+
+    end = 0;
+    while (_zran_next_ref_range(refs, &start, &end)) {
+
+        offset = base + start;
+        length = end  - start;
+
+        memcpy(ranges,                    &offset, sizeof(uint32_t));
+        memcpy(ranges + sizeof(uint32_t), &length, sizeof(uint32_t));
+        memcpy(bytes, window + offset, length);
+
+        ranges += 2 * sizeof(uint32_t);
+        bytes  += length;
+    }
+
+    zran_log("_zran_pack_sparse_window(%u ranges, %u bytes)\n",
+             nranges, nbytes);
+
+    return (uint32_t)packed_len;
+}
+
+
+/* Unpack a sparse window. */
+int _zran_unpack_sparse_window(zran_index_t *index,
+                               uint8_t      *packed,
+                               uint32_t      len,
+                               uint8_t      *buf) {
+
+    uint32_t nranges;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t i;
+    uint64_t used;
+    uint8_t *ranges;
+    uint8_t *bytes;
+
+    if (len < sizeof(uint32_t))
+        return -1;
+
+    memcpy(&nranges, packed, sizeof(uint32_t));
+
+    used = sizeof(uint32_t) + 2 * sizeof(uint32_t) * (uint64_t)nranges;
+    if (used > len)
+        return -1;
+
+    ranges = packed + sizeof(uint32_t);
+    bytes  = packed + used;
+
+    memset(buf, 0, index->window_size);
+
+    for (i = 0; i < nranges; i++) {
+
+        memcpy(&offset, ranges,                    sizeof(uint32_t));
+        memcpy(&length, ranges + sizeof(uint32_t), sizeof(uint32_t));
+
+        if ((uint64_t)offset + length > index->window_size) return -1;
+        if (used + length > len)                            return -1;
+
+        memcpy(buf + offset, bytes, length);
+
+        ranges += 2 * sizeof(uint32_t);
+        bytes  += length;
+        used   += length;
+    }
+
+    if (used != len)
+        return -1;
+
+    return 0;
+}
+
+
+/* Stores a copy of the given window in the index arena. */
+uint8_t * _zran_store_window(zran_index_t *index,
+                             uint8_t      *window,
+                             uint8_t      *refs) {
+
+    uint8_t *stored;
+    uint8_t *packed;
+    uint32_t len;
+
+    if (!window_has_header(index)) {
+        stored = zran_arena_alloc(&(index->arena), index->window_size);
+        if (stored == NULL)
+            return NULL;
+        memcpy(stored, window, index->window_size);
+        return stored;
+    }
+
+    /*
+     * The packed window is written into the second
+     * part of the scratch buffer (the first part
+     * may contain the window).
+     */
+    if (refs != NULL && (index->flags & ZRAN_SPARSE_WINDOWS)) {
+
+        if (_zran_window_buf(index) == NULL)
+            return NULL;
+
+        packed = index->window_buf + index->window_size;
+        len    = _zran_pack_sparse_window(index, window, refs, packed);
+
+        if (len > 0)
+            return _zran_store_encoded_window(index,
+                                              packed,
+                                              len,
+                                              ZRAN_WINDOW_SPARSE);
+    }
+
+    return _zran_store_encoded_window(index, window, index->window_size, 0);
+}
+
+
+/* Stores an encoded window in the index arena. */
+uint8_t * _zran_store_encoded_window(zran_index_t *index,
+                                     uint8_t      *data,
+                                     uint32_t      len,
+                                     uint8_t       flags) {
+
+    uint8_t *cmpbuf;
+    uLongf   cmplen;
+
+    /*
+     * If compression doesn't help, the
+     * window is stored uncompressed. The
+     * compressed data is written into the
+     * third part of the scratch buffer.
+     */
+    if (index->flags & ZRAN_COMPRESS_WINDOWS) {
+
+        if (_zran_window_buf(index) == NULL)
+            return NULL;
+
+        cmpbuf = index->window_buf + 2 * index->window_size;
+        cmplen = compressBound(index->window_size);
+
+        if (compress2(cmpbuf, &cmplen, data, len, Z_BEST_SPEED) == Z_OK &&
+            cmplen < len) {
+            data   = cmpbuf;
+            len    = cmplen;
+            flags |= ZRAN_WINDOW_DEFLATED;
+        }
+    }
+
+    zran_log("_zran_store_encoded_window(%u -> %u, %u)\n",
+             index->window_size, len, flags);
+
+    return _zran_store_window_data(index, data, len, flags);
+}
+
+
+/* Stores encoded window data in the index arena. */
+uint8_t * _zran_store_window_data(zran_index_t *index,
+                                  uint8_t      *data,
+                                  uint32_t      len,
+                                  uint8_t       flags) {
+
+    uint8_t *stored;
+
+    stored = zran_arena_alloc(&(index->arena), ZRAN_WINDOW_HEADER_SIZE + len);
+    if (stored == NULL)
+        return NULL;
+
+    memset(stored, 0, ZRAN_WINDOW_HEADER_SIZE);
+    memcpy(stored, &len, sizeof(uint32_t));
+    stored[sizeof(uint32_t)] = flags;
+
+    memcpy(stored + ZRAN_WINDOW_HEADER_SIZE, data, len);
+
+    return stored;
+}
+
+
+/* Returns the encoded form of a stored window. */
+uint8_t * _zran_encoded_window(zran_index_t *index,
+                               uint8_t      *data,
+                               uint8_t      *buf,
+                               uint32_t     *len,
+                               uint8_t      *flags) {
+
+    zran_mapped_window_t *mapped = _zran_mapped_window(index, data);
+    uLongf                outlen = index->window_size;
+
+    /*
+     * Mapped windows are described by their
+     * record, rather than by a header.
+     */
+    if (mapped != NULL) {
+
+        *len   = mapped->len;
+        *flags = ((mapped->flags & 3) == 2) ? ZRAN_WINDOW_SPARSE : 0;
+
+        if (!(mapped->flags & ZRAN_COMPACT_DEFLATED))
+            return mapped->record;
+
+        if (uncompress(buf, &outlen, mapped->record, mapped->len) != Z_OK)
+            return NULL;
+
+        *len = outlen;
+        return buf;
+    }
+
+    if (!window_has_header(index)) {
+        *len   = index->window_size;
+        *flags = 0;
+        return data;
+    }
+
+    memcpy(len, data, sizeof(uint32_t));
+    *flags = data[sizeof(uint32_t)];
+
+    if (!(*flags & ZRAN_WINDOW_DEFLATED))
+        return data + ZRAN_WINDOW_HEADER_SIZE;
+
+    if (uncompress(buf,
+                   &outlen,
+                   data + ZRAN_WINDOW_HEADER_SIZE,
+                   *len) != Z_OK)
+        return NULL;
+
+    *len    = outlen;
+    *flags &= ~ZRAN_WINDOW_DEFLATED;
+
+    return buf;
+}
+
+
+/* Returns non-zero if a stored window is sparse. */
+int _zran_window_is_sparse(zran_index_t *index, uint8_t *data) {
+
+    zran_mapped_window_t *mapped = _zran_mapped_window(index, data);
+
+    if (mapped != NULL)
+        return (mapped->flags & 3) == 2;
+
+    if (data == NULL || !window_has_header(index))
+        return 0;
+
+    return (data[sizeof(uint32_t)] & ZRAN_WINDOW_SPARSE) != 0;
+}
+
+
+/* Decodes a stored window into buf. */
+int _zran_inflate_window(zran_index_t *index, uint8_t *data, uint8_t *buf) {
+
+    zran_mapped_window_t *mapped;
+
+    uint8_t *tmp = NULL;
+    uint8_t *encoded;
+    uint32_t len;
+    uint8_t  flags;
+    int      ret = -1;
+
+    /*
+     * A compressed sparse window needs to be
+     * decompressed somewhere other than buf,
+     * so that it can be unpacked into buf.
+     */
+    mapped = _zran_mapped_window(index, data);
+
+    if (mapped != NULL) {
+        flags = 0;
+        if (mapped->flags & ZRAN_COMPACT_DEFLATED)
+            flags |= ZRAN_WINDOW_DEFLATED;
+        if ((mapped->flags & 3) == 2)
+            flags |= ZRAN_WINDOW_SPARSE;
+    }
+    else if (window_has_header(index)) {
+        flags = data[sizeof(uint32_t)];
+    }
+    else {
+        flags = 0;
+    }
+
+    if ((flags & ZRAN_WINDOW_DEFLATED) && (flags & ZRAN_WINDOW_SPARSE)) {
+        tmp = malloc(index->window_size);
+        if (tmp == NULL)
+            return -1;
+    }
+
+    encoded = _zran_encoded_window(index,
+                                   data,
+                                   (tmp != NULL) ? tmp : buf,
+                                   &len,
+                                   &flags);
+
+    if (encoded == NULL)
+        goto done;
+
+    if (flags & ZRAN_WINDOW_SPARSE) {
+        ret = _zran_unpack_sparse_window(index, encoded, len, buf);
+    }
+    else if (len == index->window_size) {
+        if (encoded != buf)
+            memcpy(buf, encoded, len);
+        ret = 0;
+    }
+
+done:
+    free(tmp);
+    return ret;
+}
+
+
+/* Returns the size of a stored window. */
+size_t _zran_stored_window_size(zran_index_t *index, uint8_t *data) {
+
+    uint32_t len;
+
+    if (!window_has_header(index))
+        return index->window_size;
+
+    memcpy(&len, data, sizeof(uint32_t));
+
+    return ZRAN_WINDOW_HEADER_SIZE + len;
+}
+
+
+/* Find an entry in the window table. */
+zran_window_entry_t * _zran_find_window_entry(zran_index_t *index,
+                                              uint8_t      *data,
+                                              uint32_t      hash,
+                                              uint8_t       by_content) {
+
+    zran_window_entry_t *entry;
+    uint32_t             mask;
+    uint32_t             slot;
+    size_t               size;
+
+    if (index->window_table_size == 0)
+        return NULL;
+
+    mask = index->window_table_size - 1;
+    size = _zran_stored_window_size(index, data);
+
+    for (slot = hash & mask;; slot = (slot + 1) & mask) {
+
+        entry = &(index->window_table[slot]);
+
+        if (entry->data == NULL)
+            return NULL;
+
+        if (entry->data == data)
+            return entry;
+
+        if (by_content                                         &&
+            entry->hash == hash                                &&
+            _zran_stored_window_size(index, entry->data) == size &&
+            memcmp(entry->data, data, size) == 0)
+            return entry;
+    }
+}
+
+
+/* Returns the window table entry for some stored window data. */
+zran_window_entry_t * _zran_get_window_entry(zran_index_t *index,
+                                             uint8_t      *data) {
+
+    uint32_t hash;
+
+    /* Mapped windows are not in the table */
+    if (_zran_mapped_window(index, data) != NULL)
+        return NULL;
+
+    hash = crc32(0, data, _zran_stored_window_size(index, data));
+
+    return _zran_find_window_entry(index, data, hash, 0);
+}
+
+
+/* Returns the mapped window for some window data, if it is one. */
+zran_mapped_window_t * _zran_mapped_window(zran_index_t *index,
+                                           uint8_t      *data) {
+
+    uintptr_t start = (uintptr_t)index->mapped_windows;
+    uintptr_t end   = start + index->nmapped * sizeof(zran_mapped_window_t);
+
+    if (start == 0 || (uintptr_t)data < start || (uintptr_t)data >= end)
+        return NULL;
+
+    return (zran_mapped_window_t *)data;
+}
+
+
+/* Returns the first point which uses some window data. */
+uint32_t _zran_window_owner(zran_index_t *index,
+                            uint8_t      *data,
+                            uint32_t      point) {
+
+    zran_mapped_window_t *mapped = _zran_mapped_window(index, data);
+    zran_window_entry_t  *entry;
+
+    if (mapped != NULL)
+        return mapped->owner;
+
+    entry = _zran_get_window_entry(index, data);
+
+    if (entry != NULL)
+        return entry->owner;
+
+    return point;
+}
+
+
+/* Resize the window table. */
+int _zran_resize_window_table(zran_index_t *index, uint32_t size) {
+
+    zran_window_entry_t *old_table = index->window_table;
+    uint32_t             old_size  = index->window_table_size;
+    zran_window_entry_t *table;
+    uint32_t             slot;
+    uint32_t             i;
+
+    table = calloc(size, sizeof(zran_window_entry_t));
+    if (table == NULL)
+        return -1;
+
+    for (i = 0; i < old_size; i++) {
+
+        if (old_table[i].data == NULL)
+            continue;
+
+        slot = old_table[i].hash & (size - 1);
+        while (table[slot].data != NULL)
+            slot = (slot + 1) & (size - 1);
+
+        table[slot] = old_table[i];
+    }
+
+    free(old_table);
+
+    index->window_table      = table;
+    index->window_table_size = size;
+
+    return 0;
+}
+
+
+/* Remove an entry from the window table. */
+void _zran_remove_window_entry(zran_index_t        *index,
+                               zran_window_entry_t *entry) {
+
+    uint32_t mask = index->window_table_size - 1;
+    uint32_t i    = entry - index->window_table;
+    uint32_t j    = i;
+    uint32_t home;
+    size_t   size = _zran_stored_window_size(index, entry->data);
+
+    index->window_bytes -= size;
+    atomic_sub_u64(&zran_global_bytes, size);
+
+    /*
+     * Entries which follow the removed entry
+     * are shifted back into the gap, unless
+     * that would move them before their home
+     * slot (the slot their hash maps to) -
+     * this keeps the probe sequences intact.
+     */
+    while (1) {
+
+        j = (j + 1) & mask;
+
+        if (index->window_table[j].data == NULL)
+            break;
+
+        home = index->window_table[j].hash & mask;
+
+        if (i <= j) { if (i < home && home <= j) continue; }
+        else        { if (i < home || home <= j) continue; }
+
+        index->window_table[i] = index->window_table[j];
+        i                      = j;
+    }
+
+    memset(&(index->window_table[i]), 0, sizeof(zran_window_entry_t));
+    index->window_table_count--;
+}
+
+
+/* Share a newly stored window with any identical window. */
+uint8_t * _zran_share_window(zran_index_t *index,
+                             uint8_t      *stored,
+                             uint32_t      point) {
+
+    zran_window_entry_t *entry;
+    uint32_t             hash;
+    uint32_t             slot;
+
+    hash  = crc32(0, stored, _zran_stored_window_size(index, stored));
+    entry = _zran_find_window_entry(index, stored, hash, 1);
+
+    if (entry != NULL) {
+
+        zran_log("_zran_share_window(%u): sharing window of point %u\n",
+                 point, entry->owner);
+
+        zran_arena_rewind(&(index->arena), stored);
+        entry->refcount++;
+        return entry->data;
+    }
+
+    /* Keep the table at most half full */
+    if (2 * (index->window_table_count + 1) > index->window_table_size) {
+        if (_zran_resize_window_table(
+                index, max(16, 2 * index->window_table_size)) != 0)
+            return NULL;
+    }
+
+    slot = hash & (index->window_table_size - 1);
+    while (index->window_table[slot].data != NULL)
+        slot = (slot + 1) & (index->window_table_size - 1);
+
+    entry           = &(index->window_table[slot]);
+    entry->data     = stored;
+    entry->hash     = hash;
+    entry->refcount = 1;
+    entry->owner    = point;
+    entry->used     = 0;
+
+    index->window_table_count++;
+    index->window_bytes += _zran_stored_window_size(index, stored);
+    atomic_add_u64(&zran_global_bytes,
+                   _zran_stored_window_size(index, stored));
+
+    return stored;
+}
+
+
+/* Release the windows of all points from the given point onwards. */
+void _zran_release_windows(zran_index_t *index, uint32_t from) {
+
+    zran_window_entry_t *entry;
+    uint8_t             *rewind = NULL;
+    uint8_t             *data;
+    uint32_t             i;
+
+    for (i = from; i < index->npoints; i++) {
+
+        data = index->windows[i];
+        if (data == NULL)
+            continue;
+
+        entry = _zran_get_window_entry(index, data);
+
+        if (entry != NULL)
+            entry->refcount--;
+    }
+
+    /*
+     * Windows are allocated from the arena in the
+     * order of the points that own them, so the
+     * first window which is no longer used by any
+     * point is the earliest allocation that can be
+     * released, and everything after it can also
+     * be released.
+     */
+    for (i = from; i < index->npoints; i++) {
+
+        data = index->windows[i];
+        if (data == NULL)
+            continue;
+
+        entry = _zran_get_window_entry(index, data);
+
+        if (entry != NULL && entry->refcount == 0) {
+            if (rewind == NULL)
+                rewind = data;
+            _zran_remove_window_entry(index, entry);
+        }
+
+        index->windows[i] = NULL;
+    }
+
+    zran_arena_rewind(&(index->arena), rewind);
+}
+
+
+/* Frees the window table. */
+void _zran_free_window_table(zran_index_t *index) {
+
+    free(index->window_table);
+    atomic_sub_u64(&zran_global_bytes, index->window_bytes);
+
+    index->window_table       = NULL;
+    index->window_table_size  = 0;
+    index->window_table_count = 0;
+    index->window_bytes       = 0;
+}
+
+
+/* Returns non-0 if the index is over its window budget. */
+int _zran_window_budget_exceeded(zran_index_t *index, uint8_t target) {
+
+    uint64_t budget;
+
+    budget = index->window_budget;
+    if (budget > 0) {
+        if (target) budget -= budget / 8;
+        if (index->window_bytes > budget)
+            return 1;
+    }
+
+    budget = atomic_load_u64(&zran_global_budget);
+    if (budget > 0) {
+        if (target) budget -= budget / 8;
+        if (atomic_load_u64(&zran_global_bytes) > budget)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/* Compare two window references by owner. */
+int _zran_cmp_window_owner(const void *a, const void *b) {
+
+    uint32_t oa = ((const zran_window_ref_t *)a)->owner;
+    uint32_t ob = ((const zran_window_ref_t *)b)->owner;
+
+    return (oa > ob) - (oa < ob);
+}
+
+
+/* Compare two window references by window data location. */
+int _zran_cmp_window_data(const void *a, const void *b) {
+
+    uintptr_t da = (uintptr_t)((const zran_window_ref_t *)a)->data;
+    uintptr_t db = (uintptr_t)((const zran_window_ref_t *)b)->data;
+
+    return (da > db) - (da < db);
+}
+
+
+/* Evict windows until the index is back within its budget. */
+int _zran_enforce_window_budget(zran_index_t *index) {
+
+    zran_window_entry_t *entry;
+    zran_window_ref_t   *cands    = NULL;
+    uint32_t             ncands;
+    uint32_t             nevicted = 0;
+    uint32_t             i;
+    uint8_t              pass;
+
+    if (!_zran_window_budget_exceeded(index, 0))
+        return 0;
+
+    cands = malloc(max(1, index->window_table_count) *
+                   sizeof(zran_window_ref_t));
+    if (cands == NULL)
+        goto fail;
+
+    /*
+     * Windows which have been used since the last
+     * eviction are given a second chance - they
+     * are skipped (and their used flag cleared)
+     * on the first pass, and only evicted on the
+     * second pass if that is still necessary.
+     */
+    for (pass = 0;
+         pass < 2 && _zran_window_budget_exceeded(index, 1);
+         pass++) {
+
+        /*
+         * Shared windows, and the window of the
+         * last point (needed to expand the index)
+         * are kept.
+         */
+        ncands = 0;
+        for (i = 0; i < index->window_table_size; i++) {
+
+            entry = &(index->window_table[i]);
+
+            if (entry->data     == NULL ||
+                entry->refcount != 1    ||
+                entry->owner    == index->npoints - 1)
+                continue;
+
+            if (entry->used && pass == 0) {
+                entry->used = 0;
+                continue;
+            }
+
+            cands[ncands].data  = entry->data;
+            cands[ncands].hash  = entry->hash;
+            cands[ncands].owner = entry->owner;
+            ncands++;
+        }
+
+        qsort(cands,
+              ncands,
+              sizeof(zran_window_ref_t),
+              _zran_cmp_window_owner);
+
+        /*
+         * The windows of points which are a multiple
+         * of evict_stride are kept, and the others
+         * are evicted. If that is not enough, the
+         * stride is doubled, so that the remaining
+         * windows stay evenly spread out.
+         */
+        while (_zran_window_budget_exceeded(index, 1)) {
+
+            for (i = 0; i < ncands; i++) {
+
+                if (!_zran_window_budget_exceeded(index, 1))
+                    break;
+
+                if (cands[i].data == NULL ||
+                    cands[i].owner % index->evict_stride == 0)
+                    continue;
+
+                zran_log("_zran_enforce_window_budget: evicting window "
+                         "of point %u\n", cands[i].owner);
+
+                entry = _zran_find_window_entry(index,
+                                                cands[i].data,
+                                                cands[i].hash,
+                                                0);
+                _zran_remove_window_entry(index, entry);
+                _zran_set_point_evicted(index, cands[i].owner);
+
+                index->windows[cands[i].owner] = NULL;
+                cands[i].data                  = NULL;
+
+                nevicted++;
+            }
+
+            if (!_zran_window_budget_exceeded(index, 1) ||
+                index->evict_stride >= index->npoints)
+                break;
+
+            index->evict_stride *= 2;
+        }
+    }
+
+    free(cands);
+    cands = NULL;
+
+    /*
+     * Evicted windows are still taking up space
+     * in the arena, so the remaining windows are
+     * moved into a new one.
+     */
+    if (nevicted > 0 && _zran_compact_windows(index) != 0)
+        goto fail;
+
+    return 0;
+
+fail:
+    free(cands);
+    return -1;
+}
+
+
+/* Move all stored windows into a new arena. */
+int _zran_compact_windows(zran_index_t *index) {
+
+    zran_arena_t       arena;
+    zran_window_ref_t *refs  = NULL;
+    zran_window_ref_t *ref;
+    zran_window_ref_t  key;
+    uint32_t           nrefs = 0;
+    uint32_t           i;
+    size_t             size;
+
+    zran_log("_zran_compact_windows(%llu bytes)\n", index->window_bytes);
+
+    zran_arena_init(&arena,
+                    index->arena.chunk_size,
+                    index->arena.huge_pages);
+
+    refs = malloc(max(1, index->window_table_count) *
+                  sizeof(zran_window_ref_t));
+    if (refs == NULL)
+        goto fail;
+
+    for (i = 0; i < index->window_table_size; i++) {
+
+        if (index->window_table[i].data == NULL)
+            continue;
+
+        refs[nrefs].data  = index->window_table[i].data;
+        refs[nrefs].owner = index->window_table[i].owner;
+        refs[nrefs].slot  = i;
+        nrefs++;
+    }
+
+    /*
+     * Windows must stay in point order
+     * (see _zran_release_windows).
+     */
+    qsort(refs, nrefs, sizeof(zran_window_ref_t), _zran_cmp_window_owner);
+
+    for (i = 0; i < nrefs; i++) {
+
+        size          = _zran_stored_window_size(index, refs[i].data);
+        refs[i].moved = zran_arena_alloc(&arena, size);
+
+        if (refs[i].moved == NULL)
+            goto fail;
+
+        memcpy(refs[i].moved, refs[i].data, size);
+    }
+
+    /*
+     * Nothing can fail from here on. Point the
+     * window table and all points which use
+     * each window to its new location.
+     */
+    for (i = 0; i < nrefs; i++)
+        index->window_table[refs[i].slot].data = refs[i].moved;
+
+    qsort(refs, nrefs, sizeof(zran_window_ref_t), _zran_cmp_window_data);
+
+    for (i = 0; i < index->npoints; i++) {
+
+        if (index->windows[i] == NULL)
+            continue;
+
+        key.data = index->windows[i];
+        ref      = bsearch(&key,
+                           refs,
+                           nrefs,
+                           sizeof(zran_window_ref_t),
+                           _zran_cmp_window_data);
+
+        if (ref != NULL)
+            index->windows[i] = ref->moved;
+    }
+
+    zran_arena_free(&(index->arena));
+    free(refs);
+
+    index->arena = arena;
+    index->generation++;
+
+    return 0;
+
+fail:
+    zran_arena_free(&arena);
+    free(refs);
+    return -1;
+}
+
+
+/* Re-create the window of point i. */
+int _zran_regenerate_window(zran_index_t *index, uint32_t i, uint8_t *buf) {
+
+    zran_reader_t reader;
+    uint64_t      offset = index->uncmp_offsets[i];
+    uint64_t      len    = index->window_size;
+    int           ret    = -1;
+
+    zran_log("_zran_regenerate_window(%u)\n", i);
+
+    /*
+     * Data before the start of the
+     * file is never referenced.
+     */
+    if (offset < len)
+        len = offset;
+
+    memset(buf, 0, index->window_size - len);
+
+    /*
+     * A separate reader is used, so that
+     * the inflation cursor of the index
+     * reader is not disturbed.
+     */
+    _zran_init_reader(&reader, index, index->fd, index->f);
+
+    if (_zran_seek(&reader, offset - len, SEEK_SET, NULL) != ZRAN_SEEK_OK)
+        goto cleanup;
+
+    if (len > 0 &&
+        _zran_read(&reader,
+                   buf + index->window_size - len,
+                   len) != (int64_t)len)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    _zran_free_cursor(&reader);
+    _zran_free_window_cache(&reader);
+    return ret;
+}
+
+
+/* Returns the uncompressed window for the given stored window data. */
+uint8_t * _zran_load_window(zran_reader_t *reader, uint8_t *data) {
+
+    zran_index_t         *index = reader->index;
+    zran_mapped_window_t *mapped;
+    uint32_t              i;
+    uint32_t              lru;
+
+    if (data == NULL)
+        return NULL;
+
+    mapped = _zran_mapped_window(index, data);
+
+    /*
+     * Stored (or mapped) as-is - no need to
+     * cache it. The window is read straight
+     * from the mapped file.
+     */
+    if (mapped != NULL) {
+        if (mapped->flags == 1)
+            return mapped->record;
+    }
+    else if (!window_has_header(index)) {
+        return data;
+    }
+    else if (data[sizeof(uint32_t)] == 0) {
+        return data + ZRAN_WINDOW_HEADER_SIZE;
+    }
+
+    /*
+     * Window data pointers may have been re-used
+     * (and the window size may have changed) if
+     * points have been removed from the index
+     * since the cache was last used.
+     */
+    if (reader->window_cache_generation != index->generation) {
+        _zran_free_window_cache(reader);
+        reader->window_cache_generation = index->generation;
+    }
+
+    reader->window_cache_clock++;
+
+    /* Cache hit? Otherwise find the least recently used entry. */
+    lru = 0;
+    for (i = 0; i < ZRAN_WINDOW_CACHE_SIZE; i++) {
+
+        if (reader->window_cache_keys[i] == data) {
+            reader->window_cache_used[i] = reader->window_cache_clock;
+            return reader->window_cache[i];
+        }
+
+        if (reader->window_cache_used[i] < reader->window_cache_used[lru])
+            lru = i;
+    }
+
+    zran_log("_zran_load_window: cache miss, replacing entry %u\n", lru);
+
+    if (reader->window_cache[lru] == NULL) {
+        reader->window_cache[lru] = malloc(index->window_size);
+        if (reader->window_cache[lru] == NULL)
+            return NULL;
+    }
+
+    reader->window_cache_keys[lru] = NULL;
+
+    if (_zran_inflate_window(index, data, reader->window_cache[lru]) != 0)
+        return NULL;
+
+    reader->window_cache_keys[lru] = data;
+    reader->window_cache_used[lru] = reader->window_cache_clock;
+
+    return reader->window_cache[lru];
+}
+
+
+/* Frees the decompressed window cache of a reader. */
+void _zran_free_window_cache(zran_reader_t *reader) {
+
+    uint32_t i;
+
+    for (i = 0; i < ZRAN_WINDOW_CACHE_SIZE; i++) {
+        free(reader->window_cache[i]);
+        reader->window_cache[i]      = NULL;
+        reader->window_cache_keys[i] = NULL;
+        reader->window_cache_used[i] = 0;
+    }
+}
+
+
+/* Copies the uncompressed window of point i into buf. */
+int zran_get_window(zran_index_t *index, uint32_t i, uint8_t *buf) {
+
+    uint8_t *data;
+
+    if (i >= index->npoints)
+        return -1;
+
+    data = index->windows[i];
+
+    if (data == NULL)
+        return -1;
+
+    return _zran_inflate_window(index, data, buf);
+}
+
+
+/* Set the window budget of an index. */
+int zran_set_window_budget(zran_index_t *index, uint64_t budget) {
+
+    zran_log("zran_set_window_budget(%llu)\n", budget);
+
+    index->window_budget = budget;
+
+    return _zran_enforce_window_budget(index);
+}
+
+
+/* Set the window budget for all indexes. */
+void zran_set_global_window_budget(uint64_t budget) {
+
+    atomic_store_u64(&zran_global_budget, budget);
+}
+
+
+/* Return the number of window bytes stored by all indexes. */
+uint64_t zran_global_window_bytes(void) {
+
+    return atomic_load_u64(&zran_global_bytes);
+}
+
+
+/* Hash a span cache key. */
+uint32_t _zran_span_cache_bucket(uint64_t key, uint64_t start) {
+
+    uint64_t hash = (key * 0x9E3779B97F4A7C15ULL) ^ start;
+
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+
+    return (uint32_t)(hash % ZRAN_SPAN_CACHE_BUCKETS);
+}
+
+
+/* Find a span in a cache. */
+zran_span_entry_t * _zran_span_cache_find(zran_span_cache_t *cache,
+                                          uint64_t           key,
+                                          uint64_t           start) {
+
+    zran_span_entry_t *entry;
+
+    entry = cache->buckets[_zran_span_cache_bucket(key, start)];
+
+    while (entry != NULL && (entry->key != key || entry->start != start))
+        entry = entry->chain;
+
+    return entry;
+}
+
+
+/* Move an entry to the front of the list. */
+void _zran_span_cache_touch(zran_span_cache_t *cache,
+                            zran_span_entry_t *entry) {
+
+    if (entry == cache->newest)
+        return;
+
+    entry->newer->older = entry->older;
+    if (entry->older != NULL) entry->older->newer = entry->newer;
+    else                      cache->oldest       = entry->newer;
+
+    entry->newer         = NULL;
+    entry->older         = cache->newest;
+    cache->newest->newer = entry;
+    cache->newest        = entry;
+}
+
+
+/* Add a span to a cache, evicting old spans as needed. */
+int _zran_span_cache_add(zran_span_cache_t *cache,
+                         uint64_t           key,
+                         uint64_t           start,
+                         uint64_t           len,
+                         uint8_t           *data) {
+
+    zran_span_entry_t *entry;
+    uint64_t           budget = atomic_load_u64(&cache->budget);
+    uint32_t           bucket = _zran_span_cache_bucket(key, start);
+
+    if (len > budget / ZRAN_SPAN_CACHE_MAX_FRACTION)
+        return -1;
+
+    while (cache->oldest != NULL && cache->bytes + len > budget)
+        _zran_span_cache_remove(cache, cache->oldest);
+
+    entry = calloc(1, sizeof(zran_span_entry_t));
+    if (entry == NULL)
+        return -1;
+
+    entry->key   = key;
+    entry->start = start;
+    entry->len   = len;
+    entry->data  = data;
+    entry->chain = cache->buckets[bucket];
+    entry->older = cache->newest;
+
+    if (cache->newest != NULL) cache->newest->newer = entry;
+    else                       cache->oldest        = entry;
+
+    cache->buckets[bucket] = entry;
+    cache->newest          = entry;
+    cache->bytes          += len;
+    cache->nspans         += 1;
+
+    return 0;
+}
+
+
+/* Copy data from a span in the memory cache, if it is present. */
+int _zran_span_cache_copy(uint64_t  id,
+                          uint64_t  start,
+                          uint64_t  pos,
+                          uint8_t  *buf,
+                          uint64_t  len) {
+
+    zran_span_entry_t *entry;
+
+    zran_span_cache_acquire();
+
+    entry = _zran_span_cache_find(&zran_span_cache, id, start);
+
+    if (entry == NULL || pos + len > entry->start + entry->len) {
+        zran_span_cache.misses++;
+        zran_span_cache_release();
+        return 0;
+    }
+
+    zran_span_cache.hits++;
+    memcpy(buf, entry->data + (pos - start), len);
+    _zran_span_cache_touch(&zran_span_cache, entry);
+
+    zran_span_cache_release();
+    return 1;
+}
+
+
+/* Add a span to the memory cache. */
+void _zran_span_cache_insert(uint64_t  id,
+                             uint64_t  start,
+                             uint64_t  len,
+                             uint8_t  *data) {
+
+    zran_span_entry_t *entry;
+    int                ret = -1;
+
+    zran_span_cache_acquire();
+
+    /*
+     * Another thread may have added
+     * the span since we looked for it
+     */
+    entry = _zran_span_cache_find(&zran_span_cache, id, start);
+
+    if (entry != NULL && entry->len < len) {
+        _zran_span_cache_remove(&zran_span_cache, entry);
+        entry = NULL;
+    }
+
+    if (entry == NULL)
+        ret = _zran_span_cache_add(&zran_span_cache, id, start, len, data);
+
+    zran_span_cache_release();
+
+    if (ret != 0)
+        free(data);
+}
+
+
+/* Remove an entry from a cache. */
+void _zran_span_cache_remove(zran_span_cache_t *cache,
+                             zran_span_entry_t *entry) {
+
+    zran_span_entry_t **link;
+    char               *path;
+
+    link = &(cache->buckets[_zran_span_cache_bucket(entry->key,
+                                                    entry->start)]);
+
+    while (*link != entry)
+        link = &((*link)->chain);
+
+    *link = entry->chain;
+
+    if (entry->newer != NULL) entry->newer->older = entry->older;
+    else                      cache->newest       = entry->older;
+    if (entry->older != NULL) entry->older->newer = entry->newer;
+    else                      cache->oldest       = entry->newer;
+
+    cache->bytes  -= entry->len;
+    cache->nspans -= 1;
+
+    if (cache->dir != NULL) {
+        path = _zran_disk_cache_path(entry->key, entry->start);
+        if (path != NULL)
+            remove(path);
+        free(path);
+    }
+
+    free(entry->data);
+    free(entry);
+}
+
+
+/* Remove all entries from a cache. */
+void _zran_span_cache_clear(zran_span_cache_t *cache) {
+
+    zran_span_entry_t *entry;
+    zran_span_entry_t *older;
+
+    for (entry = cache->newest; entry != NULL; entry = older) {
+        older = entry->older;
+        free(entry->data);
+        free(entry);
+    }
+
+    memset(cache->buckets, 0, sizeof(cache->buckets));
+
+    cache->newest = NULL;
+    cache->oldest = NULL;
+    cache->bytes  = 0;
+    cache->nspans = 0;
+}
+
+
+/* Remove all of the spans of one index from the memory cache. */
+void _zran_span_cache_purge(uint64_t id) {
+
+    zran_span_entry_t *entry;
+    zran_span_entry_t *older;
+
+    zran_span_cache_acquire();
+
+    entry = zran_span_cache.newest;
+    while (entry != NULL) {
+        older = entry->older;
+        if (entry->key == id)
+            _zran_span_cache_remove(&zran_span_cache, entry);
+        entry = older;
+    }
+
+    zran_span_cache_release();
+}
+
+
+/* Set the budget of the memory cache. */
+void zran_set_span_cache_budget(uint64_t budget) {
+
+    zran_log("zran_set_span_cache_budget(%llu)\n", budget);
+
+    zran_span_cache_acquire();
+
+    atomic_store_u64(&zran_span_cache.budget, budget);
+
+    while (zran_span_cache.oldest != NULL &&
+           zran_span_cache.bytes > budget) {
+        _zran_span_cache_remove(&zran_span_cache, zran_span_cache.oldest);
+    }
+
+    zran_span_cache_release();
+}
+
+
+/* Identify a file by its identity, size and contents. */
+uint64_t _zran_disk_key(zran_reader_t *reader) {
+
+    uint8_t  sample[ZRAN_DISK_KEY_SAMPLE];
+    uint64_t values[7];
+    uint64_t hash = 0;
+    uint64_t size;
+    int64_t  pos;
+    size_t   nread;
+    uint32_t i;
+#ifdef _WIN32
+    struct _stat64 st;
+#else
+    struct stat    st;
+#endif
+
+    if (reader->fd == NULL)
+        return ZRAN_DISK_KEY_NONE;
+
+#ifdef _WIN32
+    if (_fstat64(_fileno(reader->fd), &st) != 0)
+        return ZRAN_DISK_KEY_NONE;
+#else
+    if (fstat(fileno(reader->fd), &st) != 0)
+        return ZRAN_DISK_KEY_NONE;
+#endif
+
+    size      = st.st_size;
+    values[0] = (uint64_t)st.st_dev;
+    values[1] = (uint64_t)st.st_ino;
+    values[2] = (uint64_t)st.st_mtime;
+    values[3] = size;
+
+    /*
+     * Use the sub-second part of the modification
+     * time where it is available, so that a file
+     * which is re-written within the same second
+     * gets a different key.
+     */
+#if defined(__APPLE__)
+    values[4] = (uint64_t)st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+    values[4] = 0;
+#else
+    values[4] = (uint64_t)st.st_mtim.tv_nsec;
+#endif
+
+    pos = _zran_ftell(reader);
+    if (pos < 0)
+        return ZRAN_DISK_KEY_NONE;
+
+    /* First and last bytes of the file */
+    for (i = 0; i < 2; i++) {
+
+        if (i == 0 || size <= ZRAN_DISK_KEY_SAMPLE) {
+            if (_zran_fseek(reader, 0) != 0)
+                return ZRAN_DISK_KEY_NONE;
+        }
+        else if (_zran_fseek(reader, size - ZRAN_DISK_KEY_SAMPLE) != 0) {
+            return ZRAN_DISK_KEY_NONE;
+        }
+
+        nread = _zran_fread(reader, sample, ZRAN_DISK_KEY_SAMPLE);
+
+        if (_zran_ferror(reader)) {
+            clearerr(reader->fd);
+            _zran_fseek(reader, pos);
+            return ZRAN_DISK_KEY_NONE;
+        }
+
+        values[5 + i] = crc32(crc32(0L, Z_NULL, 0), sample, (uInt)nread);
+    }
+
+    if (_zran_fseek(reader, pos) != 0)
+        return ZRAN_DISK_KEY_NONE;
+
+    for (i = 0; i < 7; i++) {
+        hash  = (hash ^ values[i]) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 33;
+        hash *= 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 33;
+    }
+
+    /* 0 means that the key is not known */
+    if (hash == 0 || hash == ZRAN_DISK_KEY_NONE)
+        hash = 1;
+
+    return hash;
+}
+
+
+/* Allocate the path of a disk cache file. */
+char * _zran_disk_cache_path(uint64_t key, uint64_t start) {
+
+    char   *path;
+    size_t  dirlen = strlen(zran_disk_cache.dir);
+
+    path = malloc(dirlen + ZRAN_DISK_CACHE_NAME_LEN + 2);
+    if (path == NULL)
+        return NULL;
+
+    memcpy(path, zran_disk_cache.dir, dirlen);
+    path[dirlen] = '/';
+
+    sprintf(path + dirlen + 1,
+            ZRAN_DISK_CACHE_NAME_FORMAT,
+            (unsigned long long)key,
+            (unsigned long long)start);
+
+    return path;
+}
+
+
+/* Read a span from the disk cache, if it is present. */
+int _zran_disk_cache_load(uint64_t  key,
+                          uint64_t  start,
+                          uint8_t  *buf,
+                          uint64_t  len,
+                          uint32_t  crc) {
+
+    zran_span_entry_t *entry;
+    char              *path = NULL;
+    FILE              *fd;
+    int                hit  = 0;
+
+    zran_span_cache_acquire();
+
+    entry = _zran_span_cache_find(&zran_disk_cache, key, start);
+
+    if (entry != NULL && len <= entry->len) {
+        _zran_span_cache_touch(&zran_disk_cache, entry);
+        path = _zran_disk_cache_path(key, start);
+    }
+
+    zran_span_cache_release();
+
+    /*
+     * The file is read without holding
+     * the lock, so that other threads can
+     * use the caches in the meantime.
+     */
+    if (path != NULL) {
+        fd = fopen(path, "rb");
+        if (fd != NULL) {
+            hit = fread_(buf, 1, len, fd, NULL) == len;
+            fclose(fd);
+        }
+
+        /*
+         * The span file may be stale, or may
+         * belong to a different file which
+         * happens to have the same key.
+         */
+        if (hit && crc32(crc32(0L, Z_NULL, 0), buf, (uInt)len) != crc) {
+            zran_log("_zran_disk_cache_load: CRC mismatch in span "
+                     "%016llx-%016llx\n", key, start);
+            hit = 0;
+        }
+    }
+
+    zran_span_cache_acquire();
+
+    if (hit) {
+        zran_disk_cache.hits++;
+    }
+    else {
+        zran_disk_cache.misses++;
+
+        /*
+         * Forget about the file if it could not
+         * be read (e.g. if it has been deleted by
+         * another process which is using the same
+         * cache directory), or is invalid.
+         */
+        if (path != NULL) {
+            entry = _zran_span_cache_find(&zran_disk_cache, key, start);
+            if (entry != NULL)
+                _zran_span_cache_remove(&zran_disk_cache, entry);
+        }
+    }
+
+    zran_span_cache_release();
+
+    free(path);
+    return hit;
+}
+
+
+/* Write a span to the disk cache. */
+void _zran_disk_cache_store(uint64_t  key,
+                            uint64_t  start,
+                            uint64_t  len,
+                            uint8_t  *data) {
+
+    zran_span_entry_t *entry;
+    char              *path   = NULL;
+    char              *tmp    = NULL;
+    FILE              *fd     = NULL;
+    uint64_t           budget = atomic_load_u64(&zran_disk_cache.budget);
+    int                ok;
+
+    if (len > budget / ZRAN_SPAN_CACHE_MAX_FRACTION)
+        return;
+
+    zran_span_cache_acquire();
+
+    if (zran_disk_cache.dir != NULL) {
+        entry = _zran_span_cache_find(&zran_disk_cache, key, start);
+        if (entry == NULL || entry->len < len)
+            path = _zran_disk_cache_path(key, start);
+    }
+
+    zran_span_cache_release();
+
+    if (path == NULL)
+        return;
+
+    /*
+     * The span is written to a temporary file
+     * (named uniquely for this process and
+     * thread), which is then renamed over any
+     * existing file, so that other processes
+     * which share the cache directory never
+     * see a partial file.
+     */
+    tmp = malloc(strlen(path) + 64);
+    if (tmp == NULL)
+        goto cleanup;
+
+    sprintf(tmp, "%s.%lu.%llx.tmp",
+            path,
+            (unsigned long)zran_getpid(),
+            (unsigned long long)(uintptr_t)data);
+
+    fd = fopen(tmp, "wb");
+    if (fd == NULL)
+        goto cleanup;
+
+    ok = fwrite(data, 1, len, fd) == len;
+    ok = (fclose(fd) == 0) && ok;
+#ifdef _WIN32
+    ok = ok && MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && (rename(tmp, path) == 0);
+#endif
+
+    if (!ok) {
+        remove(tmp);
+        goto cleanup;
+    }
+
+    zran_span_cache_acquire();
+
+    /*
+     * If there was a shorter span, its entry
+     * now refers to the new file.
+     */
+    if (zran_disk_cache.dir != NULL) {
+        entry = _zran_span_cache_find(&zran_disk_cache, key, start);
+        if (entry == NULL) {
+            _zran_span_cache_add(&zran_disk_cache, key, start, len, NULL);
+        }
+        else {
+            zran_disk_cache.bytes += len - entry->len;
+            entry->len             = len;
+            _zran_span_cache_touch(&zran_disk_cache, entry);
+
+            while (zran_disk_cache.oldest != entry &&
+                   zran_disk_cache.bytes  >  budget)
+                _zran_span_cache_remove(&zran_disk_cache,
+                                        zran_disk_cache.oldest);
+        }
+    }
+
+    zran_span_cache_release();
+
+cleanup:
+    free(path);
+    free(tmp);
+}
+
+
+/* Order span files by modification time. */
+int _zran_cmp_disk_file(const void *a, const void *b) {
+
+    const zran_disk_file_t *fa = (const zran_disk_file_t *)a;
+    const zran_disk_file_t *fb = (const zran_disk_file_t *)b;
+
+    if (fa->mtime < fb->mtime) return -1;
+    if (fa->mtime > fb->mtime) return  1;
+    return 0;
+}
+
+
+/* Add the span files in the cache directory to the disk cache. */
+int _zran_disk_cache_scan(void) {
+
+    zran_disk_file_t   *files  = NULL;
+    zran_disk_file_t   *tmp;
+    uint32_t            nfiles = 0;
+    uint32_t            size   = 0;
+    uint32_t            i;
+    char                name[ZRAN_DISK_CACHE_NAME_LEN + 1];
+    const char         *fname;
+    unsigned long long  key;
+    unsigned long long  start;
+    uint64_t            len;
+    int64_t             mtime;
+
+#ifdef _WIN32
+    WIN32_FIND_DATAA    data;
+    HANDLE              handle;
+    char               *pattern;
+
+    pattern = malloc(strlen(zran_disk_cache.dir) + 8);
+    if (pattern == NULL)
+        return -1;
+
+    sprintf(pattern, "%s/*.span", zran_disk_cache.dir);
+    handle = FindFirstFileA(pattern, &data);
+    free(pattern);
+
+    if (handle == INVALID_HANDLE_VALUE) {
+        if (GetLastError() == ERROR_FILE_NOT_FOUND) return 0;
+        else                                        return -1;
+    }
+
+    do {
+        fname = data.cFileName;
+        len   = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+        mtime = ((int64_t)data.ftLastWriteTime.dwHighDateTime << 32) |
+                data.ftLastWriteTime.dwLowDateTime;
+#else
+    DIR                *dir;
+    struct dirent      *ent;
+    struct stat         st;
+    char               *path;
+
+    dir = opendir(zran_disk_cache.dir);
+    if (dir == NULL)
+        return -1;
+
+    while ((ent = readdir(dir)) != NULL) {
+
+        fname = ent->d_name;
+#endif
+
+        /*
+         * Only files which are named exactly
+         * as they would be by this function
+         * are cached.
+         */
+        if (strlen(fname) != ZRAN_DISK_CACHE_NAME_LEN ||
+            sscanf(fname, "%16llx-%16llx", &key, &start) != 2)
+            continue;
+
+        sprintf(name, ZRAN_DISK_CACHE_NAME_FORMAT, key, start);
+        if (strcmp(name, fname) != 0)
+            continue;
+
+#ifndef _WIN32
+        path = _zran_disk_cache_path(key, start);
+        if (path == NULL)
+            continue;
+        if (stat(path, &st) != 0) {
+            free(path);
+            continue;
+        }
+        free(path);
+
+        len   = st.st_size;
+        mtime = st.st_mtime;
+#endif
+
+        if (nfiles == size) {
+            size = size == 0 ? 64 : size * 2;
+            tmp  = realloc(files, size * sizeof(zran_disk_file_t));
+            if (tmp == NULL)
+                break;
+            files = tmp;
+        }
+
+        files[nfiles].key   = key;
+        files[nfiles].start = start;
+        files[nfiles].len   = len;
+        files[nfiles].mtime = mtime;
+        nfiles++;
+
+#ifdef _WIN32
+    } while (FindNextFileA(handle, &data));
+    FindClose(handle);
+#else
+    }
+    closedir(dir);
+#endif
+
+    /*
+     * The most recently modified files are
+     * added last, so the least recently
+     * modified files are evicted first.
+     */
+    if (nfiles > 0)
+        qsort(files, nfiles, sizeof(zran_disk_file_t), _zran_cmp_disk_file);
+
+    for (i = 0; i < nfiles; i++) {
+        _zran_span_cache_add(&zran_disk_cache,
+                             files[i].key,
+                             files[i].start,
+                             files[i].len,
+                             NULL);
+    }
+
+    free(files);
+    return 0;
+}
+
+
+/* Set the directory and budget of the disk cache. */
+int zran_set_disk_cache(const char *dir, uint64_t budget) {
+
+    int ret = 0;
+
+    zran_log("zran_set_disk_cache(%s, %llu)\n", dir, budget);
+
+    zran_span_cache_acquire();
+
+    _zran_span_cache_clear(&zran_disk_cache);
+    free(zran_disk_cache.dir);
+
+    zran_disk_cache.dir = NULL;
+    atomic_store_u64(&zran_disk_cache.budget, 0);
+
+    if (dir == NULL || budget == 0)
+        goto done;
+
+    zran_disk_cache.dir = malloc(strlen(dir) + 1);
+    if (zran_disk_cache.dir == NULL) {
+        ret = -1;
+        goto done;
+    }
+
+    strcpy(zran_disk_cache.dir, dir);
+    atomic_store_u64(&zran_disk_cache.budget, budget);
+
+    if (_zran_disk_cache_scan() != 0) {
+        _zran_span_cache_clear(&zran_disk_cache);
+        free(zran_disk_cache.dir);
+        zran_disk_cache.dir = NULL;
+        atomic_store_u64(&zran_disk_cache.budget, 0);
+        ret = -1;
+    }
+
+done:
+    zran_span_cache_release();
+    return ret;
+}
+
+
+/* Return the current state of the span caches. */
+void zran_span_cache_stats(zran_span_cache_stats_t *stats) {
+
+    zran_span_cache_acquire();
+
+    stats->budget      = atomic_load_u64(&zran_span_cache.budget);
+    stats->bytes       = zran_span_cache.bytes;
+    stats->hits        = zran_span_cache.hits;
+    stats->misses      = zran_span_cache.misses;
+    stats->nspans      = zran_span_cache.nspans;
+    stats->disk_budget = atomic_load_u64(&zran_disk_cache.budget);
+    stats->disk_bytes  = zran_disk_cache.bytes;
+    stats->disk_hits   = zran_disk_cache.hits;
+    stats->disk_misses = zran_disk_cache.misses;
+    stats->disk_nspans = zran_disk_cache.nspans;
+
+    zran_span_cache_release();
+}
+
+
+/* Reset the span cache hit and miss counters. */
+void zran_reset_span_cache_stats(void) {
+
+    zran_span_cache_acquire();
+
+    zran_span_cache.hits   = 0;
+    zran_span_cache.misses = 0;
+    zran_disk_cache.hits   = 0;
+    zran_disk_cache.misses = 0;
+
+    zran_span_cache_release();
+}
+
+
+/* Copies point i into the given zran_point_t struct. */
+int zran_get_point(zran_index_t *index, uint32_t i, zran_point_t *point) {
+
+    if (i >= index->npoints)
+        return -1;
+
+    point->cmp_offset   = index->cmp_offsets[  i];
+    point->uncmp_offset = index->uncmp_offsets[i];
+    point->bits         = _zran_get_point_bits(index, i);
+    point->data         = index->windows[i];
+
+    return 0;
+}
+
+
+/* Searches for the point at or before the given offset. */
+int zran_find_point(zran_index_t *index,
+                    uint64_t      offset,
+                    uint8_t       compressed,
+                    uint32_t     *hint,
+                    zran_point_t *point) {
+
+    int ret = _zran_get_point_at(index, offset, compressed, hint, point);
+
+    if      (ret == ZRAN_GET_POINT_OK)          return ZRAN_SEEK_OK;
+    else if (ret == ZRAN_GET_POINT_NOT_COVERED) return ZRAN_SEEK_NOT_COVERED;
+    else if (ret == ZRAN_GET_POINT_EOF)         return ZRAN_SEEK_EOF;
+    else                                        return ZRAN_SEEK_FAIL;
+}
+
+
+/* Initialise a zran_reader_t struct. */
+void _zran_init_reader(zran_reader_t *reader,
+                       zran_index_t  *index,
+                       FILE          *fd,
+                       PyObject      *f) {
+
+    memset(reader, 0, sizeof(zran_reader_t));
+
+    reader->index = index;
+    reader->fd    = fd;
+    reader->f     = f;
+}
+
+
+/* Returns the reader embedded in the index. */
+zran_reader_t * _zran_index_reader(zran_index_t *index) {
+
+    index->reader.fd = index->fd;
+    index->reader.f  = index->f;
+
+    return &(index->reader);
+}
+
+
+/* Releases the inflation cursor, if it is active. */
+void _zran_free_cursor(zran_reader_t *reader) {
+
+    if (!reader->cursor_active)
+        return;
+
+    zran_log("_zran_free_cursor\n");
+
+    inflateEnd(&(reader->cursor));
+    free(reader->readbuf);
+
+    reader->readbuf              = NULL;
+    reader->readbuf_offset       = 0;
+    reader->readbuf_end          = 0;
+    reader->inflate_cmp_offset   = 0;
+    reader->inflate_uncmp_offset = 0;
+    reader->cursor_active        = 0;
+}
+
+
+/* Prepares the inflation cursor to carry on inflating. */
+int _zran_resume_cursor(zran_reader_t *reader) {
+
+    uint64_t file_offset;
+
+    /*
+     * The compressed data up to inflate_cmp_offset
+     * has been consumed, and the data between
+     * readbuf_offset and readbuf_end is buffered,
+     * so the file position needs to be just after
+     * the buffered data.
+     */
+    file_offset = reader->inflate_cmp_offset +
+                  (reader->readbuf_end - reader->readbuf_offset);
+
+    zran_log("_zran_resume_cursor(%llu, %llu, file: %llu)\n",
+             reader->inflate_cmp_offset,
+             reader->inflate_uncmp_offset,
+             file_offset);
+
+    if (seekable_(reader->fd, reader->f)) {
+        if (_zran_fseek(reader, file_offset) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+
+/* Deallocate memory used by a zran_index_t struct. */
+void zran_free(zran_index_t *index) {
+
+    zran_log("zran_free\n");
+
+    zran_readahead_stop(index, NULL);
+    _zran_span_cache_purge(index->cache_id);
+    _zran_free_cursor(&(index->reader));
+    _zran_free_window_cache(&(index->reader));
+    _zran_free_point_list(index);
+    free(index->window_buf);
+
+    index->window_buf               = NULL;
+
+    index->fd                       = NULL;
+    index->f                        = NULL;
+    index->spacing                  = 0;
+    index->window_size              = 0;
+    index->readbuf_size             = 0;
+    index->npoints                  = 0;
+    index->size                     = 0;
+    index->reader.fd                = NULL;
+    index->reader.f                 = NULL;
+    index->reader.uncmp_seek_offset = 0;
+}
+
+
+/* Discard all points in the index after the specified compressed offset. */
+int _zran_invalidate_index(zran_index_t *index, uint64_t from)
+{
+    uint32_t i;
+    uint32_t npoints;
+
+    if (index->npoints == 0)
+        return 0;
+
+    for (i = 0; i < index->npoints; i++) {
+        if (index->cmp_offsets[i] >= from)
+            break;
+    }
+
+    /*
+     * The index doesn't cover
+     * the requested offest
+     */
+    if (i == index->npoints)
+        return 0;
+
+    /*
+     * _zran_expand_index starts from the beginning
+     * of the file if there are less than two
+     * points, so we can't leave just one behind.
+     */
+    if (i <= 2) npoints = 0;
+    else        npoints = i - 1;
+
+    /*
+     * Release the windows of discarded points,
+     * apart from those which are shared with
+     * points that are being kept.
+     */
+    _zran_release_windows(index, npoints);
+
+    index->generation++;
+
+    index->npoints = npoints;
+
+    /*
+     * The span which follows the new last
+     * point is no longer complete.
+     */
+    if (npoints == 0)
+        index->nspans = 0;
+    else if (index->nspans >= npoints)
+        index->nspans = npoints - 1;
+
+    return _zran_free_unused(index);
+}
+
+
+/* (Re-)Builds the full index. */
+int zran_build_index(zran_index_t *index, uint64_t from, uint64_t until)
+{
+
+    if (_zran_invalidate_index(index, from) != 0)
+        return ZRAN_BUILD_INDEX_FAIL;
+
+    return _zran_expand_index(index, until);
+}
+
+
+/* Returns non-0 if point i is at or before the given offset. */
+int _zran_point_precedes(zran_index_t *index,
+                         uint32_t      i,
+                         uint64_t      offset,
+                         uint8_t       compressed)
+{
+    /*
+     * Adjust the offset for non
+     * byte-aligned seek points.
+     */
+    if (compressed) return index->cmp_offsets[i] <=
+                        offset + (_zran_get_point_bits(index, i) > 0);
+    else            return index->uncmp_offsets[i] <= offset;
+}
+
+
+/* Searches for and returns the index at the specified offset. */
+int _zran_get_point_at(
+    zran_index_t  *index,
+    uint64_t       offset,
+    uint8_t        compressed,
+    uint32_t      *hint,
+    zran_point_t  *point)
+{
+    uint64_t cmp_max;
+    uint64_t uncmp_max;
+    uint32_t npoints;
+    uint32_t lo;
+    uint32_t hi;
+    uint32_t mid;
+    uint32_t i;
+
+    /*
+     * Bad input - past the end of the compressed or
+     * uncompressed streams (if their sizes are known).
+     */
+    if (compressed                 &&
+        index->compressed_size > 0 &&
+        offset >= index->compressed_size)
+        goto eof;
+
+    if (!compressed                  &&
+        index->uncompressed_size > 0 &&
+        offset >= index->uncompressed_size)
+        goto eof;
+
+    if (index->npoints == 0)
+        goto not_covered;
+
+    zran_log("_zran_get_point_at(%llu, c=%u)\n", offset, compressed);
+
+    /*
+     * Figure out how much of the compressed
+     * and uncompressed data the index currently
+     * covers -  the offsets of the last point
+     * in the index.
+     */
+    npoints   = index->npoints;
+    uncmp_max = index->uncmp_offsets[npoints - 1];
+    cmp_max   = index->cmp_offsets[  npoints - 1];
+
+    if ( compressed && offset > cmp_max)   goto not_covered;
+    if (!compressed && offset > uncmp_max) goto not_covered;
+
+    /*
+     * We should have an index point which
+     * corresponds to this offset - the last
+     * point which precedes the offset (or
+     * the first point, if none do). First
+     * we see if it is the point that was
+     * found last time, or the one after it.
+     */
+    if (hint != NULL && *hint < npoints) {
+
+        i = *hint;
+
+        if (i == 0 || _zran_point_precedes(index, i, offset, compressed)) {
+
+            if (i + 1 == npoints ||
+                !_zran_point_precedes(index, i + 1, offset, compressed))
+                goto found;
+
+            i++;
+
+            if (i + 1 == npoints ||
+                !_zran_point_precedes(index, i + 1, offset, compressed))
+                goto found;
+        }
+    }
+
+    /*
+     * Otherwise we search for it. The point
+     * offsets are monotonically increasing,
+     * and point lo is always a candidate.
+     */
+    lo = 0;
+    hi = npoints;
+    while (hi - lo > 1) {
+
+        mid = lo + (hi - lo) / 2;
+
+        if (_zran_point_precedes(index, mid, offset, compressed)) lo = mid;
+        else                                                      hi = mid;
+    }
+
+    i = lo;
+
+found:
+    zran_log("_zran_get_point_at: found point %u\n", i);
+
+    if (hint != NULL)
+        *hint = i;
+
+    /*
+     * We can't start inflating from a point
+     * whose window has been evicted, so we use
+     * the nearest earlier point instead (the
+     * first point never has a window, so is
+     * never evicted).
+     */
+    while (i > 0 && _zran_point_evicted(index, i))
+        i--;
+
+    zran_get_point(index, i, point);
+    return ZRAN_GET_POINT_OK;
+
+not_covered:
+    return ZRAN_GET_POINT_NOT_COVERED;
+
+eof:
+    return ZRAN_GET_POINT_EOF;
+}
+
+
+/*
+ * Get the index point corresponding to the given offset, expanding
+ * the index as needed if ZRAN_AUTO_BUILD is active.
+ */
+int _zran_get_point_with_expand(zran_index_t  *index,
+                                uint64_t       offset,
+                                uint8_t        compressed,
+                                uint32_t      *hint,
+                                zran_point_t  *point)
+{
+
+    int      result;
+    uint64_t expand;
+    uint64_t limit;
+
+    zran_log("_zran_get_point_with_expand(%llu, %u, autobuild=%u)\n",
+             offset,
+             compressed,
+             index->flags & ZRAN_AUTO_BUILD);
+
+    /*
+     * See if there is an index point that
+     * covers the specified offset. If there's
+     * not, we're going to expand the index
+     * until there is.
+     */
+    result = _zran_get_point_at(index, offset, compressed, hint, point);
+
+    /*
+     * Don't expand the index if
+     * auto_build is not active
+     */
+    if ((index->flags & ZRAN_AUTO_BUILD) == 0) {
+        return result;
+    }
+
+    while (result == ZRAN_GET_POINT_NOT_COVERED) {
+
+        /*
+         * If result == ZRAN_GET_POINT_NOT_COVERED,
+         * get_point says that an index point for
+         * this offset doesn't yet exist. So let's
+         * expand the index.
+         *
+         * Guess how far we need to expand the index,
+         * and expand it by that much.
+         */
+        if (compressed == 0) expand = _zran_estimate_offset(index, offset, 0);
+        else                 expand = offset;
+
+        /*
+         * If _zran_estimate_offset was unable to
+         * estimate a sensible compressed offset
+         * (i.e. smaller or at the current index
+         * extent), we force it past the limit,
+         * so that the expand_index function will
+         * create at least one point.
+         */
+        limit = _zran_index_limit(index, 1);
+        if (expand <= limit)
+            expand = limit + 10;
+
+        zran_log("Estimated mapping from uncompressed offset "
+                 "%lu into compressed data: %lu\n", offset, expand);
+
+        /*
+         * Expand the index
+         */
+        result = _zran_expand_index(index, expand);
+        if      (result == ZRAN_EXPAND_INDEX_CRC_ERROR) { goto crcerror; }
+        else if (result != 0)                           { goto fail; }
+
+        /*
+         * Index has been expanded, so
+         * there should now be a point
+         * which covers the requested
+         * offset.
+         */
+        result = _zran_get_point_at(index, offset, compressed, hint, point);
+
+        /*
+         * If we've made it to EOF, return
+         * a ref to the eof point.
+         */
+        if (result == ZRAN_GET_POINT_EOF) {
+            zran_get_point(index, index->npoints - 1, point);
+
+            if (offset < index->uncompressed_size) {
+                result = ZRAN_GET_POINT_OK;
+            }
+        }
+    }
+
+    return result;
+
+crcerror:
+    return ZRAN_GET_POINT_CRC_ERROR;
+fail:
+    return ZRAN_GET_POINT_FAIL;
+}
+
+
+/*
+ * Given an offset in one stream, estimates the corresponding offset into the
+ * other stream.
+ */
+uint64_t _zran_estimate_offset(
+    zran_index_t *index,
+    uint64_t      offset,
+    uint8_t       compressed)
+{
+
+    uint64_t last_cmp;
+    uint64_t last_uncmp;
+    uint64_t estimate;
+
+    /*
+     * We have no reference. The first index
+     * point maps offsets 0 and 0, which won't
+     * help us here, so at least two index
+     * points need to have been created.
+     * The assumed correspondences between
+     * the compressed streams are arbitrary.
+     */
+    if (index->npoints <= 1) {
+        if (compressed) estimate = offset * 2.0;
+        else            estimate = offset * 0.8;
+    }
+
+    /*
+     * I'm just assuming a roughly linear correspondence
+     * between the compressed/uncompressed data streams.
+     */
+    else {
+        last_cmp   = index->cmp_offsets[  index->npoints - 1];
+        last_uncmp = index->uncmp_offsets[index->npoints - 1];
+
+        if (compressed)
+            estimate = round(offset * ((float)last_uncmp / last_cmp));
+        else
+            estimate = round(offset * ((float)last_cmp / last_uncmp));
+    }
+
+
+    zran_log("_zran_estimate_offset(%llu, %u) = %llu\n",
+             offset, compressed, estimate);
+
+    return estimate;
+}
+
+
+
+/* Add a new point to the index. */
+int _zran_add_point(zran_index_t  *index,
+                    uint8_t        bits,
+                    uint64_t       cmp_offset,
+                    uint64_t       uncmp_offset,
+                    uint32_t       data_offset,
+                    uint32_t       data_size,
+                    uint8_t       *data,
+                    uint8_t       *refs) {
+
+    zran_reader_t *reader;
+    uint8_t       *window     = NULL;
+    uint8_t       *stored     = NULL;
+    uint8_t       *point_data = NULL;
+
+    #ifdef ZRAN_VERBOSE
+    zran_log("_zran_add_point(%i, c=%lld + %i, u=%lld, data=%u / %u)\n",
+             index->npoints,
+             cmp_offset,
+             bits > 0,
+             uncmp_offset,
+             data_offset,
+             data_size);
+
+    if (data != NULL)
+        zran_log("Window data: [%02x %02x %02x %02x ...]\n",
+                 data[(data_offset - index->window_size + 0) % data_size],
+                 data[(data_offset - index->window_size + 1) % data_size],
+                 data[(data_offset - index->window_size + 2) % data_size],
+                 data[(data_offset - index->window_size + 3) % data_size]);
+    #endif
+
+    /* if the point arrays are full, make them bigger */
+    if (index->npoints == index->size) {
+        if (_zran_expand_point_list(index) != 0) {
+            goto fail;
+        }
+    }
+
+    /*
+     * Index points corresponding to the
+     * beginning of a gzip stream (including
+     * at start of file), and points after
+     * which the window is never referenced,
+     * do not have any window data associated
+     * with them. Otherwise, the uncompressed data
+     * (the "window") associated with this
+     * point is assembled in the index
+     * scratch buffer, and then stored.
+     */
+    if (data != NULL) {
+
+        window = _zran_window_buf(index);
+        if (window == NULL)
+            goto fail;
+
+        /*
+         * The uncompressed data may not start at
+         * the beginning of the data pointer, but
+         * rather from an arbitrary point. So we
+         * copy the beginning of the window from
+         * the end of data, and the end of the
+         * window from the beginning of data. Does
+         * that make sense?
+         */
+        if (data_offset >= index->window_size) {
+
+            memcpy(window,
+                   data + (data_offset - index->window_size),
+                   index->window_size);
+
+            zran_log("Copy %u bytes from %u to %u\n",
+                     index->window_size,
+                     data_offset - index->window_size,
+                     data_offset);
+        }
+        else {
+            memcpy(window,
+                   data + (data_size - (index->window_size - data_offset)),
+                   (index->window_size - data_offset));
+
+            memcpy(window + (index->window_size - data_offset),
+                   data,
+                   data_offset);
+
+            zran_log("Copy %u bytes from %u to %u, %u bytes from %u to %u\n",
+                     (index->window_size - data_offset),
+                     (data_size - (index->window_size - data_offset)),
+                     data_size,
+                     data_offset,
+                     0,
+                     data_offset);
+        }
+
+        stored = _zran_store_window(index, window, refs);
+        if (stored == NULL)
+            goto fail;
+
+        point_data = _zran_share_window(index, stored, index->npoints);
+        if (point_data == NULL) {
+            zran_arena_rewind(&(index->arena), stored);
+            goto fail;
+        }
+    }
+
+    /*
+     * The new point ends the span which follows
+     * the previous point - the index reader has
+     * inflated all of it, so its CRC is known
+     * (see _zran_update_span).
+     */
+    reader = &(index->reader);
+    if (index->npoints > 0   &&
+        reader->span_active &&
+        reader->span_point == index->npoints - 1) {
+
+        if (index->nspans == index->npoints - 1)
+            index->span_crcs[index->nspans++] = reader->span_crc32;
+
+        reader->span_point = index->npoints;
+        reader->span_crc32 = 0;
+    }
+
+    index->cmp_offsets[  index->npoints] = cmp_offset;
+    index->uncmp_offsets[index->npoints] = uncmp_offset;
+    index->windows[      index->npoints] = point_data;
+    _zran_set_point_bits(index, index->npoints, bits);
+
+    index->npoints++;
+
+    return 0;
+
+fail:
+    return -1;
+}
+
+
+/* Initialise the given z_stream struct for decompression/inflation. */
+int _zran_init_zlib_inflate(zran_reader_t *reader,
+                            z_stream      *strm,
+                            zran_point_t  *point) {
+
+    zran_index_t        *index = reader->index;
+    zran_window_entry_t *entry;
+    int                  ret;
+    int                  window;
+    int64_t              seek_loc;
+    unsigned long        bytes_read;
+    uint8_t             *dict  = NULL;
+
+    bytes_read   = strm->avail_in;
+    window       = index->log_window_size;
+    strm->zalloc = Z_NULL;
+    strm->zfree  = Z_NULL;
+    strm->opaque = Z_NULL;
+
+    /*
+     * If we're starting from the the current location in
+     * the compressed data, we assume that there is a gzip
+     * header present. Initialise inflation, then read
+     * past the header.
+
+     * Below, we will re-initialise for raw inflation.
+     */
+    if (point == NULL) {
+
+        zran_log("_zran_init_zlib_inflate from current "
+                 "seek location (expecting GZIP header)\n");
+        if (inflateInit2(strm, window + 32) != Z_OK) { goto fail; }
+        if (inflate(strm, Z_BLOCK)          != Z_OK) { goto fail_free_strm; }
+        if (inflateEnd(strm)                != Z_OK) { goto fail; }
+    }
+
+    /*
+     * If starting from an index point, seek to the
+     * required location in the compressed data stream.
+     *
+     * The compressed offset for index points correspond
+     * to the first full byte of compressed data. So if
+     * the index point is not byte-aligned (bits > 0), we
+     * need to seek to the previous byte, and tell zlib
+     * about it (via the inflatePrime call below).
+     */
+    else {
+        seek_loc = point->cmp_offset - (point->bits > 0);
+
+        zran_log("_zran_init_zlib_inflate from index point (%li, %li, %li)\n",
+                 seek_loc,
+                 point->cmp_offset,
+                 point->uncmp_offset);
+
+        if (_zran_fseek(reader, seek_loc) != 0) {
+            goto fail;
+        }
+    }
+
+    /*
+     * Now initialise for raw inflation. This tells zlib
+     * not to expect any GZIP headers, and not to read
+     * the GZIP footer (as we do our own CRC validation
+     * in _zran_inflate).
+     */
+
+    if (inflateInit2(strm, -window) != Z_OK) {
+        goto fail;
+    }
+
+    /*
+     * If starting from an index point, initialise
+     * the inflation dictionary from the uncompressed
+     * data associated with the index point.
+     */
+    if (point != NULL && point->data != NULL) {
+
+        /*
+         * Get hold of the uncompressed window
+         * (which may need to be decompressed).
+         */
+        dict = _zran_load_window(reader, point->data);
+        if (dict == NULL)
+            goto fail_free_strm;
+
+        /*
+         * Keep track of the windows used by the index
+         * reader, so they are not evicted. Other
+         * readers may be running concurrently, so
+         * must not modify the index.
+         */
+        if (reader == &(index->reader) &&
+            (index->window_budget > 0 ||
+             atomic_load_u64(&zran_global_budget) > 0)) {
+
+            entry = _zran_get_window_entry(index, point->data);
+            if (entry != NULL)
+                entry->used = 1;
+        }
+    }
+
+    /*
+     * The starting index point is not byte-aligned,
+     * so we'll insert the initial bits into the
+     * inflate stream using inflatePrime (above,
+     * we seeked one byte back to accommodate this).
+     * This applies to points without a window too.
+     */
+    if (point != NULL && point->bits > 0) {
+
+        ret = _zran_getc(reader);
+
+        if (ret == -1 && _zran_ferror(reader)) {
+            goto fail_free_strm;
+        }
+
+        if (inflatePrime(strm,
+                         point->bits, ret >> (8 - point->bits)) != Z_OK)
+            goto fail_free_strm;
+    }
+
+    if (point != NULL && point->data != NULL) {
+
+        /*
+         * Initialise the inflate stream
+         * with the index point data.
+         */
+        if (inflateSetDictionary(strm,
+                                 dict,
+                                 index->window_size) != Z_OK)
+            goto fail_free_strm;
+    }
+
+    /*
+     * Reset CRC/size validation counters when
+     * we start reading a new gzip stream
+     */
+    reader->validating   = (point == NULL);
+    reader->stream_size  = 0;
+    reader->stream_crc32 = 0;
+
+    zran_log("_zran_zlib_init_inflate: initialised, read %i bytes\n",
+             bytes_read - strm->avail_in);
+
+    /*
+     * Return the number of bytes of compressed
+     * data, if any that were read over
+     */
+    return bytes_read - strm->avail_in;
+
+/*
+ * Something has gone wrong, but
+ * inflateInit2 has been called,
+ * so we need to call inflateEnd.
+ * Falls through to the fail:
+ * clause.
+ */
+fail_free_strm:
+    inflateEnd(strm);
+/* Something has gone wrong */
+fail:
+    return -1;
+}
+
+
+/*
+ * Read data from the GZIP file, and copy it into the read buffer for
+ * decompression.
+ */
+static int _zran_read_data_from_file(zran_reader_t *reader,
+                                     z_stream      *stream,
+                                     uint64_t       cmp_offset,
+                                     uint64_t       uncmp_offset,
+                                     uint32_t       need_atleast) {
+
+    zran_index_t *index = reader->index;
+    size_t        f_ret;
+    int64_t       p_ret;
+
+    if (stream->avail_in >= need_atleast) {
+        return 0;
+    }
+
+    /*
+     * If there are any unprocessed bytes
+     * left over, put them at the beginning
+     * of the read buffer.
+     *
+     * TODO: In times gone by, we would only
+     * attempt to read data (and therefore
+     * rotate memory here) when the read
+     * buffer was empty. But now, to keep
+     * the code in _zran_inflate clean-ish,
+     * we do this repeatedly, even when we
+     * are at EOF, to ensure that there is
+     * enough data to validate one stream,
+     * and find the next. We could improve
+     * things here, by only rotating memory
+     * here if needed.
+     */
+    if (stream->avail_in > 0) {
+        memmove(reader->readbuf, stream->next_in, stream->avail_in);
+    }
+
+    zran_log("Reading from file %llu "
+             "[into readbuf offset %u]\n",
+             cmp_offset + stream->avail_in,
+             stream->avail_in);
+
+    /*
+     * Read a block of compressed data
+     * (offsetting past any left over
+     * bytes that we may have copied to
+     * the beginning of the read buffer
+     * above), from the I/O pipeline if
+     * there is one, or from the file.
+     */
+    if (reader->pipeline != NULL) {
+        p_ret = _zran_pipeline_read(reader,
+                                    reader->readbuf + stream->avail_in,
+                                    index->readbuf_size - stream->avail_in);
+        if (p_ret < 0) {
+            goto fail;
+        }
+        f_ret = (size_t)p_ret;
+    }
+    else {
+        f_ret = _zran_fread(reader,
+                            reader->readbuf + stream->avail_in,
+                            index->readbuf_size - stream->avail_in);
+
+        if (_zran_ferror(reader)) {
+            goto fail;
+        }
+    }
+
+    /*
+     * No bytes left to read, and there are
+     * only 8 bytes left to process (size of
+     * gzip footer) - we've reached EOF.
+     */
+    if (f_ret == 0 && stream->avail_in <= 8) {
+        if (reader->pipeline != NULL ||
+            _zran_feof(reader, f_ret)) {
+
+            zran_log("End of file, stopping inflation\n");
+
+            /*
+             * Reset next_in pointer to beginning of
+             * read buffer, as we rotated it above,
+             * and the area that next_in was pointing
+             * to may have been overwritten by memmove.
+             */
+            stream->next_in = reader->readbuf;
+
+            /*
+             * we have uncompressed everything,
+             * so we now know its size. Only the
+             * index's own reader modifies the
+             * index - other readers may be in
+             * use concurrently.
+             */
+            if (reader != &(index->reader)) {
+                goto eof;
+            }
+            if (index->uncompressed_size == 0) {
+                zran_log("Updating uncompressed data "
+                         "size: %llu\n", uncmp_offset);
+                index->uncompressed_size = uncmp_offset;
+            }
+            if (index->compressed_size == 0) {
+                zran_log("Updating compressed data "
+                         "size: %llu\n", cmp_offset);
+                index->compressed_size = cmp_offset + 8;
+            }
+            goto eof;
+        }
+        /*
+         * Or something went wrong (this
+         * should never happen if ferror
+         * does the right thing).
+         */
+        else {
+            goto fail;
+        }
+    }
+
+    zran_log("Read %lu bytes from file [c=%llu, u=%llu] "
+             "[%02x %02x %02x %02x ...]\n",
+             f_ret, cmp_offset, uncmp_offset,
+             reader->readbuf[stream->avail_in],
+             reader->readbuf[stream->avail_in + 1],
+             reader->readbuf[stream->avail_in + 2],
+             reader->readbuf[stream->avail_in + 3]);
+
+    /*
+     * Tell zlib about the block
+     * of compressed data that we
+     * just read in.
+     */
+    reader->readbuf_end = f_ret + stream->avail_in;
+    stream->avail_in  += f_ret;
+    stream->next_in    = reader->readbuf;
+
+    return 0;
+eof:
+    return ZRAN_READ_DATA_EOF;
+fail:
+    return ZRAN_READ_DATA_ERROR;
+}
+
+
+/*
+ * Identify the location of the next compressed stream (if the file
+ * contains concatenated streams).
+ */
+int _zran_find_next_stream(zran_reader_t *reader,
+                           z_stream      *stream,
+                           int           *offset) {
+
+    int ret;
+    int found;
+
+    /*
+     * Search for the beginning of
+     * the next stream. GZIP files
+     * start with 0x1f8b.
+     */
+    found = 0;
+
+    zran_log("Searching for a new stream [%u]\n", stream->avail_in);
+
+    while (stream->avail_in > 0) {
+
+        if (stream->avail_in   >= 2    &&
+            stream->next_in[0] == 0x1f &&
+            stream->next_in[1] == 0x8b) {
+            found = 1;
+            break;
+        }
+
+        *offset          += 1;
+        stream->next_in  += 1;
+        stream->avail_in -= 1;
+    }
+
+    /*
+     * No header found for
+     * the next stream.
+     */
+    if (found == 0) {
+        zran_log("Could not find another stream [%u]\n", stream->avail_in);
+        goto not_found;
+    }
+
+    zran_log("New stream found, re-initialising inflation\n");
+
+    /*
+     * Re-configure for inflation
+     * from the new stream.
+     */
+    if (inflateEnd(stream) != Z_OK) {
+        goto fail;
+    }
+
+    ret = _zran_init_zlib_inflate(reader, stream, NULL);
+
+    if (ret < 0) {
+        goto fail;
+    }
+
+    *offset += ret;
+
+    return 0;
+
+fail:
+    return ZRAN_FIND_STREAM_ERROR;
+
+not_found:
+    return ZRAN_FIND_STREAM_NOT_FOUND;
+}
+
+
+/* Validate the CRC32 and size of a GZIP stream. */
+static int _zran_validate_stream(zran_reader_t *reader,
+                                 z_stream      *stream,
+                                 int           *offset) {
+
+    zran_index_t *index = reader->index;
+    uint32_t      crc;
+    uint32_t      size;
+
+    /* CRC validation is disabled. Skip over footer
+     * and return.
+     */
+    if (index->flags & ZRAN_SKIP_CRC_CHECK) {
+        stream->avail_in -= 8;
+        stream->next_in  += 8;
+        *offset          += 8;
+        return 0;
+    }
+
+    /*
+     * A gzip stream should end with an 8 byte footer,
+     * which contains the CRC32 of the uncompressed
+     * data, and the uncompressed size modulo 2^32.
+     */
+    if (stream->avail_in < 8) {
+        return ZRAN_VALIDATE_STREAM_ERROR;
+    }
+
+    crc  = ((stream->next_in[0] << 0)  +
+            (stream->next_in[1] << 8)  +
+            (stream->next_in[2] << 16) +
+            (stream->next_in[3] << 24));
+    size = ((stream->next_in[4] << 0)  +
+            (stream->next_in[5] << 8)  +
+            (stream->next_in[6] << 16) +
+            (stream->next_in[7] << 24));
+
+    zran_log("Validating CRC32 and size [%8x == %8x, %u == %u]\n",
+             crc, reader->stream_crc32, size, reader->stream_size);
+
+    stream->avail_in -= 8;
+    stream->next_in  += 8;
+    *offset          += 8;
+
+    if (reader->stream_crc32 != crc || reader->stream_size != size) {
+        return ZRAN_VALIDATE_STREAM_INVALID;
+    }
+
+    return 0;
+}
+
+
+/* Start calculating the CRC of the span following the given point. */
+void _zran_start_span(zran_reader_t *reader, zran_point_t *start) {
+
+    zran_index_t *index = reader->index;
+    uint32_t      i     = 0;
+
+    reader->span_active = 0;
+    reader->span_crc32  = 0;
+
+    if (index->flags & ZRAN_SKIP_CRC_CHECK)
+        return;
+
+    /*
+     * _zran_get_point_at stores the position of the
+     * point it found in reader->last_point, but
+     * returns the nearest earlier point if its
+     * window has been evicted. Inflation from the
+     * start of the file starts at the first point
+     * (which may be about to be added).
+     */
+    if (start != NULL) {
+        i = reader->last_point;
+        while (i > 0 && i < index->npoints && _zran_point_evicted(index, i))
+            i--;
+
+        if (i >= index->npoints                          ||
+            index->cmp_offsets[  i] != start->cmp_offset ||
+            index->uncmp_offsets[i] != start->uncmp_offset)
+            return;
+    }
+
+    reader->span_point  = i;
+    reader->span_active = 1;
+}
+
+
+/* Update the CRC of the span being inflated, and check completed spans. */
+int _zran_update_span(zran_reader_t *reader,
+                      uint8_t       *data,
+                      uint32_t       len,
+                      uint64_t       offset) {
+
+    zran_index_t *index = reader->index;
+    uint64_t      end;
+    uint32_t      i;
+    uint32_t      n;
+
+    while (reader->span_active) {
+
+        i = reader->span_point;
+
+        /*
+         * The CRC of this span is not known, and
+         * will never be (e.g. the index was imported
+         * from a file without span CRCs).
+         */
+        if (i > index->nspans ||
+            (i == index->nspans && i + 1 < index->npoints)) {
+            reader->span_active = 0;
+            break;
+        }
+
+        /*
+         * This is the last span in the index. Its
+         * CRC is only needed if the index is being
+         * built, in which case it is stored when the
+         * next point is added (see _zran_add_point).
+         */
+        if (i + 1 >= index->npoints) {
+            if (reader != &(index->reader))
+                reader->span_active = 0;
+            else
+                reader->span_crc32 = crc32(reader->span_crc32, data, len);
+            break;
+        }
+
+        /*
+         * The points have changed since
+         * inflation started (see
+         * _zran_invalidate_index).
+         */
+        end = index->uncmp_offsets[i + 1];
+        if (end < offset) {
+            reader->span_active = 0;
+            break;
+        }
+
+        if (end - offset < len) n = end - offset;
+        else                    n = len;
+
+        reader->span_crc32 = crc32(reader->span_crc32, data, n);
+        data              += n;
+        len               -= n;
+        offset            += n;
+
+        if (offset < end)
+            break;
+
+        zran_log("Validating CRC32 of span %u [%8x == %8x]\n",
+                 i, index->span_crcs[i], reader->span_crc32);
+
+        if (reader->span_crc32 != index->span_crcs[i])
+            return -1;
+
+        reader->span_point = i + 1;
+        reader->span_crc32 = 0;
+    }
+
+    return 0;
+}
+
+
+/* The workhorse. Inflate/decompress data from the file. */
+static int _zran_inflate(zran_reader_t *reader,
+                         z_stream      *strm,
+                         uint64_t       offset,
+                         uint16_t       flags,
+                         uint32_t      *total_consumed,
+                         uint32_t      *total_output,
+                         uint32_t       len,
+                         uint8_t       *data,
+                         int            add_stream_points) {
+
+    /* The index that the reader is using. */
+    zran_index_t *index = reader->index;
+
+    /*
+     * z_ret is for zlib/zran functions.
+     * off is for storing offset of new
+     * stream (from _zran_validate_stream
+     * and _zran_find_next_stream).
+     * return_val/error_return_val is
+     * the return value for this function.
+     */
+    int z_ret;
+    int off;
+    int return_val       = ZRAN_INFLATE_OK;
+    int error_return_val = ZRAN_INFLATE_ERROR;
+
+    /*
+     * Offsets into the compressed
+     * and uncompressed data streams,
+     * and total number of bytes
+     * decompressed and output.
+     */
+    uint64_t cmp_offset;
+    uint64_t uncmp_offset;
+    uint32_t _total_consumed = 0;
+    uint32_t _total_output   = 0;
+
+    /*
+     * Number of bytes input/decompressed
+     * during a single call to zlib:inflate.
+     */
+    uint32_t bytes_consumed = 0;
+    uint32_t bytes_output   = 0;
+
+    /*
+     * Index point to start from
+     * (if ZRAN_INFLATE_USE_OFFSET
+     * is active).
+     */
+    zran_point_t  start_point;
+    zran_point_t *start = NULL;
+
+    /*
+     * Set all zstream_t fields to 0
+     * if we are initialising.
+     */
+    if (inflate_init_stream(flags)) {
+        memset(strm, 0, sizeof(z_stream));
+    }
+
+    /*
+     * If ZRAN_INFLATE_INIT_READBUF is not set,
+     * make sure that a read buffer exists.
+     *
+     * If the opposite is true, the read buffer
+     * from a prior call has not been cleaned up.
+     */
+    if ((!inflate_init_readbuf(flags) && reader->readbuf == NULL) ||
+        ( inflate_init_readbuf(flags) && reader->readbuf != NULL)) {
+        goto fail;
+    }
+
+    /*
+     * It begins...
+     */
+    zran_log("_zran_inflate(%llu, block=%u, use_offset=%u, init_stream=%u,\n"
+             "              free_stream=%u, init_readbuf=%u, free_readbuf=%u,\n"
+             "              clear_offsets=%u, nbytes=%u)\n",
+             offset,
+             inflate_stop_at_block(        flags),
+             inflate_use_offset(           flags),
+             inflate_init_stream(          flags),
+             inflate_free_stream(          flags),
+             inflate_init_readbuf(         flags),
+             inflate_free_readbuf(         flags),
+             inflate_clear_readbuf_offsets(flags),
+             len);
+
+    /*
+     * The compressed/uncompressed offsets are initialised in
+     * one of three ways. If ZRAN_INFLATE_USE_OFFSET is active,
+     * they are either:
+     *
+     *    - Both set to 0
+     *
+     *    - Initialised according to an existing index
+     *      point that precedes the requested offset.
+     *
+     * Otherwise, they are initialised from reader->inflate_cmp_offset
+     * and reader->inflate_uncmp_offset, which are assumed to have been
+     * set in a prior call to _zran_inflate.
+     */
+    if (inflate_use_offset(flags)) {
+
+        cmp_offset   = 0;
+        uncmp_offset = 0;
+
+        /*
+         * If a non-zero offset has been specified,
+         * search the index to see if we can start
+         * inflating from a known location.
+         */
+        if (offset > 0) {
+
+            /*
+             * In order to successfully decompress
+             * data from the current uncompressed seek
+             * location, we need to start decompressing
+             * from the index point which preceeds it.
+             */
+            z_ret = _zran_get_point_at(index,
+                                       offset,
+                                       1,
+                                       &(reader->last_point),
+                                       &start_point);
+
+            if (z_ret == ZRAN_GET_POINT_NOT_COVERED)
+                return ZRAN_INFLATE_NOT_COVERED;
+
+            if (z_ret == ZRAN_GET_POINT_EOF)
+                return ZRAN_INFLATE_EOF;
+
+            start = &start_point;
+        }
+
+        /*
+         * Start inflating from the index point
+         * corresponding to the offset (or keep
+         * the offsets at 0 if no point was found).
+         */
+        if (start != NULL) {
+
+            cmp_offset   = start->cmp_offset;
+            uncmp_offset = start->uncmp_offset;
+        }
+    }
+
+    /*
+     * If ZRAN_INFLATE_USE_OFFSET is not active,
+     * we initialise from offsets which were
+     * stored on the last call to _zran_inflate.
+     */
+    else {
+        cmp_offset   = reader->inflate_cmp_offset;
+        uncmp_offset = reader->inflate_uncmp_offset;
+    }
+
+    zran_log("initialising to inflate from "
+             "cmp_offset=%llu, uncmp_offset=%llu\n",
+             cmp_offset,
+             uncmp_offset);
+
+    /*
+     * If ZRAN_INFLATE_INIT_READBUF,
+     * allocate memory for reading
+     * compressed data from the file.
+     * The buffer is attached to the
+     * zran_index_t->readbuf pointer.
+     */
+    if (inflate_init_readbuf(flags)) {
+        reader->readbuf = calloc(1, index->readbuf_size);
+        if (reader->readbuf == NULL)
+            goto fail;
+    }
+
+    /*
+     * If ZRAN_INFLATE_CLEAR_READBUF_OFFSETS,
+     * we clear any stored information about
+     * the read buffer, and start reading
+     * from/writing to it from the beginning.
+     */
+    if (inflate_clear_readbuf_offsets(flags)) {
+        reader->readbuf_offset = 0;
+        reader->readbuf_end    = 0;
+    }
+
+    /*
+     * Otherwise, assume that there is already
+     * some input (compressed) data in the
+     * readbuf, and that reader->readbuf_offset
+     * and reader->readbuf_end were set on a
+     * prior call.
+     *
+     *    - readbuf_offset tells us where in
+     *      readbuf the data starts
+     *
+     *    - readbuf_end tells us where it ends.
+     */
+    else {
+        strm->next_in  = reader->readbuf     + reader->readbuf_offset;
+        strm->avail_in = reader->readbuf_end - reader->readbuf_offset;
+    }
+
+    /*
+     * Tell zlib where to store
+     * the uncompressed data.
+     */
+    strm->avail_out = len;
+    strm->next_out  = data;
+
+    /*
+     * If ZRAN_INFLATE_INIT_Z_STREAM is active,
+     * initialise the zlib struct for inflation.
+     *
+     * If ZRAN_INFLATE_INIT_Z_STREAM is not
+     * active, we assume that the inflation is
+     * already initialised.
+     */
+    if (inflate_init_stream(flags)) {
+
+        /*
+         * No index point - we need to start reading
+         * from the beginning of the input file. If
+         * starting from an index point, the
+         * _zran_init_zlib_inflate function will seek
+         * to the correct location in the file for us.
+         */
+        if (start == NULL) {
+            /*
+             * If file is not seekable, assume that
+             * it is positioned at the beginning of
+             * the stream.
+             */
+            if (seekable_(reader->fd, reader->f)) {
+                if (_zran_fseek(reader, 0) != 0) {
+                    goto fail;
+                }
+            }
+
+            /*
+             * In this situation, _zran_init_zlib_inflate
+             * is going to expect a GZIP header, so make
+             * sure we have some data for it to look at.
+             */
+            if (_zran_read_data_from_file(reader,
+                                          strm,
+                                          cmp_offset,
+                                          uncmp_offset,
+                                          index->readbuf_size) != 0) {
+                goto fail;
+            }
+        }
+
+        /*
+         * If init_zlib_inflate skips over any input data
+         * (e.g. gzip header), it returns the number of
+         * bytes that were read.
+         */
+        z_ret = _zran_init_zlib_inflate(reader, strm, start);
+        if (z_ret < 0) {
+            goto fail;
+        }
+        cmp_offset      += z_ret;
+        _total_consumed += z_ret;
+
+        /*
+         * Start checking the CRC of the data from
+         * the starting point - this is done before
+         * the first point is added, so the span that
+         * it starts is tracked from the beginning.
+         */
+        _zran_start_span(reader, start);
+
+        if (start == NULL && add_stream_points) {
+            if (_zran_add_point(index, 0, cmp_offset, 0, 0, 0, NULL, NULL)
+                != 0) {
+                goto fail;
+            }
+        }
+    }
+
+    /*
+     * Keep going until we run out of space.
+     */
+    while (strm->avail_out > 0) {
+
+        /*
+         * Make sure the input buffer contains
+         * some data to be decompressed.
+         */
+        z_ret = _zran_read_data_from_file(reader,
+                                          strm,
+                                          cmp_offset,
+                                          uncmp_offset,
+                                          1);
+
+        /* EOF - there is no more data left to read */
+        if (z_ret == ZRAN_READ_DATA_EOF) {
+            return_val = ZRAN_INFLATE_EOF;
+            break;
+        }
+        else if (z_ret != 0) {
+            goto fail;
+        }
+
+        /*
+         * Decompress data until there's no data
+         * left, or we've read enough bytes
+         */
+        z_ret = Z_OK;
+        while (strm->avail_in > 0) {
+
+            /*
+             * Initialise counters to calculate
+             * how many bytes are input/output
+             * during this call to inflate.
+             */
+            bytes_consumed = strm->avail_in;
+            bytes_output   = strm->avail_out;
+
+            zran_log("Before inflate - avail_in=%u, avail_out=%u, "
+                     "cmp_offset=%lu, uncmp_offset=%lu\n",
+                     strm->avail_in, strm->avail_out,
+                     cmp_offset, uncmp_offset);
+
+            /*
+             * Inflate the block - the decompressed
+             * data is output straight to the provided
+             * data buffer.
+             *
+             * If ZRAN_INFLATE_STOP_AT_BLOCK is active,
+             * Z_BLOCK tells inflate to stop inflating
+             * at a compression block boundary. Otherwise,
+             * inflate stops when it comes to the end of a
+             * stream, or it runs out of input or output.
+             */
+            if (inflate_stop_at_block(flags)) {
+                z_ret = inflate(strm, Z_BLOCK);
+            }
+            else {
+                z_ret = inflate(strm, Z_NO_FLUSH);
+            }
+
+            /*
+             * Adjust our offsets according to what
+             * was actually consumed/decompressed.
+             */
+            bytes_consumed   = bytes_consumed - strm->avail_in;
+            bytes_output     = bytes_output   - strm->avail_out;
+            cmp_offset      += bytes_consumed;
+            _total_consumed += bytes_consumed;
+            uncmp_offset    += bytes_output;
+            _total_output   += bytes_output;
+
+            zran_log("After inflate - avail_in=%u, avail_out=%u, "
+                     "cmp_offset=%lu, uncmp_offset=%lu\n",
+                     strm->avail_in, strm->avail_out,
+                     cmp_offset, uncmp_offset);
+
+
+            /*
+             * Now we need to figure out what just happened.
+             *
+             * Z_BUF_ERROR indicates that the output buffer
+             * is full; we clobber it though, as it makes the
+             * code below a bit easier (and anyway, we can
+             * tell if the output buffer is full by checking
+             * strm->avail_out).
+             */
+            if (z_ret == Z_BUF_ERROR) {
+                z_ret = Z_OK;
+            }
+
+            /*
+             * If z_ret is not Z_STREAM_END or
+             * Z_OK, something has gone wrong.
+             *
+             * If the file comprises a sequence of
+             * concatenated gzip streams, we will
+             * encounter Z_STREAM_END before the end
+             * of the file (where one stream ends and
+             * the other begins).
+             *
+             * If at a new stream, we re-initialise
+             * inflation on the next loop iteration.
+             */
+            if (z_ret != Z_OK && z_ret != Z_STREAM_END) {
+                zran_log("zlib inflate failed (code: %i, msg: %s)\n",
+                         z_ret, strm->msg);
+                goto fail;
+            }
+
+            /*
+             * If we have not yet validated the current
+             * GZIP stream, update its size and crc so
+             * we can validate them against the size
+             * recorded in the stream footer when we
+             * get to it.
+             */
+            if ((uncmp_offset > reader->last_stream_ended) &&
+                reader->validating                         &&
+                !(index->flags & ZRAN_SKIP_CRC_CHECK)) {
+                reader->stream_size +=       bytes_output;
+                reader->stream_crc32 = crc32(reader->stream_crc32,
+                                            strm->next_out - bytes_output,
+                                            bytes_output);
+            }
+
+            /*
+             * Check the CRC of every span between
+             * two index points that we pass through.
+             */
+            if (reader->span_active &&
+                _zran_update_span(reader,
+                                  strm->next_out - bytes_output,
+                                  bytes_output,
+                                  uncmp_offset   - bytes_output) != 0) {
+                error_return_val = ZRAN_INFLATE_CRC_ERROR;
+                goto fail;
+            }
+
+            /*
+             * End of a block? If INFLATE_STOP_AT_BLOCK
+             * is active, we want to stop at a compression
+             * block boundary.
+             *
+             * If we used Z_BLOCK above, and inflate
+             * encountered a block boundary, it indicates
+             * this in the the strm->data_type field.
+             */
+            if (inflate_stop_at_block(flags) &&
+                ((strm->data_type & 128) && !(strm->data_type & 64))) {
+
+                zran_log("At block or stream boundary, "
+                         "stopping inflation\n");
+
+                return_val = ZRAN_INFLATE_BLOCK_BOUNDARY;
+                break;
+            }
+
+            /*
+             * We've found the end of file, or end of one
+             * gzip stream. Validate the uncompressed
+             * data (size/ CRC) against the gzip footer.
+             * Then search for a new stream and, if we
+             * find one, re-initialise inflation
+             */
+            if (z_ret == Z_STREAM_END) {
+
+                zran_log("End of gzip stream [%u]\n", strm->avail_in);
+
+                /*
+                 * Make sure we have data in the input buffer
+                 * to read and validate the gzip footer and,
+                 * in case we are reading concatenated
+                 * streams, to search for the next stream and
+                 * read its header.
+                 *
+                 * There is no way of knowing how much data we
+                 * need to read in here - there is no upper
+                 * bound on the amount of null padding bytes
+                 * that may be present in between, or at the
+                 * end of, a stream, and there is no upper
+                 * bound on the size of a gzip header.
+
+                 * So a critical assumption is made here, that
+                 * the size of the read buffer is large enough
+                 * to encompass all of:
+                 *
+                 *   - the footer of a gzip stream,
+                 *   - null padding after the end of a gzip
+                 *     stream, and
+                 *   - the header of the next gzip stream
+                 *
+                 * This assumption could be removed by changing
+                 * the way that data is loaded and buffered
+                 * from the file - e.g. we could load bytes in
+                 * one-by-one, skipping over null bytes, and
+                 * then parse the gzip header ourselves.  But
+                 * this is far too much work for what is a very
+                 * edge-casey scenario.
+                 */
+                z_ret = _zran_read_data_from_file(reader,
+                                                  strm,
+                                                  cmp_offset,
+                                                  uncmp_offset,
+                                                  index->readbuf_size);
+                if (!((z_ret == 0) || (z_ret == ZRAN_READ_DATA_EOF))) {
+                    goto fail;
+                }
+
+                /*
+                 * If there is no more data, the footer is
+                 * missing, so the data must be corrupt.
+                 */
+                if (strm->avail_in < 8) {
+                    goto fail;
+                }
+
+                if (reader->footers != NULL &&
+                    _zran_log_footer(reader, strm, uncmp_offset) != 0) {
+                    goto fail;
+                }
+
+                /*
+                 * _validate_stream reads and checks in the
+                 * gzip stream footer (the CRC32 and ISIZE
+                 * fields at the end of a gzip stream), and
+                 * _find_next_stream will skip over any
+                 * remaining bytes (e.g. null padding bytes)
+                 * until eof, or a new stream is found.
+                 *
+                 * The number of bytes that were read/
+                 * skipped over are accumulated into off.
+                 */
+                off = 0;
+
+                /*
+                 * If we have not yet validated this stream,
+                 * check that the CRC and uncompressed size in
+                 * the footer match what we have calculated
+                 */
+                if (uncmp_offset > reader->last_stream_ended &&
+                    reader->validating) {
+                    z_ret = _zran_validate_stream(reader, strm, &off);
+
+                    if (z_ret == ZRAN_VALIDATE_STREAM_INVALID) {
+                        error_return_val = ZRAN_INFLATE_CRC_ERROR;
+                        goto fail;
+                    }
+                    else if (z_ret != 0) {
+                        goto fail;
+                    }
+                    reader->last_stream_ended = uncmp_offset;
+                    reader->validating        = 0;
+                }
+
+                /* Otherwise skip over the 8 byte GZIP footer */
+                else {
+                    strm->avail_in -= 8;
+                    strm->next_in  += 8;
+                    off            += 8;
+                }
+
+                /*
+                 * See if we have another concatenated gzip
+                 * stream.  If we run out of input data here,
+                 * bad things will happen. Refer to the long
+                 * comment regarding the input buffer, above.
+                 */
+                z_ret = _zran_find_next_stream(reader, strm, &off);
+
+                cmp_offset      += off;
+                _total_consumed += off;
+
+                /*
+                 * If _zran_find_next_stream can't find
+                 * a new stream, we are either out of
+                 * compressed input data, or at eof. In
+                 * either case, break and let the outer
+                 * loop deal with it.
+                 */
+                if (z_ret == ZRAN_FIND_STREAM_NOT_FOUND) {
+                    break;
+                }
+                else if (z_ret != 0) {
+                    goto fail;
+                }
+
+                if (add_stream_points) {
+                    if (_zran_add_point(index,
+                                        0,
+                                        cmp_offset,
+                                        uncmp_offset,
+                                        0,
+                                        0,
+                                        NULL,
+                                        NULL) != 0) {
+                        goto fail;
+                    }
+                }
+            }
+
+            /*
+             * We've run out of space to store decompressed
+             * data - this is the responsibility of the caller,
+             * so bail out.
+             */
+            if (strm->avail_out == 0) {
+
+                zran_log("Output buffer full - stopping inflation\n");
+
+                /*
+                 * We return OUTPUT_FULL if we haven't
+                 * decompressed the requested number of
+                 * bytes, or ZRAN_INFLATE_STOP_AT_BLOCK
+                 * is active and we haven't yet found a
+                 * block.
+                 */
+                if (inflate_stop_at_block(flags) || _total_output < len) {
+                    return_val = ZRAN_INFLATE_OUTPUT_FULL;
+                }
+                break;
+            }
+        }
+
+        /*
+         * Some of the code above has decided that
+         * it wants this _zran_inflate call to return.
+         */
+        if (return_val != ZRAN_INFLATE_OK) {
+            break;
+        }
+    }
+
+    /*
+     * If ZRAN_INFLATE_FREE_READBUF is
+     * active, clear input buffer memory
+     * and offsets.
+     */
+    if (inflate_free_readbuf(flags)) {
+        free(reader->readbuf);
+        reader->readbuf        = NULL;
+        reader->readbuf_offset = 0;
+        reader->readbuf_end    = 0;
+    }
+
+    /*
+     * Otherwise save the readbuf
+     * offset for next time.
+     */
+    else {
+        reader->readbuf_offset = reader->readbuf_end - strm->avail_in;
+    }
+
+    /*
+     * If ZRAN_INFLATE_FREE_Z_STREAM
+     * is active, do just that.
+     */
+    if (inflate_free_stream(flags)) {
+        if (inflateEnd(strm) != Z_OK)
+            goto fail;
+    }
+
+    /*
+     * Update the total number of
+     * bytes that were consumed/read
+     */
+    *total_consumed = _total_consumed;
+    *total_output   = _total_output;
+
+    /*
+     * Update the compressed/uncompressed
+     * offsets in case we need to use them
+     * later.
+     */
+    reader->inflate_cmp_offset   = cmp_offset;
+    reader->inflate_uncmp_offset = uncmp_offset;
+
+    zran_log("Inflate finished - consumed=%u, output=%u,\n"
+             "                   cmp_offset=%llu, uncmp_offset=%llu \n\n",
+             *total_consumed, *total_output,
+             cmp_offset, uncmp_offset);
+
+    /* Phew. */
+    return return_val;
+
+fail:
+    if (reader->readbuf != NULL) {
+        free(reader->readbuf);
+        reader->readbuf        = NULL;
+        reader->readbuf_offset = 0;
+        reader->readbuf_end    = 0;
+    }
+
+    return error_return_val;
+}
+
+
+/* Parses a BGZF block header, returning the header and block sizes. */
+int _zran_bgzf_block(uint8_t  *buf,
+                     uint32_t  len,
+                     uint32_t *hlen,
+                     uint32_t *bsize) {
+
+    uint32_t xlen;
+    uint32_t off;
+    uint32_t slen;
+
+    /*
+     * A BGZF header has the FEXTRA
+     * flag, and no other flags.
+     */
+    if (len    < ZRAN_BGZF_HEADER_SIZE ||
+        buf[0] != 0x1f                 ||
+        buf[1] != 0x8b                 ||
+        buf[2] != 8                    ||
+        buf[3] != 4)
+        return ZRAN_BGZF_NOT_BGZF;
+
+    xlen = buf[10] | (buf[11] << 8);
+
+    if (len < ZRAN_BGZF_HEADER_SIZE + xlen)
+        return ZRAN_BGZF_NOT_BGZF;
+
+    /*
+     * Look for the BC subfield - there
+     * may be other subfields as well.
+     */
+    off = ZRAN_BGZF_HEADER_SIZE;
+    while (off + 4 <= ZRAN_BGZF_HEADER_SIZE + xlen) {
+
+        slen = buf[off + 2] | (buf[off + 3] << 8);
+
+        if (buf[off] == 'B' && buf[off + 1] == 'C' && slen == 2 &&
+            off + ZRAN_BGZF_FIELD_SIZE <= ZRAN_BGZF_HEADER_SIZE + xlen) {
+
+            *hlen  = ZRAN_BGZF_HEADER_SIZE + xlen;
+            *bsize = (buf[off + 4] | (buf[off + 5] << 8)) + 1;
+
+            /*
+             * The block must at least contain
+             * the header and the footer.
+             */
+            if (*bsize < *hlen + 8)
+                return ZRAN_BGZF_NOT_BGZF;
+
+            return ZRAN_BGZF_OK;
+        }
+
+        off += 4 + slen;
+    }
+
+    return ZRAN_BGZF_NOT_BGZF;
+}
+
+
+/*
+ * Always rebuilds the whole index from scratch - until
+ * is only used to skip the rebuild if the index already
+ * covers it.
+ */
+int _zran_expand_bgzf_index(zran_index_t *index, uint64_t until) {
+
+    zran_reader_t *reader = _zran_index_reader(index);
+    uint8_t        buf[ZRAN_BGZF_READ_SIZE + 4];
+    uint8_t       *header;
+    uint32_t       len;
+    uint32_t       hlen;
+    uint32_t       bsize;
+    uint32_t       isize;
+    uint64_t       cmp_offset;
+    uint64_t       uncmp_offset;
+
+    zran_log("_zran_expand_bgzf_index(%llu)\n", until);
+
+    /*
+     * The index already covers the requested
+     * offset. Nothing needs to be done.
+     */
+    if (index->npoints > 1 &&
+        until != 0         &&
+        until <= index->cmp_offsets[index->npoints - 1])
+        return ZRAN_BGZF_OK;
+
+    /* Start from scratch */
+    _zran_free_cursor(reader);
+    if (_zran_invalidate_index(index, 0) != 0)
+        return ZRAN_BGZF_ERROR;
+
+    /*
+     * The data is not inflated,
+     * so span CRCs are not known.
+     */
+    reader->span_active = 0;
+    cmp_offset          = 0;
+    uncmp_offset        = 0;
+
+    if (_zran_fseek(reader, 0) != 0)
+        goto fail;
+
+    len    = _zran_fread(reader, buf, ZRAN_BGZF_READ_SIZE);
+    header = buf;
+
+    /*
+     * Each read contains the ISIZE field at the
+     * end of a block, followed by the header of
+     * the next block (apart from the first read).
+     */
+    while (cmp_offset < index->compressed_size) {
+
+        if (_zran_ferror(reader))
+            goto fail;
+
+        if (_zran_bgzf_block(header, len, &hlen, &bsize) != ZRAN_BGZF_OK)
+            goto not_bgzf;
+
+        /*
+         * Empty blocks (e.g. the BGZF EOF marker)
+         * don't need a point of their own.
+         */
+        if (index->npoints == 0 ||
+            index->uncmp_offsets[index->npoints - 1] < uncmp_offset) {
+            if (_zran_add_point(index,
+                                0,
+                                cmp_offset + hlen,
+                                uncmp_offset,
+                                0,
+                                0,
+                                NULL,
+                                NULL) != 0)
+                goto fail;
+        }
+
+        cmp_offset += bsize;
+
+        if (cmp_offset > index->compressed_size)
+            goto not_bgzf;
+
+        if (_zran_fseek(reader, cmp_offset - 4) != 0)
+            goto fail;
+
+        len = _zran_fread(reader, buf, ZRAN_BGZF_READ_SIZE + 4);
+
+        if (len < 4)
+            goto fail;
+
+        isize         = ((uint32_t)buf[0]       |
+                         (uint32_t)buf[1] << 8  |
+                         (uint32_t)buf[2] << 16 |
+                         (uint32_t)buf[3] << 24);
+        uncmp_offset += isize;
+        header        = buf + 4;
+        len          -= 4;
+    }
+
+    /*
+     * Make sure that the last point is at the
+     * end of the data, if the file does not
+     * end with an empty block.
+     */
+    if (index->uncmp_offsets[index->npoints - 1] < uncmp_offset) {
+        if (_zran_add_point(index,
+                            0,
+                            index->compressed_size,
+                            uncmp_offset,
+                            0,
+                            0,
+                            NULL,
+                            NULL) != 0)
+            goto fail;
+    }
+
+    index->uncompressed_size = uncmp_offset;
+
+    if (_zran_free_unused(index) != 0)
+        goto fail;
+
+    return ZRAN_BGZF_OK;
+
+not_bgzf:
+    zran_log("_zran_expand_bgzf_index: not a BGZF block at %llu\n",
+             cmp_offset);
+    if (_zran_invalidate_index(index, 0) != 0)
+        goto fail;
+    return ZRAN_BGZF_NOT_BGZF;
+
+fail:
+    return ZRAN_BGZF_ERROR;
+}
+
+
+int _zran_read_bgzf_block(FILE     *fd,
+                          PyObject *f,
+                          uint64_t  offset,
+                          uint32_t *hlen,
+                          uint32_t *bsize,
+                          uint32_t *isize) {
+
+    uint8_t buf[ZRAN_BGZF_READ_SIZE];
+    size_t  len;
+
+    if (fseek_(fd, f, offset, SEEK_SET) != 0)
+        return ZRAN_BGZF_ERROR;
+
+    len = fread_(buf, 1, ZRAN_BGZF_READ_SIZE, fd, f);
+    if (ferror_(fd, f))
+        return ZRAN_BGZF_ERROR;
+
+    if (_zran_bgzf_block(buf, len, hlen, bsize) != ZRAN_BGZF_OK)
+        return ZRAN_BGZF_NOT_BGZF;
+
+    if (isize == NULL)
+        return ZRAN_BGZF_OK;
+
+    if (fseek_(fd, f, offset + *bsize - 4, SEEK_SET) != 0)
+        return ZRAN_BGZF_ERROR;
+
+    len = fread_(buf, 1, 4, fd, f);
+    if (ferror_(fd, f))
+        return ZRAN_BGZF_ERROR;
+    if (len != 4)
+        return ZRAN_BGZF_NOT_BGZF;
+
+    *isize = _zran_get_uint(buf, 4, 0);
+
+    return ZRAN_BGZF_OK;
+}
+
+
+int _zran_expand_index(zran_index_t *index, uint64_t until) {
+
+    /*
+     * The index is built with the
+     * reader that is embedded in it.
+     */
+    zran_reader_t *reader = _zran_index_reader(index);
+
+    /*
+     * Used to store return code when
+     * an error occurs.
+     */
+    int error_return_val = ZRAN_EXPAND_INDEX_FAIL;
+
+    /*
+     * Used to store and check return values
+     * from zlib and zran functions.
+     */
+    int z_ret;
+
+    /* Zlib stream struct */
+    z_stream strm;
+
+    /*
+     * Number of bytes read/decompressed
+     * on each call to _zran_inflate.
+     */
+    uint32_t bytes_consumed;
+    uint32_t bytes_output;
+
+    /*
+     * Buffer to store uncompressed data,
+     * size of said buffer, and current offset
+     * into said buffer. We wrap the buffer
+     * around to the beginning when it is
+     * filled.
+     *
+     * Ideally, we only want to decompress
+     * index->spacing bytes before creating a
+     * new index point. But we may have to
+     * decompress more than this before a
+     * suitable location (a block/stream
+     * boundary) is found, so we allocate
+     * more space.
+     */
+    uint8_t *data        = NULL;
+    uint32_t data_size   = index->spacing * 4;
+    uint32_t data_offset = 0;
+
+    /*
+     * Window bytes which are referenced after
+     * each new point (see _zran_find_window_refs).
+     * If none are, the point does not need a
+     * window at all.
+     */
+    uint8_t *refs;
+    int      refs_ret;
+    uint32_t ref_start;
+    uint32_t ref_end;
+    uint8_t  windowless;
+
+    /*
+     * _zran_inflate control flags. We need
+     * to use different flags on the first
+     * call - first_inflate is used to track
+     * this.
+     */
+    uint16_t inflate_flags;
+    uint8_t  first_inflate = 1;
+
+    /*
+     * Counters to keep track of where we are
+     * in both the compressed and uncompressed
+     * streams.
+     */
+    uint64_t cmp_offset;
+    uint64_t uncmp_offset;
+    uint64_t last_uncmp_offset;
+
+    /*
+     * start is a copy of the last point
+     * in the index when this function
+     * is called. This is where we need
+     * to start decompressing data from
+     * before we can add more index points.
+     *
+     * last_created is a copy of the
+     * most recent point that was added
+     * to the index in this call to
+     * _zran_expand_index.
+     *
+     * Each of these refers to the
+     * corresponding *_point struct,
+     * or is NULL if there is no
+     * such point.
+     */
+    zran_point_t  start_point;
+    zran_point_t  last_point;
+    zran_point_t *start        = NULL;
+    zran_point_t *last_created = NULL;
+
+    /*
+     * BGZF files are indexed from their block
+     * headers. If the file turns out not to be
+     * entirely made of BGZF blocks, it is
+     * indexed in the normal way.
+     */
+    if (index->bgzf) {
+        z_ret = _zran_expand_bgzf_index(index, until);
+
+        if      (z_ret == ZRAN_BGZF_OK)    return ZRAN_EXPAND_INDEX_OK;
+        else if (z_ret == ZRAN_BGZF_ERROR) return ZRAN_EXPAND_INDEX_FAIL;
+
+        index->bgzf = 0;
+    }
+
+    /*
+     * In order to create a new index
+     * point, we need to start reading
+     * at the last index point, so that
+     * we read enough data to initialise
+     * the inflation. If we don't have
+     * at least two points, we start
+     * at the beginning of the file.
+     */
+    start = NULL;
+    if (index->npoints > 1) {
+
+        zran_get_point(index, index->npoints - 1, &start_point);
+        start = &start_point;
+
+        /*
+         * The index already covers the requested
+         * offset. Nothing needs to be done.
+         */
+        if (until != 0 && until <= start->cmp_offset)
+            return 0;
+    }
+
+    /*
+     * We need the read buffer, so the
+     * zran_read inflation cursor (if
+     * there is one) has to go.
+     */
+    _zran_free_cursor(reader);
+
+    /*
+     * Allocate memory for the
+     * uncompressed data buffer.
+     */
+    data = calloc(1, data_size);
+    if (data == NULL)
+        goto fail;
+
+    /* Let's do this. */
+    zran_log("_zran_expand_index(%llu)\n", until);
+
+    /*
+     * If the caller passed until == 0,
+     * we expand to EOF.
+     */
+    if (until == 0) {
+        until = UINT64_MAX;
+    }
+
+    /*
+     * We start from the last point in
+     * the index, or the beginning of
+     * the file, if there are not enough
+     * points in the index.
+     */
+    if (start != NULL) {
+        cmp_offset        = start->cmp_offset;
+        uncmp_offset      = start->uncmp_offset;
+        last_uncmp_offset = uncmp_offset;
+    }
+    else {
+        cmp_offset        = 0;
+        uncmp_offset      = 0;
+        last_uncmp_offset = 0;
+    }
+
+    /*
+     * Read compressed data ahead on an I/O
+     * thread, so that inflation doesn't have
+     * to wait for it. If this is not possible,
+     * data is read as and when it is needed.
+     */
+    if (until - cmp_offset >= ZRAN_PIPELINE_MIN_SIZE)
+        _zran_start_pipeline(reader);
+
+    /*
+     * Don't finish until we're at the end of the
+     * file (break at bottom of loop), or we've
+     * expanded the index past the requested
+     * offset (and have created at least one new
+     * index point - last_created == NULL tells
+     * us whether a point has been created).
+     */
+    while (last_created == NULL || last_created->cmp_offset < until) {
+
+        /*
+         * On the first call to _zran_inflate, we
+         * tell it to initialise the zlib stream
+         * struct, create a read buffer, and start
+         * inflation from our starting point.
+         */
+        if (first_inflate) {
+            first_inflate = 0;
+            inflate_flags = (ZRAN_INFLATE_INIT_Z_STREAM         |
+                             ZRAN_INFLATE_INIT_READBUF          |
+                             ZRAN_INFLATE_USE_OFFSET            |
+                             ZRAN_INFLATE_CLEAR_READBUF_OFFSETS |
+                             ZRAN_INFLATE_STOP_AT_BLOCK);
+        }
+
+        /*
+         * On subsequent calls, we tell _zran_inflate
+         * to just continue where it left off on the
+         * previous call.
+         */
+        else {
+            inflate_flags = ZRAN_INFLATE_STOP_AT_BLOCK;
+        }
+
+        zran_log("Searching for next block boundary\n"
+                 "       c=%llu, u=%llu,\n"
+                 "       data_offset=%u, data_space=%u\n",
+                 cmp_offset, uncmp_offset, data_offset,
+                 data_size - data_offset);
+
+        /*
+         * We wrap the data buffer around to its
+         * beginning by using some trickery with
+         * the data_offset. By doing this, the
+         * _zran_add_point function will be able
+         * to retrieve the data associated with
+         * an index point even if some of it it
+         * is contained at the end of the data
+         * buffer, and the rest at the beginning.
+         */
+        z_ret = _zran_inflate(reader,
+                              &strm,
+                              cmp_offset,
+                              inflate_flags,
+                              &bytes_consumed,
+                              &bytes_output,
+                              data_size - data_offset,
+                              data      + data_offset,
+                              1);
+
+        cmp_offset   += bytes_consumed;
+        uncmp_offset += bytes_output;
+        data_offset   = (data_offset + bytes_output) % data_size;
+
+        /*
+         * update the last created offset on every iteration,
+         * to catch any index points created by _zran_inflate
+         */
+        if (index->npoints > 0) {
+            zran_get_point(index, index->npoints - 1, &last_point);
+            last_created      = &last_point;
+            last_uncmp_offset = last_created->uncmp_offset;
+        }
+
+        /*
+         * Has the output buffer been filled?
+         * If so, we just continue - the
+         * data_offset trickery means that we
+         * can ask the _zran_inflate function
+         * to just keep filling the buffer
+         * until we find a block.
+         */
+        if (z_ret == ZRAN_INFLATE_OUTPUT_FULL)
+            continue;
+
+        /*
+         * If z_ret != ZRAN_INFLATE_EOF or
+         * ZRAN_INFLATE_BLOCK_BOUNDARY,
+         * something has gone wrong.
+         */
+        else if (z_ret != ZRAN_INFLATE_EOF &&
+                 z_ret != ZRAN_INFLATE_BLOCK_BOUNDARY) {
+            if (z_ret == ZRAN_INFLATE_CRC_ERROR) {
+                error_return_val = ZRAN_EXPAND_INDEX_CRC_ERROR;
+            }
+            goto fail;
+        }
+
+        /*
+         * If we're at the end of the file (z_ret
+         * == ZRAN_INFLATE_EOF), or at a compress
+         * block boundary, and index->spacing bytes
+         * have passed since the last index point
+         * that was created, we'll create a new
+         * index point at this location.
+         *
+         * Note that the _zran_inflate function
+         * also adds index points at the beginning
+         * of the file, and at the beginning of all
+         * other gzip streams, in the case of
+         * concatenated streams (refer to its
+         * add_stream_points argument).
+         */
+        if (z_ret == ZRAN_INFLATE_EOF ||
+            uncmp_offset - last_uncmp_offset >= index->spacing) {
+
+            /*
+             * Find out which window bytes are needed
+             * by the data after the point - nothing
+             * is needed at EOF. If none are needed
+             * (e.g. at a full flush point), the point
+             * is created without a window. This is
+             * only done for byte-aligned points, which
+             * can be read by older versions of
+             * indexed_gzip that don't expect windowless
+             * points in the middle of a stream.
+             */
+            refs       = NULL;
+            windowless = 0;
+            if (z_ret != ZRAN_INFLATE_EOF ||
+                (index->flags & ZRAN_SPARSE_WINDOWS)) {
+
+                refs = _zran_window_buf(index);
+                if (refs == NULL)
+                    goto fail;
+
+                refs += 2 * index->window_size +
+                        compressBound(index->window_size);
+
+                if (z_ret == ZRAN_INFLATE_EOF) {
+                    memset(refs, 0, ZRAN_DEFLATE_WINDOW);
+                }
+                else {
+                    refs_ret = _zran_find_window_refs(reader,
+                                                      cmp_offset,
+                                                      strm.data_type & 7,
+                                                      refs);
+                    if      (refs_ret < 0) goto fail;
+                    else if (refs_ret > 0) refs = NULL;
+                }
+
+                ref_end    = 0;
+                windowless = (z_ret != ZRAN_INFLATE_EOF     &&
+                              refs  != NULL                 &&
+                              (strm.data_type & 7) == 0     &&
+                              !_zran_next_ref_range(refs,
+                                                    &ref_start,
+                                                    &ref_end));
+            }
+
+            if (_zran_add_point(index,
+                                strm.data_type & 7,
+                                cmp_offset,
+                                uncmp_offset,
+                                data_offset,
+                                data_size,
+                                windowless ? NULL : data,
+                                refs) != 0) {
+                goto fail;
+            }
+
+            if (_zran_enforce_window_budget(index) != 0)
+                goto fail;
+            zran_get_point(index, index->npoints - 1, &last_point);
+            last_created      = &last_point;
+            last_uncmp_offset = uncmp_offset;
+        }
+
+        /* And if at EOF, we are done. */
+        if (z_ret == ZRAN_INFLATE_EOF) {
+            break;
+        }
+    }
+
+    /*
+     * A final call to _zran_inflate, to clean
+     * up read buffer and z_stream memory.
+     */
+    z_ret = _zran_inflate(reader,
+                          &strm,
+                          0,
+                          (ZRAN_INFLATE_CLEAR_READBUF_OFFSETS |
+                           ZRAN_INFLATE_FREE_Z_STREAM         |
+                           ZRAN_INFLATE_FREE_READBUF),
+                          &bytes_consumed,
+                          &bytes_output,
+                          0,
+                          data,
+                          0);
+
+    if (z_ret != ZRAN_INFLATE_OK && z_ret != ZRAN_INFLATE_EOF) {
+        if (z_ret == ZRAN_INFLATE_CRC_ERROR) {
+            error_return_val = ZRAN_EXPAND_INDEX_CRC_ERROR;
+        }
+        goto fail;
+    }
+
+    /*
+     * The index may have over-allocated
+     * space for storing index points, so
+     * here we free the unused memory.
+     */
+    if (_zran_free_unused(index) != 0) {
+        goto fail;
+    }
+
+    zran_log("Expansion finished (cmp_offset=%llu, last_created=%llu)\n",
+             cmp_offset, last_created->cmp_offset);
+
+    _zran_stop_pipeline(reader);
+    free(data);
+    return ZRAN_EXPAND_INDEX_OK;
+
+fail:
+    _zran_stop_pipeline(reader);
+    free(data);
+    return error_return_val;
+}
+
+
+/*
+ * Get the index point corresponding to the given offset - the index is
+ * only expanded for its own reader.
+ */
+int _zran_reader_get_point(zran_reader_t  *reader,
+                           uint64_t        offset,
+                           uint8_t         compressed,
+                           zran_point_t   *point)
+{
+    if (reader == &(reader->index->reader))
+        return _zran_get_point_with_expand(reader->index,
+                                           offset,
+                                           compressed,
+                                           &(reader->last_point),
+                                           point);
+    else
+        return _zran_get_point_at(reader->index,
+                                  offset,
+                                  compressed,
+                                  &(reader->last_point),
+                                  point);
+}
+
+
+/*
+ * Seek to the approximate location of the specified offset into
+ * the uncompressed data stream.
+ */
+int _zran_seek(zran_reader_t  *reader,
+               int64_t         offset,
+               uint8_t         whence,
+               zran_point_t   *point)
+{
+
+    zran_index_t *index = reader->index;
+    int           result;
+    zran_point_t  seek_point;
+
+    memset(&seek_point, 0, sizeof(zran_point_t));
+
+    zran_log("zran_seek(%lld, %i)\n", offset, whence);
+
+    if (whence == SEEK_END && index->uncompressed_size == 0) {
+      goto index_not_built;
+    }
+
+    /*
+     * The offset passed in is signed, so
+     * negative offsets are allowed. But
+     * here we transform the offset to
+     * positive, as _zran_get_point_with_expand
+     * requires an absolute offset from the
+     * beginning of the uncompressed stream.
+     *
+     * I am not currently taking into account
+     * the overflow potential when converting
+     * from int64 to uint64.
+     */
+
+    /*
+     * SEEK_END: seek relative to the
+     * end of the uncompressed stream
+     */
+    if (whence == SEEK_END) {
+      offset += index->uncompressed_size;
+    }
+
+    /*
+     * SEEK_CUR: seek relative to
+     * the current file position.
+     */
+    if (whence == SEEK_CUR) {
+      offset += reader->uncmp_seek_offset;
+    }
+
+    /* Bad input */
+    if (offset < 0) {
+      goto fail;
+    }
+
+    /*
+     * We implicitly allow seek(0) - if
+     * not auto-building the index,
+     * seek(0) would otherwwise fail.
+     */
+    if (offset == 0) {
+        reader->uncmp_seek_offset = offset;
+    }
+    else {
+
+        /*
+         * Get the index point that
+         * corresponds to this offset.
+         */
+        result = _zran_reader_get_point(reader, offset, 0, &seek_point);
+
+        if      (result == ZRAN_GET_POINT_EOF)         goto eof;
+        else if (result == ZRAN_GET_POINT_NOT_COVERED) goto not_covered;
+        else if (result == ZRAN_GET_POINT_CRC_ERROR)   goto crcerror;
+        else if (result != ZRAN_GET_POINT_OK)          goto fail;
+
+        /*
+         * transform into an offset
+         * into the compressed stream
+         */
+        reader->uncmp_seek_offset = offset;
+        offset                    = seek_point.cmp_offset;
+
+        /*
+         * This index point is not byte-aligned.
+         * Adjust the offset accordingly.
+         */
+        if (seek_point.bits > 0)
+            offset -= 1;
+    }
+
+    /*
+     * The caller wants a copy of the
+     * index point corresponding to
+     * the seek location.
+     */
+    if (point != NULL) {
+        *point = seek_point;
+    }
+
+    if (_zran_fseek(reader, offset) != 0)
+        goto fail;
+
+    return ZRAN_SEEK_OK;
+
+crcerror:        return ZRAN_SEEK_CRC_ERROR;
+fail:            return ZRAN_SEEK_FAIL;
+index_not_built: return ZRAN_SEEK_INDEX_NOT_BUILT;
+not_covered:     return ZRAN_SEEK_NOT_COVERED;
+eof:
+    reader->uncmp_seek_offset = index->uncompressed_size;
+    return ZRAN_SEEK_EOF;
+}
+
+
+/* Seek to the specified offset in the uncompressed data stream. */
+int zran_seek(zran_index_t  *index,
+              int64_t        offset,
+              uint8_t        whence,
+              zran_point_t  *point)
+{
+    return _zran_seek(_zran_index_reader(index), offset, whence, point);
+}
+
+
+/* Return the current seek position in the uncompressed data stream. */
+uint64_t zran_tell(zran_index_t *index) {
+
+    return index->reader.uncmp_seek_offset;
+}
+
+
+/* Read len bytes from the uncompressed data stream, storing them in buf. */
+int64_t zran_read(zran_index_t *index,
+                  void         *buf,
+                  uint64_t      len) {
+
+    zran_reader_t *reader = _zran_index_reader(index);
+
+    if (reader->readahead != NULL)
+        return _zran_readahead_read(reader, buf, len);
+
+    return _zran_cached_read(reader, buf, len);
+}
+
+
+/* Read data via the span caches, decompressing and caching missing spans. */
+int64_t _zran_cached_read(zran_reader_t *reader,
+                          void          *buf,
+                          uint64_t       len) {
+
+    zran_index_t *index = reader->index;
+    uint8_t      *out   = (uint8_t *)buf;
+    uint8_t      *data  = NULL;
+    uint64_t      mem_budget;
+    uint64_t      disk_budget;
+    uint64_t      disk_key;
+    uint64_t      total = 0;
+    uint64_t      pos;
+    uint64_t      start;
+    uint64_t      end;
+    uint64_t      got;
+    uint64_t      n;
+    uint32_t      span;
+    uint8_t       in_mem;
+    uint8_t       on_disk;
+    uint8_t       loaded;
+    int64_t       ret;
+
+    mem_budget  = atomic_load_u64(&zran_span_cache.budget);
+    disk_budget = atomic_load_u64(&zran_disk_cache.budget);
+    disk_key    = 0;
+
+    /*
+     * The disk cache key of the file is only
+     * calculated when it is first needed, as
+     * the file has to be read to do so.
+     */
+    if (disk_budget > 0) {
+        disk_key = atomic_load_u64(&index->disk_key);
+        if (disk_key == 0) {
+            disk_key = _zran_disk_key(reader);
+            atomic_store_u64(&index->disk_key, disk_key);
+        }
+        if (disk_key == ZRAN_DISK_KEY_NONE)
+            disk_budget = 0;
+    }
+
+    if ((mem_budget == 0 && disk_budget == 0) ||
+        len == 0                              ||
+        len > INT64_MAX)
+        return _zran_read(reader, buf, len);
+
+    while (total < len) {
+
+        pos = reader->uncmp_seek_offset;
+
+        /*
+         * Only spans which lie between two
+         * index points are cached - anything
+         * after the last point is read (and
+         * the index expanded) by _zran_read.
+         */
+        if (index->npoints < 2)
+            break;
+
+        span = _zran_find_span(index, pos);
+
+        if (span + 1 >= index->npoints ||
+            index->uncmp_offsets[span] > pos)
+            break;
+
+        start   = index->uncmp_offsets[span];
+        end     = index->uncmp_offsets[span + 1];
+        n       = end - pos;
+        in_mem  = end - start <= mem_budget  / ZRAN_SPAN_CACHE_MAX_FRACTION;
+        on_disk = end - start <= disk_budget / ZRAN_SPAN_CACHE_MAX_FRACTION;
+
+        if (n > len - total)
+            n = len - total;
+
+        /*
+         * Spans loaded from the disk cache are
+         * checked against their span CRC, so
+         * spans without one are not stored on
+         * disk (e.g. if CRC checks are disabled).
+         */
+        if (index->span_crcs == NULL || span >= index->nspans)
+            on_disk = 0;
+
+        if (in_mem && _zran_span_cache_copy(index->cache_id,
+                                            start,
+                                            pos,
+                                            out + total,
+                                            n)) {
+            reader->uncmp_seek_offset += n;
+            total                     += n;
+            continue;
+        }
+
+        /* Too big to cache - read it directly */
+        if (!in_mem && !on_disk) {
+            ret = _zran_read(reader, out + total, n);
+            if (ret <= 0)
+                goto fail;
+            total += ret;
+            continue;
+        }
+
+        /*
+         * Load the whole span from the disk
+         * cache, or decompress it (and add it
+         * to the disk cache), then copy out the
+         * part that we need, and add the span
+         * to the memory cache.
+         */
+        data = malloc(end - start);
+        if (data == NULL) {
+            ret = ZRAN_READ_FAIL;
+            goto fail;
+        }
+
+        loaded = on_disk &&
+                 _zran_disk_cache_load(disk_key,
+                                       start,
+                                       data,
+                                       end - start,
+                                       index->span_crcs[span]);
+
+        if (!loaded) {
+
+            reader->uncmp_seek_offset = start;
+
+            for (got = 0; got < end - start; got += ret) {
+                ret = _zran_read(reader, data + got, end - start - got);
+                if (ret <= 0) {
+                    if (ret == ZRAN_READ_EOF)
+                        ret = ZRAN_READ_FAIL;
+                    reader->uncmp_seek_offset = pos;
+                    free(data);
+                    goto fail;
+                }
+            }
+
+            if (on_disk)
+                _zran_disk_cache_store(disk_key,
+                                       start,
+                                       end - start,
+                                       data);
+        }
+
+        memcpy(out + total, data + (pos - start), n);
+
+        if (in_mem)
+            _zran_span_cache_insert(index->cache_id,
+                                    start,
+                                    end - start,
+                                    data);
+        else
+            free(data);
+
+        reader->uncmp_seek_offset = pos + n;
+        total                    += n;
+    }
+
+    if (total < len) {
+        ret = _zran_read(reader, out + total, len - total);
+        if (ret < 0)
+            goto fail;
+        total += ret;
+    }
+
+    return total;
+
+fail:
+    /*
+     * Return whatever we managed to read
+     * before reaching EOF. Errors are
+     * always reported.
+     */
+    if (ret == ZRAN_READ_EOF && total > 0)
+        return total;
+    if (ret == 0)
+        return total;
+    return ret;
+}
+
+
+/* Read len bytes from the uncompressed data stream, storing them in buf. */
+int64_t _zran_read(zran_reader_t *reader,
+                   void          *buf,
+                   uint64_t       len) {
+
+    /* The index that the reader is using. */
+    zran_index_t *index = reader->index;
+
+    /* Used to store/check return values. */
+    int ret;
+
+    /*
+     * Used to store error code for return
+     *   if an error occurs
+     */
+    int error_return_val = ZRAN_READ_FAIL;
+
+    /*
+     * Number of bytes we try to read, and
+     * number of bytes actually read/output
+     * on each call to _zran_inflate.
+     */
+    uint64_t bytes_to_read;
+    uint32_t bytes_consumed;
+    uint32_t bytes_output;
+
+    /*
+     * _zran_inflate control flags. We need
+     * to pass different flags on the first
+     * call to _zran_inflate.
+     */
+    uint16_t inflate_flags;
+    uint8_t  first_inflate = 1;
+
+    /*
+     * Set to 1 if we are carrying on from
+     * the inflation cursor left behind by
+     * a previous call.
+     */
+    uint8_t  resume;
+
+    /*
+     * Counters keeping track of the current
+     * location in both the compressed and
+     * uncompressed streams, and the total
+     * number of bytes read.
+     */
+    uint64_t uncmp_offset;
+    uint64_t cmp_offset;
+    uint64_t total_read;
+
+    /*
+     * Zlib stream struct and starting
+     * index point for the read. The
+     * z_stream is stored in the index,
+     * so it can be re-used by the next
+     * call (see _zran_resume_cursor).
+     */
+    z_stream     *strm = &(reader->cursor);
+    zran_point_t  start;
+
+    /*
+     * Memory used to store bytes that we skip
+     * over before reaching the appropriate
+     * point in the uncompressed data stream.
+     *
+     * to_discard is used to store the number of
+     * bytes that we want to discard on a single
+     * call to _zran_inflate (which is limited by
+     * the discard buffer size).
+     *
+     * total_discarded keeps track of the total
+     * number of bytes discarded so far.
+     *
+     * discard_size is the size of the discard *
+     * buffer. Ideally we will only have to
+     * decompress (on average) spacing / 2 bytes
+     * before reaching the seek location (or none
+     * at all if we are carrying on from the
+     * cursor), but this isn't a guarantee, so we
+     * allocate more to reduce the number of reads
+     * that are required.
+     */
+    uint8_t *discard         = NULL;
+    uint64_t to_discard      = 0;
+    uint64_t total_discarded = 0;
+    uint64_t discard_size    = index->spacing * 4;
+
+    if (len == 0)         return 0;
+    if (len >  INT64_MAX) goto fail;
+
+    zran_log("zran_read(%llu, %lu)\n", len, reader->uncmp_seek_offset);
+
+    if (index->uncompressed_size > 0 &&
+        reader->uncmp_seek_offset >= index->uncompressed_size)
+        goto eof;
+
+    /*
+     * If the previous read finished exactly
+     * where this one starts, we can just carry
+     * on from there, without needing to look up
+     * an index point.
+     */
+    resume = reader->cursor_active &&
+             reader->inflate_uncmp_offset == reader->uncmp_seek_offset;
+
+    /*
+     * Otherwise we search for the index point that
+     * corresponds to our current seek location in
+     * the uncompressed data stream. Reading from the
+     * start of file is always allowed, even if the
+     * index does not contain any points.
+     */
+    if (resume) {
+        cmp_offset   = reader->inflate_cmp_offset;
+        uncmp_offset = reader->inflate_uncmp_offset;
+    }
+    else if (reader->uncmp_seek_offset == 0) {
+        cmp_offset   = 0;
+        uncmp_offset = 0;
+    }
+    else {
+        ret = _zran_reader_get_point(reader,
+                                     reader->uncmp_seek_offset,
+                                     0,
+                                     &start);
+
+        if      (ret == ZRAN_GET_POINT_EOF)         goto eof;
+        if      (ret == ZRAN_GET_POINT_NOT_COVERED) goto not_covered;
+        else if (ret != ZRAN_GET_POINT_OK) {
+            if (ret == ZRAN_GET_POINT_CRC_ERROR) {
+                error_return_val = ZRAN_READ_CRC_ERROR;
+            }
+            goto fail;
+        }
+
+        cmp_offset   = start.cmp_offset;
+        uncmp_offset = start.uncmp_offset;
+
+        /*
+         * If the cursor is somewhere between the
+         * index point and the seek location (e.g.
+         * the caller has skipped forward a little
+         * bit), we can carry on from the cursor,
+         * and discard less data. Note that the
+         * cursor may have been released if the
+         * index was expanded above.
+         */
+        if (reader->cursor_active                            &&
+            reader->inflate_uncmp_offset >= uncmp_offset      &&
+            reader->inflate_uncmp_offset <= reader->uncmp_seek_offset) {
+            resume       = 1;
+            cmp_offset   = reader->inflate_cmp_offset;
+            uncmp_offset = reader->inflate_uncmp_offset;
+        }
+    }
+
+    /*
+     * We either carry on from the cursor,
+     * or get rid of it and start afresh
+     * from the index point.
+     */
+    if (resume) {
+        zran_log("Resuming from cursor [%llu, %llu]\n",
+                 cmp_offset, uncmp_offset);
+        if (_zran_resume_cursor(reader) != 0)
+            goto fail;
+        first_inflate = 0;
+    }
+    else {
+        _zran_free_cursor(reader);
+        first_inflate = 1;
+    }
+
+    /*
+     * We have to start decompressing from
+     * the index point that precedes the seek
+     * location, so we need to skip over bytes
+     * until we get to that location. We use
+     * the discard buffer to store those bytes.
+     */
+    discard = malloc(discard_size);
+    if (discard == NULL) {
+        goto fail;
+    }
+
+    /*
+     * Inflate and discard data until we
+     * reach the current seek location
+     * into the uncompressed data stream.
+     */
+    total_discarded = 0;
+    while (uncmp_offset < reader->uncmp_seek_offset) {
+
+        /*
+         * On the first call to _zran_inflate,
+         * we tell it to initialise the z_stream,
+         * and create a read buffer.
+         */
+        if (first_inflate) {
+            first_inflate = 0;
+            inflate_flags = (ZRAN_INFLATE_INIT_Z_STREAM         |
+                             ZRAN_INFLATE_INIT_READBUF          |
+                             ZRAN_INFLATE_CLEAR_READBUF_OFFSETS |
+                             ZRAN_INFLATE_USE_OFFSET);
+        }
+        /*
+         * On subsequent calls, we just tell
+         * _zran_inflate to continue where
+         * it left off.
+         */
+        else {
+            inflate_flags = 0;
+        }
+
+        /*
+         * Don't read past the uncompressed seek
+         * location - at this point, we will need
+         * to stop discarding bytes, and start
+         * fulfilling the read request.
+         */
+        to_discard = reader->uncmp_seek_offset - uncmp_offset;
+        if (to_discard > discard_size)
+            to_discard = discard_size;
+
+        zran_log("Discarding %llu bytes (%llu < %llu)\n",
+                 to_discard,
+                 uncmp_offset,
+                 reader->uncmp_seek_offset);
+
+        ret = _zran_inflate(reader,
+                            strm,
+                            cmp_offset,
+                            inflate_flags,
+                            &bytes_consumed,
+                            &bytes_output,
+                            to_discard,
+                            discard,
+                            0);
+
+        /*
+         * _zran_inflate should return 0 if
+         * it runs out of output space (which
+         * is ok), or it has read enough bytes
+         * (which is perfect). Any other
+         * return code means that something
+         * has gone wrong.
+         */
+        if (ret != ZRAN_INFLATE_OUTPUT_FULL &&
+            ret != ZRAN_INFLATE_EOF         &&
+            ret != ZRAN_INFLATE_OK) {
+            if (ret == ZRAN_INFLATE_CRC_ERROR) {
+                error_return_val = ZRAN_READ_CRC_ERROR;
+            }
+            goto fail;
+        }
+
+        cmp_offset      += bytes_consumed;
+        uncmp_offset    += bytes_output;
+        total_discarded += bytes_output;
+    }
+
+    /*
+     * Sanity check - we should be at the
+     * correct location in the uncompressed
+     * stream.
+     *
+     * TODO What happens here if we are at EOF?
+     */
+    if (uncmp_offset != reader->uncmp_seek_offset)
+        goto fail;
+
+    zran_log("Discarded %llu bytes, ready to "
+             "read from %llu (== %llu)\n",
+             total_discarded,
+             uncmp_offset,
+             reader->uncmp_seek_offset);
+
+    /*
+     * At this point, we are ready to inflate
+     * from the uncompressed seek location.
+     */
+
+    total_read = 0;
+    while (total_read < len) {
+
+        /*
+         * If we started at the correct location,
+         * the discard loop above will not have
+         * executed, and _zran_inflate will not
+         * have initialised itself. So we repeat
+         * the flag control stuff here.
+         */
+        if (first_inflate) {
+            first_inflate = 0;
+            inflate_flags = (ZRAN_INFLATE_INIT_Z_STREAM         |
+                             ZRAN_INFLATE_INIT_READBUF          |
+                             ZRAN_INFLATE_CLEAR_READBUF_OFFSETS |
+                             ZRAN_INFLATE_USE_OFFSET);
+        }
+        else {
+            inflate_flags = 0;
+        }
+
+        /*
+         * _zran_inflate only allows us to
+         * read max(uint32_t) at a time. If
+         * len is greater than this, we need
+         * to split it into multiple calls.
+         */
+        bytes_to_read = len - total_read;
+        if (bytes_to_read > 4294967295) {
+            bytes_to_read = 4294967295;
+        }
+
+        ret = _zran_inflate(reader,
+                            strm,
+                            cmp_offset,
+                            inflate_flags,
+                            &bytes_consumed,
+                            &bytes_output,
+                            bytes_to_read,
+                            (uint8_t *)(buf) + total_read,
+                            0);
+
+        cmp_offset   += bytes_consumed;
+        uncmp_offset += bytes_output;
+        total_read   += bytes_output;
+
+        if (ret == ZRAN_INFLATE_EOF)
+            break;
+
+        else if (ret == ZRAN_INFLATE_OUTPUT_FULL) {
+
+            /*
+             * We might be reading 2**32 sized chunks
+             * of data on each call to _zran_inflate.
+             */
+            if (bytes_to_read == len) {
+                break;
+            }
+        }
+        else if (ret != ZRAN_INFLATE_OK) {
+            if (ret == ZRAN_INFLATE_CRC_ERROR) {
+                error_return_val = ZRAN_READ_CRC_ERROR;
+            }
+            goto fail;
+        }
+
+        zran_log("Read %u bytes (%llu / %llu)\n",
+                 bytes_output,
+                 total_read,
+                 len);
+    }
+
+    /*
+     * If we have reached EOF, a final call
+     * to _zran_inflate to clean up memory.
+     * Otherwise we leave the z_stream and
+     * read buffer alive, so the next call
+     * can carry on from where we are now.
+     */
+    if (ret == ZRAN_INFLATE_EOF) {
+        reader->cursor_active = 0;
+        ret = _zran_inflate(reader,
+                            strm,
+                            0,
+                            (ZRAN_INFLATE_CLEAR_READBUF_OFFSETS |
+                             ZRAN_INFLATE_FREE_Z_STREAM         |
+                             ZRAN_INFLATE_FREE_READBUF),
+                            &bytes_consumed,
+                            &bytes_output,
+                            0,
+                            discard,
+                            0);
+
+        if (ret != ZRAN_INFLATE_OK && ret != ZRAN_INFLATE_EOF) {
+            if (ret == ZRAN_INFLATE_CRC_ERROR) {
+                error_return_val = ZRAN_READ_CRC_ERROR;
+            }
+            goto fail;
+        }
+
+        /*
+         * The seek location was right at the
+         * end of the data, but we didn't know
+         * it until now.
+         */
+        if (total_read == 0) {
+            free(discard);
+            goto eof;
+        }
+    }
+    else {
+        reader->cursor_active = 1;
+    }
+
+    /*
+     * Update the current uncompressed
+     * seek position.
+     */
+    reader->uncmp_seek_offset += total_read;
+
+    zran_log("Read succeeded - %llu bytes read [compressed offset: %ld]\n",
+             total_read,
+             _zran_ftell(reader));
+
+    free(discard);
+
+    return total_read;
+
+not_covered: return ZRAN_READ_NOT_COVERED;
+eof:         return ZRAN_READ_EOF;
+fail:
+
+    /*
+     * Make sure that the z_stream and read
+     * buffer are not left dangling (inflateEnd
+     * is harmless on a z_stream which has
+     * already been ended).
+     */
+    if (!first_inflate) {
+        reader->cursor_active = 1;
+        _zran_free_cursor(reader);
+    }
+
+    if (discard != NULL)
+        free(discard);
+
+    return error_return_val;
+}
+
+
+/* Create a new reader for the given index. */
+zran_reader_t * zran_reader_create(zran_index_t *index,
+                                   FILE         *fd,
+                                   PyObject     *f) {
+
+    zran_reader_t *reader;
+
+    zran_log("zran_reader_create\n");
+
+    reader = malloc(sizeof(zran_reader_t));
+    if (reader == NULL)
+        return NULL;
+
+    _zran_init_reader(reader, index, fd, f);
+
+    return reader;
+}
+
+
+/* Free a reader created by zran_reader_create. */
+void zran_reader_free(zran_reader_t *reader) {
+
+    zran_log("zran_reader_free\n");
+
+    if (reader == NULL)
+        return;
+
+    zran_readahead_stop(reader->index, reader);
+    _zran_free_cursor(reader);
+    _zran_free_window_cache(reader);
+    free(reader);
+}
+
+
+/* Seek the reader to the specified offset in the uncompressed data stream. */
+int zran_reader_seek(zran_reader_t *reader,
+                     int64_t        offset,
+                     uint8_t        whence) {
+
+    return _zran_seek(reader, offset, whence, NULL);
+}
+
+
+/* Return the current seek position of the reader. */
+uint64_t zran_reader_tell(zran_reader_t *reader) {
+
+    return reader->uncmp_seek_offset;
+}
+
+
+/* Read len bytes from the reader, storing them in buf. */
+int64_t zran_reader_read(zran_reader_t *reader,
+                         void          *buf,
+                         uint64_t       len) {
+
+    if (reader->readahead != NULL)
+        return _zran_readahead_read(reader, buf, len);
+
+    return _zran_cached_read(reader, buf, len);
+}
+
+
+/* Record the footer of the gzip stream which has just ended. */
+int _zran_log_footer(zran_reader_t *reader,
+                     z_stream      *stream,
+                     uint64_t       offset) {
+
+    zran_footer_log_t *log = reader->footers;
+    zran_footer_t     *footers;
+    zran_footer_t     *footer;
+    uint32_t           size;
+
+    if ((int64_t)offset <= log->from || offset > log->to)
+        return 0;
+
+    if (log->nfooters == log->size) {
+
+        size    = (log->size == 0) ? 8 : log->size * 2;
+        footers = realloc(log->footers, size * sizeof(zran_footer_t));
+
+        if (footers == NULL)
+            return -1;
+
+        log->footers = footers;
+        log->size    = size;
+    }
+
+    footer = &(log->footers[log->nfooters]);
+
+    footer->offset    = offset;
+    footer->crc       = ((stream->next_in[0] << 0)  +
+                         (stream->next_in[1] << 8)  +
+                         (stream->next_in[2] << 16) +
+                         (stream->next_in[3] << 24));
+    footer->size      = ((stream->next_in[4] << 0)  +
+                         (stream->next_in[5] << 8)  +
+                         (stream->next_in[6] << 16) +
+                         (stream->next_in[7] << 24));
+    footer->span      = 0;
+    footer->piece_crc = 0;
+    footer->piece_len = 0;
+
+    log->nfooters++;
+
+    zran_log("_zran_log_footer(%llu, %08x, %u)\n",
+             offset, footer->crc, footer->size);
+
+    return 0;
+}
+
+
+/* Size of the buffer used by each zran_verify thread. */
+#define ZRAN_VERIFY_BUFFER_SIZE 1048576
+
+
+/*
+ * Number of chunks that the spans are divided into for each zran_verify
+ * thread, so that the work stays balanced when some spans take longer to
+ * decompress than others.
+ */
+#define ZRAN_VERIFY_CHUNKS_PER_THREAD 8
+
+
+/* Entry point for threads started by _zran_run_threads. */
+#ifdef _WIN32
+static DWORD WINAPI _zran_thread_main(LPVOID arg) {
+    zran_thread_t *thread = (zran_thread_t *)arg;
+    thread->fn(thread->arg);
+    return 0;
+}
+#else
+static void *_zran_thread_main(void *arg) {
+    zran_thread_t *thread = (zran_thread_t *)arg;
+    thread->fn(thread->arg);
+    return NULL;
+}
+#endif
+
+
+/* Start a thread which calls thread->fn(thread->arg). */
+int _zran_start_thread(zran_thread_t *thread) {
+
+    #ifdef _WIN32
+    thread->handle  = CreateThread(NULL,
+                                   0,
+                                   _zran_thread_main,
+                                   thread,
+                                   0,
+                                   NULL);
+    thread->started = thread->handle != NULL;
+    #else
+    thread->started = pthread_create(&(thread->handle),
+                                     NULL,
+                                     _zran_thread_main,
+                                     thread) == 0;
+    #endif
+
+    return thread->started ? 0 : -1;
+}
+
+
+/* Wait for a thread started by _zran_start_thread to finish. */
+void _zran_join_thread(zran_thread_t *thread) {
+
+    #ifdef _WIN32
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+    #else
+    pthread_join(thread->handle, NULL);
+    #endif
+
+    thread->started = 0;
+}
+
+
+/* Call fn concurrently on each of args. */
+void _zran_run_threads(void   (*fn)(void *),
+                       void    *args,
+                       size_t   argsize,
+                       uint32_t n) {
+
+    zran_thread_t *threads = NULL;
+    uint8_t       *argp    = (uint8_t *)args;
+    uint32_t       i;
+
+    if (n > 1)
+        threads = calloc(n, sizeof(zran_thread_t));
+
+    for (i = 1; threads != NULL && i < n; i++) {
+
+        threads[i].fn  = fn;
+        threads[i].arg = argp + i * argsize;
+
+        _zran_start_thread(&(threads[i]));
+    }
+
+    fn(argp);
+
+    for (i = 1; i < n; i++) {
+
+        if (threads == NULL || !threads[i].started) {
+            fn(argp + i * argsize);
+            continue;
+        }
+
+        _zran_join_thread(&(threads[i]));
+    }
+
+    free(threads);
+}
+
+
+/* Verify chunks of spans until there are none left. */
+void _zran_verify_worker(void *arg) {
+
+    zran_verify_worker_t *worker = (zran_verify_worker_t *)arg;
+    zran_verify_t        *verify = worker->verify;
+    uint8_t              *buf    = NULL;
+    uint64_t              chunk;
+
+    worker->ret = ZRAN_VERIFY_OK;
+
+    buf = malloc(ZRAN_VERIFY_BUFFER_SIZE);
+    if (buf == NULL) {
+        worker->ret = ZRAN_VERIFY_FAIL;
+        goto fail;
+    }
+
+    while (!atomic_load_u64(&verify->failed)) {
+
+        chunk = atomic_add_u64(&verify->next_chunk, 1);
+
+        if (chunk >= verify->nchunks)
+            break;
+
+        worker->ret = _zran_verify_chunk(verify,
+                                         worker->reader,
+                                         (uint32_t)chunk,
+                                         buf,
+                                         ZRAN_VERIFY_BUFFER_SIZE);
+
+        if (worker->ret != ZRAN_VERIFY_OK)
+            goto fail;
+    }
+
+    worker->reader->footers = NULL;
+    free(buf);
+    return;
+
+fail:
+    atomic_store_u64(&verify->failed, 1);
+    worker->reader->footers = NULL;
+    free(buf);
+}
+
+
+/* Calculate the CRC32s of all spans, and pieces of spans, in one chunk. */
+int _zran_verify_chunk(zran_verify_t *verify,
+                       zran_reader_t *reader,
+                       uint32_t       chunk,
+                       uint8_t       *buf,
+                       uint32_t       bufsz) {
+
+    zran_index_t      *index  = verify->index;
+    zran_footer_log_t *log    = &(verify->logs[chunk]);
+    zran_footer_t     *footer;
+    uint32_t           span;
+    uint32_t           last;
+    uint32_t           nfooters = 0;
+    uint32_t           crc      = 0;
+    uint64_t           len      = 0;
+    uint64_t           start;
+    uint64_t           end;
+    uint64_t           pos;
+    uint64_t           cur;
+    uint64_t           next;
+    uint64_t           want;
+    int64_t            n;
+    int                ret;
+
+    span = chunk * verify->chunk_spans;
+    last = span  + verify->chunk_spans;
+
+    if (last > verify->nspans)
+        last = verify->nspans;
+
+    start = index->uncmp_offsets[span];
+    end   = index->uncmp_offsets[last];
+    pos   = start;
+
+    zran_log("_zran_verify_chunk(%u, spans %u-%u, %llu - %llu)\n",
+             chunk, span, last, start, end);
+
+    /*
+     * A stream which ends at the start of this
+     * chunk is recorded by the previous chunk.
+     */
+    log->from       = (chunk == 0) ? -1 : (int64_t)start;
+    log->to         = end;
+    reader->footers = log;
+
+    ret = _zran_seek(reader, start, SEEK_SET, NULL);
+
+    if      (ret == ZRAN_SEEK_CRC_ERROR) return ZRAN_VERIFY_CRC_ERROR;
+    else if (ret != ZRAN_SEEK_OK &&
+             ret != ZRAN_SEEK_EOF)       return ZRAN_VERIFY_FAIL;
+
+    while (1) {
+
+        /*
+         * Once all of the data in the chunk has
+         * been read, one more byte is read, so
+         * that the footers of any streams which
+         * end at the end of the chunk are passed
+         * through (and logged).
+         */
+        if (pos < end) want = end - pos;
+        else           want = 1;
+        if (want > bufsz)
+            want = bufsz;
+
+        n = _zran_read(reader, buf, want);
+
+        if      (n == ZRAN_READ_CRC_ERROR) return ZRAN_VERIFY_CRC_ERROR;
+        else if (n == ZRAN_READ_EOF)       n = 0;
+        else if (n <  0)                   return ZRAN_VERIFY_FAIL;
+
+        /* The index says there is more data than this */
+        if (pos < end && (uint64_t)n != want)
+            return ZRAN_VERIFY_FAIL;
+
+        /* The extra byte is not part of this chunk */
+        if (pos == end)
+            n = 0;
+
+        /*
+         * Close off the CRC of each span, and of
+         * each piece of a span which precedes the
+         * end of a stream, within the data that
+         * has just been read, in offset order.
+         */
+        cur = pos;
+        while (1) {
+
+            footer = NULL;
+            if (nfooters < log->nfooters)
+                footer = &(log->footers[nfooters]);
+
+            if (span < last &&
+                (footer == NULL ||
+                 index->uncmp_offsets[span + 1] < footer->offset)) {
+                footer = NULL;
+                next   = index->uncmp_offsets[span + 1];
+            }
+            else if (footer != NULL) next = footer->offset;
+            else                     break;
+
+            if (next > pos + n)
+                break;
+
+            crc  = crc32(crc, buf + (cur - pos), (uInt)(next - cur));
+            len += next - cur;
+            cur  = next;
+
+            if (footer != NULL) {
+                footer->span      = span;
+                footer->piece_crc = crc;
+                footer->piece_len = len;
+                nfooters++;
+            }
+            else {
+                verify->span_crcs[span] = crc;
+                verify->span_lens[span] = len;
+                span++;
+            }
+
+            crc = 0;
+            len = 0;
+        }
+
+        crc  = crc32(crc, buf + (cur - pos), (uInt)(pos + n - cur));
+        len += pos + n - cur;
+
+        if (pos == end)
+            break;
+
+        pos += n;
+    }
+
+    /* Footers should not have been logged beyond the end of the chunk */
+    if (nfooters != log->nfooters || span != last)
+        return ZRAN_VERIFY_FAIL;
+
+    return ZRAN_VERIFY_OK;
+}
+
+
+/* Check the footer of every stream against the CRC32s of the spans. */
+int _zran_verify_combine(zran_verify_t *verify) {
+
+    zran_index_t      *index    = verify->index;
+    zran_footer_log_t *log;
+    zran_footer_t     *footer;
+    uint32_t           crc      = 0;
+    uint32_t           span_crc = 0;
+    uint64_t           size     = 0;
+    uint32_t           chunk    = 0;
+    uint32_t           f        = 0;
+    uint8_t            store    = index->nspans < verify->nspans;
+    uint32_t           i;
+
+    for (i = 0; i <= verify->nspans; i++) {
+
+        /*
+         * Streams which end within span i (the
+         * footers are logged in offset order).
+         */
+        while (chunk < verify->nchunks) {
+
+            log = &(verify->logs[chunk]);
+
+            if (f == log->nfooters) {
+                chunk++;
+                f = 0;
+                continue;
+            }
+
+            footer = &(log->footers[f]);
+
+            if (footer->span != i)
+                break;
+
+            crc   = crc32_combine(crc,
+                                  footer->piece_crc,
+                                  (z_off_t)footer->piece_len);
+            size += footer->piece_len;
+
+            zran_log("_zran_verify_combine: stream ending at %llu "
+                     "[%08x == %08x, %u == %u]\n",
+                     footer->offset, crc, footer->crc,
+                     (uint32_t)size, footer->size);
+
+            if (crc != footer->crc || (uint32_t)size != footer->size)
+                return ZRAN_VERIFY_CRC_ERROR;
+
+            span_crc = crc32_combine(span_crc,
+                                     footer->piece_crc,
+                                     (z_off_t)footer->piece_len);
+            crc      = 0;
+            size     = 0;
+            f++;
+        }
+
+        if (i < verify->nspans) {
+            crc      = crc32_combine(crc,
+                                     verify->span_crcs[i],
+                                     (z_off_t)verify->span_lens[i]);
+            span_crc = crc32_combine(span_crc,
+                                     verify->span_crcs[i],
+                                     (z_off_t)verify->span_lens[i]);
+            size    += verify->span_lens[i];
+
+            if (store)
+                verify->span_crcs[i] = span_crc;
+            span_crc = 0;
+        }
+    }
+
+    /* Every footer should have been checked */
+    if (chunk < verify->nchunks)
+        return ZRAN_VERIFY_FAIL;
+
+    /* Data at the end of the file without a footer */
+    if (size != 0)
+        return ZRAN_VERIFY_CRC_ERROR;
+
+    if (store) {
+        memcpy(index->span_crcs,
+               verify->span_crcs,
+               verify->nspans * sizeof(uint32_t));
+        index->nspans = verify->nspans;
+    }
+
+    return ZRAN_VERIFY_OK;
+}
+
+
+/* Verify the CRC32 and size of every stream in the file. */
+int zran_verify(zran_index_t   *index,
+                zran_reader_t **readers,
+                uint32_t        nreaders) {
+
+    zran_verify_t         verify;
+    zran_verify_worker_t *workers  = NULL;
+    zran_reader_t         reader;
+    zran_reader_t        *rptr     = NULL;
+    uint32_t              nworkers = nreaders;
+    uint32_t              i;
+    int                   ret;
+
+    memset(&verify, 0, sizeof(verify));
+
+    zran_log("zran_verify(%u)\n", nreaders);
+
+    /* Make sure that the index covers the whole file */
+    if (index->npoints              == 0 ||
+        index->uncompressed_size    == 0 ||
+        index->uncmp_offsets[index->npoints - 1] !=
+        index->uncompressed_size) {
+
+        ret = _zran_expand_index(index, 0);
+
+        if (ret == ZRAN_EXPAND_INDEX_CRC_ERROR)
+            return ZRAN_VERIFY_CRC_ERROR;
+        else if (ret != ZRAN_EXPAND_INDEX_OK)
+            return ZRAN_VERIFY_FAIL;
+    }
+
+    if (index->npoints < 2)
+        return ZRAN_VERIFY_OK;
+
+    /*
+     * A separate reader is used, so that
+     * the inflation cursor of the index
+     * reader is not disturbed.
+     */
+    if (nreaders == 0) {
+        _zran_init_reader(&reader, index, index->fd, index->f);
+        rptr     = &reader;
+        readers  = &rptr;
+        nworkers = 1;
+    }
+
+    verify.index       = index;
+    verify.nspans      = index->npoints - 1;
+    verify.chunk_spans = 1;
+
+    if (nworkers == 1) {
+        verify.chunk_spans = verify.nspans;
+    }
+    else if (verify.nspans > nworkers * ZRAN_VERIFY_CHUNKS_PER_THREAD) {
+        verify.chunk_spans = verify.nspans /
+                             (nworkers * ZRAN_VERIFY_CHUNKS_PER_THREAD);
+    }
+
+    verify.nchunks = (verify.nspans + verify.chunk_spans - 1) /
+                     verify.chunk_spans;
+
+    if (nworkers > verify.nchunks)
+        nworkers = verify.nchunks;
+
+    ret = ZRAN_VERIFY_FAIL;
+
+    verify.span_crcs = calloc(verify.nspans,  sizeof(uint32_t));
+    verify.span_lens = calloc(verify.nspans,  sizeof(uint64_t));
+    verify.logs      = calloc(verify.nchunks, sizeof(zran_footer_log_t));
+    workers          = calloc(nworkers,       sizeof(zran_verify_worker_t));
+
+    if (verify.span_crcs == NULL ||
+        verify.span_lens == NULL ||
+        verify.logs      == NULL ||
+        workers          == NULL) {
+        goto cleanup;
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        workers[i].verify = &verify;
+        workers[i].reader = readers[i];
+    }
+
+    _zran_run_threads(_zran_verify_worker,
+                      workers,
+                      sizeof(zran_verify_worker_t),
+                      nworkers);
+
+    /*
+     * A CRC error found by any worker takes
+     * precedence over other errors, which
+     * may have been caused by it.
+     */
+    ret = ZRAN_VERIFY_OK;
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i].ret == ZRAN_VERIFY_CRC_ERROR ||
+            (workers[i].ret != ZRAN_VERIFY_OK && ret == ZRAN_VERIFY_OK))
+            ret = workers[i].ret;
+    }
+
+    if (ret == ZRAN_VERIFY_OK)
+        ret = _zran_verify_combine(&verify);
+
+cleanup:
+    if (verify.logs != NULL) {
+        for (i = 0; i < verify.nchunks; i++)
+            free(verify.logs[i].footers);
+    }
+
+    if (rptr != NULL)
+        _zran_free_cursor(&reader);
+
+    free(verify.span_crcs);
+    free(verify.span_lens);
+    free(verify.logs);
+    free(workers);
+
+    return ret;
+}
+
+
+/*
+ * Number of chunks that the spans are divided into for each
+ * zran_read_parallel thread.
+ */
+#define ZRAN_READ_PARALLEL_CHUNKS_PER_THREAD 4
+
+
+/* Read chunks of spans until there are none left. */
+void _zran_read_parallel_worker(void *arg) {
+
+    zran_read_parallel_worker_t *worker = (zran_read_parallel_worker_t *)arg;
+    zran_read_parallel_t        *state  = worker->state;
+    uint64_t                     chunk;
+
+    worker->ret = 0;
+
+    while (!atomic_load_u64(&state->failed)) {
+
+        chunk = atomic_add_u64(&state->next_chunk, 1);
+
+        if (chunk >= state->nchunks)
+            break;
+
+        worker->ret = _zran_read_parallel_chunk(state,
+                                                worker->reader,
+                                                (uint32_t)chunk);
+
+        if (worker->ret != 0) {
+            atomic_store_u64(&state->failed, 1);
+            break;
+        }
+    }
+}
+
+
+/* Read all of the data in one chunk of spans. */
+int64_t _zran_read_parallel_chunk(zran_read_parallel_t *state,
+                                  zran_reader_t        *reader,
+                                  uint32_t              chunk) {
+
+    zran_index_t *index = state->index;
+    uint32_t      span;
+    uint32_t      last;
+    uint64_t      start;
+    uint64_t      end;
+    int64_t       n;
+    int           ret;
+
+    span = state->first + chunk * state->chunk_spans;
+    last = span         + state->chunk_spans;
+
+    /*
+     * The first and last chunks start and
+     * end part way through their spans.
+     */
+    if (chunk == 0) start = state->offset;
+    else            start = index->uncmp_offsets[span];
+
+    if (last >= state->first + state->nspans) end = state->end;
+    else                                      end = index->uncmp_offsets[last];
+
+    zran_log("_zran_read_parallel_chunk(%u, %llu - %llu)\n",
+             chunk, start, end);
+
+    if (start >= end)
+        return 0;
+
+    ret = _zran_seek(reader, start, SEEK_SET, NULL);
+
+    if      (ret == ZRAN_SEEK_CRC_ERROR) return ZRAN_READ_CRC_ERROR;
+    else if (ret != ZRAN_SEEK_OK)        return ZRAN_READ_FAIL;
+
+    while (start < end) {
+
+        n = _zran_read(reader,
+                       state->buf + (start - state->offset),
+                       end - start);
+
+        if      (n == ZRAN_READ_CRC_ERROR) return ZRAN_READ_CRC_ERROR;
+        else if (n <= 0)                   return ZRAN_READ_FAIL;
+
+        start += n;
+    }
+
+    return 0;
+}
+
+
+/* Read data from the whole of a range of spans concurrently. */
+int64_t zran_read_parallel(zran_index_t   *index,
+                           zran_reader_t **readers,
+                           uint32_t        nreaders,
+                           void           *buf,
+                           uint64_t        offset,
+                           uint64_t        len) {
+
+    zran_read_parallel_t         state;
+    zran_read_parallel_worker_t *workers  = NULL;
+    zran_reader_t                reader;
+    zran_reader_t               *rptr     = NULL;
+    zran_point_t                 point;
+    uint32_t                     nworkers = nreaders;
+    uint32_t                     i;
+    int64_t                      ret;
+
+    memset(&state, 0, sizeof(state));
+
+    zran_log("zran_read_parallel(%llu, %llu, %u)\n", offset, len, nreaders);
+
+    if (len == 0)
+        return 0;
+
+    /*
+     * Make sure that the index covers the last
+     * byte in the range (expanding the index if
+     * ZRAN_AUTO_BUILD is set), and truncate the
+     * range if it extends past the end of the
+     * data.
+     */
+    ret = _zran_get_point_with_expand(index,
+                                      offset + len - 1,
+                                      0,
+                                      NULL,
+                                      &point);
+
+    if (ret == ZRAN_GET_POINT_EOF) {
+        if (offset >= index->uncompressed_size)
+            return ZRAN_READ_EOF;
+        len = index->uncompressed_size - offset;
+    }
+    else if (ret == ZRAN_GET_POINT_NOT_COVERED) return ZRAN_READ_NOT_COVERED;
+    else if (ret == ZRAN_GET_POINT_CRC_ERROR)   return ZRAN_READ_CRC_ERROR;
+    else if (ret != ZRAN_GET_POINT_OK)          return ZRAN_READ_FAIL;
+
+    state.index  = index;
+    state.buf    = (uint8_t *)buf;
+    state.offset = offset;
+    state.end    = offset + len;
+
+    /*
+     * Find the point at or before the start
+     * of the range, and count the spans which
+     * overlap with the range.
+     */
+    while (state.first + 1 < index->npoints &&
+           index->uncmp_offsets[state.first + 1] <= offset) {
+        state.first++;
+    }
+
+    state.nspans = 1;
+    while (state.first + state.nspans < index->npoints &&
+           index->uncmp_offsets[state.first + state.nspans] < state.end) {
+        state.nspans++;
+    }
+
+    /*
+     * As with zran_verify, a separate reader is
+     * used, so that the seek location of the
+     * index is not changed.
+     */
+    if (nreaders == 0) {
+        _zran_init_reader(&reader, index, index->fd, index->f);
+        rptr     = &reader;
+        readers  = &rptr;
+        nworkers = 1;
+    }
+
+    state.chunk_spans = 1;
+
+    if (nworkers == 1) {
+        state.chunk_spans = state.nspans;
+    }
+    else if (state.nspans > nworkers * ZRAN_READ_PARALLEL_CHUNKS_PER_THREAD) {
+        state.chunk_spans = state.nspans /
+                            (nworkers * ZRAN_READ_PARALLEL_CHUNKS_PER_THREAD);
+    }
+
+    state.nchunks = (state.nspans + state.chunk_spans - 1) /
+                    state.chunk_spans;
+
+    if (nworkers > state.nchunks)
+        nworkers = state.nchunks;
+
+    ret     = ZRAN_READ_FAIL;
+    workers = calloc(nworkers, sizeof(zran_read_parallel_worker_t));
+
+    if (workers == NULL)
+        goto cleanup;
+
+    for (i = 0; i < nworkers; i++) {
+        workers[i].state  = &state;
+        workers[i].reader = readers[i];
+    }
+
+    _zran_run_threads(_zran_read_parallel_worker,
+                      workers,
+                      sizeof(zran_read_parallel_worker_t),
+                      nworkers);
+
+    /* CRC errors take precedence over other errors */
+    ret = (int64_t)len;
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i].ret == ZRAN_READ_CRC_ERROR ||
+            (workers[i].ret != 0 && ret >= 0))
+            ret = workers[i].ret;
+    }
+
+cleanup:
+    if (rptr != NULL)
+        _zran_free_cursor(&reader);
+
+    free(workers);
+
+    return ret;
+}
+
+
+/* Size of the buffer used by each zran_read_multi thread. */
+#define ZRAN_READ_MULTI_BUFFER_SIZE 1048576
+
+
+/* Order ranges by their offset. */
+int _zran_cmp_range(const void *a, const void *b) {
+
+    const zran_range_t *ra = *(const zran_range_t **)a;
+    const zran_range_t *rb = *(const zran_range_t **)b;
+
+    if (ra->offset < rb->offset) return -1;
+    if (ra->offset > rb->offset) return  1;
+    return 0;
+}
+
+
+/* Binary search for the point which precedes an offset. */
+uint32_t _zran_find_span(zran_index_t *index, uint64_t offset) {
+
+    uint32_t lo = 0;
+    uint32_t hi;
+    uint32_t mid;
+
+    if (index->npoints == 0)
+        return 0;
+
+    hi = index->npoints - 1;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo + 1) / 2;
+        if (index->uncmp_offsets[mid] <= offset) lo = mid;
+        else                                     hi = mid - 1;
+    }
+
+    return lo;
+}
+
+
+/* Read range groups until there are none left. */
+void _zran_read_multi_worker(void *arg) {
+
+    zran_read_multi_worker_t *worker = (zran_read_multi_worker_t *)arg;
+    zran_read_multi_t        *state  = worker->state;
+    uint8_t                  *buf    = NULL;
+    uint64_t                  group;
+
+    worker->ret = 0;
+
+    buf = malloc(ZRAN_READ_MULTI_BUFFER_SIZE);
+    if (buf == NULL) {
+        worker->ret = ZRAN_READ_FAIL;
+        goto fail;
+    }
+
+    while (!atomic_load_u64(&state->failed)) {
+
+        group = atomic_add_u64(&state->next_group, 1);
+
+        if (group >= state->ngroups)
+            break;
+
+        worker->ret = _zran_read_multi_group(&(state->groups[group]),
+                                             worker->reader,
+                                             buf,
+                                             ZRAN_READ_MULTI_BUFFER_SIZE);
+
+        if (worker->ret != 0)
+            goto fail;
+    }
+
+    free(buf);
+    return;
+
+fail:
+    atomic_store_u64(&state->failed, 1);
+    free(buf);
+}
+
+
+/* Read one group of ranges, and scatter the data into their buffers. */
+int64_t _zran_read_multi_group(zran_range_group_t *group,
+                               zran_reader_t      *reader,
+                               uint8_t            *buf,
+                               uint32_t            bufsz) {
+
+    zran_range_t *range;
+    uint64_t      pos;
+    uint64_t      want;
+    uint64_t      from;
+    uint64_t      to;
+    uint32_t      first;
+    uint32_t      i;
+    int64_t       n;
+    int           ret;
+
+    zran_log("_zran_read_multi_group(%llu - %llu, %u ranges)\n",
+             group->start, group->end, group->nranges);
+
+    ret = _zran_seek(reader, group->start, SEEK_SET, NULL);
+
+    if      (ret == ZRAN_SEEK_CRC_ERROR) return ZRAN_READ_CRC_ERROR;
+    else if (ret != ZRAN_SEEK_OK)        return ZRAN_READ_FAIL;
+
+    pos   = group->start;
+    first = 0;
+
+    while (pos < group->end) {
+
+        want = group->end - pos;
+        if (want > bufsz)
+            want = bufsz;
+
+        n = _zran_read(reader, buf, want);
+
+        if      (n == ZRAN_READ_CRC_ERROR) return ZRAN_READ_CRC_ERROR;
+        else if (n <= 0)                   return ZRAN_READ_FAIL;
+
+        /*
+         * Ranges are sorted by offset, so we
+         * can skip over those at the start of
+         * the group which have been filled.
+         */
+        while (first < group->nranges &&
+               group->ranges[first]->offset +
+               group->ranges[first]->nread <= pos) {
+            first++;
+        }
+
+        for (i = first; i < group->nranges; i++) {
+
+            range = group->ranges[i];
+
+            if (range->offset >= pos + n)
+                break;
+
+            from = range->offset > pos ? range->offset : pos;
+            to   = range->offset + range->nread;
+
+            if (to > pos + n)
+                to = pos + n;
+
+            if (from < to)
+                memcpy((uint8_t *)range->buf + (from - range->offset),
+                       buf + (from - pos),
+                       to - from);
+        }
+
+        pos += n;
+    }
+
+    return 0;
+}
+
+
+/* Read a set of ranges, decompressing each part of the data once. */
+int64_t zran_read_multi(zran_index_t   *index,
+                        zran_reader_t **readers,
+                        uint32_t        nreaders,
+                        zran_range_t   *ranges,
+                        uint32_t        nranges) {
+
+    zran_read_multi_t         state;
+    zran_read_multi_worker_t *workers  = NULL;
+    zran_range_t            **sorted   = NULL;
+    zran_range_group_t       *group;
+    zran_reader_t             reader;
+    zran_reader_t            *rptr     = NULL;
+    zran_point_t              point;
+    uint32_t                  nworkers = nreaders;
+    uint32_t                  nsorted  = 0;
+    uint32_t                  i;
+    uint64_t                  end      = 0;
+    uint64_t                  total    = 0;
+    int64_t                   ret;
+
+    memset(&state, 0, sizeof(state));
+
+    zran_log("zran_read_multi(%u ranges, %u)\n", nranges, nreaders);
+
+    for (i = 0; i < nranges; i++) {
+        ranges[i].nread = 0;
+        if (ranges[i].len > 0 && ranges[i].offset + ranges[i].len > end)
+            end = ranges[i].offset + ranges[i].len;
+    }
+
+    if (end == 0)
+        return 0;
+
+    /*
+     * Make sure that the index covers the end
+     * of the last range (expanding the index
+     * if ZRAN_AUTO_BUILD is set) - ranges are
+     * truncated at the end of the data.
+     */
+    ret = _zran_get_point_with_expand(index, end - 1, 0, NULL, &point);
+
+    if (ret == ZRAN_GET_POINT_EOF)              end = index->uncompressed_size;
+    else if (ret == ZRAN_GET_POINT_NOT_COVERED) return ZRAN_READ_NOT_COVERED;
+    else if (ret == ZRAN_GET_POINT_CRC_ERROR)   return ZRAN_READ_CRC_ERROR;
+    else if (ret != ZRAN_GET_POINT_OK)          return ZRAN_READ_FAIL;
+
+    ret          = ZRAN_READ_FAIL;
+    sorted       = calloc(nranges, sizeof(zran_range_t *));
+    state.groups = calloc(nranges, sizeof(zran_range_group_t));
+
+    if (sorted == NULL || state.groups == NULL)
+        goto cleanup;
+
+    for (i = 0; i < nranges; i++) {
+
+        if (ranges[i].len == 0 || ranges[i].offset >= end)
+            continue;
+
+        ranges[i].nread = ranges[i].len;
+        if (ranges[i].offset + ranges[i].len > end)
+            ranges[i].nread = end - ranges[i].offset;
+
+        sorted[nsorted++] = &(ranges[i]);
+        total            += ranges[i].nread;
+    }
+
+    if (nsorted == 0) {
+        ret = 0;
+        goto cleanup;
+    }
+
+    qsort(sorted, nsorted, sizeof(zran_range_t *), _zran_cmp_range);
+
+    /*
+     * Coalesce the sorted ranges into groups.
+     * A range is added to the current group if
+     * there is no index point between the end
+     * of the group and the start of the range,
+     * as seeking to the range would then start
+     * decompressing from the same point (or an
+     * earlier one) anyway.
+     */
+    group = NULL;
+    for (i = 0; i < nsorted; i++) {
+
+        if (group == NULL                     ||
+            (sorted[i]->offset > group->end   &&
+             _zran_find_span(index, sorted[i]->offset) !=
+             _zran_find_span(index, group->end))) {
+
+            group          = &(state.groups[state.ngroups++]);
+            group->start   = sorted[i]->offset;
+            group->end     = sorted[i]->offset;
+            group->ranges  = &(sorted[i]);
+            group->nranges = 0;
+        }
+
+        group->nranges++;
+        if (sorted[i]->offset + sorted[i]->nread > group->end)
+            group->end = sorted[i]->offset + sorted[i]->nread;
+    }
+
+    /*
+     * As with zran_verify, a separate reader is
+     * used, so that the seek location of the
+     * index is not changed.
+     */
+    if (nreaders == 0) {
+        _zran_init_reader(&reader, index, index->fd, index->f);
+        rptr     = &reader;
+        readers  = &rptr;
+        nworkers = 1;
+    }
+
+    if (nworkers > state.ngroups)
+        nworkers = state.ngroups;
+
+    workers = calloc(nworkers, sizeof(zran_read_multi_worker_t));
+    if (workers == NULL)
+        goto cleanup;
+
+    for (i = 0; i < nworkers; i++) {
+        workers[i].state  = &state;
+        workers[i].reader = readers[i];
+    }
+
+    _zran_run_threads(_zran_read_multi_worker,
+                      workers,
+                      sizeof(zran_read_multi_worker_t),
+                      nworkers);
+
+    /* CRC errors take precedence over other errors */
+    ret = (int64_t)total;
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i].ret == ZRAN_READ_CRC_ERROR ||
+            (workers[i].ret != 0 && ret >= 0))
+            ret = workers[i].ret;
+    }
+
+cleanup:
+    if (rptr != NULL)
+        _zran_free_cursor(&reader);
+
+    free(workers);
+    free(sorted);
+    free(state.groups);
+
+    return ret;
+}
+
+
+/* Fill pending readahead buffers until told to stop. */
+void _zran_readahead_main(void *arg) {
+
+    zran_readahead_t     *ra = (zran_readahead_t *)arg;
+    zran_readahead_buf_t *buf;
+    uint32_t              i;
+    int                   ret;
+
+    zran_mutex_lock(&(ra->lock));
+
+    while (!ra->stop) {
+
+        buf = NULL;
+        for (i = 0; i < ZRAN_READAHEAD_BUFFERS; i++) {
+            if (ra->bufs[i].state == ZRAN_READAHEAD_PENDING &&
+                (buf == NULL || ra->bufs[i].start < buf->start))
+                buf = &(ra->bufs[i]);
+        }
+
+        if (buf == NULL) {
+            zran_cond_wait(&(ra->cond), &(ra->lock));
+            continue;
+        }
+
+        buf->state = ZRAN_READAHEAD_BUSY;
+        zran_mutex_unlock(&(ra->lock));
+
+        ret = _zran_readahead_fill(ra, buf);
+
+        zran_mutex_lock(&(ra->lock));
+        if (ret == 0) buf->state = ZRAN_READAHEAD_READY;
+        else          buf->state = ZRAN_READAHEAD_FAILED;
+        zran_cond_broadcast(&(ra->cond));
+    }
+
+    zran_mutex_unlock(&(ra->lock));
+}
+
+
+/* Decompress the data for a readahead buffer. */
+int _zran_readahead_fill(zran_readahead_t     *ra,
+                         zran_readahead_buf_t *buf) {
+
+    z_stream  strm;
+    uint64_t  len    = buf->end - buf->start;
+    uint8_t   first  = 1;
+    uint8_t   header = 0;
+    uint32_t  skip   = 0;
+    uint32_t  crc;
+    uint32_t  i;
+    size_t    nread;
+    int       c;
+    int       z_ret;
+
+    zran_log("_zran_readahead_fill(%llu - %llu)\n", buf->start, buf->end);
+
+    memset(&strm, 0, sizeof(z_stream));
+
+    if (fseek_(ra->fd,
+               NULL,
+               buf->cmp_offset - (buf->bits > 0),
+               SEEK_SET) != 0)
+        return -1;
+
+    if (inflateInit2(&strm, -(int)ra->log_window_size) != Z_OK)
+        return -1;
+
+    if (buf->bits > 0) {
+        c = getc_(ra->fd, NULL);
+        if (c == -1)
+            goto fail;
+        if (inflatePrime(&strm, buf->bits, c >> (8 - buf->bits)) != Z_OK)
+            goto fail;
+    }
+
+    if (buf->has_window &&
+        inflateSetDictionary(&strm, buf->window, ra->window_size) != Z_OK)
+        goto fail;
+
+    strm.next_out  = buf->data;
+    strm.avail_out = (uInt)len;
+
+    while (strm.avail_out > 0) {
+
+        if (strm.avail_in == 0) {
+            nread = fread_(ra->readbuf, 1, ra->readbuf_size, ra->fd, NULL);
+            if (nread == 0)
+                goto fail;
+            strm.next_in  = ra->readbuf;
+            strm.avail_in = (uInt)nread;
+        }
+
+        /*
+         * At the end of a gzip stream - skip over its
+         * footer (the footer of the first stream has to
+         * be skipped manually, as it is inflated in raw
+         * mode), and any padding, and then start on the
+         * next stream. Streams other than the first are
+         * inflated in gzip mode, so zlib checks their
+         * CRCs for us.
+         */
+        if (header) {
+
+            while (skip > 0 && strm.avail_in > 0) {
+                strm.next_in++;
+                strm.avail_in--;
+                skip--;
+            }
+            while (skip == 0 && strm.avail_in > 0 && strm.next_in[0] == 0) {
+                strm.next_in++;
+                strm.avail_in--;
+            }
+
+            if (strm.avail_in == 0)
+                continue;
+
+            if (inflateReset2(&strm, ra->log_window_size + 16) != Z_OK)
+                goto fail;
+            header = 0;
+        }
+
+        z_ret = inflate(&strm, Z_NO_FLUSH);
+
+        if (z_ret == Z_STREAM_END) {
+            header = 1;
+            skip   = first ? 8 : 0;
+            first  = 0;
+        }
+        else if (z_ret != Z_OK) {
+            goto fail;
+        }
+    }
+
+    inflateEnd(&strm);
+
+    for (i = 0; i < buf->ncrcs; i++) {
+        crc = crc32(0,
+                    buf->data + (buf->crcs[i].start - buf->start),
+                    (uInt)(buf->crcs[i].end - buf->crcs[i].start));
+        if (crc != buf->crcs[i].crc) {
+            zran_log("_zran_readahead_fill: CRC mismatch at %llu\n",
+                     buf->crcs[i].start);
+            return -1;
+        }
+    }
+
+    return 0;
+
+fail:
+    inflateEnd(&strm);
+    return -1;
+}
+
+
+/* Prepare a readahead buffer for the data at offset. */
+int _zran_readahead_prepare(zran_index_t         *index,
+                            zran_readahead_buf_t *buf,
+                            uint64_t              offset,
+                            uint64_t              size) {
+
+    zran_readahead_crc_t *crcs;
+    zran_point_t          point;
+    uint8_t              *data;
+    uint64_t              start;
+    uint64_t              end;
+    uint32_t              first;
+    uint32_t              last;
+    uint32_t              i;
+
+    if (size < ZRAN_READAHEAD_MIN_SIZE) size = ZRAN_READAHEAD_MIN_SIZE;
+    if (size > ZRAN_READAHEAD_MAX_SIZE) size = ZRAN_READAHEAD_MAX_SIZE;
+
+    if (index->npoints < 2)
+        return -1;
+
+    first = _zran_find_span(index, offset);
+
+    if (first + 1 >= index->npoints          ||
+        index->uncmp_offsets[first] > offset ||
+        _zran_point_evicted(index, first))
+        return -1;
+
+    start = index->uncmp_offsets[first];
+    last  = first + 1;
+
+    while (last + 1 < index->npoints &&
+           index->uncmp_offsets[last] - start < size)
+        last++;
+
+    end = index->uncmp_offsets[last];
+    if (end - start > ZRAN_READAHEAD_MAX_SIZE)
+        end = start + ZRAN_READAHEAD_MAX_SIZE;
+
+    if (offset >= end || zran_get_point(index, first, &point) != 0)
+        return -1;
+
+    if (buf->size < end - start) {
+        data = realloc(buf->data, end - start);
+        if (data == NULL)
+            return -1;
+        buf->data = data;
+        buf->size = end - start;
+    }
+
+    if (buf->crcsize < last - first) {
+        crcs = realloc(buf->crcs, (last - first) * sizeof(*crcs));
+        if (crcs == NULL)
+            return -1;
+        buf->crcs    = crcs;
+        buf->crcsize = last - first;
+    }
+
+    if (point.data != NULL && zran_get_window(index, first, buf->window) != 0)
+        return -1;
+
+    buf->start      = start;
+    buf->end        = end;
+    buf->cmp_offset = point.cmp_offset;
+    buf->bits       = point.bits;
+    buf->has_window = point.data != NULL;
+    buf->ncrcs      = 0;
+
+    if (index->flags & ZRAN_SKIP_CRC_CHECK)
+        return 0;
+
+    for (i = first; i < last && i < index->nspans; i++) {
+
+        if (index->uncmp_offsets[i + 1] > end)
+            break;
+
+        buf->crcs[buf->ncrcs].start = index->uncmp_offsets[i];
+        buf->crcs[buf->ncrcs].end   = index->uncmp_offsets[i + 1];
+        buf->crcs[buf->ncrcs].crc   = index->span_crcs[i];
+        buf->ncrcs++;
+    }
+
+    return 0;
+}
+
+
+/* Find the readahead buffer which contains offset. */
+zran_readahead_buf_t * _zran_readahead_find(zran_readahead_t *ra,
+                                            uint64_t          offset) {
+
+    zran_readahead_buf_t *buf;
+    uint32_t              i;
+
+    for (i = 0; i < ZRAN_READAHEAD_BUFFERS; i++) {
+
+        buf = &(ra->bufs[i]);
+
+        if (buf->state != ZRAN_READAHEAD_EMPTY &&
+            buf->start <= offset               &&
+            buf->end   >  offset)
+            return buf;
+    }
+
+    return NULL;
+}
+
+
+/* Detect sequential/strided reads, and read ahead accordingly. */
+void _zran_readahead_schedule(zran_reader_t *reader,
+                              uint64_t       offset,
+                              uint64_t       len) {
+
+    zran_readahead_t     *ra    = reader->readahead;
+    zran_index_t         *index = reader->index;
+    zran_readahead_buf_t *keep[ZRAN_READAHEAD_BUFFERS];
+    zran_readahead_buf_t *buf;
+    uint64_t              next;
+    uint64_t              step;
+    uint64_t              stride;
+    uint32_t              nkeep;
+    uint32_t              i;
+    uint32_t              j;
+
+    step = 0;
+    if (offset > ra->last_offset)
+        step = offset - ra->last_offset;
+
+    if      (offset == ra->last_end)             stride = 0;
+    else if (step > 0 && step == ra->last_step)  stride = step;
+    else                                         stride = UINT64_MAX;
+
+    ra->last_offset = offset;
+    ra->last_end    = offset + len;
+    ra->last_step   = step;
+
+    if (stride == UINT64_MAX)
+        return;
+
+    /*
+     * The next read is expected to start where
+     * this one ended, or one stride after where
+     * this one started. Make sure that there is a
+     * buffer for it, and for the read after it
+     * (or for the data following the first
+     * buffer, if the read after it falls within
+     * the same buffer).
+     */
+    if (stride == 0) next = offset + len;
+    else             next = offset + stride;
+
+    zran_mutex_lock(&(ra->lock));
+
+    for (nkeep = 0; nkeep < ZRAN_READAHEAD_BUFFERS; nkeep++) {
+
+        buf = _zran_readahead_find(ra, next);
+
+        if (buf == NULL) {
+
+            /*
+             * Re-use a buffer which is not
+             * already being filled, and which
+             * does not contain any of the data
+             * that we are expecting to read.
+             */
+            for (i = 0; i < ZRAN_READAHEAD_BUFFERS; i++) {
+
+                buf = &(ra->bufs[i]);
+
+                for (j = 0; j < nkeep; j++) {
+                    if (keep[j] == buf)
+                        break;
+                }
+
+                if (j == nkeep && buf->state != ZRAN_READAHEAD_BUSY)
+                    break;
+            }
+
+            if (i == ZRAN_READAHEAD_BUFFERS)
+                break;
+
+            if (_zran_readahead_prepare(index, buf, next, len) != 0) {
+                buf->state = ZRAN_READAHEAD_EMPTY;
+                break;
+            }
+
+            buf->state = ZRAN_READAHEAD_PENDING;
+            zran_cond_broadcast(&(ra->cond));
+        }
+
+        keep[nkeep] = buf;
+
+        if (stride == 0 || next + stride < buf->end) next = buf->end;
+        else                                         next = next + stride;
+    }
+
+    zran_mutex_unlock(&(ra->lock));
+}
+
+
+/* Read data via the readahead buffers. */
+int64_t _zran_readahead_read(zran_reader_t *reader,
+                             void          *buf,
+                             uint64_t       len) {
+
+    zran_readahead_t     *ra     = reader->readahead;
+    zran_readahead_buf_t *rbuf;
+    uint8_t              *out    = (uint8_t *)buf;
+    uint64_t              offset = reader->uncmp_seek_offset;
+    uint64_t              total  = 0;
+    uint64_t              pos;
+    uint64_t              n;
+    int64_t               ret;
+
+    if (len == 0 || len > INT64_MAX)
+        return _zran_cached_read(reader, buf, len);
+
+    zran_mutex_lock(&(ra->lock));
+
+    while (total < len) {
+
+        pos  = offset + total;
+        rbuf = _zran_readahead_find(ra, pos);
+
+        if (rbuf == NULL || rbuf->state == ZRAN_READAHEAD_FAILED)
+            break;
+
+        if (rbuf->state != ZRAN_READAHEAD_READY) {
+            zran_cond_wait(&(ra->cond), &(ra->lock));
+            continue;
+        }
+
+        n = rbuf->end - pos;
+        if (n > len - total)
+            n = len - total;
+
+        /*
+         * Ready buffers are only modified by
+         * the reader, so the thread can carry
+         * on while we copy the data out.
+         */
+        zran_mutex_unlock(&(ra->lock));
+        memcpy(out + total, rbuf->data + (pos - rbuf->start), n);
+        zran_mutex_lock(&(ra->lock));
+
+        total += n;
+    }
+
+    zran_mutex_unlock(&(ra->lock));
+
+    reader->uncmp_seek_offset += total;
+    ra->bytes                 += total;
+
+    if (total < len) {
+        ret = _zran_cached_read(reader, out + total, len - total);
+
+        if (ret < 0 && (ret != ZRAN_READ_EOF || total == 0))
+            return ret;
+        if (ret > 0)
+            total += ret;
+    }
+
+    _zran_readahead_schedule(reader, offset, total);
+
+    return total;
+}
+
+
+/* Free a readahead thread and its buffers. */
+void _zran_free_readahead(zran_readahead_t *ra) {
+
+    uint32_t i;
+
+    for (i = 0; i < ZRAN_READAHEAD_BUFFERS; i++) {
+        free(ra->bufs[i].window);
+        free(ra->bufs[i].data);
+        free(ra->bufs[i].crcs);
+    }
+
+    free(ra->readbuf);
+    free(ra);
+}
+
+
+/* Start a readahead thread for a reader. */
+int zran_readahead_start(zran_index_t  *index,
+                         zran_reader_t *reader,
+                         FILE          *fd) {
+
+    zran_readahead_t *ra;
+    uint32_t          i;
+
+    if (reader == NULL)
+        reader = &(index->reader);
+
+    zran_log("zran_readahead_start\n");
+
+    if (reader->readahead != NULL)
+        return 0;
+
+    ra = calloc(1, sizeof(zran_readahead_t));
+    if (ra == NULL)
+        return -1;
+
+    ra->fd              = fd;
+    ra->window_size     = index->window_size;
+    ra->log_window_size = index->log_window_size;
+    ra->readbuf_size    = index->readbuf_size;
+    ra->readbuf         = malloc(index->readbuf_size);
+
+    if (ra->readbuf == NULL)
+        goto fail;
+
+    for (i = 0; i < ZRAN_READAHEAD_BUFFERS; i++) {
+        ra->bufs[i].window = malloc(index->window_size);
+        if (ra->bufs[i].window == NULL)
+            goto fail;
+    }
+
+    zran_mutex_init(&(ra->lock));
+    zran_cond_init( &(ra->cond));
+
+    ra->thread.fn  = _zran_readahead_main;
+    ra->thread.arg = ra;
+
+    if (_zran_start_thread(&(ra->thread)) != 0) {
+        zran_cond_destroy( &(ra->cond));
+        zran_mutex_destroy(&(ra->lock));
+        goto fail;
+    }
+
+    reader->readahead = ra;
+
+    return 0;
+
+fail:
+    _zran_free_readahead(ra);
+    return -1;
+}
+
+
+/* Stop the readahead thread of a reader. */
+void zran_readahead_stop(zran_index_t  *index,
+                         zran_reader_t *reader) {
+
+    zran_readahead_t *ra;
+
+    if (reader == NULL)
+        reader = &(index->reader);
+
+    ra = reader->readahead;
+
+    if (ra == NULL)
+        return;
+
+    zran_log("zran_readahead_stop\n");
+
+    zran_mutex_lock(&(ra->lock));
+    ra->stop = 1;
+    zran_cond_broadcast(&(ra->cond));
+    zran_mutex_unlock(&(ra->lock));
+
+    _zran_join_thread(&(ra->thread));
+
+    zran_cond_destroy( &(ra->cond));
+    zran_mutex_destroy(&(ra->lock));
+
+    _zran_free_readahead(ra);
+
+    reader->readahead = NULL;
+}
+
+
+/* Return the number of bytes copied from the readahead buffers. */
+uint64_t zran_readahead_bytes(zran_index_t  *index,
+                              zran_reader_t *reader) {
+
+    if (reader == NULL)
+        reader = &(index->reader);
+
+    if (reader->readahead == NULL)
+        return 0;
+
+    return reader->readahead->bytes;
+}
+
+
+#ifndef _WIN32
+/* Read data from a file descriptor, at the given offset. */
+int64_t _zran_pread(int       fd,
+                    void     *buf,
+                    uint64_t  len,
+                    uint64_t  offset) {
+
+    uint8_t  *out   = (uint8_t *)buf;
+    uint64_t  total = 0;
+    ssize_t   ret;
+
+    while (total < len) {
+
+        ret = pread(fd, out + total, len - total, (off_t)(offset + total));
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return -1;
+        if (ret == 0)
+            break;
+
+        total += ret;
+    }
+
+    return total;
+}
+#endif
+
+
+/* Set the position of a reader in the compressed data. */
+int _zran_fseek(zran_reader_t *reader, uint64_t offset) {
+
+#ifndef _WIN32
+    if (reader->fd != NULL) {
+        reader->cmp_pos = offset;
+        reader->cmp_eof = 0;
+        return 0;
+    }
+#endif
+
+    return fseek_(reader->fd, reader->f, offset, SEEK_SET);
+}
+
+
+/* Return the position of a reader in the compressed data. */
+int64_t _zran_ftell(zran_reader_t *reader) {
+
+#ifndef _WIN32
+    if (reader->fd != NULL)
+        return reader->cmp_pos;
+#endif
+
+    return ftell_(reader->fd, reader->f);
+}
+
+
+/* Read compressed data from the current position of a reader. */
+size_t _zran_fread(zran_reader_t *reader, void *buf, size_t len) {
+
+#ifndef _WIN32
+    int64_t nread;
+
+    if (reader->fd != NULL) {
+
+        nread = _zran_pread(fileno(reader->fd), buf, len, reader->cmp_pos);
+
+        reader->cmp_error = nread < 0;
+        if (nread < 0)
+            return 0;
+
+        reader->cmp_eof  = (size_t)nread < len;
+        reader->cmp_pos += nread;
+
+        return nread;
+    }
+#endif
+
+    return fread_(buf, 1, len, reader->fd, reader->f);
+}
+
+
+/* Read one byte from the current position of a reader. */
+int _zran_getc(zran_reader_t *reader) {
+
+#ifndef _WIN32
+    uint8_t c;
+
+    if (reader->fd != NULL)
+        return _zran_fread(reader, &c, 1) == 1 ? c : -1;
+#endif
+
+    return getc_(reader->fd, reader->f);
+}
+
+
+/* Check whether the most recent read by a reader failed. */
+int _zran_ferror(zran_reader_t *reader) {
+
+#ifndef _WIN32
+    if (reader->fd != NULL)
+        return reader->cmp_error;
+#endif
+
+    return ferror_(reader->fd, reader->f);
+}
+
+
+/* Check whether the most recent read by a reader reached EOF. */
+int _zran_feof(zran_reader_t *reader, size_t f_ret) {
+
+#ifndef _WIN32
+    if (reader->fd != NULL)
+        return reader->cmp_eof;
+#endif
+
+    return feof_(reader->fd, reader->f, f_ret);
+}
+
+
+/* Start an I/O pipeline for a reader. */
+int _zran_start_pipeline(zran_reader_t *reader) {
+
+#ifdef _WIN32
+    return -1;
+#else
+
+    zran_pipeline_t *pipe;
+
+    if (reader->fd == NULL)
+        return -1;
+
+    if (reader->pipeline != NULL)
+        return 0;
+
+    pipe = calloc(1, sizeof(zran_pipeline_t));
+    if (pipe == NULL)
+        return -1;
+
+    pipe->fd     = fileno(reader->fd);
+    pipe->blocks = malloc(ZRAN_PIPELINE_BLOCKS * ZRAN_PIPELINE_BLOCK_SIZE);
+
+    if (pipe->fd < 0 || pipe->blocks == NULL)
+        goto fail;
+
+    zran_mutex_init(&(pipe->lock));
+    zran_cond_init( &(pipe->cond));
+
+    pipe->thread.fn  = _zran_pipeline_main;
+    pipe->thread.arg = pipe;
+
+    if (_zran_start_thread(&(pipe->thread)) != 0) {
+        zran_cond_destroy( &(pipe->cond));
+        zran_mutex_destroy(&(pipe->lock));
+        goto fail;
+    }
+
+    zran_log("_zran_start_pipeline\n");
+
+    reader->pipeline = pipe;
+
+    return 0;
+
+fail:
+    free(pipe->blocks);
+    free(pipe);
+    return -1;
+#endif
+}
+
+
+/* Stop the I/O pipeline of a reader. */
+void _zran_stop_pipeline(zran_reader_t *reader) {
+
+    zran_pipeline_t *pipe = reader->pipeline;
+
+    if (pipe == NULL)
+        return;
+
+    zran_log("_zran_stop_pipeline\n");
+
+    zran_mutex_lock(&(pipe->lock));
+    pipe->stop = 1;
+    zran_cond_broadcast(&(pipe->cond));
+    zran_mutex_unlock(&(pipe->lock));
+
+    _zran_join_thread(&(pipe->thread));
+
+    zran_cond_destroy( &(pipe->cond));
+    zran_mutex_destroy(&(pipe->lock));
+
+    free(pipe->blocks);
+    free(pipe);
+
+    reader->pipeline = NULL;
+}
+
+
+/* Read blocks of compressed data into the ring. */
+void _zran_pipeline_main(void *arg) {
+
+#ifndef _WIN32
+    zran_pipeline_t *pipe = (zran_pipeline_t *)arg;
+    uint8_t         *block;
+    uint64_t         offset;
+    uint64_t         generation;
+    uint32_t         slot;
+    int64_t          nread;
+
+    zran_mutex_lock(&(pipe->lock));
+
+    while (!pipe->stop) {
+
+        if (pipe->eof   ||
+            pipe->error ||
+            pipe->head - pipe->tail == ZRAN_PIPELINE_BLOCKS) {
+            zran_cond_wait(&(pipe->cond), &(pipe->lock));
+            continue;
+        }
+
+        slot       = pipe->head % ZRAN_PIPELINE_BLOCKS;
+        block      = pipe->blocks + (uint64_t)slot * ZRAN_PIPELINE_BLOCK_SIZE;
+        offset     = pipe->next;
+        generation = pipe->generation;
+
+        zran_mutex_unlock(&(pipe->lock));
+
+        nread = _zran_pread(pipe->fd, block, ZRAN_PIPELINE_BLOCK_SIZE, offset);
+
+        zran_mutex_lock(&(pipe->lock));
+
+        /* The reader has moved elsewhere */
+        if (generation != pipe->generation)
+            continue;
+
+        if (nread < 0) {
+            pipe->error = 1;
+        }
+        else if (nread == 0) {
+            pipe->eof = 1;
+        }
+        else {
+            pipe->offsets[slot] = offset;
+            pipe->lens[   slot] = (uint32_t)nread;
+            pipe->next         += nread;
+            pipe->head         += 1;
+        }
+
+        zran_cond_broadcast(&(pipe->cond));
+    }
+
+    zran_mutex_unlock(&(pipe->lock));
+#endif
+}
+
+
+/* Copy compressed data out of the ring. */
+int64_t _zran_pipeline_read(zran_reader_t *reader,
+                            uint8_t       *buf,
+                            uint64_t       len) {
+
+    zran_pipeline_t *pipe  = reader->pipeline;
+    uint64_t         total = 0;
+    uint64_t         start;
+    uint64_t         pos;
+    uint64_t         n;
+    uint32_t         slot;
+    int64_t          loc;
+    int64_t          ret   = 0;
+
+    loc = _zran_ftell(reader);
+    if (loc < 0)
+        return -1;
+
+    zran_mutex_lock(&(pipe->lock));
+
+    while (total < len) {
+
+        pos = (uint64_t)loc + total;
+
+        if (pipe->head > pipe->tail) {
+
+            slot  = pipe->tail % ZRAN_PIPELINE_BLOCKS;
+            start = pipe->offsets[slot];
+
+            /* Finished with this block */
+            if (pos >= start + pipe->lens[slot]) {
+                pipe->tail++;
+                zran_cond_broadcast(&(pipe->cond));
+                continue;
+            }
+
+            if (pos >= start) {
+                n = start + pipe->lens[slot] - pos;
+                if (n > len - total)
+                    n = len - total;
+
+                memcpy(buf + total,
+                       pipe->blocks +
+                       (uint64_t)slot * ZRAN_PIPELINE_BLOCK_SIZE +
+                       (pos - start),
+                       n);
+                total += n;
+                continue;
+            }
+        }
+
+        /*
+         * The data that we need is not in the ring,
+         * and is not going to be read next - restart
+         * the I/O thread from where we are.
+         */
+        else if (pipe->next == pos) {
+
+            if (pipe->error) { ret = -1; break; }
+            if (pipe->eof)   {           break; }
+
+            zran_cond_wait(&(pipe->cond), &(pipe->lock));
+            continue;
+        }
+
+        zran_log("_zran_pipeline_read: restarting at %llu\n", pos);
+
+        pipe->generation++;
+        pipe->tail  = pipe->head;
+        pipe->next  = pos;
+        pipe->eof   = 0;
+        pipe->error = 0;
+        zran_cond_broadcast(&(pipe->cond));
+    }
+
+    zran_mutex_unlock(&(pipe->lock));
+
+    if (ret == 0 && _zran_fseek(reader, loc + total) != 0)
+        ret = -1;
+
+    if (ret < 0)
+        return ret;
+
+    return total;
+}
+
+
+/* Minimum and maximum amount of compressed data in a parallel build chunk. */
+#define ZRAN_PBUILD_MIN_CHUNK 4194304
+#define ZRAN_PBUILD_MAX_CHUNK 16777216
+
+
+/*
+ * Number of chunks that the compressed data is divided into for each
+ * zran_build_index_parallel thread.
+ */
+#define ZRAN_PBUILD_CHUNKS_PER_THREAD 4
+
+
+/*
+ * Amount of compressed data read past the end of each parallel build
+ * chunk, as decoding stops at the first block boundary after the end of
+ * the chunk. A chunk which ends in a block that is larger than this is
+ * decoded sequentially instead.
+ */
+#define ZRAN_PBUILD_OVERLAP 1048576
+
+
+/* Size of the input/output buffers used by _zran_pbuild_inflate. */
+#define ZRAN_PBUILD_BUFFER_SIZE 262144
+
+
+/* Add a point to a parallel build chunk. */
+static int _zran_pbuild_add_point(zran_pbuild_chunk_t *chunk,
+                                  uint64_t             bitpos,
+                                  uint64_t             uncmp_offset,
+                                  uint8_t             *window,
+                                  uint16_t            *markers,
+                                  uint8_t             *refs) {
+
+    zran_pbuild_point_t *points;
+    zran_pbuild_point_t *point;
+    uint32_t             size;
+
+    if (chunk->npoints == chunk->pointsize) {
+
+        size   = (chunk->pointsize == 0) ? 8 : chunk->pointsize * 2;
+        points = realloc(chunk->points, size * sizeof(zran_pbuild_point_t));
+
+        if (points == NULL)
+            return -1;
+
+        chunk->points    = points;
+        chunk->pointsize = size;
+    }
+
+    point          = &(chunk->points[chunk->npoints]);
+    point->window  = malloc(2 * ZRAN_DEFLATE_WINDOW);
+    point->markers = NULL;
+
+    if (point->window == NULL)
+        return -1;
+
+    /* Count the point before anything else can fail */
+    chunk->npoints++;
+
+    point->bitpos       = bitpos;
+    point->uncmp_offset = uncmp_offset;
+    point->refs         = refs != NULL;
+
+    if (markers != NULL) {
+        point->markers = malloc(ZRAN_DEFLATE_WINDOW * sizeof(uint16_t));
+        if (point->markers == NULL)
+            return -1;
+        memcpy(point->markers,
+               markers,
+               ZRAN_DEFLATE_WINDOW * sizeof(uint16_t));
+    }
+    else {
+        memcpy(point->window, window, ZRAN_DEFLATE_WINDOW);
+    }
+
+    if (refs != NULL)
+        memcpy(point->window + ZRAN_DEFLATE_WINDOW,
+               refs,
+               ZRAN_DEFLATE_WINDOW);
+
+    return 0;
+}
+
+
+/* Free the memory used by a parallel build chunk. */
+static void _zran_pbuild_free_chunk(zran_pbuild_chunk_t *chunk) {
+
+    uint32_t i;
+
+    for (i = 0; i < chunk->npoints; i++) {
+        free(chunk->points[i].window);
+        free(chunk->points[i].markers);
+    }
+
+    free(chunk->points);
+    free(chunk->window);
+
+    chunk->points    = NULL;
+    chunk->window    = NULL;
+    chunk->npoints   = 0;
+    chunk->pointsize = 0;
+}
+
+
+/*
+ * Add a point, with a window of markers, to a parallel build chunk. The
+ * bytes of the window which are referenced are found from the compressed
+ * data in buf, which starts at bit offset base in the file.
+ */
+static int _zran_pbuild_add_marker_point(zran_pbuild_chunk_t *chunk,
+                                         uint8_t             *buf,
+                                         size_t               len,
+                                         uint64_t             base,
+                                         uint64_t             bitpos,
+                                         uint64_t             outcnt,
+                                         uint16_t            *symbols,
+                                         uint8_t             *refs) {
+
+    uint64_t cmp_offset = (bitpos + 7) / 8;
+    uint8_t  bits       = cmp_offset * 8 - bitpos;
+    int      ret;
+
+    memset(refs, 0, ZRAN_DEFLATE_WINDOW);
+    ret = zran_deflate_scan_refs(buf + cmp_offset,
+                                 len - cmp_offset,
+                                 bits ? buf[cmp_offset - 1] >> (8 - bits) : 0,
+                                 bits,
+                                 refs);
+
+    return _zran_pbuild_add_point(chunk,
+                                  base + bitpos,
+                                  outcnt,
+                                  NULL,
+                                  symbols,
+                                  ret == ZRAN_DEFLATE_SCAN_OK ? refs : NULL);
+}
+
+
+/*
+ * Parse the gzip header at the start of buf, returning its length, or 0
+ * if it is not a valid header.
+ */
+static size_t _zran_pbuild_parse_header(uint8_t *buf, size_t len) {
+
+    z_stream strm;
+    uint8_t  out[1];
+    size_t   hlen = 0;
+
+    memset(&strm, 0, sizeof(z_stream));
+
+    if (inflateInit2(&strm, 16 + 15) != Z_OK)
+        return 0;
 
     /*
-     * Tell zlib about the block
-     * of compressed data that we
-     * just read in.
+     * With Z_BLOCK, inflate stops after
+     * the header has been parsed.
      */
-    index->readbuf_end = f_ret + stream->avail_in;
-    stream->avail_in  += f_ret;
-    stream->next_in    = index->readbuf;
+    strm.next_in   = buf;
+    strm.avail_in  = len;
+    strm.next_out  = out;
+    strm.avail_out = 1;
 
-    return 0;
-eof:
-    return ZRAN_READ_DATA_EOF;
-fail:
-    return ZRAN_READ_DATA_ERROR;
+    if (inflate(&strm, Z_BLOCK) == Z_OK &&
+        (strm.data_type & 128)          &&
+        strm.total_out == 0)
+        hlen = strm.total_in;
+
+    inflateEnd(&strm);
+
+    return hlen;
+}
+
+
+/* Search a buffer for a gzip header. */
+int _zran_pbuild_find_stream(uint8_t  *buf,
+                             size_t    len,
+                             uint64_t  from,
+                             uint64_t  to,
+                             uint64_t *start,
+                             uint64_t *end) {
+
+    uint64_t i;
+    size_t   hlen;
+
+    for (i = from; i < to && i + 3 < len; i++) {
+
+        if (buf[i]     != 0x1f ||
+            buf[i + 1] != 0x8b ||
+            buf[i + 2] != 0x08 ||
+            (buf[i + 3] & 0xe0))
+            continue;
+
+        hlen = _zran_pbuild_parse_header(buf + i, len - i);
+
+        if (hlen > 0) {
+            *start = i;
+            *end   = i + hlen;
+            return ZRAN_PBUILD_OK;
+        }
+    }
+
+    return ZRAN_PBUILD_NO_STREAM;
+}
+
+
+/* Find the next gzip stream in the file. */
+int _zran_pbuild_next_stream(zran_reader_t *reader,
+                             uint64_t       offset,
+                             uint64_t      *bitpos) {
+
+    uint8_t *buf = NULL;
+    size_t   len;
+    size_t   hlen;
+    size_t   i;
+    int      ret = ZRAN_PBUILD_ERROR;
+
+    buf = malloc(ZRAN_PBUILD_BUFFER_SIZE);
+    if (buf == NULL)
+        return ZRAN_PBUILD_ERROR;
+
+    while (1) {
+
+        if (_zran_fseek(reader, offset) != 0)
+            goto cleanup;
+
+        len = _zran_fread(reader, buf, ZRAN_PBUILD_BUFFER_SIZE);
+        if (_zran_ferror(reader))
+            goto cleanup;
+
+        for (i = 0; i + 1 < len; i++) {
+            if (buf[i] == 0x1f && buf[i + 1] == 0x8b)
+                break;
+        }
+
+        /* EOF */
+        if (i + 1 >= len && len < ZRAN_PBUILD_BUFFER_SIZE) {
+            ret = ZRAN_PBUILD_NO_STREAM;
+            goto cleanup;
+        }
+
+        /*
+         * Keep looking, or re-read from the
+         * start of the header, so that all
+         * of it is in the buffer.
+         */
+        if (i + 1 >= len || (i > 0 && len == ZRAN_PBUILD_BUFFER_SIZE)) {
+            offset += (i + 1 >= len) ? len - 1 : i;
+            continue;
+        }
+
+        hlen = _zran_pbuild_parse_header(buf + i, len - i);
+
+        if (hlen == 0) {
+            ret = ZRAN_PBUILD_DATA_ERROR;
+            goto cleanup;
+        }
+
+        *bitpos = (offset + i + hlen) * 8;
+        ret     = ZRAN_PBUILD_OK;
+        break;
+    }
+
+cleanup:
+    free(buf);
+    return ret;
+}
+
+
+/*
+ * Add a point, found by _zran_pbuild_inflate, to a parallel build chunk.
+ * The window is the ZRAN_DEFLATE_WINDOW bytes preceding offset have in
+ * out - if any of these bytes are from the initial window (the first
+ * initial bytes of out), the window is taken from symbols instead.
+ */
+static int _zran_pbuild_add_inflate_point(zran_pbuild_chunk_t *chunk,
+                                          uint64_t             bitpos,
+                                          uint64_t             outcnt,
+                                          uint8_t             *out,
+                                          uint32_t             have,
+                                          uint16_t            *symbols,
+                                          uint32_t             initial,
+                                          uint16_t            *tmp,
+                                          uint8_t             *refs) {
+
+    uint8_t  *window = out + have - ZRAN_DEFLATE_WINDOW;
+    uint32_t  i;
+
+    if (initial <= have - ZRAN_DEFLATE_WINDOW)
+        return _zran_pbuild_add_point(
+            chunk, bitpos, outcnt, window, NULL, refs);
+
+    for (i = 0; i < ZRAN_DEFLATE_WINDOW; i++) {
+        if (have - ZRAN_DEFLATE_WINDOW + i < initial)
+            tmp[i] = symbols[have - ZRAN_DEFLATE_WINDOW + i];
+        else
+            tmp[i] = window[i];
+    }
+
+    return _zran_pbuild_add_point(chunk, bitpos, outcnt, NULL, tmp, refs);
+}
+
+
+/* Decode from bitpos with zlib, creating points along the way. */
+int _zran_pbuild_inflate(zran_pbuild_chunk_t *chunk,
+                         zran_reader_t       *reader,
+                         uint64_t             bitpos,
+                         uint8_t             *window,
+                         uint16_t            *symbols,
+                         uint64_t             outcnt,
+                         uint64_t             limit,
+                         uint32_t             spacing) {
+
+    z_stream  strm;
+    uint8_t  *in         = NULL;
+    uint8_t  *out        = NULL;
+    uint8_t  *refs       = NULL;
+    uint16_t *tmp        = NULL;
+    uint8_t   strm_init  = 0;
+    uint8_t   start      = symbols != NULL;
+    uint64_t  cmp_offset = bitpos / 8;
+    uint64_t  last_point = 0;
+    uint64_t  pos        = bitpos;
+    uint32_t  have       = ZRAN_DEFLATE_WINDOW;
+    uint32_t  initial    = 0;
+    uint32_t  space;
+    uint8_t   bits;
+    size_t    f_ret;
+    int       z_ret;
+    int       c;
+    uint32_t  i;
+    int       ret        = ZRAN_PBUILD_ERROR;
+
+    zran_log("_zran_pbuild_inflate(%llu, %llu, %llu)\n",
+             bitpos, outcnt, limit);
+
+    memset(&strm, 0, sizeof(z_stream));
+
+    /*
+     * The first byte of the input buffer holds
+     * the last byte that was read, so that the
+     * bits preceding a point are available.
+     */
+    in   = malloc(ZRAN_PBUILD_BUFFER_SIZE + 1);
+    out  = calloc(1, ZRAN_DEFLATE_WINDOW + ZRAN_PBUILD_BUFFER_SIZE);
+    refs = malloc(ZRAN_DEFLATE_WINDOW);
+    tmp  = malloc(ZRAN_DEFLATE_WINDOW * sizeof(uint16_t));
+
+    if (in == NULL || out == NULL || refs == NULL || tmp == NULL)
+        goto cleanup;
+
+    if (inflateInit2(&strm, -15) != Z_OK)
+        goto cleanup;
+    strm_init = 1;
+
+    if (chunk->npoints > 0)
+        last_point = chunk->points[chunk->npoints - 1].uncmp_offset;
+
+    if (window != NULL) {
+        memcpy(out, window, ZRAN_DEFLATE_WINDOW);
+        if (inflateSetDictionary(&strm,
+                                 window,
+                                 ZRAN_DEFLATE_WINDOW) != Z_OK)
+            goto cleanup;
+    }
+
+    /*
+     * The data preceding the start of a stream
+     * is not needed to decode it, but it is
+     * still needed for the windows of points
+     * near the start of the stream.
+     */
+    else if (symbols != NULL) {
+        initial = ZRAN_DEFLATE_WINDOW;
+        for (i = 0; i < ZRAN_DEFLATE_WINDOW; i++)
+            out[i] = symbols[i] < 256 ? symbols[i] : 0;
+    }
+
+    if (_zran_fseek(reader, cmp_offset) != 0)
+        goto cleanup;
+
+    if (bitpos % 8 != 0) {
+
+        c = _zran_getc(reader);
+        if (c == -1) {
+            ret = ZRAN_PBUILD_DATA_ERROR;
+            goto cleanup;
+        }
+
+        if (inflatePrime(&strm, 8 - bitpos % 8, c >> (bitpos % 8)) != Z_OK)
+            goto cleanup;
+
+        in[0] = c;
+        cmp_offset++;
+    }
+
+    while (1) {
+
+        /*
+         * Nothing before the start of a
+         * stream is needed to decode it,
+         * so the point has no window.
+         */
+        if (start) {
+            memset(refs, 0, ZRAN_DEFLATE_WINDOW);
+            if (_zran_pbuild_add_inflate_point(chunk,
+                                               pos,
+                                               outcnt,
+                                               out,
+                                               have,
+                                               symbols,
+                                               initial,
+                                               tmp,
+                                               refs) != 0)
+                goto cleanup;
+
+            last_point = outcnt;
+            start      = 0;
+        }
+
+        if (strm.avail_in == 0) {
+
+            if (strm.next_in != NULL)
+                in[0] = strm.next_in[-1];
+
+            f_ret = _zran_fread(reader, in + 1, ZRAN_PBUILD_BUFFER_SIZE);
+
+            if (_zran_ferror(reader))
+                goto cleanup;
+
+            /* The deflate stream is truncated */
+            if (f_ret == 0) {
+                ret = ZRAN_PBUILD_DATA_ERROR;
+                goto cleanup;
+            }
+
+            strm.next_in  = in + 1;
+            strm.avail_in = f_ret;
+            cmp_offset   += f_ret;
+        }
+
+        if (have == ZRAN_DEFLATE_WINDOW + ZRAN_PBUILD_BUFFER_SIZE) {
+            memmove(out,
+                    out + have - ZRAN_DEFLATE_WINDOW,
+                    ZRAN_DEFLATE_WINDOW);
+            have    = ZRAN_DEFLATE_WINDOW;
+            initial = 0;
+        }
+
+        space          = ZRAN_DEFLATE_WINDOW + ZRAN_PBUILD_BUFFER_SIZE - have;
+        strm.next_out  = out + have;
+        strm.avail_out = space;
+
+        z_ret   = inflate(&strm, Z_BLOCK);
+        have   += space - strm.avail_out;
+        outcnt += space - strm.avail_out;
+
+        if (z_ret != Z_OK && z_ret != Z_STREAM_END && z_ret != Z_BUF_ERROR) {
+            ret = ZRAN_PBUILD_DATA_ERROR;
+            goto cleanup;
+        }
+
+        bits = strm.data_type & 7;
+        pos  = (cmp_offset - strm.avail_in) * 8 - bits;
+
+        /*
+         * The stream has ended - skip over its
+         * footer, and carry on from the start
+         * of the next stream, if there is one.
+         */
+        if (z_ret == Z_STREAM_END) {
+
+            pos   = (cmp_offset - strm.avail_in) * 8;
+            z_ret = _zran_pbuild_next_stream(reader, pos / 8 + 8, &pos);
+
+            if (z_ret == ZRAN_PBUILD_NO_STREAM) {
+                chunk->last = 1;
+                pos         = (cmp_offset - strm.avail_in) * 8;
+                break;
+            }
+            else if (z_ret != ZRAN_PBUILD_OK) {
+                ret = z_ret;
+                goto cleanup;
+            }
+
+            if (pos >= limit)
+                break;
+
+            if (inflateReset(&strm) != Z_OK)
+                goto cleanup;
+
+            cmp_offset    = pos / 8;
+            strm.next_in  = NULL;
+            strm.avail_in = 0;
+            start         = 1;
+
+            if (_zran_fseek(reader, cmp_offset) != 0)
+                goto cleanup;
+
+            continue;
+        }
+
+        /* Not at a block boundary */
+        if (!(strm.data_type & 128) || (strm.data_type & 64))
+            continue;
+
+        if (pos >= limit)
+            break;
+
+        if (outcnt - last_point < spacing)
+            continue;
+
+        /*
+         * Find out which window bytes are needed,
+         * from the data that is in the input
+         * buffer (see _zran_expand_index).
+         */
+        memset(refs, 0, ZRAN_DEFLATE_WINDOW);
+        c = zran_deflate_scan_refs(strm.next_in,
+                                   strm.avail_in,
+                                   bits ? strm.next_in[-1] >> (8 - bits) : 0,
+                                   bits,
+                                   refs);
+
+        if (_zran_pbuild_add_inflate_point(chunk,
+                                           pos,
+                                           outcnt,
+                                           out,
+                                           have,
+                                           symbols,
+                                           initial,
+                                           tmp,
+                                           c == ZRAN_DEFLATE_SCAN_OK ?
+                                           refs : NULL) != 0)
+            goto cleanup;
+
+        last_point = outcnt;
+    }
+
+    if (chunk->window == NULL)
+        chunk->window = malloc(ZRAN_DEFLATE_WINDOW * sizeof(uint16_t));
+    if (chunk->window == NULL)
+        goto cleanup;
+
+    for (i = 0; i < ZRAN_DEFLATE_WINDOW; i++) {
+        if (have - ZRAN_DEFLATE_WINDOW + i < initial)
+            chunk->window[i] = symbols[have - ZRAN_DEFLATE_WINDOW + i];
+        else
+            chunk->window[i] = out[have - ZRAN_DEFLATE_WINDOW + i];
+    }
+
+    chunk->end  = pos;
+    chunk->size = outcnt;
+    ret         = ZRAN_PBUILD_OK;
+
+cleanup:
+    if (strm_init)
+        inflateEnd(&strm);
+    free(in);
+    free(out);
+    free(refs);
+    free(tmp);
+    return ret;
 }
 
 
-/*
- * Identify the location of the next compressed stream (if the file
- * contains concatenated streams).
- */
-int _zran_find_next_stream(zran_index_t *index,
-                           z_stream     *stream,
-                           int          *offset) {
+/* Decode one chunk of the compressed data. */
+int _zran_pbuild_chunk(zran_pbuild_t       *pbuild,
+                       zran_reader_t       *reader,
+                       zran_pbuild_chunk_t *chunk) {
+
+    zran_index_t           *index   = pbuild->index;
+    zran_deflate_markers_t *markers = NULL;
+    uint8_t                *buf     = NULL;
+    uint8_t                *window  = NULL;
+    uint8_t                *refs    = NULL;
+    uint16_t               *symbols = NULL;
+    uint64_t                offset  = chunk->from / 8;
+    uint64_t                base    = offset * 8;
+    uint64_t                from    = chunk->from - base;
+    uint64_t                limit   = chunk->to   - base;
+    uint64_t                hstart  = 0;
+    uint64_t                hend    = 0;
+    uint64_t                next    = 0;
+    uint64_t                found;
+    uint8_t                 stream;
+    size_t                  len;
+    uint32_t                i;
+    int                     ret     = -1;
+    int                     z_ret;
+
+    zran_log("_zran_pbuild_chunk(%llu - %llu)\n", chunk->from, chunk->to);
+
+    /*
+     * The first chunk starts at the
+     * beginning of the deflate stream.
+     */
+    if (chunk->from == 0) {
+
+        chunk->start = pbuild->header;
+        chunk->valid = 1;
+
+        z_ret = _zran_pbuild_inflate(chunk,
+                                     reader,
+                                     pbuild->header,
+                                     NULL,
+                                     NULL,
+                                     0,
+                                     chunk->to,
+                                     index->spacing);
+
+        if      (z_ret == ZRAN_PBUILD_DATA_ERROR) goto invalid;
+        else if (z_ret != ZRAN_PBUILD_OK)         goto cleanup;
+
+        ret = 0;
+        goto cleanup;
+    }
+
+    len = (chunk->to - chunk->from) / 8 + ZRAN_PBUILD_OVERLAP;
+    if (offset + len > index->compressed_size)
+        len = index->compressed_size - offset;
+
+    buf     = malloc(len);
+    markers = malloc(sizeof(zran_deflate_markers_t));
+    window  = malloc(ZRAN_DEFLATE_WINDOW);
+    refs    = malloc(ZRAN_DEFLATE_WINDOW);
+    symbols = malloc(ZRAN_DEFLATE_WINDOW * sizeof(uint16_t));
+
+    if (buf     == NULL || markers == NULL || window == NULL ||
+        refs    == NULL || symbols == NULL)
+        goto cleanup;
+
+    if (_zran_fseek(reader, offset) != 0)
+        goto cleanup;
+
+    len = _zran_fread(reader, buf, len);
+    if (_zran_ferror(reader))
+        goto cleanup;
+
+    /*
+     * The start of a gzip stream is the
+     * easiest place to start decoding from,
+     * as nothing before it is needed.
+     */
+    stream = _zran_pbuild_find_stream(buf,
+                                      len,
+                                      (from + 7) / 8,
+                                      (limit + 7) / 8,
+                                      &hstart,
+                                      &hend) == ZRAN_PBUILD_OK;
+
+    /*
+     * But search for the first block before
+     * it, as there may be a lot of data in
+     * between. A candidate is rejected if it
+     * cannot be decoded.
+     */
+    while (1) {
+
+        if (zran_deflate_find_block(buf,
+                                    len,
+                                    from,
+                                    stream ? hstart * 8 : limit,
+                                    &found) != ZRAN_DEFLATE_SCAN_OK) {
+            found = UINT64_MAX;
+            break;
+        }
+
+        zran_deflate_markers_init(markers, found);
+
+        z_ret = zran_deflate_decode_markers(buf,
+                                            len,
+                                            limit,
+                                            index->spacing,
+                                            markers);
 
-    int ret;
-    int found;
+        if      (z_ret == ZRAN_DEFLATE_SCAN_ERROR)    from = found + 1;
+        else if (z_ret == ZRAN_DEFLATE_SCAN_NO_INPUT) goto invalid;
+        else                                          break;
+    }
 
     /*
-     * Search for the beginning of
-     * the next stream. GZIP files
-     * start with 0x1f8b.
+     * Decode from the start of the stream
+     * - the window preceding it is unknown,
+     * but it is not needed.
      */
-    found = 0;
+    if (found == UINT64_MAX) {
 
-    zran_log("Searching for a new stream [%u]\n", stream->avail_in);
+        if (!stream)
+            goto invalid;
 
-    while (stream->avail_in > 0) {
+        zran_log("_zran_pbuild_chunk(%llu - %llu): first stream at %llu\n",
+                 chunk->from, chunk->to, base + hend * 8);
 
-        if (stream->avail_in   >= 2    &&
-            stream->next_in[0] == 0x1f &&
-            stream->next_in[1] == 0x8b) {
-            found = 1;
-            break;
-        }
+        chunk->start = base + hend * 8;
+        chunk->valid = 1;
 
-        *offset          += 1;
-        stream->next_in  += 1;
-        stream->avail_in -= 1;
+        for (i = 0; i < ZRAN_DEFLATE_WINDOW; i++)
+            symbols[i] = 256 + i;
+
+        z_ret = _zran_pbuild_inflate(chunk,
+                                     reader,
+                                     chunk->start,
+                                     NULL,
+                                     symbols,
+                                     0,
+                                     chunk->to,
+                                     index->spacing);
+
+        if      (z_ret == ZRAN_PBUILD_DATA_ERROR) goto invalid;
+        else if (z_ret != ZRAN_PBUILD_OK)         goto cleanup;
+
+        ret = 0;
+        goto cleanup;
     }
 
+    zran_log("_zran_pbuild_chunk(%llu - %llu): first block at %llu\n",
+             chunk->from, chunk->to, base + found);
+
+    chunk->start = base + found;
+    chunk->valid = 1;
+
     /*
-     * No header found for
-     * the next stream.
+     * The chunk starts with a point - its
+     * window is the window at the end of
+     * the preceding chunk.
      */
-    if (found == 0) {
-        zran_log("Could not find another stream [%u]\n", stream->avail_in);
-        goto not_found;
-    }
+    for (i = 0; i < ZRAN_DEFLATE_WINDOW; i++)
+        symbols[i] = 256 + i;
 
-    zran_log("New stream found, re-initialising inflation\n");
+    if (_zran_pbuild_add_marker_point(
+            chunk, buf, len, base, found, 0, symbols, refs) != 0)
+        goto cleanup;
 
     /*
-     * Re-configure for inflation
-     * from the new stream.
+     * Keep decoding with markers, adding a
+     * point every spacing bytes, until the
+     * window no longer contains markers.
      */
-    if (inflateEnd(stream) != Z_OK) {
-        goto fail;
+    while (z_ret == ZRAN_DEFLATE_DECODE_OUTPUT) {
+
+        for (i = 0; i < ZRAN_DEFLATE_WINDOW; i++) {
+            symbols[i] = markers->window[
+                (markers->outcnt + i) % ZRAN_DEFLATE_WINDOW];
+        }
+
+        if (_zran_pbuild_add_marker_point(chunk,
+                                          buf,
+                                          len,
+                                          base,
+                                          markers->bitpos,
+                                          markers->outcnt,
+                                          symbols,
+                                          refs) != 0)
+            goto cleanup;
+
+        z_ret = zran_deflate_decode_markers(buf,
+                                            len,
+                                            limit,
+                                            markers->outcnt + index->spacing,
+                                            markers);
+
+        if (z_ret == ZRAN_DEFLATE_SCAN_ERROR ||
+            z_ret == ZRAN_DEFLATE_SCAN_NO_INPUT)
+            goto invalid;
     }
 
-    ret = _zran_init_zlib_inflate(index, stream, NULL);
+    zran_log("_zran_pbuild_chunk(%llu - %llu): decoded %llu bytes "
+             "with markers\n", chunk->from, chunk->to, markers->outcnt);
 
-    if (ret < 0) {
-        goto fail;
+    for (i = 0; i < ZRAN_DEFLATE_WINDOW; i++) {
+        symbols[i] = markers->window[
+            (markers->outcnt + i) % ZRAN_DEFLATE_WINDOW];
     }
 
-    *offset += ret;
+    /*
+     * The stream has ended - the chunk
+     * carries on from the start of the
+     * next stream, if there is one.
+     */
+    if (z_ret == ZRAN_DEFLATE_DECODE_LAST) {
 
-    return 0;
+        next  = (base + markers->bitpos + 7) / 8 * 8;
+        z_ret = _zran_pbuild_next_stream(reader, next / 8 + 8, &next);
 
-fail:
-    return ZRAN_FIND_STREAM_ERROR;
+        if (z_ret == ZRAN_PBUILD_NO_STREAM) {
+            chunk->last = 1;
+            next        = (base + markers->bitpos + 7) / 8 * 8;
+        }
+        else if (z_ret == ZRAN_PBUILD_DATA_ERROR) goto invalid;
+        else if (z_ret != ZRAN_PBUILD_OK)         goto cleanup;
 
-not_found:
-    return ZRAN_FIND_STREAM_NOT_FOUND;
-}
+        else if (next < chunk->to) {
 
+            z_ret = _zran_pbuild_inflate(chunk,
+                                         reader,
+                                         next,
+                                         NULL,
+                                         symbols,
+                                         markers->outcnt,
+                                         chunk->to,
+                                         index->spacing);
 
-/* Validate the CRC32 and size of a GZIP stream. */
-static int _zran_validate_stream(zran_index_t *index,
-                                 z_stream     *stream,
-                                 int          *offset) {
+            if      (z_ret == ZRAN_PBUILD_DATA_ERROR) goto invalid;
+            else if (z_ret != ZRAN_PBUILD_OK)         goto cleanup;
 
-    uint32_t crc;
-    uint32_t size;
+            ret = 0;
+            goto cleanup;
+        }
+    }
 
-    /* CRC validation is disabled. Skip over footer
-     * and return.
+    /*
+     * The window no longer contains markers,
+     * so the rest of the chunk can be
+     * decoded with zlib.
      */
-    if (index->flags & ZRAN_SKIP_CRC_CHECK) {
-        stream->avail_in -= 8;
-        stream->next_in  += 8;
-        *offset          += 8;
-        return 0;
+    else if (z_ret == ZRAN_DEFLATE_DECODE_CLEAN) {
+
+        for (i = 0; i < ZRAN_DEFLATE_WINDOW; i++)
+            window[i] = symbols[i];
+
+        z_ret = _zran_pbuild_inflate(chunk,
+                                     reader,
+                                     base + markers->bitpos,
+                                     window,
+                                     NULL,
+                                     markers->outcnt,
+                                     chunk->to,
+                                     index->spacing);
+
+        if      (z_ret == ZRAN_PBUILD_DATA_ERROR) goto invalid;
+        else if (z_ret != ZRAN_PBUILD_OK)         goto cleanup;
+
+        ret = 0;
+        goto cleanup;
     }
 
     /*
-     * A gzip stream should end with an 8 byte footer,
-     * which contains the CRC32 of the uncompressed
-     * data, and the uncompressed size modulo 2^32.
+     * The end of the chunk was reached while
+     * the window still contained markers - they
+     * are resolved by _zran_pbuild_stitch.
      */
-    if (stream->avail_in < 8) {
-        return ZRAN_VALIDATE_STREAM_ERROR;
+    else {
+        next = base + markers->bitpos;
     }
 
-    crc  = ((stream->next_in[0] << 0)  +
-            (stream->next_in[1] << 8)  +
-            (stream->next_in[2] << 16) +
-            (stream->next_in[3] << 24));
-    size = ((stream->next_in[4] << 0)  +
-            (stream->next_in[5] << 8)  +
-            (stream->next_in[6] << 16) +
-            (stream->next_in[7] << 24));
+    chunk->window = symbols;
+    chunk->end    = next;
+    chunk->size   = markers->outcnt;
+    symbols       = NULL;
+    ret           = 0;
+    goto cleanup;
 
-    zran_log("Validating CRC32 and size [%8x == %8x, %u == %u]\n",
-             crc, index->stream_crc32, size, index->stream_size);
+invalid:
+    zran_log("_zran_pbuild_chunk(%llu - %llu): invalid\n",
+             chunk->from, chunk->to);
+    _zran_pbuild_free_chunk(chunk);
+    chunk->valid = 0;
+    chunk->last  = 0;
+    ret          = 0;
 
-    stream->avail_in -= 8;
-    stream->next_in  += 8;
-    *offset          += 8;
+cleanup:
+    free(buf);
+    free(markers);
+    free(window);
+    free(refs);
+    free(symbols);
+    return ret;
+}
 
-    if (index->stream_crc32 != crc || index->stream_size != size) {
-        return ZRAN_VALIDATE_STREAM_INVALID;
-    }
 
-    return 0;
+/* Decode chunks until there are none left. */
+void _zran_pbuild_worker(void *arg) {
+
+    zran_pbuild_worker_t *worker = (zran_pbuild_worker_t *)arg;
+    zran_pbuild_t        *pbuild = worker->pbuild;
+    zran_pbuild_chunk_t  *chunk;
+    uint64_t              i;
+
+    worker->ret = 0;
+
+    while (!atomic_load_u64(&pbuild->failed)) {
+
+        i = atomic_add_u64(&pbuild->next_chunk, 1);
+
+        if (i >= pbuild->nchunks)
+            break;
+
+        chunk = &(pbuild->chunks[i]);
+
+        if (_zran_pbuild_chunk(pbuild, worker->reader, chunk) != 0) {
+            worker->ret = -1;
+            atomic_store_u64(&pbuild->failed, 1);
+            break;
+        }
+    }
 }
 
 
-/* The workhorse. Inflate/decompress data from the file. */
-static int _zran_inflate(zran_index_t *index,
-                         z_stream     *strm,
-                         uint64_t      offset,
-                         uint16_t      flags,
-                         uint32_t     *total_consumed,
-                         uint32_t     *total_output,
-                         uint32_t      len,
-                         uint8_t      *data,
-                         int           add_stream_points) {
+/* Add the points from all chunks to the index, in order. */
+int _zran_pbuild_stitch(zran_pbuild_t *pbuild,
+                        zran_reader_t *reader) {
+
+    zran_index_t        *index      = pbuild->index;
+    zran_pbuild_chunk_t *chunk;
+    zran_pbuild_chunk_t  gap;
+    zran_pbuild_point_t *point;
+    uint8_t             *window     = NULL;
+    uint8_t             *prev       = NULL;
+    uint8_t             *refs       = NULL;
+    uint64_t             bitpos     = pbuild->header;
+    uint64_t             uncmp      = 0;
+    uint64_t             last_point = 0;
+    uint64_t             cmp_offset;
+    uint8_t              last       = 0;
+    uint8_t              bits;
+    uint8_t              windowless;
+    uint32_t             ref_start;
+    uint32_t             ref_end;
+    uint32_t             i;
+    uint32_t             j;
+    uint32_t             k          = 0;
+    uint16_t             sym;
+    int                  ret        = -1;
+
+    memset(&gap, 0, sizeof(zran_pbuild_chunk_t));
+
+    window = calloc(1, ZRAN_DEFLATE_WINDOW);
+    prev   = calloc(1, ZRAN_DEFLATE_WINDOW);
+    if (window == NULL || prev == NULL)
+        goto cleanup;
+
+    /* The first point is at the start of the stream */
+    if (_zran_add_point(index, 0, bitpos / 8, 0, 0, 0, NULL, NULL) != 0)
+        goto cleanup;
+
+    while (!last) {
+
+        chunk = (k < pbuild->nchunks) ? &(pbuild->chunks[k]) : NULL;
 
-    /*
-     * z_ret is for zlib/zran functions.
-     * off is for storing offset of new
-     * stream (from _zran_validate_stream
-     * and _zran_find_next_stream).
-     * return_val/error_return_val is
-     * the return value for this function.
-     */
-    int z_ret;
-    int off;
-    int return_val       = ZRAN_INFLATE_OK;
-    int error_return_val = ZRAN_INFLATE_ERROR;
+        /*
+         * The chunk is invalid, or the data
+         * before bitpos has been decoded in
+         * another chunk.
+         */
+        if (chunk != NULL && (!chunk->valid || chunk->start < bitpos)) {
+            k++;
+            continue;
+        }
 
-    /*
-     * Offsets into the compressed
-     * and uncompressed data streams,
-     * and total number of bytes
-     * decompressed and output.
-     */
-    uint64_t cmp_offset;
-    uint64_t uncmp_offset;
-    uint32_t _total_consumed = 0;
-    uint32_t _total_output   = 0;
+        /*
+         * The previous chunk finished where this
+         * one starts, so it is correct. Otherwise,
+         * decode up to the start of the next chunk
+         * (or to the end of the stream).
+         */
+        if (chunk == NULL || chunk->start != bitpos) {
 
-    /*
-     * Number of bytes input/decompressed
-     * during a single call to zlib:inflate.
-     */
-    uint32_t bytes_consumed = 0;
-    uint32_t bytes_output   = 0;
+            zran_log("_zran_pbuild_stitch: decoding gap from %llu to %llu\n",
+                     bitpos, chunk ? chunk->start : 0);
 
-    /*
-     * Index point to start from
-     * (if ZRAN_INFLATE_USE_OFFSET
-     * is active).
-     */
-    zran_point_t *start = NULL;
+            gap.start = bitpos;
+
+            if (_zran_pbuild_inflate(&gap,
+                                     reader,
+                                     bitpos,
+                                     uncmp == 0 ? NULL : window,
+                                     NULL,
+                                     0,
+                                     chunk ? chunk->start : UINT64_MAX,
+                                     index->spacing) != ZRAN_PBUILD_OK)
+                goto cleanup;
+
+            chunk = &gap;
+        }
+        else {
+            k++;
+        }
+
+        for (i = 0; i < chunk->npoints; i++) {
+
+            point      = &(chunk->points[i]);
+            cmp_offset = (point->bitpos + 7) / 8;
+            bits       = cmp_offset * 8 - point->bitpos;
+            refs       = point->refs ? point->window + ZRAN_DEFLATE_WINDOW :
+                                       NULL;
+            ref_end    = 0;
+            windowless = (refs != NULL &&
+                          bits == 0    &&
+                          !_zran_next_ref_range(refs, &ref_start, &ref_end));
+
+            /*
+             * Each chunk starts with a point, which
+             * is dropped if it is too close to the
+             * last point in the preceding chunk.
+             * Points without a window (e.g. at the
+             * start of each gzip stream) are kept,
+             * as _zran_expand_index does.
+             */
+            if (!windowless &&
+                uncmp + point->uncmp_offset - last_point <
+                index->spacing / 2)
+                continue;
+
+            last_point = uncmp + point->uncmp_offset;
+
+            /*
+             * The point was found while the window
+             * still contained markers - they refer
+             * to the window at the start of the chunk.
+             */
+            if (point->markers != NULL) {
+                for (j = 0; j < ZRAN_DEFLATE_WINDOW; j++) {
+                    sym              = point->markers[j];
+                    point->window[j] = sym < 256 ? sym : window[sym - 256];
+                }
+            }
+
+            if (_zran_add_point(index,
+                                bits,
+                                cmp_offset,
+                                uncmp + point->uncmp_offset,
+                                ZRAN_DEFLATE_WINDOW,
+                                ZRAN_DEFLATE_WINDOW,
+                                windowless ? NULL : point->window,
+                                refs) != 0)
+                goto cleanup;
+
+            if (_zran_enforce_window_budget(index) != 0)
+                goto cleanup;
+        }
+
+        /* Resolve any markers in the final window */
+        memcpy(prev, window, ZRAN_DEFLATE_WINDOW);
+        for (i = 0; i < ZRAN_DEFLATE_WINDOW; i++) {
+            sym       = chunk->window[i];
+            window[i] = sym < 256 ? sym : prev[sym - 256];
+        }
+
+        bitpos  = chunk->end;
+        uncmp  += chunk->size;
+        last    = chunk->last;
+
+        _zran_pbuild_free_chunk(&gap);
+        memset(&gap, 0, sizeof(zran_pbuild_chunk_t));
+    }
 
     /*
-     * Set all zstream_t fields to 0
-     * if we are initialising.
+     * The footer of the final
+     * stream must be complete.
      */
-    if (inflate_init_stream(flags)) {
-        memset(strm, 0, sizeof(z_stream));
-    }
+    if ((bitpos + 7) / 8 + 8 > index->compressed_size)
+        goto cleanup;
 
     /*
-     * If ZRAN_INFLATE_INIT_READBUF is not set,
-     * make sure that a read buffer exists.
-     *
-     * If the opposite is true, the read buffer
-     * from a prior call has not been cleaned up.
+     * And the last point is at EOF (see
+     * _zran_expand_index) - nothing after
+     * it refers to its window.
      */
-    if ((!inflate_init_readbuf(flags) && index->readbuf == NULL) ||
-        ( inflate_init_readbuf(flags) && index->readbuf != NULL)) {
-        goto fail;
+    refs = NULL;
+    if (index->flags & ZRAN_SPARSE_WINDOWS) {
+        refs = prev;
+        memset(refs, 0, ZRAN_DEFLATE_WINDOW);
     }
 
+    if (_zran_add_point(index,
+                        0,
+                        index->compressed_size,
+                        uncmp,
+                        ZRAN_DEFLATE_WINDOW,
+                        ZRAN_DEFLATE_WINDOW,
+                        window,
+                        refs) != 0)
+        goto cleanup;
+
+    if (_zran_enforce_window_budget(index) != 0)
+        goto cleanup;
+
+    index->uncompressed_size = uncmp;
+    ret                      = 0;
+
+cleanup:
+    _zran_pbuild_free_chunk(&gap);
+    free(window);
+    free(prev);
+    return ret;
+}
+
+
+/* Build the full index with multiple threads. */
+int zran_build_index_parallel(zran_index_t   *index,
+                              zran_reader_t **readers,
+                              uint32_t        nreaders) {
+
+    zran_pbuild_t         pbuild;
+    zran_pbuild_worker_t *workers    = NULL;
+    uint64_t              chunk_size;
+    uint32_t              i;
+    int                   ret        = ZRAN_BUILD_INDEX_FAIL;
+
+    memset(&pbuild, 0, sizeof(pbuild));
+
+    zran_log("zran_build_index_parallel(%u)\n", nreaders);
+
     /*
-     * It begins...
+     * Small files, and files which can't be
+     * read concurrently, are indexed in the
+     * normal way.
      */
-    zran_log("_zran_inflate(%llu, block=%u, use_offset=%u, init_stream=%u,\n"
-             "              free_stream=%u, init_readbuf=%u, free_readbuf=%u,\n"
-             "              clear_offsets=%u, nbytes=%u)\n",
-             offset,
-             inflate_stop_at_block(        flags),
-             inflate_use_offset(           flags),
-             inflate_init_stream(          flags),
-             inflate_free_stream(          flags),
-             inflate_init_readbuf(         flags),
-             inflate_free_readbuf(         flags),
-             inflate_clear_readbuf_offsets(flags),
-             len);
+    if (nreaders < 2                                        ||
+        index->compressed_size < 2 * ZRAN_PBUILD_MIN_CHUNK ||
+        !seekable_(index->fd, index->f))
+        return zran_build_index(index, 0, 0);
 
     /*
-     * The compressed/uncompressed offsets are initialised in
-     * one of three ways. If ZRAN_INFLATE_USE_OFFSET is active,
-     * they are either:
-     *
-     *    - Both set to 0
-     *
-     *    - Initialised according to an existing index
-     *      point that precedes the requested offset.
-     *
-     * Otherwise, they are initialised from index->inflate_cmp_offset
-     * and index->inflate_uncmp_offset, which are assumed to have been
-     * set in a prior call to _zran_inflate.
+     * BGZF files are indexed from their block
+     * headers, which is quicker than inflating
+     * the data with any number of threads.
      */
-    if (inflate_use_offset(flags)) {
+    if (index->bgzf) {
+        ret = _zran_expand_bgzf_index(index, 0);
 
-        cmp_offset   = 0;
-        uncmp_offset = 0;
+        if      (ret == ZRAN_BGZF_OK)    return ZRAN_BUILD_INDEX_OK;
+        else if (ret == ZRAN_BGZF_ERROR) return ZRAN_BUILD_INDEX_FAIL;
 
-        /*
-         * If a non-zero offset has been specified,
-         * search the index to see if we can start
-         * inflating from a known location.
-         */
-        if (offset > 0) {
+        index->bgzf = 0;
+        ret         = ZRAN_BUILD_INDEX_FAIL;
+    }
 
-            /*
-             * In order to successfully decompress
-             * data from the current uncompressed seek
-             * location, we need to start decompressing
-             * from the index point which preceeds it.
-             */
-            z_ret = _zran_get_point_at(index, offset, 1, &start);
+    if (_zran_pbuild_next_stream(readers[0], 0, &pbuild.header) !=
+        ZRAN_PBUILD_OK)
+        return zran_build_index(index, 0, 0);
 
-            if (z_ret == ZRAN_GET_POINT_NOT_COVERED)
-                return ZRAN_INFLATE_NOT_COVERED;
+    chunk_size = index->compressed_size /
+                 (nreaders * ZRAN_PBUILD_CHUNKS_PER_THREAD);
 
-            if (z_ret == ZRAN_GET_POINT_EOF)
-                return ZRAN_INFLATE_EOF;
-        }
+    if (chunk_size < ZRAN_PBUILD_MIN_CHUNK) chunk_size = ZRAN_PBUILD_MIN_CHUNK;
+    if (chunk_size > ZRAN_PBUILD_MAX_CHUNK) chunk_size = ZRAN_PBUILD_MAX_CHUNK;
 
-        /*
-         * Start inflating from the index point
-         * corresponding to the offset (or keep
-         * the offsets at 0 if no point was found).
-         */
-        if (start != NULL) {
+    pbuild.index   = index;
+    pbuild.nchunks = (index->compressed_size + chunk_size - 1) / chunk_size;
+    pbuild.chunks  = calloc(pbuild.nchunks, sizeof(zran_pbuild_chunk_t));
+    workers        = calloc(nreaders,       sizeof(zran_pbuild_worker_t));
 
-            cmp_offset   = start->cmp_offset;
-            uncmp_offset = start->uncmp_offset;
-        }
+    if (pbuild.chunks == NULL || workers == NULL)
+        goto cleanup;
+
+    for (i = 0; i < pbuild.nchunks; i++) {
+        pbuild.chunks[i].from = i * chunk_size * 8;
+        pbuild.chunks[i].to   = (i + 1) * chunk_size * 8;
+    }
+    pbuild.chunks[pbuild.nchunks - 1].to = index->compressed_size * 8;
+
+    for (i = 0; i < nreaders; i++) {
+        workers[i].pbuild = &pbuild;
+        workers[i].reader = readers[i];
+    }
+
+    /* Start from scratch */
+    _zran_free_cursor(&(index->reader));
+    if (_zran_invalidate_index(index, 0) != 0)
+        goto cleanup;
+    index->reader.span_active = 0;
+
+    _zran_run_threads(_zran_pbuild_worker,
+                      workers,
+                      sizeof(zran_pbuild_worker_t),
+                      nreaders);
+
+    if (atomic_load_u64(&pbuild.failed))
+        goto cleanup;
+
+    ret = _zran_pbuild_stitch(&pbuild, readers[0]);
+
+    if (ret != 0 || _zran_free_unused(index) != 0) {
+        ret = ZRAN_BUILD_INDEX_FAIL;
+        goto cleanup;
     }
 
     /*
-     * If ZRAN_INFLATE_USE_OFFSET is not active,
-     * we initialise from offsets which were
-     * stored on the last call to _zran_inflate.
+     * The data is not checked while it is
+     * decoded, so all of the CRCs are checked
+     * afterwards, which also stores the CRC of
+     * each span in the index.
      */
-    else {
-        cmp_offset   = index->inflate_cmp_offset;
-        uncmp_offset = index->inflate_uncmp_offset;
+    ret = ZRAN_BUILD_INDEX_OK;
+    if (!(index->flags & ZRAN_SKIP_CRC_CHECK)) {
+        ret = zran_verify(index, readers, nreaders);
+
+        if (ret == ZRAN_VERIFY_CRC_ERROR)
+            ret = ZRAN_BUILD_INDEX_CRC_ERROR;
+        else if (ret != ZRAN_VERIFY_OK)
+            ret = ZRAN_BUILD_INDEX_FAIL;
     }
 
-    zran_log("initialising to inflate from "
-             "cmp_offset=%llu, uncmp_offset=%llu\n",
-             cmp_offset,
-             uncmp_offset);
+cleanup:
+    if (pbuild.chunks != NULL) {
+        for (i = 0; i < pbuild.nchunks; i++)
+            _zran_pbuild_free_chunk(&(pbuild.chunks[i]));
+    }
+    free(pbuild.chunks);
+    free(workers);
+    return ret;
+}
+
+
+/*
+ * Store checkpoint information from index to file fd. File should be opened
+ * in binary write mode.
+ */
+int zran_export_index(zran_index_t *index,
+                      FILE         *fd,
+                      PyObject     *f) {
+
+    return zran_export_index_flags(index, fd, f, 0);
+}
+
+
+/* Store checkpoint information, with flags controlling the file format. */
+int zran_export_index_flags(zran_index_t *index,
+                            FILE         *fd,
+                            PyObject     *f,
+                            uint16_t      export_flags) {
 
     /*
-     * If ZRAN_INFLATE_INIT_READBUF,
-     * allocate memory for reading
-     * compressed data from the file.
-     * The buffer is attached to the
-     * zran_index_t->readbuf pointer.
+     * TODO: Endianness check for fwrite calls. Prefer little-endian to be
+     * consistent with gzip library.
      */
-    if (inflate_init_readbuf(flags)) {
-        index->readbuf = calloc(1, index->readbuf_size);
-        if (index->readbuf == NULL)
-            goto fail;
-    }
+
+    /* Used for checking return value of fwrite calls. */
+    size_t f_ret;
+    int    ret;
+
+    /* Used for iterating over the index points. */
+    uint32_t     i;
+    zran_point_t point;
 
     /*
-     * If ZRAN_INFLATE_CLEAR_READBUF_OFFSETS,
-     * we clear any stored information about
-     * the read buffer, and start reading
-     * from/writing to it from the beginning.
+     * Window data to be written. If windows are stored
+     * compressed, each one is decompressed into a buffer
+     * first, as the file contains uncompressed windows
+     * (which may be sparse). The same buffer is used
+     * to re-create evicted windows.
      */
-    if (inflate_clear_readbuf_offsets(flags)) {
-        index->readbuf_offset = 0;
-        index->readbuf_end    = 0;
-    }
+    uint8_t *window    = NULL;
+    uint8_t *windowbuf = NULL;
+    uint32_t window_len;
+    uint8_t  window_flags;
 
     /*
-     * Otherwise, assume that there is already
-     * some input (compressed) data in the
-     * readbuf, and that index->readbuf_offset
-     * and index->readbuf_end were set on a
-     * prior call.
-     *
-     *    - readbuf_offset tells us where in
-     *      readbuf the data starts
-     *
-     *    - readbuf_end tells us where it ends.
+     * Data flag for each point (see zran_export_index
+     * in zran.h), and the owner of the window of points
+     * which share their window with an earlier point.
      */
-    else {
-        strm->next_in  = index->readbuf     + index->readbuf_offset;
-        strm->avail_in = index->readbuf_end - index->readbuf_offset;
-    }
+    uint8_t *dataflags = NULL;
+    uint32_t owner;
 
     /*
-     * Tell zlib where to store
-     * the uncompressed data.
+     * Files are written with the oldest format version
+     * that can represent the index, so they can be read
+     * by older versions where possible - version 2 is
+     * only needed if there are any sparse windows, and
+     * version 3 if there are any shared windows. The
+     * compact format (version 4) is only written on
+     * request.
      */
-    strm->avail_out = len;
-    strm->next_out  = data;
+    uint8_t version = 1;
 
     /*
-     * If ZRAN_INFLATE_INIT_Z_STREAM is active,
-     * initialise the zlib struct for inflation.
-     *
-     * If ZRAN_INFLATE_INIT_Z_STREAM is not
-     * active, we assume that the inflation is
-     * already initialised.
+     * File flags (see zran_export_index in
+     * zran.h). Also used as a temporary variable.
      */
-    if (inflate_init_stream(flags)) {
+    uint8_t flags = 0;
 
-        /*
-         * No index point - we need to start reading
-         * from the beginning of the input file. If
-         * starting from an index point, the
-         * _zran_init_zlib_inflate function will seek
-         * to the correct location in the file for us.
-         */
-        if (start == NULL) {
-            /*
-             * If file is not seekable, assume that
-             * it is positioned at the beginning of
-             * the stream.
-             */
-            if (seekable_(index->fd, index->f)) {
-                if (fseek_(index->fd, index->f, 0, SEEK_SET) != 0) {
-                    goto fail;
-                }
-            }
+    zran_log("zran_export_index: (%lu, %lu, %u, %u, %u)\n",
+             index->compressed_size,
+             index->uncompressed_size,
+             index->spacing,
+             index->window_size,
+             index->npoints);
 
-            /*
-             * In this situation, _zran_init_zlib_inflate
-             * is going to expect a GZIP header, so make
-             * sure we have some data for it to look at.
-             */
-            if (_zran_read_data_from_file(index,
-                                          strm,
-                                          cmp_offset,
-                                          uncmp_offset,
-                                          index->readbuf_size) != 0) {
-                goto fail;
-            }
-        }
+    /* Index files for other tools are written separately */
+    if (export_flags & (ZRAN_EXPORT_BGZIP | ZRAN_EXPORT_GZTOOL)) {
 
-        /*
-         * If init_zlib_inflate skips over any input data
-         * (e.g. gzip header), it returns the number of
-         * bytes that were read.
-         */
-        z_ret = _zran_init_zlib_inflate(index, strm, start);
-        if (z_ret < 0) {
-            goto fail;
-        }
-        cmp_offset      += z_ret;
-        _total_consumed += z_ret;
+        if (export_flags & ZRAN_EXPORT_BGZIP)
+            ret = _zran_export_bgzip_index(index, fd, f);
+        else
+            ret = _zran_export_gztool_index(index, fd, f);
 
-        if (start == NULL && add_stream_points) {
-            if (_zran_add_point(index, 0, cmp_offset, 0, 0, 0, NULL) != 0) {
-                goto fail;
-            }
-        }
+        if (ret != ZRAN_EXPORT_OK)
+            return ret;
+
+        goto flush;
     }
 
-    /*
-     * Keep going until we run out of space.
-     */
-    while (strm->avail_out > 0) {
+    dataflags = calloc(max(index->npoints, 1), 1);
+    if (dataflags == NULL)
+        goto fail;
 
-        /*
-         * Make sure the input buffer contains
-         * some data to be decompressed.
-         */
-        z_ret = _zran_read_data_from_file(index,
-                                          strm,
-                                          cmp_offset,
-                                          uncmp_offset,
-                                          1);
+    for (i = 0; i < index->npoints; i++) {
 
-        /* EOF - there is no more data left to read */
-        if (z_ret == ZRAN_READ_DATA_EOF) {
-            return_val = ZRAN_INFLATE_EOF;
-            break;
+        /* Evicted windows are re-created in full */
+        if (_zran_point_evicted(index, i)) {
+            dataflags[i] = 1;
+            continue;
         }
-        else if (z_ret != 0) {
-            goto fail;
+
+        if (index->windows[i] == NULL)
+            continue;
+
+        if (_zran_window_owner(index, index->windows[i], i) != i) {
+            dataflags[i] = 3;
+            version      = 3;
+        }
+        else if (_zran_window_is_sparse(index, index->windows[i])) {
+            dataflags[i] = 2;
+            version      = max(version, 2);
         }
+        else {
+            dataflags[i] = 1;
+        }
+    }
 
-        /*
-         * Decompress data until there's no data
-         * left, or we've read enough bytes
-         */
-        z_ret = Z_OK;
-        while (strm->avail_in > 0) {
+    if (export_flags & ZRAN_EXPORT_COMPACT)
+        version = 4;
 
-            /*
-             * Initialise counters to calculate
-             * how many bytes are input/output
-             * during this call to inflate.
-             */
-            bytes_consumed = strm->avail_in;
-            bytes_output   = strm->avail_out;
+    if (index->nspans > 0)
+        flags |= ZRAN_INDEX_FILE_SPAN_CRCS;
 
-            zran_log("Before inflate - avail_in=%u, avail_out=%u, "
-                     "cmp_offset=%lu, uncmp_offset=%lu\n",
-                     strm->avail_in, strm->avail_out,
-                     cmp_offset, uncmp_offset);
+    /* Write ID and version, and check for errors. */
+    f_ret = fwrite_(ZRAN_INDEX_FILE_ID, sizeof(ZRAN_INDEX_FILE_ID), 1, fd, f);
+    if (ferror_(fd, f)) goto fail;
+    if (f_ret != 1)     goto fail;
 
-            /*
-             * Inflate the block - the decompressed
-             * data is output straight to the provided
-             * data buffer.
-             *
-             * If ZRAN_INFLATE_STOP_AT_BLOCK is active,
-             * Z_BLOCK tells inflate to stop inflating
-             * at a compression block boundary. Otherwise,
-             * inflate stops when it comes to the end of a
-             * stream, or it runs out of input or output.
-             */
-            if (inflate_stop_at_block(flags)) {
-                z_ret = inflate(strm, Z_BLOCK);
-            }
-            else {
-                z_ret = inflate(strm, Z_NO_FLUSH);
-            }
+    f_ret = fwrite_(&version, 1, 1, fd, f);
+    if (ferror_(fd, f)) goto fail;
+    if (f_ret != 1)     goto fail;
 
-            /*
-             * Adjust our offsets according to what
-             * was actually consumed/decompressed.
-             */
-            bytes_consumed   = bytes_consumed - strm->avail_in;
-            bytes_output     = bytes_output   - strm->avail_out;
-            cmp_offset      += bytes_consumed;
-            _total_consumed += bytes_consumed;
-            uncmp_offset    += bytes_output;
-            _total_output   += bytes_output;
+    /* Write flags */
+    f_ret = fwrite_(&flags, 1, 1, fd, f);
+    if (ferror_(fd, f)) goto fail;
+    if (f_ret != 1)     goto fail;
 
-            zran_log("After inflate - avail_in=%u, avail_out=%u, "
-                     "cmp_offset=%lu, uncmp_offset=%lu\n",
-                     strm->avail_in, strm->avail_out,
-                     cmp_offset, uncmp_offset);
+    /* Write compressed size, and check for errors. */
+    f_ret = fwrite_(&index->compressed_size,
+                   sizeof(index->compressed_size), 1, fd, f);
 
+    if (ferror_(fd, f)) goto fail;
+    if (f_ret != 1)     goto fail;
 
-            /*
-             * Now we need to figure out what just happened.
-             *
-             * Z_BUF_ERROR indicates that the output buffer
-             * is full; we clobber it though, as it makes the
-             * code below a bit easier (and anyway, we can
-             * tell if the output buffer is full by checking
-             * strm->avail_out).
-             */
-            if (z_ret == Z_BUF_ERROR) {
-                z_ret = Z_OK;
-            }
+    /* Write uncompressed size, and check for errors. */
+    f_ret = fwrite_(&index->uncompressed_size,
+                   sizeof(index->uncompressed_size), 1, fd, f);
 
-            /*
-             * If z_ret is not Z_STREAM_END or
-             * Z_OK, something has gone wrong.
-             *
-             * If the file comprises a sequence of
-             * concatenated gzip streams, we will
-             * encounter Z_STREAM_END before the end
-             * of the file (where one stream ends and
-             * the other begins).
-             *
-             * If at a new stream, we re-initialise
-             * inflation on the next loop iteration.
-             */
-            if (z_ret != Z_OK && z_ret != Z_STREAM_END) {
-                zran_log("zlib inflate failed (code: %i, msg: %s)\n",
-                         z_ret, strm->msg);
-                goto fail;
-            }
+    if (ferror_(fd, f)) goto fail;
+    if (f_ret != 1)     goto fail;
 
-            /*
-             * If we have not yet validated the current
-             * GZIP stream, update its size and crc so
-             * we can validate them against the size
-             * recorded in the stream footer when we
-             * get to it.
-             */
-            if ((uncmp_offset > index->last_stream_ended) &&
-                index->validating                         &&
-                !(index->flags & ZRAN_SKIP_CRC_CHECK)) {
-                index->stream_size +=       bytes_output;
-                index->stream_crc32 = crc32(index->stream_crc32,
-                                            strm->next_out - bytes_output,
-                                            bytes_output);
-            }
+    /* Write spacing, and check for errors. */
+    f_ret = fwrite_(&index->spacing, sizeof(index->spacing), 1, fd, f);
 
-            /*
-             * End of a block? If INFLATE_STOP_AT_BLOCK
-             * is active, we want to stop at a compression
-             * block boundary.
-             *
-             * If we used Z_BLOCK above, and inflate
-             * encountered a block boundary, it indicates
-             * this in the the strm->data_type field.
-             */
-            if (inflate_stop_at_block(flags) &&
-                ((strm->data_type & 128) && !(strm->data_type & 64))) {
+    if (ferror_(fd, f)) goto fail;
+    if (f_ret != 1)     goto fail;
 
-                zran_log("At block or stream boundary, "
-                         "stopping inflation\n");
+    /* Write window size, and check for errors. */
+    f_ret = fwrite_(&index->window_size, sizeof(index->window_size), 1, fd, f);
 
-                return_val = ZRAN_INFLATE_BLOCK_BOUNDARY;
-                break;
-            }
+    if (ferror_(fd, f)) goto fail;
+    if (f_ret != 1)     goto fail;
 
-            /*
-             * We've found the end of file, or end of one
-             * gzip stream. Validate the uncompressed
-             * data (size/ CRC) against the gzip footer.
-             * Then search for a new stream and, if we
-             * find one, re-initialise inflation
-             */
-            if (z_ret == Z_STREAM_END) {
+    /* Write number of points, and check for errors. */
+    f_ret = fwrite_(&index->npoints, sizeof(index->npoints), 1, fd, f);
 
-                zran_log("End of gzip stream [%u]\n", strm->avail_in);
+    if (ferror_(fd, f)) goto fail;
+    if (f_ret != 1)     goto fail;
 
-                /*
-                 * Make sure we have data in the input buffer
-                 * to read and validate the gzip footer and,
-                 * in case we are reading concatenated
-                 * streams, to search for the next stream and
-                 * read its header.
-                 *
-                 * There is no way of knowing how much data we
-                 * need to read in here - there is no upper
-                 * bound on the amount of null padding bytes
-                 * that may be present in between, or at the
-                 * end of, a stream, and there is no upper
-                 * bound on the size of a gzip header.
+    /*
+     * The rest of a compact index file
+     * is written separately.
+     */
+    if (version >= 4) {
+        if (_zran_export_compact_index(index, dataflags, fd, f) != 0)
+            goto fail;
+        goto spans;
+    }
 
-                 * So a critical assumption is made here, that
-                 * the size of the read buffer is large enough
-                 * to encompass all of:
-                 *
-                 *   - the footer of a gzip stream,
-                 *   - null padding after the end of a gzip
-                 *     stream, and
-                 *   - the header of the next gzip stream
-                 *
-                 * This assumption could be removed by changing
-                 * the way that data is loaded and buffered
-                 * from the file - e.g. we could load bytes in
-                 * one-by-one, skipping over null bytes, and
-                 * then parse the gzip header ourselves.  But
-                 * this is far too much work for what is a very
-                 * edge-casey scenario.
-                 */
-                z_ret = _zran_read_data_from_file(index,
-                                                  strm,
-                                                  cmp_offset,
-                                                  uncmp_offset,
-                                                  index->readbuf_size);
-                if (!((z_ret == 0) || (z_ret == ZRAN_READ_DATA_EOF))) {
-                    goto fail;
-                }
+    /*
+     * We will make two passes over points list now. In the first pass, offset
+     * mapping information of each point will be written. In the second pass,
+     * checkpoint snapshot data will be written. This will keep offsets bundled
+     * together, which enables user to read all offset mappings in one pass.
+     */
 
-                /*
-                 * If there is no more data, the footer is
-                 * missing, so the data must be corrupt.
-                 */
-                if (strm->avail_in < 8) {
-                    goto fail;
-                }
+    /* Write all points iteratively for checkpoint offset mapping. */
+    for (i = 0; i < index->npoints; i++) {
 
-                /*
-                 * _validate_stream reads and checks in the
-                 * gzip stream footer (the CRC32 and ISIZE
-                 * fields at the end of a gzip stream), and
-                 * _find_next_stream will skip over any
-                 * remaining bytes (e.g. null padding bytes)
-                 * until eof, or a new stream is found.
-                 *
-                 * The number of bytes that were read/
-                 * skipped over are accumulated into off.
-                 */
-                off = 0;
+        zran_get_point(index, i, &point);
 
-                /*
-                 * If we have not yet validated this stream,
-                 * check that the CRC and uncompressed size in
-                 * the footer match what we have calculated
-                 */
-                if (uncmp_offset > index->last_stream_ended &&
-                    index->validating) {
-                    z_ret = _zran_validate_stream(index, strm, &off);
+        /* Write compressed offset, and check for errors. */
+        f_ret = fwrite_(&point.cmp_offset,
+                        sizeof(point.cmp_offset), 1, fd, f);
+        if (ferror_(fd, f)) goto fail;
+        if (f_ret != 1)     goto fail;
 
-                    if (z_ret == ZRAN_VALIDATE_STREAM_INVALID) {
-                        error_return_val = ZRAN_INFLATE_CRC_ERROR;
-                        goto fail;
-                    }
-                    else if (z_ret != 0) {
-                        goto fail;
-                    }
-                    index->last_stream_ended = uncmp_offset;
-                    index->validating        = 0;
-                }
+        /* Write uncompressed offset, and check for errors. */
+        f_ret = fwrite_(&point.uncmp_offset,
+                        sizeof(point.uncmp_offset), 1, fd, f);
+        if (ferror_(fd, f)) goto fail;
+        if (f_ret != 1)     goto fail;
 
-                /* Otherwise skip over the 8 byte GZIP footer */
-                else {
-                    strm->avail_in -= 8;
-                    strm->next_in  += 8;
-                    off            += 8;
-                }
+        /* Write bit offset, and check for errors. */
+        f_ret = fwrite_(&point.bits, sizeof(point.bits), 1, fd, f);
+        if (ferror_(fd, f)) goto fail;
+        if (f_ret != 1)     goto fail;
 
-                /*
-                 * See if we have another concatenated gzip
-                 * stream.  If we run out of input data here,
-                 * bad things will happen. Refer to the long
-                 * comment regarding the input buffer, above.
-                 */
-                z_ret = _zran_find_next_stream(index, strm, &off);
+        /* Write data flag, and check for errors. */
+        flags = dataflags[i];
+        f_ret = fwrite_(&flags, 1, 1, fd, f);
+        if (ferror_(fd, f)) goto fail;
+        if (f_ret != 1)     goto fail;
 
-                cmp_offset      += off;
-                _total_consumed += off;
+        zran_log("zran_export_index: (p%u, %lu, %lu, %u, %u)\n",
+                 i,
+                 point.cmp_offset,
+                 point.uncmp_offset,
+                 point.bits,
+                 flags);
+    }
 
-                /*
-                 * If _zran_find_next_stream can't find
-                 * a new stream, we are either out of
-                 * compressed input data, or at eof. In
-                 * either case, break and let the outer
-                 * loop deal with it.
-                 */
-                if (z_ret == ZRAN_FIND_STREAM_NOT_FOUND) {
-                    break;
-                }
-                else if (z_ret != 0) {
-                    goto fail;
-                }
+    /*
+     * Now write out the window data for every point. No data is written for
+     * points which don't have any data (e.g. at stream boundaries).
+     */
+    for (i = 0; i < index->npoints; i++) {
 
-                if (add_stream_points) {
-                    if (_zran_add_point(index,
-                                        0,
-                                        cmp_offset,
-                                        uncmp_offset,
-                                        0,
-                                        0,
-                                        NULL) != 0) {
-                        goto fail;
-                    }
-                }
+        zran_get_point(index, i, &point);
+
+        /*
+         * Evicted windows are re-created by
+         * decompressing the data before the
+         * point (see zran_set_window_budget).
+         */
+        if (_zran_point_evicted(index, i)) {
+
+            if (windowbuf == NULL) {
+                windowbuf = malloc(index->window_size);
+                if (windowbuf == NULL)
+                    goto fail;
             }
 
-            /*
-             * We've run out of space to store decompressed
-             * data - this is the responsibility of the caller,
-             * so bail out.
-             */
-            if (strm->avail_out == 0) {
+            if (_zran_regenerate_window(index, i, windowbuf) != 0)
+                goto fail;
 
-                zran_log("Output buffer full - stopping inflation\n");
+            f_ret = fwrite_(windowbuf, index->window_size, 1, fd, f);
+            if (ferror_(fd, f)) goto fail;
+            if (f_ret != 1)     goto fail;
 
-                /*
-                 * We return OUTPUT_FULL if we haven't
-                 * decompressed the requested number of
-                 * bytes, or ZRAN_INFLATE_STOP_AT_BLOCK
-                 * is active and we haven't yet found a
-                 * block.
-                 */
-                if (inflate_stop_at_block(flags) || _total_output < len) {
-                    return_val = ZRAN_INFLATE_OUTPUT_FULL;
-                }
-                break;
-            }
+            zran_log("zran_export_index: (%u, re-created)\n", i);
+            continue;
+        }
+
+        if (point.data == NULL) {
+            continue;
         }
 
         /*
-         * Some of the code above has decided that
-         * it wants this _zran_inflate call to return.
+         * For shared windows, we just write
+         * the position of the point which the
+         * window was written for.
          */
-        if (return_val != ZRAN_INFLATE_OK) {
-            break;
-        }
-    }
+        if (dataflags[i] == 3) {
 
-    /*
-     * If ZRAN_INFLATE_FREE_READBUF is
-     * active, clear input buffer memory
-     * and offsets.
-     */
-    if (inflate_free_readbuf(flags)) {
-        free(index->readbuf);
-        index->readbuf        = NULL;
-        index->readbuf_offset = 0;
-        index->readbuf_end    = 0;
-    }
+            owner = _zran_window_owner(index, point.data, i);
 
-    /*
-     * Otherwise save the readbuf
-     * offset for next time.
-     */
-    else {
-        index->readbuf_offset = index->readbuf_end - strm->avail_in;
-    }
+            f_ret = fwrite_(&owner, sizeof(owner), 1, fd, f);
+            if (ferror_(fd, f)) goto fail;
+            if (f_ret != 1)     goto fail;
 
-    /*
-     * If ZRAN_INFLATE_FREE_Z_STREAM
-     * is active, do just that.
-     */
-    if (inflate_free_stream(flags)) {
-        if (inflateEnd(strm) != Z_OK)
+            zran_log("zran_export_index: (%u, shared with %u)\n",
+                     i,
+                     owner);
+            continue;
+        }
+
+        if (index->flags & ZRAN_COMPRESS_WINDOWS && windowbuf == NULL) {
+            windowbuf = malloc(index->window_size);
+            if (windowbuf == NULL)
+                goto fail;
+        }
+
+        /*
+         * Sparse windows are written in their packed
+         * form (see _zran_pack_sparse_window), and all
+         * other windows are written in full.
+         */
+        window = _zran_encoded_window(index,
+                                      point.data,
+                                      windowbuf,
+                                      &window_len,
+                                      &window_flags);
+        if (window == NULL)
             goto fail;
+
+        /* Write checkpoint data, and check for errors. */
+        f_ret = fwrite_(window, window_len, 1, fd, f);
+        if (ferror_(fd, f)) goto fail;
+        if (f_ret != 1)     goto fail;
+
+        zran_log("zran_export_index: (%u, %u bytes, flags %u)\n",
+                 i,
+                 window_len,
+                 window_flags);
     }
 
+spans:
     /*
-     * Update the total number of
-     * bytes that were consumed/read
+     * Finally, write the CRC of each span between two
+     * points - older versions ignore everything after
+     * the window data, so can still read the file.
      */
-    *total_consumed = _total_consumed;
-    *total_output   = _total_output;
+    if (index->nspans > 0) {
+
+        f_ret = fwrite_(&index->nspans, sizeof(index->nspans), 1, fd, f);
+        if (ferror_(fd, f)) goto fail;
+        if (f_ret != 1)     goto fail;
+
+        f_ret = fwrite_(index->span_crcs,
+                        sizeof(uint32_t) * index->nspans, 1, fd, f);
+        if (ferror_(fd, f)) goto fail;
+        if (f_ret != 1)     goto fail;
+
+        zran_log("zran_export_index: (%u span CRCs)\n", index->nspans);
+    }
 
+    zran_log("zran_export_index: done\n");
+
+flush:
     /*
-     * Update the compressed/uncompressed
-     * offsets in case we need to use them
-     * later.
+     * It is important to flush written file when done, since underlying file
+     * descriptor can be closed by Python code before having a chance to flush.
      */
-    index->inflate_cmp_offset   = cmp_offset;
-    index->inflate_uncmp_offset = uncmp_offset;
+    f_ret = fflush_(fd, f);
+    if (ferror_(fd, f)) goto fail;
+    if (f_ret != 0)     goto fail;
 
-    zran_log("Inflate finished - consumed=%u, output=%u,\n"
-             "                   cmp_offset=%llu, uncmp_offset=%llu \n\n",
-             *total_consumed, *total_output,
-             cmp_offset, uncmp_offset);
+    free(windowbuf);
+    free(dataflags);
 
-    /* Phew. */
-    return return_val;
+    return ZRAN_EXPORT_OK;
 
 fail:
-    if (index->readbuf != NULL) {
-        free(index->readbuf);
-        index->readbuf        = NULL;
-        index->readbuf_offset = 0;
-        index->readbuf_end    = 0;
-    }
-
-    return error_return_val;
+    free(windowbuf);
+    free(dataflags);
+    return ZRAN_EXPORT_WRITE_ERROR;
 }
 
+/* Write a variable length integer. */
+uint32_t _zran_put_varint(uint8_t *buf, uint64_t value) {
 
-/*
- * Expands the index to encompass the
- * compressed offset specified by 'until'.
- */
-int _zran_expand_index(zran_index_t *index, uint64_t until) {
+    uint32_t n = 0;
 
-    /*
-     * Used to store return code when
-     * an error occurs.
-     */
-    int error_return_val = ZRAN_EXPAND_INDEX_FAIL;
+    while (value >= 0x80) {
+        buf[n++] = (uint8_t)(value | 0x80);
+        value  >>= 7;
+    }
 
-    /*
-     * Used to store and check return values
-     * from zlib and zran functions.
-     */
-    int z_ret;
+    buf[n++] = (uint8_t)value;
 
-    /* Zlib stream struct */
-    z_stream strm;
+    return n;
+}
 
-    /*
-     * Number of bytes read/decompressed
-     * on each call to _zran_inflate.
-     */
-    uint32_t bytes_consumed;
-    uint32_t bytes_output;
 
-    /*
-     * Buffer to store uncompressed data,
-     * size of said buffer, and current offset
-     * into said buffer. We wrap the buffer
-     * around to the beginning when it is
-     * filled.
-     *
-     * Ideally, we only want to decompress
-     * index->spacing bytes before creating a
-     * new index point. But we may have to
-     * decompress more than this before a
-     * suitable location (a block/stream
-     * boundary) is found, so we allocate
-     * more space.
-     */
-    uint8_t *data        = NULL;
-    uint32_t data_size   = index->spacing * 4;
-    uint32_t data_offset = 0;
+/* Read a variable length integer. */
+int _zran_get_varint(uint8_t  *buf,
+                     uint64_t  len,
+                     uint64_t *pos,
+                     uint64_t *value) {
 
-    /*
-     * _zran_inflate control flags. We need
-     * to use different flags on the first
-     * call - first_inflate is used to track
-     * this.
-     */
-    uint16_t inflate_flags;
-    uint8_t  first_inflate = 1;
+    uint32_t shift = 0;
+    uint8_t  byte;
 
-    /*
-     * Counters to keep track of where we are
-     * in both the compressed and uncompressed
-     * streams.
-     */
-    uint64_t cmp_offset;
-    uint64_t uncmp_offset;
-    uint64_t last_uncmp_offset;
+    *value = 0;
 
-    /*
-     * start is a reference to the last
-     * point in the index when this function
-     * is called. This is where we need
-     * to start decompressing data from
-     * before we can add more index points.
-     *
-     * last_created is a reference to the
-     * most recent point that was added
-     * to the index in this call to
-     * _zran_expand_index.
-     */
-    zran_point_t *start        = NULL;
-    zran_point_t *last_created = NULL;
+    while (1) {
 
-    /*
-     * In order to create a new index
-     * point, we need to start reading
-     * at the last index point, so that
-     * we read enough data to initialise
-     * the inflation. If we don't have
-     * at least two points, we start
-     * at the beginning of the file.
-     */
-    start = NULL;
-    if (index->npoints > 1) {
+        if (*pos >= len || shift >= 7 * ZRAN_VARINT_MAX)
+            return -1;
 
-        start = &(index->list[index->npoints - 1]);
+        byte    = buf[(*pos)++];
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        shift  += 7;
 
-        /*
-         * The index already covers the requested
-         * offset. Nothing needs to be done.
-         */
-        if (until != 0 && until <= start->cmp_offset)
+        if (!(byte & 0x80))
             return 0;
     }
+}
 
-    /*
-     * Allocate memory for the
-     * uncompressed data buffer.
-     */
-    data = calloc(1, data_size);
-    if (data == NULL)
-        goto fail;
 
-    /* Let's do this. */
-    zran_log("_zran_expand_index(%llu)\n", until);
+/* Write the point table and window records of a compact index file. */
+int _zran_export_compact_index(zran_index_t *index,
+                               uint8_t      *dataflags,
+                               FILE         *fd,
+                               PyObject     *f) {
+
+    size_t   f_ret;
+    uint32_t i;
+    uint64_t prev_cmp   = 0;
+    uint64_t prev_uncmp = 0;
 
     /*
-     * If the caller passed until == 0,
-     * we expand to EOF.
+     * The point table is encoded in memory,
+     * and then written in one go.
      */
-    if (until == 0) {
-        until = UINT64_MAX;
-    }
+    uint8_t *table = NULL;
+    uint64_t tablelen;
 
     /*
-     * We start from the last point in
-     * the index, or the beginning of
-     * the file, if there are not enough
-     * points in the index.
+     * The window record for each point which has
+     * one, and its length. Records either point to
+     * the stored window data, or to a copy in a
+     * temporary arena.
      */
-    if (start != NULL) {
-        cmp_offset        = start->cmp_offset;
-        uncmp_offset      = start->uncmp_offset;
-        last_uncmp_offset = uncmp_offset;
-    }
-    else {
-        cmp_offset        = 0;
-        uncmp_offset      = 0;
-        last_uncmp_offset = 0;
-    }
+    uint8_t    **records = NULL;
+    uint32_t    *lens    = NULL;
+    zran_arena_t arena;
 
     /*
-     * Don't finish until we're at the end of the
-     * file (break at bottom of loop), or we've
-     * expanded the index past the requested
-     * offset (and have created at least one new
-     * index point - last_created == NULL tells
-     * us whether a point has been created).
+     * Buffers used to re-create evicted windows,
+     * or decompress stored windows, and to
+     * compress windows.
      */
-    while (last_created == NULL || last_created->cmp_offset < until) {
-
-        /*
-         * On the first call to _zran_inflate, we
-         * tell it to initialise the zlib stream
-         * struct, create a read buffer, and start
-         * inflation from our starting point.
-         */
-        if (first_inflate) {
-            first_inflate = 0;
-            inflate_flags = (ZRAN_INFLATE_INIT_Z_STREAM         |
-                             ZRAN_INFLATE_INIT_READBUF          |
-                             ZRAN_INFLATE_USE_OFFSET            |
-                             ZRAN_INFLATE_CLEAR_READBUF_OFFSETS |
-                             ZRAN_INFLATE_STOP_AT_BLOCK);
-        }
-
-        /*
-         * On subsequent calls, we tell _zran_inflate
-         * to just continue where it left off on the
-         * previous call.
-         */
-        else {
-            inflate_flags = ZRAN_INFLATE_STOP_AT_BLOCK;
-        }
-
-        zran_log("Searching for next block boundary\n"
-                 "       c=%llu, u=%llu,\n"
-                 "       data_offset=%u, data_space=%u\n",
-                 cmp_offset, uncmp_offset, data_offset,
-                 data_size - data_offset);
-
-        /*
-         * We wrap the data buffer around to its
-         * beginning by using some trickery with
-         * the data_offset. By doing this, the
-         * _zran_add_point function will be able
-         * to retrieve the data associated with
-         * an index point even if some of it it
-         * is contained at the end of the data
-         * buffer, and the rest at the beginning.
-         */
-        z_ret = _zran_inflate(index,
-                              &strm,
-                              cmp_offset,
-                              inflate_flags,
-                              &bytes_consumed,
-                              &bytes_output,
-                              data_size - data_offset,
-                              data      + data_offset,
-                              1);
-
-        cmp_offset   += bytes_consumed;
-        uncmp_offset += bytes_output;
-        data_offset   = (data_offset + bytes_output) % data_size;
-
-        /*
-         * update the last created offset on every iteration,
-         * to catch any index points created by _zran_inflate
-         */
-        if (index->npoints > 0) {
-            last_created      = &index->list[index->npoints - 1];
-            last_uncmp_offset = last_created->uncmp_offset;
-        }
-
-        /*
-         * Has the output buffer been filled?
-         * If so, we just continue - the
-         * data_offset trickery means that we
-         * can ask the _zran_inflate function
-         * to just keep filling the buffer
-         * until we find a block.
-         */
-        if (z_ret == ZRAN_INFLATE_OUTPUT_FULL)
-            continue;
-
-        /*
-         * If z_ret != ZRAN_INFLATE_EOF or
-         * ZRAN_INFLATE_BLOCK_BOUNDARY,
-         * something has gone wrong.
-         */
-        else if (z_ret != ZRAN_INFLATE_EOF &&
-                 z_ret != ZRAN_INFLATE_BLOCK_BOUNDARY) {
-            if (z_ret == ZRAN_INFLATE_CRC_ERROR) {
-                error_return_val = ZRAN_EXPAND_INDEX_CRC_ERROR;
-            }
-            goto fail;
-        }
-
-        /*
-         * If we're at the end of the file (z_ret
-         * == ZRAN_INFLATE_EOF), or at a compress
-         * block boundary, and index->spacing bytes
-         * have passed since the last index point
-         * that was created, we'll create a new
-         * index point at this location.
-         *
-         * Note that the _zran_inflate function
-         * also adds index points at the beginning
-         * of the file, and at the beginning of all
-         * other gzip streams, in the case of
-         * concatenated streams (refer to its
-         * add_stream_points argument).
-         */
-        if (z_ret == ZRAN_INFLATE_EOF ||
-            uncmp_offset - last_uncmp_offset >= index->spacing) {
-            if (_zran_add_point(index,
-                                strm.data_type & 7,
-                                cmp_offset,
-                                uncmp_offset,
-                                data_offset,
-                                data_size,
-                                data) != 0) {
-                goto fail;
-            }
-            last_created      = &index->list[index->npoints - 1];
-            last_uncmp_offset = uncmp_offset;
+    uint8_t *windowbuf = NULL;
+    uint8_t *cmpbuf    = NULL;
+    uLongf   cmplen;
+
+    zran_point_t          point;
+    zran_mapped_window_t *mapped;
+    uint8_t              *data;
+    uint32_t              len;
+    uint8_t               flags;
+    int                   ret = ZRAN_EXPORT_WRITE_ERROR;
+
+    zran_arena_init(&arena, 0, 0);
+
+    records   = calloc(max(index->npoints, 1), sizeof(uint8_t *));
+    lens      = calloc(max(index->npoints, 1), sizeof(uint32_t));
+    table     = malloc(max(index->npoints, 1) * (3 * ZRAN_VARINT_MAX + 1));
+    windowbuf = malloc(index->window_size);
+    cmpbuf    = malloc(compressBound(index->window_size));
+
+    if (records   == NULL ||
+        lens      == NULL ||
+        table     == NULL ||
+        windowbuf == NULL ||
+        cmpbuf    == NULL)
+        goto done;
+
+    for (i = 0; i < index->npoints; i++) {
+
+        if (dataflags[i] == 0 || dataflags[i] == 3)
+            continue;
+
+        data = index->windows[i];
+
+        /* Evicted windows are re-created in full */
+        if (_zran_point_evicted(index, i)) {
+            if (_zran_regenerate_window(index, i, windowbuf) != 0)
+                goto done;
+            data = windowbuf;
+            len  = index->window_size;
         }
 
-        /* And if at EOF, we are done. */
-        if (z_ret == ZRAN_INFLATE_EOF) {
-            break;
+        /*
+         * Windows which are stored (or mapped)
+         * compressed are written as they are.
+         */
+        else if ((mapped = _zran_mapped_window(index, data)) != NULL &&
+                 (mapped->flags & ZRAN_COMPACT_DEFLATED)) {
+            lens[i]       = mapped->len;
+            records[i]    = mapped->record;
+            dataflags[i] |= ZRAN_COMPACT_DEFLATED;
+            continue;
+        }
+
+        else if (mapped == NULL           &&
+                 window_has_header(index) &&
+                 (data[sizeof(uint32_t)] & ZRAN_WINDOW_DEFLATED)) {
+            memcpy(&lens[i], data, sizeof(uint32_t));
+            records[i]    = data + ZRAN_WINDOW_HEADER_SIZE;
+            dataflags[i] |= ZRAN_COMPACT_DEFLATED;
+            continue;
+        }
+
+        else {
+            data = _zran_encoded_window(index, data, windowbuf, &len, &flags);
+            if (data == NULL)
+                goto done;
+        }
+
+        /* Everything else is compressed, if that helps */
+        cmplen = compressBound(index->window_size);
+        if (compress2(cmpbuf, &cmplen, data, len, Z_BEST_SPEED) == Z_OK &&
+            cmplen < len) {
+            data          = cmpbuf;
+            len           = cmplen;
+            dataflags[i] |= ZRAN_COMPACT_DEFLATED;
+        }
+
+        /*
+         * Data in one of our buffers needs to be
+         * kept until it is written.
+         */
+        if (data == cmpbuf || data == windowbuf) {
+            records[i] = zran_arena_alloc(&arena, len);
+            if (records[i] == NULL)
+                goto done;
+            memcpy(records[i], data, len);
         }
+        else {
+            records[i] = data;
+        }
+
+        lens[i] = len;
     }
 
     /*
-     * A final call to _zran_inflate, to clean
-     * up read buffer and z_stream memory.
+     * Each point is stored as the difference between
+     * its offsets and those of the previous point,
+     * the bit offset and data flag, and the length of
+     * its window record, or the owner of its window.
      */
-    z_ret = _zran_inflate(index,
-                          &strm,
-                          0,
-                          (ZRAN_INFLATE_CLEAR_READBUF_OFFSETS |
-                           ZRAN_INFLATE_FREE_Z_STREAM         |
-                           ZRAN_INFLATE_FREE_READBUF),
-                          &bytes_consumed,
-                          &bytes_output,
-                          0,
-                          data,
-                          0);
+    tablelen = 0;
+    for (i = 0; i < index->npoints; i++) {
 
-    if (z_ret != ZRAN_INFLATE_OK && z_ret != ZRAN_INFLATE_EOF) {
-        if (z_ret == ZRAN_INFLATE_CRC_ERROR) {
-            error_return_val = ZRAN_EXPAND_INDEX_CRC_ERROR;
+        zran_get_point(index, i, &point);
+
+        tablelen += _zran_put_varint(table + tablelen,
+                                     point.cmp_offset - prev_cmp);
+        tablelen += _zran_put_varint(table + tablelen,
+                                     point.uncmp_offset - prev_uncmp);
+
+        table[tablelen++] = point.bits |
+                            (dataflags[i] << ZRAN_COMPACT_FLAG_SHIFT);
+
+        if (dataflags[i] == 3) {
+            tablelen += _zran_put_varint(
+                table + tablelen,
+                _zran_window_owner(index, point.data, i));
         }
-        goto fail;
+        else if (dataflags[i] != 0) {
+            tablelen += _zran_put_varint(table + tablelen, lens[i]);
+        }
+
+        prev_cmp   = point.cmp_offset;
+        prev_uncmp = point.uncmp_offset;
+    }
+
+    zran_log("_zran_export_compact_index: (%u points, %llu bytes)\n",
+             index->npoints, tablelen);
+
+    f_ret = fwrite_(&tablelen, sizeof(tablelen), 1, fd, f);
+    if (ferror_(fd, f)) goto done;
+    if (f_ret != 1)     goto done;
+
+    if (tablelen > 0) {
+        f_ret = fwrite_(table, tablelen, 1, fd, f);
+        if (ferror_(fd, f)) goto done;
+        if (f_ret != 1)     goto done;
+    }
+
+    for (i = 0; i < index->npoints; i++) {
+
+        if (records[i] == NULL)
+            continue;
+
+        f_ret = fwrite_(records[i], lens[i], 1, fd, f);
+        if (ferror_(fd, f)) goto done;
+        if (f_ret != 1)     goto done;
+
+        zran_log("_zran_export_compact_index: (%u, %u bytes, flags %u)\n",
+                 i,
+                 lens[i],
+                 dataflags[i]);
     }
 
+    ret = ZRAN_EXPORT_OK;
+
+done:
+    zran_arena_free(&arena);
+    free(records);
+    free(lens);
+    free(table);
+    free(windowbuf);
+    free(cmpbuf);
+    return ret;
+}
+
+
+/* Read a sparse window from an index file. */
+int _zran_import_sparse_window(zran_index_t  *index,
+                               uint8_t      **stored,
+                               uint8_t        last,
+                               FILE          *fd,
+                               PyObject      *f) {
+
+    uint8_t *window;
+    uint8_t *packed;
+    uint32_t nranges;
+    uint32_t length;
+    uint32_t i;
+    uint64_t len;
+    uint64_t nbytes;
+    size_t   f_ret;
+
     /*
-     * The index may have over-allocated
-     * space for storing index points, so
-     * here we free the unused memory.
+     * The window is read into the second part
+     * of the scratch buffer, and unpacked into
+     * the first part. A valid packed window is
+     * always smaller than the window size.
      */
-    if (_zran_free_unused(index) != 0) {
-        goto fail;
+    window = _zran_window_buf(index);
+    if (window == NULL)
+        return ZRAN_IMPORT_MEMORY_ERROR;
+
+    packed = window + index->window_size;
+
+    f_ret = fread_(&nranges, sizeof(uint32_t), 1, fd, f);
+    if (feof_(fd, f, f_ret)) return ZRAN_IMPORT_EOF;
+    if (ferror_(fd, f))      return ZRAN_IMPORT_READ_ERROR;
+    if (f_ret != 1)          return ZRAN_IMPORT_READ_ERROR;
+
+    len = sizeof(uint32_t) + 2 * sizeof(uint32_t) * (uint64_t)nranges;
+    if (len >= index->window_size)
+        return ZRAN_IMPORT_FAIL;
+
+    memcpy(packed, &nranges, sizeof(uint32_t));
+
+    if (nranges > 0) {
+        f_ret = fread_(packed + sizeof(uint32_t),
+                       len    - sizeof(uint32_t), 1, fd, f);
+        if (feof_(fd, f, f_ret) && !last) return ZRAN_IMPORT_EOF;
+        if (ferror_(fd, f))               return ZRAN_IMPORT_READ_ERROR;
+        if (f_ret != 1)                   return ZRAN_IMPORT_READ_ERROR;
     }
 
-    zran_log("Expansion finished (cmp_offset=%llu, last_created=%llu)\n",
-             cmp_offset, last_created->cmp_offset);
+    /* Total length of all ranges */
+    nbytes = 0;
+    for (i = 0; i < nranges; i++) {
+        memcpy(&length,
+               packed + sizeof(uint32_t) * (2 + 2 * i),
+               sizeof(uint32_t));
+        nbytes += length;
+    }
 
-    free(data);
-    return ZRAN_EXPAND_INDEX_OK;
+    if (len + nbytes >= index->window_size)
+        return ZRAN_IMPORT_FAIL;
 
-fail:
-    free(data);
-    return error_return_val;
+    if (nbytes > 0) {
+        f_ret = fread_(packed + len, nbytes, 1, fd, f);
+        if (feof_(fd, f, f_ret) && !last) return ZRAN_IMPORT_EOF;
+        if (ferror_(fd, f))               return ZRAN_IMPORT_READ_ERROR;
+        if (f_ret != 1)                   return ZRAN_IMPORT_READ_ERROR;
+    }
+
+    len += nbytes;
+
+    /* Make sure the ranges are valid */
+    if (_zran_unpack_sparse_window(index, packed, len, window) != 0)
+        return ZRAN_IMPORT_FAIL;
+
+    zran_log("_zran_import_sparse_window(%u ranges, %llu bytes)\n",
+             nranges, nbytes);
+
+    if (index->flags & ZRAN_SPARSE_WINDOWS)
+        *stored = _zran_store_encoded_window(index,
+                                             packed,
+                                             len,
+                                             ZRAN_WINDOW_SPARSE);
+    else
+        *stored = _zran_store_window(index, window, NULL);
+
+    if (*stored == NULL)
+        return ZRAN_IMPORT_MEMORY_ERROR;
+
+    return ZRAN_IMPORT_OK;
 }
 
 
-/*
- * Seek to the approximate location of the specified offset into
- * the uncompressed data stream.
- */
-int zran_seek(zran_index_t  *index,
-              int64_t        offset,
-              uint8_t        whence,
-              zran_point_t **point)
-{
+/* Read the point table of a compact index file. */
+int _zran_import_compact_points(zran_index_t *index,
+                                uint32_t      npoints,
+                                uint8_t      *dataflags,
+                                uint32_t     *extra,
+                                FILE         *fd,
+                                PyObject     *f) {
+
+    size_t   f_ret;
+    uint32_t i;
+    uint8_t *table = NULL;
+    uint64_t tablelen;
+    uint64_t pos   = 0;
+    uint64_t cmp   = 0;
+    uint64_t uncmp = 0;
+    uint64_t value;
+    uint8_t  byte;
+    uint8_t  flag;
+    int      ret;
+
+    f_ret = fread_(&tablelen, sizeof(tablelen), 1, fd, f);
+    if (feof_(fd, f, f_ret)) return ZRAN_IMPORT_EOF;
+    if (ferror_(fd, f))      return ZRAN_IMPORT_READ_ERROR;
+    if (f_ret != 1)          return ZRAN_IMPORT_READ_ERROR;
+
+    /* Make sure the length is sensible before allocating memory */
+    if (tablelen > (uint64_t)npoints * (3 * ZRAN_VARINT_MAX + 1))
+        return ZRAN_IMPORT_FAIL;
+
+    if (tablelen == 0)
+        return (npoints == 0) ? ZRAN_IMPORT_OK : ZRAN_IMPORT_FAIL;
+
+    table = malloc(tablelen);
+    if (table == NULL)
+        return ZRAN_IMPORT_MEMORY_ERROR;
+
+    /* The file may end after the table, if no points have windows */
+    f_ret = fread_(table, tablelen, 1, fd, f);
+    if (ferror_(fd, f)) { ret = ZRAN_IMPORT_READ_ERROR; goto done; }
+    if (f_ret != 1)     { ret = ZRAN_IMPORT_EOF;        goto done; }
+
+    ret = ZRAN_IMPORT_FAIL;
+
+    for (i = 0; i < npoints; i++) {
+
+        /* Offsets can't go backwards, or overflow */
+        if (_zran_get_varint(table, tablelen, &pos, &value)) goto done;
+        cmp += value;
+        if (cmp < value)                                     goto done;
+
+        if (_zran_get_varint(table, tablelen, &pos, &value)) goto done;
+        uncmp += value;
+        if (uncmp < value)                                   goto done;
+
+        if (pos >= tablelen)
+            goto done;
+
+        byte = table[pos++];
+        flag = byte >> ZRAN_COMPACT_FLAG_SHIFT;
+
+        /* Only points with a window record can be compressed */
+        if (flag > (2 | ZRAN_COMPACT_DEFLATED) ||
+            flag == ZRAN_COMPACT_DEFLATED)
+            goto done;
+
+        if (flag != 0) {
+            if (_zran_get_varint(table, tablelen, &pos, &value)) goto done;
+            if (value > UINT32_MAX)                              goto done;
+            extra[i] = (uint32_t)value;
+        }
 
-    int           result;
-    zran_point_t *seek_point = NULL;
+        index->cmp_offsets[i]   = cmp;
+        index->uncmp_offsets[i] = uncmp;
+        dataflags[i]            = flag;
 
-    zran_log("zran_seek(%lld, %i)\n", offset, whence);
+        _zran_set_point_bits(index, i, byte & 0x07);
 
-    if (whence == SEEK_END && index->uncompressed_size == 0) {
-      goto index_not_built;
+        zran_log("_zran_import_compact_points: (p%u, %lu, %lu, %u, %u)\n",
+                 i,
+                 cmp,
+                 uncmp,
+                 byte & 0x07,
+                 flag);
     }
 
-    /*
-     * The offset passed in is signed, so
-     * negative offsets are allowed. But
-     * here we transform the offset to
-     * positive, as _zran_get_point_with_expand
-     * requires an absolute offset from the
-     * beginning of the uncompressed stream.
-     *
-     * I am not currently taking into account
-     * the overflow potential when converting
-     * from int64 to uint64.
-     */
+    /* There shouldn't be anything left over */
+    if (pos == tablelen)
+        ret = ZRAN_IMPORT_OK;
+
+done:
+    free(table);
+    return ret;
+}
 
-    /*
-     * SEEK_END: seek relative to the
-     * end of the uncompressed stream
-     */
-    if (whence == SEEK_END) {
-      offset += index->uncompressed_size;
-    }
+
+/* Read a window record from a compact index file. */
+int _zran_import_window_record(zran_index_t  *index,
+                               uint8_t      **stored,
+                               uint32_t       len,
+                               uint8_t        dataflag,
+                               uint8_t        last,
+                               FILE          *fd,
+                               PyObject      *f) {
+
+    uint8_t  sparse   = (dataflag & 3) == 2;
+    uint8_t  deflated = (dataflag & ZRAN_COMPACT_DEFLATED) != 0;
+    uint8_t *window;
+    uint8_t *packed;
+    uint8_t *record;
+    uint8_t *encoded;
+    uLongf   outlen;
+    size_t   f_ret;
 
     /*
-     * SEEK_CUR: seek relative to
-     * the current file position.
+     * The record is read into the third part of
+     * the scratch buffer. Sparse windows are
+     * decoded into the second part, and unpacked
+     * into the first part - full windows are
+     * decoded straight into the first part.
      */
-    if (whence == SEEK_CUR) {
-      offset += index->uncmp_seek_offset;
+    window = _zran_window_buf(index);
+    if (window == NULL)
+        return ZRAN_IMPORT_MEMORY_ERROR;
+
+    packed  = window + index->window_size;
+    record  = packed + index->window_size;
+    encoded = sparse ? packed : window;
+
+    if (len == 0 || len > compressBound(index->window_size))
+        return ZRAN_IMPORT_FAIL;
+    if (!deflated && len > index->window_size)
+        return ZRAN_IMPORT_FAIL;
+
+    f_ret = fread_(record, len, 1, fd, f);
+    if (feof_(fd, f, f_ret) && !last) return ZRAN_IMPORT_EOF;
+    if (ferror_(fd, f))               return ZRAN_IMPORT_READ_ERROR;
+    if (f_ret != 1)                   return ZRAN_IMPORT_READ_ERROR;
+
+    if (deflated) {
+        outlen = index->window_size;
+        if (uncompress(encoded, &outlen, record, len) != Z_OK)
+            return ZRAN_IMPORT_FAIL;
+    }
+    else {
+        outlen = len;
+        memcpy(encoded, record, len);
     }
 
-    /* Bad input */
-    if (offset < 0) {
-      goto fail;
+    /* Make sure the window is valid */
+    if (sparse) {
+        if (outlen >= index->window_size ||
+            _zran_unpack_sparse_window(index, packed, outlen, window) != 0)
+            return ZRAN_IMPORT_FAIL;
+    }
+    else if (outlen != index->window_size) {
+        return ZRAN_IMPORT_FAIL;
     }
 
+    zran_log("_zran_import_window_record(%u bytes, %u -> %lu)\n",
+             len, dataflag, outlen);
+
     /*
-     * We implicitly allow seek(0) - if
-     * not auto-building the index,
-     * seek(0) would otherwwise fail.
+     * Compressed records don't need to be
+     * compressed again if the index stores
+     * windows in the same form.
      */
-    if (offset == 0) {
-        index->uncmp_seek_offset = offset;
+    if (deflated &&
+        (index->flags & ZRAN_COMPRESS_WINDOWS) &&
+        (!sparse || (index->flags & ZRAN_SPARSE_WINDOWS)))
+        *stored = _zran_store_window_data(
+            index,
+            record,
+            len,
+            ZRAN_WINDOW_DEFLATED | (sparse ? ZRAN_WINDOW_SPARSE : 0));
+    else if (sparse && (index->flags & ZRAN_SPARSE_WINDOWS))
+        *stored = _zran_store_encoded_window(index,
+                                             packed,
+                                             outlen,
+                                             ZRAN_WINDOW_SPARSE);
+    else
+        *stored = _zran_store_window(index, window, NULL);
+
+    if (*stored == NULL)
+        return ZRAN_IMPORT_MEMORY_ERROR;
+
+    return ZRAN_IMPORT_OK;
+}
+
+
+/* Map the window data of an index file into memory. */
+uint64_t _zran_get_uint(uint8_t *buf, uint8_t nbytes, uint8_t bigendian) {
+
+    uint64_t value = 0;
+    uint8_t  i;
+
+    for (i = 0; i < nbytes; i++) {
+        if (bigendian) value = (value << 8) | buf[i];
+        else           value = (value << 8) | buf[nbytes - i - 1];
     }
-    else {
 
-        /*
-         * Get the index point that
-         * corresponds to this offset.
-         */
-        result = _zran_get_point_with_expand(index, offset, 0, &seek_point);
+    return value;
+}
 
-        if      (result == ZRAN_GET_POINT_EOF)         goto eof;
-        else if (result == ZRAN_GET_POINT_NOT_COVERED) goto not_covered;
-        else if (result == ZRAN_GET_POINT_CRC_ERROR)   goto crcerror;
-        else if (result != ZRAN_GET_POINT_OK)          goto fail;
 
-        /*
-         * transform into an offset
-         * into the compressed stream
-         */
-        index->uncmp_seek_offset = offset;
-        offset                   = seek_point->cmp_offset;
+void _zran_put_uint(uint8_t  *buf,
+                    uint64_t  value,
+                    uint8_t   nbytes,
+                    uint8_t   bigendian) {
 
-        /*
-         * This index point is not byte-aligned.
-         * Adjust the offset accordingly.
-         */
-        if (seek_point->bits > 0)
-            offset -= 1;
+    uint8_t i;
+
+    for (i = 0; i < nbytes; i++) {
+        if (bigendian) buf[nbytes - i - 1] = value & 0xff;
+        else           buf[i]              = value & 0xff;
+        value >>= 8;
+    }
+}
+
+
+int _zran_export_bgzip_index(zran_index_t *index,
+                             FILE         *fd,
+                             PyObject     *f) {
+
+    uint8_t  *entries = NULL;
+    uint64_t  nentries;
+    uint64_t  offset;
+    uint32_t  hlen;
+    uint32_t  bsize;
+    uint32_t  i;
+    int       ret     = ZRAN_EXPORT_WRITE_ERROR;
+
+    if (!index->bgzf) {
+        ret = ZRAN_EXPORT_UNSUPPORTED;
+        goto cleanup;
     }
 
+    entries  = calloc(max(index->npoints, 1) + 1, 16);
+    nentries = 0;
+    if (entries == NULL)
+        goto cleanup;
+
     /*
-     * The caller wants a ref to the
-     * index point corresponding to
-     * the seek location.
+     * Every point should be at the start of the deflate
+     * data of a BGZF block, apart from the last point,
+     * if the file does not end with an empty block.
+     * bgzip only writes blocks with an 18 byte header.
      */
-    if (point != NULL) {
-        *point = seek_point;
+    for (i = 1; i < index->npoints; i++) {
+
+        offset = index->cmp_offsets[i];
+
+        if (offset >= index->compressed_size)
+            break;
+
+        if (offset < 18 ||
+            _zran_get_point_bits(index, i) != 0 ||
+            _zran_read_bgzf_block(index->fd,
+                                  index->f,
+                                  offset - 18,
+                                  &hlen,
+                                  &bsize,
+                                  NULL) != ZRAN_BGZF_OK ||
+            hlen != 18) {
+            ret = ZRAN_EXPORT_UNSUPPORTED;
+            goto cleanup;
+        }
+
+        _zran_put_uint(entries + 8 + nentries * 16,
+                       offset - 18,
+                       8,
+                       0);
+        _zran_put_uint(entries + 16 + nentries * 16,
+                       index->uncmp_offsets[i],
+                       8,
+                       0);
+        nentries++;
     }
 
-    if (fseek_(index->fd, index->f, offset, SEEK_SET) != 0)
-        goto fail;
+    _zran_put_uint(entries, nentries, 8, 0);
 
-    return ZRAN_SEEK_OK;
+    if (fwrite_(entries, 8 + nentries * 16, 1, fd, f) != 1 ||
+        ferror_(fd, f))
+        goto cleanup;
 
-crcerror:        return ZRAN_SEEK_CRC_ERROR;
-fail:            return ZRAN_SEEK_FAIL;
-index_not_built: return ZRAN_SEEK_INDEX_NOT_BUILT;
-not_covered:     return ZRAN_SEEK_NOT_COVERED;
-eof:
-    index->uncmp_seek_offset = index->uncompressed_size;
-    return ZRAN_SEEK_EOF;
+    zran_log("zran_export_index: (bgzip, %llu entries)\n", nentries);
+
+    ret = ZRAN_EXPORT_OK;
+
+cleanup:
+    free(entries);
+    return ret;
 }
 
 
-/* Return the current seek position in the uncompressed data stream. */
-uint64_t zran_tell(zran_index_t *index) {
+int _zran_export_gztool_index(zran_index_t *index,
+                              FILE         *fd,
+                              PyObject     *f) {
 
-    return index->uncmp_seek_offset;
-}
+    uint8_t       buf[24];
+    uint8_t      *window = NULL;
+    uint8_t      *cmpbuf = NULL;
+    uLongf        cmplen;
+    uint32_t      i;
+    int           ret    = ZRAN_EXPORT_WRITE_ERROR;
 
+    window = malloc(index->window_size);
+    cmpbuf = malloc(compressBound(ZRAN_DEFLATE_WINDOW));
+    if (window == NULL || cmpbuf == NULL)
+        goto cleanup;
 
-/* Read len bytes from the uncompressed data stream, storing them in buf. */
-int64_t zran_read(zran_index_t *index,
-                  void         *buf,
-                  uint64_t      len) {
+    memset(buf, 0, 8);
+    memcpy(buf + 8, "gzipindx", 8);
+    _zran_put_uint(buf + 16, index->npoints, 8, 1);
 
-    /* Used to store/check return values. */
-    int ret;
+    if (fwrite_(buf, 24, 1, fd, f) != 1)
+        goto cleanup;
+    if (fwrite_(buf + 16, 8, 1, fd, f) != 1)
+        goto cleanup;
 
-    /*
-     * Used to store error code for return
-     *   if an error occurs
-     */
-    int error_return_val = ZRAN_READ_FAIL;
+    for (i = 0; i < index->npoints; i++) {
 
-    /*
-     * Number of bytes we try to read, and
-     * number of bytes actually read/output
-     * on each call to _zran_inflate.
-     */
-    uint64_t bytes_to_read;
-    uint32_t bytes_consumed;
-    uint32_t bytes_output;
+        /*
+         * gztool windows are always 32KB, so
+         * only the end of the window is kept.
+         */
+        cmplen = 0;
+        if (_zran_point_evicted(index, i) ||
+            (i > 0 && index->windows[i] == NULL)) {
+            if (_zran_regenerate_window(index, i, window) != 0)
+                goto cleanup;
+            cmplen = 1;
+        }
+        else if (index->windows[i] != NULL) {
+            if (zran_get_window(index, i, window) != 0)
+                goto cleanup;
+            cmplen = 1;
+        }
 
-    /*
-     * _zran_inflate control flags. We need
-     * to pass different flags on the first
-     * call to _zran_inflate.
-     */
-    uint16_t inflate_flags;
-    uint8_t  first_inflate = 1;
+        if (cmplen > 0) {
+            cmplen = compressBound(ZRAN_DEFLATE_WINDOW);
+            if (compress(cmpbuf,
+                         &cmplen,
+                         window + index->window_size - ZRAN_DEFLATE_WINDOW,
+                         ZRAN_DEFLATE_WINDOW) != Z_OK)
+                goto cleanup;
+        }
 
-    /*
-     * Counters keeping track of the current
-     * location in both the compressed and
-     * uncompressed streams, and the total
-     * number of bytes read.
-     */
-    uint64_t uncmp_offset;
-    uint64_t cmp_offset;
-    uint64_t total_read;
+        _zran_put_uint(buf,      index->uncmp_offsets[i],        8, 1);
+        _zran_put_uint(buf + 8,  index->cmp_offsets[i],          8, 1);
+        _zran_put_uint(buf + 16, _zran_get_point_bits(index, i), 4, 1);
+        _zran_put_uint(buf + 20, cmplen,                         4, 1);
+
+        if (fwrite_(buf, 24, 1, fd, f) != 1)
+            goto cleanup;
+        if (cmplen > 0 && fwrite_(cmpbuf, cmplen, 1, fd, f) != 1)
+            goto cleanup;
+    }
+
+    _zran_put_uint(buf, index->uncompressed_size, 8, 1);
+    if (fwrite_(buf, 8, 1, fd, f) != 1)
+        goto cleanup;
+
+    if (ferror_(fd, f))
+        goto cleanup;
+
+    zran_log("zran_export_index: (gztool, %u points)\n", index->npoints);
+
+    ret = ZRAN_EXPORT_OK;
+
+cleanup:
+    free(window);
+    free(cmpbuf);
+    return ret;
+}
+
+
+/*
+ * Appends a point without a window to the point
+ * arrays of new_index, which must have space for
+ * it. Points which would not be after the last
+ * point are skipped.
+ */
+static void _zran_import_windowless_point(zran_index_t *new_index,
+                                          uint64_t      cmp_offset,
+                                          uint64_t      uncmp_offset) {
 
-    /*
-     * Zlib stream struct and starting
-     * index point for the read..
-     */
-    z_stream      strm;
-    zran_point_t *start = NULL;
+    uint32_t n = new_index->npoints;
 
-    /*
-     * Memory used to store bytes that we skip
-     * over before reaching the appropriate
-     * point in the uncompressed data stream.
-     *
-     * to_discard is used to store the number of
-     * bytes that we want to discard on a single
-     * call to _zran_inflate (which is limited by
-     * the discard buffer size).
-     *
-     * total_discarded keeps track of the total
-     * number of bytes discarded so far.
-     *
-     * discard_size is the size of the discard *
-     * buffer. Ideally we will only have to
-     * decompress (on average) spacing / 2 bytes
-     * before reaching the seek location, but this
-     * isn't a guarantee, so we allocate more to
-     * reduce the number of reads that are required.
-     */
-    uint8_t *discard         = NULL;
-    uint64_t to_discard      = 0;
-    uint64_t total_discarded = 0;
-    uint64_t discard_size    = index->spacing * 4;
+    if (n > 0 && new_index->uncmp_offsets[n - 1] >= uncmp_offset)
+        return;
+
+    new_index->cmp_offsets[  n] = cmp_offset;
+    new_index->uncmp_offsets[n] = uncmp_offset;
+    new_index->windows[      n] = NULL;
+    _zran_set_point_bits(new_index, n, 0);
+    new_index->npoints++;
+}
 
-    if (len == 0)         return 0;
-    if (len >  INT64_MAX) goto fail;
 
-    zran_log("zran_read(%llu, %lu)\n", len, index->uncmp_seek_offset);
+/* Imports a bgzip index, after its number of entries has been read. */
+static int _zran_import_bgzip_index(zran_index_t *index,
+                                    zran_index_t *new_index,
+                                    uint64_t      nentries,
+                                    uint64_t     *uncompressed_size,
+                                    FILE         *fd,
+                                    PyObject     *f) {
+
+    uint8_t  buf[16];
+    uint64_t cmp_offset   = 0;
+    uint64_t uncmp_offset = 0;
+    uint64_t next_cmp;
+    uint64_t next_uncmp;
+    uint64_t i;
+    uint32_t hlen;
+    uint32_t bsize;
+    uint32_t isize;
 
     /*
-     * Search for the index point that corresponds to
-     * our current seek location in the uncompressed
-     * data stream. Reading from the start of file is
-     * always allowed, even if the index does not
-     * contain any points.
+     * bgzip index files can only be recognised
+     * by their contents - every entry must refer
+     * to a BGZF block (which is at least 28 bytes
+     * long) in the compressed file.
      */
-    if (index->uncmp_seek_offset == 0) {
-        cmp_offset   = 0;
-        uncmp_offset = 0;
-    }
-    else {
-        ret = _zran_get_point_with_expand(index,
-                                          index->uncmp_seek_offset,
-                                          0,
-                                          &start);
+    if (!index->bgzf || nentries > index->compressed_size / 28)
+        return ZRAN_IMPORT_UNKNOWN_FORMAT;
 
-        if      (ret == ZRAN_GET_POINT_EOF)         goto eof;
-        if      (ret == ZRAN_GET_POINT_NOT_COVERED) goto not_covered;
-        else if (ret != ZRAN_GET_POINT_OK) {
-            if (ret == ZRAN_GET_POINT_CRC_ERROR) {
-                error_return_val = ZRAN_READ_CRC_ERROR;
-            }
-            goto fail;
+    if (_zran_resize_point_list(new_index, max(nentries + 2, 8)) != 0)
+        return ZRAN_IMPORT_MEMORY_ERROR;
+
+    memset(new_index->windows, 0, sizeof(uint8_t *) * new_index->size);
+
+    /* The first block is not in the file */
+    if (_zran_read_bgzf_block(index->fd, index->f, 0, &hlen, &bsize, NULL) !=
+        ZRAN_BGZF_OK)
+        return ZRAN_IMPORT_INCONSISTENT;
+
+    _zran_import_windowless_point(new_index, hlen, 0);
+
+    for (i = 0; i < nentries; i++) {
+
+        if (fread_(buf, 16, 1, fd, f) != 1) {
+            if (ferror_(fd, f)) return ZRAN_IMPORT_READ_ERROR;
+            else                return ZRAN_IMPORT_EOF;
         }
 
-        cmp_offset   = start->cmp_offset;
-        uncmp_offset = start->uncmp_offset;
+        next_cmp   = _zran_get_uint(buf,     8, 0);
+        next_uncmp = _zran_get_uint(buf + 8, 8, 0);
+
+        if (next_cmp   <= cmp_offset               ||
+            next_uncmp <  uncmp_offset             ||
+            next_cmp   >= index->compressed_size)
+            return ZRAN_IMPORT_INCONSISTENT;
+
+        if (_zran_read_bgzf_block(index->fd,
+                                  index->f,
+                                  next_cmp,
+                                  &hlen,
+                                  &bsize,
+                                  NULL) != ZRAN_BGZF_OK)
+            return ZRAN_IMPORT_INCONSISTENT;
+
+        cmp_offset   = next_cmp;
+        uncmp_offset = next_uncmp;
+
+        _zran_import_windowless_point(new_index,
+                                      cmp_offset + hlen,
+                                      uncmp_offset);
     }
 
     /*
-     * We have to start decompressing from
-     * the index point that precedes the seek
-     * location, so we need to skip over bytes
-     * until we get to that location. We use
-     * the discard buffer to store those bytes.
+     * The blocks after the last entry are
+     * read, to find the uncompressed size.
      */
-    discard = malloc(discard_size);
-    if (discard == NULL) {
-        goto fail;
+    while (cmp_offset < index->compressed_size) {
+        if (_zran_read_bgzf_block(index->fd,
+                                  index->f,
+                                  cmp_offset,
+                                  &hlen,
+                                  &bsize,
+                                  &isize) != ZRAN_BGZF_OK)
+            return ZRAN_IMPORT_INCONSISTENT;
+
+        cmp_offset   += bsize;
+        uncmp_offset += isize;
     }
 
-    /*
-     * Inflate and discard data until we
-     * reach the current seek location
-     * into the uncompressed data stream.
-     */
-    first_inflate   = 1;
-    total_discarded = 0;
-    while (uncmp_offset < index->uncmp_seek_offset) {
+    if (cmp_offset != index->compressed_size)
+        return ZRAN_IMPORT_INCONSISTENT;
 
-        /*
-         * On the first call to _zran_inflate,
-         * we tell it to initialise the z_stream,
-         * and create a read buffer.
-         */
-        if (first_inflate) {
-            first_inflate = 0;
-            inflate_flags = (ZRAN_INFLATE_INIT_Z_STREAM         |
-                             ZRAN_INFLATE_INIT_READBUF          |
-                             ZRAN_INFLATE_CLEAR_READBUF_OFFSETS |
-                             ZRAN_INFLATE_USE_OFFSET);
-        }
-        /*
-         * On subsequent calls, we just tell
-         * _zran_inflate to continue where
-         * it left off.
-         */
-        else {
-            inflate_flags = 0;
-        }
+    _zran_import_windowless_point(new_index,
+                                  index->compressed_size,
+                                  uncmp_offset);
 
-        /*
-         * Don't read past the uncompressed seek
-         * location - at this point, we will need
-         * to stop discarding bytes, and start
-         * fulfilling the read request.
-         */
-        to_discard = index->uncmp_seek_offset - uncmp_offset;
-        if (to_discard > discard_size)
-            to_discard = discard_size;
+    *uncompressed_size = uncmp_offset;
 
-        zran_log("Discarding %llu bytes (%llu < %llu)\n",
-                 to_discard,
-                 uncmp_offset,
-                 index->uncmp_seek_offset);
+    zran_log("zran_import_index: (bgzip, %llu entries)\n", nentries);
 
-        ret = _zran_inflate(index,
-                            &strm,
-                            cmp_offset,
-                            inflate_flags,
-                            &bytes_consumed,
-                            &bytes_output,
-                            to_discard,
-                            discard,
-                            0);
+    return ZRAN_IMPORT_OK;
+}
 
-        /*
-         * _zran_inflate should return 0 if
-         * it runs out of output space (which
-         * is ok), or it has read enough bytes
-         * (which is perfect). Any other
-         * return code means that something
-         * has gone wrong.
-         */
-        if (ret != ZRAN_INFLATE_OUTPUT_FULL &&
-            ret != ZRAN_INFLATE_EOF         &&
-            ret != ZRAN_INFLATE_OK) {
-            if (ret == ZRAN_INFLATE_CRC_ERROR) {
-                error_return_val = ZRAN_READ_CRC_ERROR;
-            }
-            goto fail;
-        }
 
-        cmp_offset      += bytes_consumed;
-        uncmp_offset    += bytes_output;
-        total_discarded += bytes_output;
-    }
+/* Imports a gztool index, after its 16 byte header has been read. */
+static int _zran_import_gztool_index(zran_index_t *index,
+                                     zran_index_t *new_index,
+                                     uint8_t       version,
+                                     uint64_t     *uncompressed_size,
+                                     FILE         *fd,
+                                     PyObject     *f) {
+
+    uint8_t   buf[32];
+    uint8_t  *window   = NULL;
+    uint8_t  *cmpbuf   = NULL;
+    uint8_t  *stored;
+    uint32_t  cmpsize  = 0;
+    uint64_t  npoints;
+    uint64_t  uncmp_offset;
+    uint64_t  cmp_offset;
+    uint32_t  bits;
+    uint32_t  wsize;
+    uLongf    len;
+    uint32_t  i;
+    uint32_t  ptsize   = version == 1 ? 32 : 24;
+    int       ret      = ZRAN_IMPORT_FAIL;
 
     /*
-     * Sanity check - we should be at the
-     * correct location in the uncompressed
-     * stream.
-     *
-     * TODO What happens here if we are at EOF?
+     * Version 1 files have the line number
+     * format before the number of points.
      */
-    if (uncmp_offset != index->uncmp_seek_offset)
-        goto fail;
+    if (version == 1 && fread_(buf, 4, 1, fd, f) != 1)
+        goto eof;
 
-    zran_log("Discarded %llu bytes, ready to "
-             "read from %llu (== %llu)\n",
-             total_discarded,
-             uncmp_offset,
-             index->uncmp_seek_offset);
+    if (fread_(buf, 16, 1, fd, f) != 1)
+        goto eof;
 
     /*
-     * At this point, we are ready to inflate
-     * from the uncompressed seek location.
+     * The first count is 0 if the file was
+     * not finished, in which case the second
+     * is used.
      */
+    npoints = _zran_get_uint(buf, 8, 1);
+    if (npoints == 0)
+        npoints = _zran_get_uint(buf + 8, 8, 1);
 
-    total_read = 0;
-    while (total_read < len) {
+    if (npoints > UINT32_MAX - 8)
+        goto inconsistent;
 
-        /*
-         * If we started at the correct location,
-         * the discard loop above will not have
-         * executed, and _zran_inflate will not
-         * have initialised itself. So we repeat
-         * the flag control stuff here.
-         */
-        if (first_inflate) {
-            first_inflate = 0;
-            inflate_flags = (ZRAN_INFLATE_INIT_Z_STREAM         |
-                             ZRAN_INFLATE_INIT_READBUF          |
-                             ZRAN_INFLATE_CLEAR_READBUF_OFFSETS |
-                             ZRAN_INFLATE_USE_OFFSET);
-        }
-        else {
-            inflate_flags = 0;
-        }
+    window = calloc(1, index->window_size);
+    if (window == NULL)
+        goto memory_error;
 
-        /*
-         * _zran_inflate only allows us to
-         * read max(uint32_t) at a time. If
-         * len is greater than this, we need
-         * to split it into multiple calls.
-         */
-        bytes_to_read = len - total_read;
-        if (bytes_to_read > 4294967295) {
-            bytes_to_read = 4294967295;
-        }
+    if (_zran_resize_point_list(new_index, max(npoints, 8)) != 0)
+        goto memory_error;
 
-        ret = _zran_inflate(index,
-                            &strm,
-                            cmp_offset,
-                            inflate_flags,
-                            &bytes_consumed,
-                            &bytes_output,
-                            bytes_to_read,
-                            (uint8_t *)(buf) + total_read,
-                            0);
+    memset(new_index->windows, 0, sizeof(uint8_t *) * new_index->size);
 
-        cmp_offset   += bytes_consumed;
-        uncmp_offset += bytes_output;
-        total_read   += bytes_output;
+    for (i = 0; i < npoints; i++) {
 
-        if (ret == ZRAN_INFLATE_EOF)
-            break;
+        if (fread_(buf, ptsize, 1, fd, f) != 1)
+            goto eof;
 
-        else if (ret == ZRAN_INFLATE_OUTPUT_FULL) {
+        uncmp_offset = _zran_get_uint(buf,              8, 1);
+        cmp_offset   = _zran_get_uint(buf + 8,          8, 1);
+        bits         = _zran_get_uint(buf + 16,         4, 1);
+        wsize        = _zran_get_uint(buf + ptsize - 4, 4, 1);
 
-            /*
-             * We might be reading 2**32 sized chunks
-             * of data on each call to _zran_inflate.
-             */
-            if (bytes_to_read == len) {
-                break;
-            }
-        }
-        else if (ret != ZRAN_INFLATE_OK) {
-            if (ret == ZRAN_INFLATE_CRC_ERROR) {
-                error_return_val = ZRAN_READ_CRC_ERROR;
-            }
-            goto fail;
-        }
+        if (bits > 7                                     ||
+            cmp_offset > index->compressed_size          ||
+            (i > 0 &&
+             (cmp_offset   <= new_index->cmp_offsets[  i - 1] ||
+              uncmp_offset <  new_index->uncmp_offsets[i - 1])))
+            goto inconsistent;
 
-        zran_log("Read %u bytes (%llu / %llu)\n",
-                 bytes_output,
-                 total_read,
-                 len);
-    }
+        new_index->cmp_offsets[  i] = cmp_offset;
+        new_index->uncmp_offsets[i] = uncmp_offset;
+        _zran_set_point_bits(new_index, i, bits);
 
-    /*
-     * A final call to _zran_inflate,
-     * to clean up memory
-     */
-    ret = _zran_inflate(index,
-                        &strm,
-                        0,
-                        (ZRAN_INFLATE_CLEAR_READBUF_OFFSETS |
-                         ZRAN_INFLATE_FREE_Z_STREAM         |
-                         ZRAN_INFLATE_FREE_READBUF),
-                        &bytes_consumed,
-                        &bytes_output,
-                        0,
-                        discard,
-                        0);
+        if (wsize == 0)
+            continue;
 
-    if (ret != ZRAN_INFLATE_OK && ret != ZRAN_INFLATE_EOF) {
-        if (ret == ZRAN_INFLATE_CRC_ERROR) {
-            error_return_val = ZRAN_READ_CRC_ERROR;
+        if (wsize > cmpsize) {
+            free(cmpbuf);
+            cmpsize = wsize;
+            cmpbuf  = malloc(cmpsize);
+            if (cmpbuf == NULL)
+                goto memory_error;
         }
-        goto fail;
-    }
 
-    /*
-     * Update the current uncompressed
-     * seek position.
-     */
-    index->uncmp_seek_offset += total_read;
+        if (fread_(cmpbuf, wsize, 1, fd, f) != 1)
+            goto eof;
 
-    zran_log("Read succeeded - %llu bytes read [compressed offset: %ld]\n",
-             total_read,
-             ftell_(index->fd, index->f));
+        /*
+         * Windows are 32KB, and go at the end of
+         * our window - anything before them is
+         * never referenced.
+         */
+        len = ZRAN_DEFLATE_WINDOW;
+        if (uncompress(window + index->window_size - ZRAN_DEFLATE_WINDOW,
+                       &len,
+                       cmpbuf,
+                       wsize) != Z_OK ||
+            len != ZRAN_DEFLATE_WINDOW)
+            goto inconsistent;
+
+        stored = _zran_store_window(new_index, window, NULL);
+        if (stored == NULL)
+            goto memory_error;
 
-    free(discard);
+        new_index->windows[i] = _zran_share_window(new_index, stored, i);
+        if (new_index->windows[i] == NULL)
+            goto memory_error;
+    }
 
-    return total_read;
+    new_index->npoints = npoints;
 
-not_covered: return ZRAN_READ_NOT_COVERED;
-eof:         return ZRAN_READ_EOF;
-fail:
+    /* The uncompressed size is at the end, if known */
+    *uncompressed_size = 0;
+    if (fread_(buf, 8, 1, fd, f) == 1)
+        *uncompressed_size = _zran_get_uint(buf, 8, 1);
 
-    if (discard != NULL)
-        free(discard);
+    if (ferror_(fd, f))
+        goto read_error;
 
-    return error_return_val;
-}
+    zran_log("zran_import_index: (gztool, %u points)\n", npoints);
 
+    ret = ZRAN_IMPORT_OK;
+    goto cleanup;
 
-/*
- * Store checkpoint information from index to file fd. File should be opened
- * in binary write mode.
- */
-int zran_export_index(zran_index_t *index,
-                      FILE         *fd,
-                      PyObject     *f) {
+eof:
+    ret = ferror_(fd, f) ? ZRAN_IMPORT_READ_ERROR : ZRAN_IMPORT_EOF;
+    goto cleanup;
+read_error:
+    ret = ZRAN_IMPORT_READ_ERROR;
+    goto cleanup;
+inconsistent:
+    ret = ZRAN_IMPORT_INCONSISTENT;
+    goto cleanup;
+memory_error:
+    ret = ZRAN_IMPORT_MEMORY_ERROR;
+cleanup:
+    free(window);
+    free(cmpbuf);
+    return ret;
+}
 
-    /*
-     * TODO: Endianness check for fwrite calls. Prefer little-endian to be
-     * consistent with gzip library.
-     */
 
-    /* Used for checking return value of fwrite calls. */
-    size_t f_ret;
+int _zran_import_foreign_index(zran_index_t *index,
+                               zran_index_t *new_index,
+                               uint64_t     *uncompressed_size,
+                               FILE         *fd,
+                               PyObject     *f) {
+
+    uint8_t header[16];
+    size_t  len;
+
+    if (!seekable_(fd, f) || fseek_(fd, f, 0, SEEK_SET) != 0)
+        return ZRAN_IMPORT_UNKNOWN_FORMAT;
+
+    len = fread_(header, 1, 16, fd, f);
+    if (ferror_(fd, f))
+        return ZRAN_IMPORT_READ_ERROR;
+
+    if (len == 16                                &&
+        _zran_get_uint(header, 8, 0) == 0        &&
+        memcmp(header + 8, "gzipind", 7) == 0    &&
+        (header[15] == 'x' || header[15] == 'X'))
+        return _zran_import_gztool_index(index,
+                                         new_index,
+                                         header[15] == 'X',
+                                         uncompressed_size,
+                                         fd,
+                                         f);
+
+    if (len < 8 || fseek_(fd, f, 8, SEEK_SET) != 0)
+        return ZRAN_IMPORT_UNKNOWN_FORMAT;
+
+    return _zran_import_bgzip_index(index,
+                                    new_index,
+                                    _zran_get_uint(header, 8, 0),
+                                    uncompressed_size,
+                                    fd,
+                                    f);
+}
+
 
-    /* Used for iterating over elements of zran_index_t.list. */
-    zran_point_t *point;
-    zran_point_t *list_end;
+int _zran_map_windows(zran_index_t *index,
+                      uint8_t       version,
+                      uint8_t      *dataflags,
+                      uint32_t     *extra,
+                      FILE         *fd) {
 
-    /* File flags, currently not used. Also used as a temporary variable. */
-    uint8_t flags = 0;
+#ifdef _WIN32
+    return 1;
+#else
 
-    zran_log("zran_export_index: (%lu, %lu, %u, %u, %u)\n",
-             index->compressed_size,
-             index->uncompressed_size,
-             index->spacing,
-             index->window_size,
-             index->npoints);
+    zran_mapped_window_t *mapped;
+    struct stat           st;
+    uint8_t              *map;
+    off_t                 offset;
+    uint64_t              size;
+    uint64_t              pos;
+    uint64_t              len;
+    uint32_t              nranges;
+    uint32_t              length;
+    uint32_t              owner;
+    uint32_t              i;
+    uint32_t              j;
+    uint8_t               flags;
+
+    if (fd == NULL)
+        return 1;
+
+    offset = ftello(fd);
+    if (offset < 0 || fstat(fileno(fd), &st) != 0 || st.st_size <= 0)
+        return 1;
+
+    size = st.st_size;
+    pos  = offset;
+
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(fd), 0);
+    if (map == MAP_FAILED)
+        return 1;
+
+    mapped = calloc(max(index->npoints, 1), sizeof(zran_mapped_window_t));
+    if (mapped == NULL) {
+        munmap(map, size);
+        return ZRAN_IMPORT_MEMORY_ERROR;
+    }
 
-    /* Write ID and version, and check for errors. */
-    f_ret = fwrite_(ZRAN_INDEX_FILE_ID, sizeof(ZRAN_INDEX_FILE_ID), 1, fd, f);
-    if (ferror_(fd, f)) goto fail;
-    if (f_ret != 1)     goto fail;
+    /*
+     * The mapping is released by the caller
+     * (via _zran_free_point_list) on failure.
+     */
+    index->map            = map;
+    index->map_size       = size;
+    index->mapped_windows = mapped;
+    index->nmapped        = 0;
 
-    f_ret = fwrite_(&ZRAN_INDEX_FILE_VERSION, 1, 1, fd, f);
-    if (ferror_(fd, f)) goto fail;
-    if (f_ret != 1)     goto fail;
+    for (i = 0; i < index->npoints; i++) {
 
-    /* Write flags (currently unused) */
-    f_ret = fwrite_(&flags, 1, 1, fd, f);
-    if (ferror_(fd, f)) goto fail;
-    if (f_ret != 1)     goto fail;
+        if (dataflags[i] == 0)
+            continue;
 
-    /* Write compressed size, and check for errors. */
-    f_ret = fwrite_(&index->compressed_size,
-                   sizeof(index->compressed_size), 1, fd, f);
+        /* Shared windows use the mapped window of an earlier point */
+        if (version >= 3 && dataflags[i] == 3) {
 
-    if (ferror_(fd, f)) goto fail;
-    if (f_ret != 1)     goto fail;
+            if (version >= 4) {
+                owner = extra[i];
+            }
+            else {
+                if (pos + sizeof(uint32_t) > size)
+                    return ZRAN_IMPORT_EOF;
+                memcpy(&owner, map + pos, sizeof(uint32_t));
+                pos += sizeof(uint32_t);
+            }
 
-    /* Write uncompressed size, and check for errors. */
-    f_ret = fwrite_(&index->uncompressed_size,
-                   sizeof(index->uncompressed_size), 1, fd, f);
+            if (owner >= i || index->windows[owner] == NULL)
+                return ZRAN_IMPORT_FAIL;
 
-    if (ferror_(fd, f)) goto fail;
-    if (f_ret != 1)     goto fail;
+            index->windows[i] = index->windows[owner];
+            continue;
+        }
 
-    /* Write spacing, and check for errors. */
-    f_ret = fwrite_(&index->spacing, sizeof(index->spacing), 1, fd, f);
+        /*
+         * The length of a window record is in the point
+         * table of compact files. Otherwise, windows are
+         * either full, or sparse, in which case the length
+         * is calculated from the ranges of the window (see
+         * _zran_pack_sparse_window).
+         */
+        if (version >= 4) {
+            len   = extra[i];
+            flags = dataflags[i];
 
-    if (ferror_(fd, f)) goto fail;
-    if (f_ret != 1)     goto fail;
+            if (len == 0 || len > compressBound(index->window_size))
+                return ZRAN_IMPORT_FAIL;
+        }
 
-    /* Write window size, and check for errors. */
-    f_ret = fwrite_(&index->window_size, sizeof(index->window_size), 1, fd, f);
+        else if (version >= 2 && dataflags[i] == 2) {
 
-    if (ferror_(fd, f)) goto fail;
-    if (f_ret != 1)     goto fail;
+            if (pos + sizeof(uint32_t) > size)
+                return ZRAN_IMPORT_EOF;
 
-    /* Write number of points, and check for errors. */
-    f_ret = fwrite_(&index->npoints, sizeof(index->npoints), 1, fd, f);
+            memcpy(&nranges, map + pos, sizeof(uint32_t));
 
-    if (ferror_(fd, f)) goto fail;
-    if (f_ret != 1)     goto fail;
+            len = sizeof(uint32_t) + 2 * sizeof(uint32_t) * (uint64_t)nranges;
+            if (len >= index->window_size) return ZRAN_IMPORT_FAIL;
+            if (pos + len > size)          return ZRAN_IMPORT_EOF;
 
-    /*
-     * We will make two passes over points list now. In the first pass, offset
-     * mapping information of each point will be written. In the second pass,
-     * checkpoint snapshot data will be written. This will keep offsets bundled
-     * together, which enables user to read all offset mappings in one pass.
-     */
+            for (j = 0; j < nranges; j++) {
+                memcpy(&length,
+                       map + pos + sizeof(uint32_t) * (2 + 2 * j),
+                       sizeof(uint32_t));
+                len += length;
+            }
 
-    /* Write all points iteratively for checkpoint offset mapping. */
-    point    = index->list;
-    list_end = index->list + index->npoints;
-    while (point < list_end) {
+            if (len >= index->window_size)
+                return ZRAN_IMPORT_FAIL;
 
-        /* Write compressed offset, and check for errors. */
-        f_ret = fwrite_(&point->cmp_offset,
-                        sizeof(point->cmp_offset), 1, fd, f);
-        if (ferror_(fd, f)) goto fail;
-        if (f_ret != 1)     goto fail;
+            flags = 2;
+        }
 
-        /* Write uncompressed offset, and check for errors. */
-        f_ret = fwrite_(&point->uncmp_offset,
-                        sizeof(point->uncmp_offset), 1, fd, f);
-        if (ferror_(fd, f)) goto fail;
-        if (f_ret != 1)     goto fail;
+        else {
+            len   = index->window_size;
+            flags = 1;
+        }
 
-        /* Write bit offset, and check for errors. */
-        f_ret = fwrite_(&point->bits, sizeof(point->bits), 1, fd, f);
-        if (ferror_(fd, f)) goto fail;
-        if (f_ret != 1)     goto fail;
+        /* Uncompressed full windows are used straight from the file */
+        if (flags == 1 && len != index->window_size)
+            return ZRAN_IMPORT_FAIL;
 
-        /* Write data flag, and check for errors. */
-        flags = (point->data != NULL) ? 1 : 0;
-        f_ret = fwrite_(&flags, 1, 1, fd, f);
-        if (ferror_(fd, f)) goto fail;
-        if (f_ret != 1)     goto fail;
+        if (pos + len > size)
+            return ZRAN_IMPORT_EOF;
 
-        zran_log("zran_export_index: (p%lu, %lu, %lu, %u, %u)\n",
-                 (index->npoints - (list_end - point)), // point index
-                 point->cmp_offset,
-                 point->uncmp_offset,
-                 point->bits,
-                 flags);
+        mapped[index->nmapped].record = map + pos;
+        mapped[index->nmapped].len    = len;
+        mapped[index->nmapped].owner  = i;
+        mapped[index->nmapped].flags  = flags;
 
-        point++;
+        index->windows[i] = (uint8_t *)&(mapped[index->nmapped]);
+        index->nmapped++;
+        pos += len;
     }
 
-    /*
-     * Now write out the window data for every point. No data is written for
-     * points which don't have any data (e.g. at stream boundaries).
-     */
-    point    = index->list;
-    list_end = index->list + index->npoints;
-    while (point < list_end) {
+    /* Anything after the windows is read as normal */
+    if (fseeko(fd, pos, SEEK_SET) != 0)
+        return ZRAN_IMPORT_READ_ERROR;
 
-        if (point->data == NULL) {
-            point++;
-            continue;
-        }
-
-        /* Write checkpoint data, and check for errors. */
-        f_ret = fwrite_(point->data, index->window_size, 1, fd, f);
-        if (ferror_(fd, f)) goto fail;
-        if (f_ret != 1)     goto fail;
+    zran_log("_zran_map_windows: (%u windows, %llu bytes)\n",
+             index->nmapped, size);
 
-        /* Print first and last three bytes of the checkpoint window. */
-        zran_log("zran_export_index: "
-                     "(%lu, [%02x %02x %02x...%02x %02x %02x])\n",
-                 (index->npoints - (list_end - point)), // point index
-                 point->data[0],
-                 point->data[1],
-                 point->data[2],
-                 point->data[index->window_size - 3],
-                 point->data[index->window_size - 2],
-                 point->data[index->window_size - 1]);
+    return ZRAN_IMPORT_OK;
+#endif
+}
 
-        /* Done with this point. Proceed to next one. */
-        point++;
-    }
 
-    zran_log("zran_export_index: done\n");
+/* Release the index file mapping. */
+void _zran_unmap_windows(zran_index_t *index) {
 
-    /*
-     * It is important to flush written file when done, since underlying file
-     * descriptor can be closed by Python code before having a chance to flush.
-     */
-    f_ret = fflush_(fd, f);
-    if (ferror_(fd, f)) goto fail;
-    if (f_ret != 0)     goto fail;
+#ifndef _WIN32
+    if (index->map != NULL)
+        munmap(index->map, index->map_size);
+#endif
 
-    return ZRAN_EXPORT_OK;
+    free(index->mapped_windows);
 
-fail:
-    return ZRAN_EXPORT_WRITE_ERROR;
+    index->map            = NULL;
+    index->map_size       = 0;
+    index->mapped_windows = NULL;
+    index->nmapped        = 0;
 }
 
+
 /*
  * Load checkpoint information from file fd to index. File should be opened in
  * binary read mode.
@@ -3178,16 +13019,25 @@ int zran_import_index(zran_index_t *index,
                       FILE         *fd,
                       PyObject     *f) {
 
+    return zran_import_index_flags(index, fd, f, 0);
+}
+
+
+/* Load checkpoint information, with flags controlling the import. */
+int zran_import_index_flags(zran_index_t *index,
+                            FILE         *fd,
+                            PyObject     *f,
+                            uint16_t      import_flags) {
+
     /* Used for checking return value of fread calls. */
     size_t f_ret;
 
     /* Return value of function if a failure happens. */
     int fail_ret;
+    int ret;
 
-    /* Used for iterating over elements of zran_index_t.list. */
-    uint64_t      i;
-    zran_point_t *point;
-    zran_point_t *list_end;
+    /* Used for iterating over the index points. */
+    uint32_t i;
 
     /*
      * Used to store flags for each point - allocated once we
@@ -3195,6 +13045,12 @@ int zran_import_index(zran_index_t *index,
      */
     uint8_t *dataflags = NULL;
 
+    /*
+     * Window record length, or shared window owner,
+     * for each point in a compact (version 4) file.
+     */
+    uint32_t *extra = NULL;
+
     /*
      * Used for checking file ID, version, and
      * flags at the beginning of the file. Flags
@@ -3202,22 +13058,40 @@ int zran_import_index(zran_index_t *index,
      */
     char    file_id[sizeof(ZRAN_INDEX_FILE_ID)];
     uint8_t version;
+    uint8_t file_flags;
     uint8_t flags;
+    uint8_t bits;
 
     /*
      * Data fields that will be read from the file. They aren't stored directly
      * to index struct to keep original index in case of any failures while
-     * reading those data.
+     * reading those data. The new points are loaded into the point arrays
+     * of new_index - none of its other fields are used, apart from the
+     * window size, flags and scratch buffer, which are needed to store
+     * windows.
+     */
+    uint64_t     compressed_size;
+    uint64_t     uncompressed_size;
+    uint32_t     spacing;
+    uint32_t     window_size;
+    uint32_t     npoints;
+    uint32_t     nspans = 0;
+    zran_index_t new_index;
+
+    /*
+     * Location that each window is read into, and
+     * the stored window data, or the entry for the
+     * earlier point that a shared window belongs to.
      */
-    uint64_t      compressed_size;
-    uint64_t      uncompressed_size;
-    uint32_t      spacing;
-    uint32_t      window_size;
-    uint32_t      npoints;
-    zran_point_t *new_list = NULL;
+    uint8_t             *window;
+    uint8_t             *stored;
+    uint32_t             owner;
+    zran_window_entry_t *entry;
 
-    /* CRC validation is currently not possible on an imported index */
-    index->flags |= ZRAN_SKIP_CRC_CHECK;
+    memset(&new_index, 0, sizeof(zran_index_t));
+    zran_arena_init(&(new_index.arena),
+                    0,
+                    (index->flags & ZRAN_HUGE_PAGES) != 0);
 
     /* Check if file is read only. */
     if (!is_readonly(fd, f)) goto fail;
@@ -3228,9 +13102,32 @@ int zran_import_index(zran_index_t *index,
     if (ferror_(fd, f))      goto read_error;
     if (f_ret != 1)          goto read_error;
 
-    /* Verify file ID. */
-    if (memcmp(file_id, ZRAN_INDEX_FILE_ID, sizeof(file_id)))
-        goto unknown_format;
+    /*
+     * Files without our ID may have been written by
+     * another tool. These have no window data to
+     * map, so are always loaded in full.
+     */
+    if (memcmp(file_id, ZRAN_INDEX_FILE_ID, sizeof(file_id))) {
+
+        new_index.window_size = index->window_size;
+        new_index.flags       = index->flags;
+
+        ret = _zran_import_foreign_index(index,
+                                         &new_index,
+                                         &uncompressed_size,
+                                         fd,
+                                         f);
+        if (ret != ZRAN_IMPORT_OK) {
+            fail_ret = ret;
+            goto cleanup;
+        }
+
+        npoints     = new_index.npoints;
+        spacing     = index->spacing;
+        window_size = index->window_size;
+        file_flags  = 0;
+        goto spans;
+    }
 
     /* Read file format version */
     f_ret = fread_(&version, 1, 1, fd, f);
@@ -3242,8 +13139,8 @@ int zran_import_index(zran_index_t *index,
     if (version > ZRAN_INDEX_FILE_VERSION)
         goto unsupported_version;
 
-    /* Read flags (currently unused) */
-    f_ret = fread_(&flags, 1, 1, fd, f);
+    /* Read flags */
+    f_ret = fread_(&file_flags, 1, 1, fd, f);
     if (feof_(fd, f, f_ret)) goto eof;
     if (ferror_(fd, f))      goto read_error;
     if (f_ret != 1)          goto read_error;
@@ -3313,17 +13210,26 @@ int zran_import_index(zran_index_t *index,
              npoints);
 
     /*
-     * At this step, the number of points is known. Allocate space for new list
-     * of points. This pointer should be cleaned up before exit in case of
+     * At this step, the number of points is known. Allocate space for new
+     * points. These arrays should be cleaned up before exit in case of
      * failure.
      *
      * The index file is allowed to contain 0 points, in which case we
-     * initialise the point list to 8 (same as in zran_init).
+     * allocate space for 8 points (same as in zran_init).
      */
-    new_list = calloc(1, sizeof(zran_point_t) * max(npoints, 8));
-    if (new_list == NULL)
+    if (_zran_resize_point_list(&new_index, max(npoints, 8)) != 0)
         goto memory_error;
 
+    new_index.window_size = window_size;
+    new_index.flags       = index->flags;
+
+    /*
+     * Window pointers are filled in below - points
+     * which have no data keep a NULL pointer.
+     */
+    memset(new_index.windows, 0, sizeof(uint8_t *) * new_index.size);
+    new_index.npoints = npoints;
+
     /*
      * Allocate space for the data flag for each point - whether or not
      * there is data associated with it
@@ -3332,65 +13238,109 @@ int zran_import_index(zran_index_t *index,
     if (dataflags == NULL)
         goto memory_error;
 
-    /* Read new points iteratively for reading offset mapping. */
-    for (i = 0, point = new_list; i < npoints; i++, point++) {
+    /*
+     * Compact index files (version 4) have a variable
+     * length point table, which is read separately.
+     */
+    if (version >= 4) {
+
+        extra = calloc(max(npoints, 1), sizeof(uint32_t));
+        if (extra == NULL)
+            goto memory_error;
 
-        /* Read compressed offset, and check for errors. */
-        f_ret = fread_(&point->cmp_offset,
-                       sizeof(point->cmp_offset), 1, fd, f);
-        if (feof_(fd, f, f_ret)) goto eof;
-        if (ferror_(fd, f))      goto read_error;
-        if (f_ret != 1)          goto read_error;
+        ret = _zran_import_compact_points(&new_index,
+                                          npoints,
+                                          dataflags,
+                                          extra,
+                                          fd,
+                                          f);
+        if (ret != ZRAN_IMPORT_OK) {
+            fail_ret = ret;
+            goto cleanup;
+        }
+    }
 
-        /* Read uncompressed offset, and check for errors. */
-        f_ret = fread_(&point->uncmp_offset,
-                       sizeof(point->uncmp_offset), 1, fd, f);
-        if (feof_(fd, f, f_ret)) goto eof;
-        if (ferror_(fd, f))      goto read_error;
-        if (f_ret != 1)          goto read_error;
+    else {
+        /* Read new points iteratively for reading offset mapping. */
+        for (i = 0; i < npoints; i++) {
 
-        /* Read bit offset, and check for errors. */
-        f_ret = fread_(&point->bits, sizeof(point->bits), 1, fd, f);
-        if (feof_(fd, f, f_ret)) goto eof;
-        if (ferror_(fd, f))      goto read_error;
-        if (f_ret != 1)          goto read_error;
+            /* Read compressed offset, and check for errors. */
+            f_ret = fread_(&new_index.cmp_offsets[i],
+                           sizeof(uint64_t), 1, fd, f);
+            if (feof_(fd, f, f_ret)) goto eof;
+            if (ferror_(fd, f))      goto read_error;
+            if (f_ret != 1)          goto read_error;
+
+            /* Read uncompressed offset, and check for errors. */
+            f_ret = fread_(&new_index.uncmp_offsets[i],
+                           sizeof(uint64_t), 1, fd, f);
+            if (feof_(fd, f, f_ret)) goto eof;
+            if (ferror_(fd, f))      goto read_error;
+            if (f_ret != 1)          goto read_error;
 
-        /* Read data flag (added in version 1), and check for errors. */
-        if (version >= 1) {
-            f_ret = fread_(&flags, 1, 1, fd, f);
+            /* Read bit offset, and check for errors. */
+            f_ret = fread_(&bits, sizeof(bits), 1, fd, f);
             if (feof_(fd, f, f_ret)) goto eof;
             if (ferror_(fd, f))      goto read_error;
             if (f_ret != 1)          goto read_error;
 
+            _zran_set_point_bits(&new_index, i, bits);
+
+            /* Read data flag (added in version 1), and check for errors. */
+            if (version >= 1) {
+                f_ret = fread_(&flags, 1, 1, fd, f);
+                if (feof_(fd, f, f_ret)) goto eof;
+                if (ferror_(fd, f))      goto read_error;
+                if (f_ret != 1)          goto read_error;
+
+                /*
+                 * The data flag determines whether or not any window data
+                 * is associated with this point. We store it in dataflags
+                 * to indicate to the loop below that this point has data
+                 * to be loaded.
+                 */
+            }
             /*
-             * The data flag determines whether or not any window data
-             * is associated with this point. We set point->data to 1
-             * to indicate to the loop below that this point has data
-             * to be loaded.
+             * In index file version 0, the first point
+             * has no data, but all other points do.
              */
+            else {
+                flags = (i == 0) ? 0 : 1;
+            }
+
+            dataflags[i] = flags;
+
+            zran_log("zran_import_index: (p%u, %lu, %lu, %u, %u)\n",
+                     i,
+                     new_index.cmp_offsets[i],
+                     new_index.uncmp_offsets[i],
+                     bits,
+                     flags);
         }
-        /*
-         * In index file version 0, the first point
-         * has no data, but all other points do.
-         */
-        else {
-            flags = (point == new_list) ? 0 : 1;
-        }
+    }
 
-        dataflags[i] = flags;
+    /*
+     * Windows are left in the file if the import
+     * is lazy - if the file can't be mapped, they
+     * are loaded as normal.
+     */
+    if (import_flags & ZRAN_IMPORT_LAZY) {
 
-        zran_log("zran_import_index: (p%lu, %lu, %lu, %u, %u)\n",
-                 i,
-                 point->cmp_offset,
-                 point->uncmp_offset,
-                 point->bits,
-                 flags);
+        ret = _zran_map_windows(&new_index, version, dataflags, extra, fd);
+
+        if (ret == ZRAN_IMPORT_OK)
+            goto spans;
+
+        if (ret != 1) {
+            fail_ret = ret;
+            goto cleanup;
+        }
     }
 
     /*
      * Now loop through and load the window data for all index points.
      */
-    for (i = 0, point = new_list; i < npoints; i++, point++) {
+    for (i = 0; i < npoints; i++) {
 
         /*
          * There is no data associated with this point - it is either
@@ -3401,40 +13351,166 @@ int zran_import_index(zran_index_t *index,
         }
 
         /*
-         * Allocate space for checkpoint data. These pointers in each point
-         * should be cleaned up in case of any failures.
+         * Shared windows (added in version 3) are stored
+         * as the position of an earlier point which has
+         * the same window.
          */
-        point->data = calloc(1, window_size);
-        if (point->data == NULL)
-            goto memory_error;
+        if (version >= 3 && dataflags[i] == 3) {
+
+            /*
+             * In compact files, the owner is
+             * stored in the point table.
+             */
+            if (version >= 4) {
+                owner = extra[i];
+            }
+            else {
+                f_ret = fread_(&owner, sizeof(owner), 1, fd, f);
+                if (feof_(fd, f, f_ret) && i < npoints - 1) goto eof;
+                if (ferror_(fd, f))                         goto read_error;
+                if (f_ret != 1)                             goto read_error;
+            }
+
+            if (owner >= i || new_index.windows[owner] == NULL)
+                goto fail;
+
+            entry = _zran_get_window_entry(&new_index,
+                                           new_index.windows[owner]);
+            if (entry == NULL)
+                goto fail;
+
+            entry->refcount++;
+            new_index.windows[i] = entry->data;
+
+            zran_log("zran_import_index: (%u, shared with %u)\n", i, owner);
+            continue;
+        }
 
         /*
-         * Read checkpoint data, and check for errors. End of file can be
-         * reached just after the last element, so it's not an error for
-         * the last element.
+         * Windows in compact files (version 4) are
+         * stored as records, which may be compressed.
          */
-        f_ret = fread_(point->data, window_size, 1, fd, f);
-        if (feof_(fd, f, f_ret) && i < npoints - 1) goto eof;
-        if (ferror_(fd, f))                         goto read_error;
-        if (f_ret != 1)                             goto read_error;
+        if (version >= 4) {
+            ret = _zran_import_window_record(&new_index,
+                                             &stored,
+                                             extra[i],
+                                             dataflags[i],
+                                             i == npoints - 1,
+                                             fd,
+                                             f);
+            if (ret != ZRAN_IMPORT_OK) {
+                fail_ret = ret;
+                goto cleanup;
+            }
+        }
 
         /*
-         * TODO: If there are still more data after importing is done, it
-         * is silently ignored. It might be handled by other means.
+         * Sparse windows (added in version 2) are stored
+         * in their packed form (see _zran_pack_sparse_window).
          */
+        else if (version >= 2 && dataflags[i] == 2) {
+            ret = _zran_import_sparse_window(&new_index,
+                                             &stored,
+                                             i == npoints - 1,
+                                             fd,
+                                             f);
+            if (ret != ZRAN_IMPORT_OK) {
+                fail_ret = ret;
+                goto cleanup;
+            }
+        }
 
-        /* Print first and last three bytes of the checkpoint window. */
-        zran_log("zran_import_index:"
-                     "(%lu, [%02x %02x %02x...%02x %02x %02x])\n",
-                 i,
-                 point->data[0],
-                 point->data[1],
-                 point->data[2],
-                 point->data[window_size - 3],
-                 point->data[window_size - 2],
-                 point->data[window_size - 1]);
+        else {
+
+            /*
+             * Allocate space for checkpoint data, and read it
+             * straight into the arena. The arena is cleaned up
+             * in case of any failures. If windows are stored
+             * with a header, we read into the scratch buffer
+             * instead, and then store it in the arena.
+             */
+            if (window_has_header(&new_index)) {
+                window = _zran_window_buf(&new_index);
+            }
+            else {
+                window = zran_arena_alloc(&(new_index.arena), window_size);
+            }
+
+            if (window == NULL)
+                goto memory_error;
+
+            /*
+             * Read checkpoint data, and check for errors. End of file can
+             * be reached just after the last element, so it's not an error
+             * for the last element.
+             */
+            f_ret = fread_(window, window_size, 1, fd, f);
+            if (feof_(fd, f, f_ret) && i < npoints - 1) goto eof;
+            if (ferror_(fd, f))                         goto read_error;
+            if (f_ret != 1)                             goto read_error;
+
+            if (window_has_header(&new_index)) {
+                stored = _zran_store_window(&new_index, window, NULL);
+                if (stored == NULL)
+                    goto memory_error;
+            }
+            else {
+                stored = window;
+            }
+
+            /* Print first and last three bytes of the checkpoint window. */
+            zran_log("zran_import_index:"
+                         "(%u, [%02x %02x %02x...%02x %02x %02x])\n",
+                     i,
+                     window[0],
+                     window[1],
+                     window[2],
+                     window[window_size - 3],
+                     window[window_size - 2],
+                     window[window_size - 1]);
+        }
+
+        /*
+         * Identical windows are shared, even
+         * if they were not shared in the file.
+         */
+        new_index.windows[i] = _zran_share_window(&new_index, stored, i);
+        if (new_index.windows[i] == NULL)
+            goto memory_error;
+
+    }
+
+spans:
+    /*
+     * The CRCs of the spans between points
+     * follow the window data, if present.
+     */
+    if (file_flags & ZRAN_INDEX_FILE_SPAN_CRCS) {
+
+        f_ret = fread_(&nspans, sizeof(nspans), 1, fd, f);
+        if (feof_(fd, f, f_ret)) goto eof;
+        if (ferror_(fd, f))      goto read_error;
+        if (f_ret != 1)          goto read_error;
+
+        if (nspans > 0 && nspans >= npoints)
+            goto fail;
+
+        if (nspans > 0) {
+            f_ret = fread_(new_index.span_crcs,
+                           sizeof(uint32_t) * nspans, 1, fd, f);
+            if (feof_(fd, f, f_ret)) goto eof;
+            if (ferror_(fd, f))      goto read_error;
+            if (f_ret != 1)          goto read_error;
+        }
+
+        zran_log("zran_import_index: (%u span CRCs)\n", nspans);
     }
 
+    /*
+     * TODO: If there are still more data after importing is done, it
+     * is silently ignored. It might be handled by other means.
+     */
+
     /* There are no errors, it's safe to overwrite existing index data now. */
 
     /* If a new uncompressed_size is read, update current index. */
@@ -3453,40 +13529,75 @@ int zran_import_index(zran_index_t *index,
     }
 
     /*
-     * Now, we will release current checkpoint list of the index, and then
-     * point to the new list.
+     * The index is being replaced, so
+     * start afresh on the next read.
      */
+    _zran_free_cursor(&(index->reader));
 
     /*
-     * Initialize point to the second element of the list, and list_end to the
-     * end of the list. We initialize to the second element, because first
-     * element does not keep checkpoint data.
+     * Now, we will release the current points of the index, and then
+     * replace them with the new points.
      */
-    point    = index->list + 1;
-    list_end = index->list + index->npoints;
+    _zran_free_point_list(index);
+
+    /* The old points are dead, long live the new points! */
+    index->cmp_offsets   = new_index.cmp_offsets;
+    index->uncmp_offsets = new_index.uncmp_offsets;
+    index->bits          = new_index.bits;
+    index->windows       = new_index.windows;
+    index->span_crcs     = new_index.span_crcs;
+    index->nspans        = nspans;
+    index->arena         = new_index.arena;
+    index->npoints       = npoints;
+    index->generation++;
 
-    while (point < list_end) {
-        free(point->data);
-        point++;
-    }
+    /*
+     * Uncompressed data can't be validated
+     * without the CRCs of the spans between
+     * points - the gzip stream CRCs only
+     * cover whole streams.
+     */
+    if (nspans == 0)
+        index->flags |= ZRAN_SKIP_CRC_CHECK;
 
-    /* Now release the old list. */
-    free(index->list);
+    index->window_table       = new_index.window_table;
+    index->window_table_size  = new_index.window_table_size;
+    index->window_table_count = new_index.window_table_count;
+    index->window_bytes       = new_index.window_bytes;
+    index->evict_stride       = 1;
 
-    /* The old list is dead, long live the new list! */
-    index->list    = new_list;
-    index->npoints = npoints;
+    index->map            = new_index.map;
+    index->map_size       = new_index.map_size;
+    index->mapped_windows = new_index.mapped_windows;
+    index->nmapped        = new_index.nmapped;
+
+    /*
+     * The scratch buffer is sized according
+     * to the window size, which may have
+     * changed.
+     */
+    free(index->window_buf);
+    index->window_buf    = new_index.window_buf;
 
     /*
      * Let's not forget to update the size as well.
-     * If npoints is 0, the list will have been
+     * If npoints is 0, the arrays will have been
      * initialised to allow space for 8 points.
      */
-    index->size    = max(npoints, 8);
+    index->size          = new_index.size;
 
     zran_log("zran_import_index: done\n");
 
     free(dataflags);
+    free(extra);
+
+    /*
+     * The imported index is complete and
+     * usable at this point, even if it
+     * can't be brought within budget.
+     */
+    if (_zran_enforce_window_budget(index) != 0)
+        return ZRAN_IMPORT_MEMORY_ERROR;
 
     return ZRAN_IMPORT_OK;
 
@@ -3511,41 +13622,23 @@ memory_error:
     fail_ret = ZRAN_IMPORT_MEMORY_ERROR;
     goto cleanup;
 
-unknown_format:
-    fail_ret = ZRAN_IMPORT_UNKNOWN_FORMAT;
-    goto cleanup;
-
 unsupported_version:
     fail_ret = ZRAN_IMPORT_UNSUPPORTED_VERSION;
     goto cleanup;
 
 cleanup:
-    if (new_list != NULL) {
-
-        /*
-         * Initialize point to the second element of the list, and list_end to
-         * the end of the list. We initialize to the second element, because
-         * first element does not keep checkpoint data.
-         */
-        point    = new_list + 1;
-        list_end = new_list + npoints;
-
-        /*
-         * Release until the end of list or the first NULL data pointer,
-         * whichever comes first.
-         */
-        while (point < list_end && point->data != NULL) {
-            free(point->data);
-            point++;
-        }
-
-        /* Release the list itself. */
-        free(new_list);
-    }
+    /*
+     * Release any windows that have been loaded,
+     * the arrays, and the scratch buffer.
+     */
+    _zran_free_point_list(&new_index);
+    free(new_index.window_buf);
 
     if (dataflags != NULL) {
         free(dataflags);
     }
 
+    free(extra);
+
     return fail_ret;
 }
@@ -11,23 +11,307 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+#include "zlib.h"
+#include "zran_arena.h"
+
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
 struct _zran_index;
 struct _zran_point;
+struct _zran_reader;
+struct _zran_window_entry;
+struct _zran_mapped_window;
+struct _zran_footer_log;
+struct _zran_readahead;
+struct _zran_pipeline;
+
 
+typedef struct _zran_index         zran_index_t;
+typedef struct _zran_point         zran_point_t;
+typedef struct _zran_reader        zran_reader_t;
+typedef struct _zran_window_entry  zran_window_entry_t;
+typedef struct _zran_mapped_window zran_mapped_window_t;
+typedef struct _zran_footer_log    zran_footer_log_t;
+typedef struct _zran_readahead     zran_readahead_t;
+typedef struct _zran_pipeline      zran_pipeline_t;
+
+
+/*
+ * Number of decoded windows that each reader keeps in its cache,
+ * when ZRAN_COMPRESS_WINDOWS or ZRAN_SPARSE_WINDOWS is active.
+ */
+#define ZRAN_WINDOW_CACHE_SIZE 4
 
-typedef struct _zran_index zran_index_t;
-typedef struct _zran_point zran_point_t;
 
 /*
  * These values may be passed in as flags to the zran_init function.
  * They are specified as bit-masks, rather than bit locations.
  */
 enum {
-  ZRAN_AUTO_BUILD     = 1,
-  ZRAN_SKIP_CRC_CHECK = 2,
+  ZRAN_AUTO_BUILD       = 1,
+  ZRAN_SKIP_CRC_CHECK   = 2,
+  ZRAN_HUGE_PAGES       = 4,
+  ZRAN_COMPRESS_WINDOWS = 8,
+  ZRAN_SPARSE_WINDOWS   = 16,
+};
+
+
+/*
+ * Struct representing the seek/read state of a single stream of
+ * decompressed data. A reader refers to an index, and has its own seek
+ * location, read buffer and z_stream, so multiple readers may be used
+ * concurrently (e.g. from different threads) with the same index, as long
+ * as the index is not modified while they are in use. Readers which are
+ * given a Python file-like must each have their own one, but readers
+ * given a FILE may share it, other than on Windows (see cmp_pos).
+ *
+ * Every index contains one reader, which is used by zran_seek and
+ * zran_read. Additional readers are created with zran_reader_create.
+ * None of the fields in this struct should ever need to be accessed or
+ * modified directly, except for fd and f, which may be changed in
+ * between calls (e.g. to re-open the file).
+ */
+struct _zran_reader {
+
+    /*
+     * The index that this reader is using.
+     */
+    zran_index_t *index;
+
+    /*
+     * Handle to the compressed file.
+     */
+    FILE *fd;
+
+    /*
+     * Handle to the compressed file object.
+     */
+    PyObject *f;
+
+    /*
+     * Position in the compressed data, and
+     * status of the most recent read. These
+     * are used instead of the FILE position
+     * when fd is not NULL - the compressed
+     * data is then read with pread, so that
+     * multiple readers can share a single
+     * file handle (see _zran_fread).
+     */
+    uint64_t cmp_pos;
+    uint8_t  cmp_error;
+    uint8_t  cmp_eof;
+
+    /*
+     * Most recently requested seek/read
+     * location into the uncompressed data
+     * stream - this is used to keep track
+     * of where the calling code thinks it
+     * is in the (uncompressed) file.
+     */
+    uint64_t uncmp_seek_offset;
+
+    /*
+     * Position, in the index point list,
+     * of the point that was most recently
+     * looked up by this reader. This is
+     * checked first on subsequent lookups.
+     */
+    uint32_t last_point;
+
+    /*
+     * All of the fields after this point are used
+     * by the internal _zran_inflate function.
+     */
+
+    /*
+     * Reference to a file input
+     * buffer of size readbuf_size.
+     */
+    uint8_t *readbuf;
+
+    /*
+     * An offset into readbuf.
+     */
+    uint32_t readbuf_offset;
+
+    /*
+     * The current end of the readbuf contents.
+     */
+    uint32_t readbuf_end;
+
+    /*
+     * Current offsets into the uncompressed and
+     * compressed data streams.
+     */
+    uint64_t inflate_cmp_offset;
+    uint64_t inflate_uncmp_offset;
+
+    /*
+     * Uncompressed offset at the point that the
+     * last GZIP stream ended. This is updated as
+     * more data is read and uncompressed, and
+     * used to determine whether the CRC/size
+     * check for the current stream has already
+     * been performed.
+     */
+    uint64_t last_stream_ended;
+
+    /*
+     * CRC-32 checksum and size (number of
+     * bytes, modulo 2^32) of the uncompressed
+     * data in the current gzip stream, not
+     * used if ZRAN_SKIP_CRC_CHECK is active.
+     * The CRC and size are incrementally
+     * calculated as data is read in. When the
+     * end of a gzip stream is reached, the
+     * calculated CRC and size are compared
+     * against the CRC and size in the gzip
+     * footer, and an error is returned if
+     * they don't match.
+     */
+    uint32_t stream_crc32;
+    uint32_t stream_size;
+    uint8_t  validating;
+
+    /*
+     * CRC-32 checksum of the uncompressed data
+     * that has been inflated since index point
+     * span_point (valid while span_active is
+     * non-zero, which is not the case if
+     * ZRAN_SKIP_CRC_CHECK is active). When the
+     * next point is reached, the CRC is compared
+     * against the CRC of the span between the
+     * two points, if it is known (see
+     * zran_index_t.span_crcs). While the index
+     * is being built, it is instead stored as
+     * the CRC of that span.
+     */
+    uint32_t span_crc32;
+    uint32_t span_point;
+    uint8_t  span_active;
+
+    /*
+     * Used by zran_verify - if not NULL, the
+     * CRC and size in the footer of each gzip
+     * stream that is passed through are
+     * recorded here.
+     */
+    zran_footer_log_t *footers;
+
+    /*
+     * Used while the index is being expanded
+     * - if not NULL, compressed data is read
+     * ahead into a ring of buffers by an I/O
+     * thread, and passed to zlib from there
+     * (see _zran_read_data_from_file).
+     */
+    zran_pipeline_t *pipeline;
+
+    /*
+     * Inflation cursor. zran_read leaves the
+     * z_stream it was using (along with the
+     * readbuf and the offsets above) alive
+     * when it returns, so that a subsequent
+     * call which starts at or shortly after
+     * the location where the previous call
+     * finished can carry on inflating from
+     * there, instead of restarting from the
+     * nearest index point. cursor_active is
+     * non-zero while the cursor is valid.
+     */
+    z_stream cursor;
+    uint8_t  cursor_active;
+
+    /*
+     * Small LRU cache of decoded windows, used
+     * when the index was created with the
+     * ZRAN_COMPRESS_WINDOWS or ZRAN_SPARSE_WINDOWS
+     * flags. Each entry is keyed
+     * by the (compressed) window data pointer of the
+     * point it belongs to, and is only valid while
+     * window_cache_generation is equal to the index
+     * generation. Windows are allocated on demand.
+     */
+    uint8_t  *window_cache_keys[ ZRAN_WINDOW_CACHE_SIZE];
+    uint8_t  *window_cache[      ZRAN_WINDOW_CACHE_SIZE];
+    uint64_t  window_cache_used[ ZRAN_WINDOW_CACHE_SIZE];
+    uint64_t  window_cache_clock;
+    uint32_t  window_cache_generation;
+
+    /*
+     * Background readahead thread, or NULL if
+     * readahead is not active for this reader
+     * (see zran_readahead_start).
+     */
+    zran_readahead_t *readahead;
+};
+
+
+/*
+ * Entry in the table of windows which are stored by an index (see
+ * zran_index_t.window_table).
+ */
+struct _zran_window_entry {
+
+    /*
+     * Stored window data (an entry in
+     * zran_index_t.windows), or NULL if
+     * this slot in the table is empty.
+     */
+    uint8_t *data;
+
+    /*
+     * CRC32 of the stored window data.
+     */
+    uint32_t hash;
+
+    /*
+     * Number of points which use this window.
+     */
+    uint32_t refcount;
+
+    /*
+     * The first point which uses this window -
+     * the window data was allocated for this
+     * point, and other points refer to it.
+     */
+    uint32_t owner;
+
+    /*
+     * Set when the window is used by the index
+     * reader (see zran_seek and zran_read), and
+     * cleared when the index looks for windows
+     * to evict (see zran_set_window_budget).
+     */
+    uint8_t used;
+};
+
+
+/*
+ * Describes a window which has been left in a memory-mapped index file
+ * (see ZRAN_IMPORT_LAZY).
+ */
+struct _zran_mapped_window {
+
+    /*
+     * The window record in the mapped file,
+     * and its length.
+     */
+    uint8_t *record;
+    uint32_t len;
+
+    /*
+     * The first point which uses this window.
+     */
+    uint32_t owner;
+
+    /*
+     * Data flag of the record - 1 for a full
+     * window, 2 for a sparse window, plus 4
+     * if the record is compressed.
+     */
+    uint8_t flags;
 };
 
 
@@ -59,6 +343,35 @@ struct _zran_index {
      */
     uint64_t uncompressed_size;
 
+    /*
+     * Non-zero if the file starts with a
+     * BGZF block. This is detected in
+     * zran_init, and the index of a BGZF
+     * file is built from its block headers,
+     * without inflating any data.
+     */
+    uint8_t bgzf;
+
+    /*
+     * Unique identifier of this index, used
+     * to identify its spans in the process-wide
+     * span cache (see zran_set_span_cache_budget).
+     */
+    uint64_t cache_id;
+
+    /*
+     * Identifies the compressed file in the
+     * disk span cache (see zran_set_disk_cache).
+     * This is a hash of the identity (device,
+     * inode and modification time, to the
+     * nanosecond where available) and size of
+     * the file, and of data at its start and
+     * end, so is the same in every process. It
+     * is calculated the first time the disk
+     * cache is used, and is 0 until then.
+     */
+    uint64_t disk_key;
+
     /*
      * Spacing size in bytes, relative to the
      * uncompressed data stream, between adjacent
@@ -92,88 +405,139 @@ struct _zran_index {
 
     /*
      * Number of index points that can be stored -
-     * i.e. the amount allocated to the "list" field.
+     * i.e. the amount allocated to the point
+     * arrays below.
      */
     uint32_t size;
 
     /*
-     * List of index points.
+     * Index points are stored as a set of
+     * parallel arrays, rather than as an array
+     * of zran_point_t structs, so that searching
+     * the index only touches the offsets being
+     * searched. Element i of each array
+     * corresponds to point i - refer to the
+     * zran_point_t struct for a description of
+     * each field.
      */
-    zran_point_t *list;
+    uint64_t *cmp_offsets;
+    uint64_t *uncmp_offsets;
 
     /*
-     * Most recently requested seek/read
-     * location into the uncompressed data
-     * stream - this is used to keep track
-     * of where the calling code thinks it
-     * is in the (uncompressed) file.
+     * The bit offsets for each point are at
+     * most 7, so two are packed into each byte -
+     * the bits for point i are stored in the low
+     * four bits of bits[i / 2] if i is even, or
+     * in the high four bits if i is odd. The
+     * highest of the four bits is set if the
+     * window of the point has been evicted (see
+     * zran_set_window_budget).
      */
-    uint64_t uncmp_seek_offset;
+    uint8_t  *bits;
 
     /*
-     * Flags passed to zran_init
+     * Window data for each point (NULL
+     * for points which have no data -
+     * points at the start of a gzip
+     * stream, or points after which
+     * the window is never referenced).
+     * Points with identical windows
+     * share the same window data.
      */
-    uint16_t flags;
+    uint8_t **windows;
 
     /*
-     * All of the fields after this point are used
-     * by the internal _zran_inflate function.
+     * CRC-32 checksum of the uncompressed data
+     * between each point and the next one, for
+     * the first nspans points. These are
+     * calculated as the index is built, and are
+     * stored in exported index files, so that
+     * data can still be validated when it is
+     * read via an imported index.
      */
+    uint32_t *span_crcs;
+    uint32_t  nspans;
 
     /*
-     * Reference to a file input
-     * buffer of size readbuf_size.
+     * Hash table containing every stored window,
+     * used to find identical windows as points
+     * are added, and to keep track of how many
+     * points are sharing each window. The table
+     * uses open addressing, and has
+     * window_table_size slots (a power of two),
+     * window_table_count of which are in use.
      */
-    uint8_t *readbuf;
+    zran_window_entry_t *window_table;
+    uint32_t             window_table_size;
+    uint32_t             window_table_count;
 
     /*
-     * An offset into readbuf.
+     * Maximum number of bytes of window data to
+     * keep in memory (0 for no limit), and the
+     * number of bytes currently stored (see
+     * zran_set_window_budget). When windows are
+     * evicted, the windows of points which are
+     * a multiple of evict_stride are kept.
      */
-    uint32_t readbuf_offset;
+    uint64_t window_budget;
+    uint64_t window_bytes;
+    uint32_t evict_stride;
 
     /*
-     * The current end of the readbuf contents.
+     * Memory for the window data is allocated
+     * from this arena, in point order, rather
+     * than one window at a time, and is all
+     * released at once.
      */
-    uint32_t readbuf_end;
+    zran_arena_t arena;
 
     /*
-     * Current offsets into the uncompressed and
-     * compressed data streams.
+     * The windows of an index which was imported
+     * with ZRAN_IMPORT_LAZY are left in the index
+     * file, which is mapped into memory (map and
+     * map_size). The windows of such points point
+     * to one of the nmapped mapped_windows, rather
+     * than to stored window data, and are decoded
+     * from the file when they are used.
      */
-    uint64_t inflate_cmp_offset;
-    uint64_t inflate_uncmp_offset;
+    uint8_t              *map;
+    uint64_t              map_size;
+    zran_mapped_window_t *mapped_windows;
+    uint32_t              nmapped;
 
     /*
-     * Uncompressed offset at the point that the
-     * last GZIP stream ended. This is updated as
-     * more data is read and uncompressed, and
-     * used to determine whether the CRC/size
-     * check for the current stream has already
-     * been performed.
+     * Incremented whenever points are removed
+     * from the index, so that readers know to
+     * discard their cached windows.
      */
-    uint64_t last_stream_ended;
+    uint32_t generation;
 
     /*
-     * CRC-32 checksum and size (number of
-     * bytes, modulo 2^32) of the uncompressed
-     * data in the current gzip stream, not
-     * used if ZRAN_SKIP_CRC_CHECK is active.
-     * The CRC and size are incrementally
-     * calculated as data is read in. When the
-     * end of a gzip stream is reached, the
-     * calculated CRC and size are compared
-     * against the CRC and size in the gzip
-     * footer, and an error is returned if
-     * they don't match.
+     * Scratch space used to assemble and compress
+     * windows as points are added, allocated on
+     * first use.
      */
-    uint32_t stream_crc32;
-    uint32_t stream_size;
-    uint8_t  validating;
+    uint8_t *window_buf;
+
+    /*
+     * Flags passed to zran_init
+     */
+    uint16_t flags;
+
+    /*
+     * Seek/read state used by zran_seek and
+     * zran_read (and when building the index).
+     * Any number of additional readers can be
+     * created with zran_reader_create.
+     */
+    zran_reader_t reader;
 };
 
 
 /*
- * Struct representing a single seek point in the index.
+ * Struct representing a single seek point in the index. The index does not
+ * store its points in this form - a copy of any point can be retrieved with
+ * the zran_get_point function.
  */
 struct _zran_point {
 
@@ -204,7 +568,12 @@ struct _zran_point {
     /*
      * Chunk of uncompressed data preceding this point.
      * This is required to initialise decompression from
-     * this point onward.
+     * this point onward. If the index was created with
+     * ZRAN_COMPRESS_WINDOWS or ZRAN_SPARSE_WINDOWS, this
+     * is the encoded representation of the window
+     * (compressed, and/or with unused bytes removed),
+     * prefixed with a small header - zran_get_window
+     * can be used to retrieve the uncompressed window.
      */
     uint8_t  *data;
 };
@@ -235,6 +604,36 @@ struct _zran_point {
  *                          when the end of a GZIP stream is reached.
  *                          This flag is automatically set when an index
  *                          is imported from file using zran_import_index.
+ *
+ *     ZRAN_HUGE_PAGES:     Ask the kernel to back the memory used to
+ *                          store index point windows with transparent
+ *                          huge pages (via madvise(MADV_HUGEPAGE)), where
+ *                          supported.
+ *
+ *     ZRAN_COMPRESS_WINDOWS:
+ *                          Keep index point windows deflate-compressed
+ *                          in memory. Windows are decompressed when they
+ *                          are needed to start inflating from a point,
+ *                          and the most recently used ones are cached by
+ *                          each reader (see ZRAN_WINDOW_CACHE_SIZE).
+ *
+ *     ZRAN_SPARSE_WINDOWS: When an index point is created, parse the
+ *                          compressed data which follows it to find out
+ *                          which bytes of its window are referenced, and
+ *                          only store those bytes. The unreferenced
+ *                          bytes are zero-filled when the window is used,
+ *                          which does not affect the inflated data.
+ *                          This can be combined with
+ *                          ZRAN_COMPRESS_WINDOWS. If the referenced bytes
+ *                          cannot be determined (e.g. on an unseekable
+ *                          file), the full window is stored.
+ *
+ * If the file is seekable, and starts with a BGZF block (as created by
+ * bgzip/htslib), the index is built by reading the header and footer of
+ * each block, rather than by inflating the data. A point is created at the
+ * start of every block, regardless of the spacing, and none of the points
+ * have a window. If a part of the file turns out not to be a BGZF block,
+ * the index is built in the normal way.
  */
 int  zran_init(
   zran_index_t *index,        /* The index                                  */
@@ -283,6 +682,189 @@ int zran_build_index(
 );
 
 
+/*
+ * Copies the index point at position i (where 0 <= i < npoints) into the
+ * given zran_point_t struct. The data field of the copy refers to the
+ * window data owned by the index, so it is only valid until the index is
+ * next modified.
+ *
+ * Returns 0 on success, or non-0 if i is out of range.
+ */
+int zran_get_point(
+  zran_index_t *index, /* The index                    */
+  uint32_t      i,     /* Position of the point        */
+  zran_point_t *point  /* Place to store the point     */
+);
+
+
+/*
+ * Searches for the index point from which the data at the given compressed
+ * or uncompressed offset can be read - the last point at or before the
+ * offset, or the nearest earlier point if its window has been evicted. The
+ * index is not expanded. If hint is not NULL, it should contain the
+ * position of the point found by a previous search (before any evicted
+ * points were skipped), and is updated in the same way.
+ *
+ * Returns ZRAN_SEEK_OK on success, ZRAN_SEEK_NOT_COVERED if the index does
+ * not cover the offset, or ZRAN_SEEK_EOF if the offset is at or beyond the
+ * end of the file.
+ */
+int zran_find_point(
+  zran_index_t *index,      /* The index                              */
+  uint64_t      offset,     /* Offset to search for                   */
+  uint8_t       compressed, /* Non-0 if offset is a compressed offset */
+  uint32_t     *hint,       /* Position of a previously found point,
+                               or NULL                                */
+  zran_point_t *point       /* Place to store the point               */
+);
+
+
+/*
+ * Copies the uncompressed window data for the index point at position i
+ * into buf, which must be at least window_size bytes long.
+ *
+ * Returns 0 on success, or non-0 if i is out of range, if the point has
+ * no window data (including if its window has been evicted - see
+ * zran_set_window_budget), or if the window could not be decoded. The
+ * bytes of a sparse window which are not needed are set to zero.
+ */
+int zran_get_window(
+  zran_index_t *index, /* The index                    */
+  uint32_t      i,     /* Position of the point        */
+  uint8_t      *buf    /* Place to store the window    */
+);
+
+
+/*
+ * Limits the number of bytes of window data that the index keeps in
+ * memory. A budget of 0 (the default) means that there is no limit.
+ *
+ * Whenever the index is expanded beyond its budget, windows are evicted
+ * until it is back within 7/8 of the budget. Windows which have been used
+ * by zran_seek/zran_read since the last eviction are only evicted if
+ * evicting all others is not enough. Otherwise only the windows of every
+ * Nth point are kept, with N doubling whenever that is still too many, so
+ * that the remaining windows stay evenly spread throughout the index.
+ * Windows which are shared by more than one point, and the window of the
+ * last point (which is needed to expand the index), are never evicted.
+ *
+ * Points whose window has been evicted are skipped when seeking, so that
+ * the data is decompressed from the nearest earlier point which still has
+ * a window - this costs extra decompression, but no extra memory. When the
+ * index is exported, the evicted windows are re-created by decompressing
+ * the data that precedes them, so the compressed file must be seekable.
+ *
+ * As the index is modified when windows are evicted, this function must
+ * not be called while any other readers are in use.
+ *
+ * Returns 0 on success, non-0 on failure.
+ */
+int zran_set_window_budget(
+  zran_index_t *index, /* The index                                   */
+  uint64_t      budget /* Maximum number of window bytes, 0 for none  */
+);
+
+
+/*
+ * Sets a limit on the total number of bytes of window data that is kept
+ * in memory by all indexes in this process (0, the default, means that
+ * there is no limit). The limit is enforced in the same way as
+ * zran_set_window_budget - whenever an index is expanded while the total
+ * is over the limit, that index evicts its own windows, until the total is
+ * within 7/8 of the limit, or it has nothing left to evict.
+ */
+void zran_set_global_window_budget(
+  uint64_t budget /* Maximum number of window bytes, 0 for none */
+);
+
+
+/*
+ * Returns the total number of bytes of window data that is currently
+ * stored by all indexes in this process.
+ */
+uint64_t zran_global_window_bytes(void);
+
+
+/*
+ * Sets the size, in bytes, of a process-wide cache of decompressed spans
+ * (the data between a pair of index points), which is shared by all
+ * indexes (0, the default, disables the cache). When the cache is enabled,
+ * zran_read and zran_reader_read copy data from cached spans, rather than
+ * decompressing it again. A span which is not in the cache is decompressed
+ * in full and added to it, and the least recently used spans are discarded
+ * to stay within the budget. Spans larger than a quarter of the budget,
+ * and data after the last index point, are never cached.
+ *
+ * Reducing the budget discards spans immediately.
+ */
+void zran_set_span_cache_budget(
+  uint64_t budget /* Maximum number of bytes to cache, 0 for none */
+);
+
+
+/*
+ * Span cache statistics, returned by zran_span_cache_stats.
+ */
+typedef struct _zran_span_cache_stats {
+    uint64_t budget;      /* Current budget                         */
+    uint64_t bytes;       /* Number of bytes currently cached       */
+    uint64_t hits;        /* Number of reads served from the cache  */
+    uint64_t misses;      /* Number of reads which missed           */
+    uint32_t nspans;      /* Number of spans currently cached       */
+    uint64_t disk_budget; /* The same, for the disk cache (see      */
+    uint64_t disk_bytes;  /* zran_set_disk_cache)                   */
+    uint64_t disk_hits;
+    uint64_t disk_misses;
+    uint32_t disk_nspans;
+} zran_span_cache_stats_t;
+
+
+/*
+ * Enables a second, disk-backed, tier of the span cache. Spans which are
+ * decompressed by zran_read and zran_reader_read (whether or not the memory
+ * span cache is enabled) are written to files in the given directory, and
+ * are read back from there, rather than being decompressed again. When the
+ * total size of the files exceeds the budget, the least recently used files
+ * are deleted. Spans larger than a quarter of the budget are not cached.
+ *
+ * Files are identified by their identity, size and contents (see
+ * zran_index_t.disk_key), so the directory can be shared by multiple
+ * processes, and re-used by later processes - any span files which are
+ * already in the directory are added to the cache, and the least recently
+ * modified ones deleted if the directory is over budget. Spans which are
+ * read back from the cache are checked against the span CRCs of the
+ * index, so spans whose CRCs are not known (e.g. when the index was
+ * created with ZRAN_SKIP_CRC_CHECK) are not cached on disk. Only real
+ * files (not Python file-likes) are cached.
+ *
+ * Passing a NULL dir, or a budget of 0, disables the disk cache, without
+ * deleting any files.
+ *
+ * Returns 0 on success, or non-0 if the directory cannot be read, in
+ * which case the disk cache is disabled.
+ */
+int zran_set_disk_cache(
+  const char *dir,   /* Cache directory                              */
+  uint64_t    budget /* Maximum number of bytes to store, 0 for none */
+);
+
+
+/*
+ * Stores the current state of the span caches in stats. The hit and miss
+ * counters include every index in the process, and are only reset by
+ * zran_reset_span_cache_stats.
+ */
+void zran_span_cache_stats(
+  zran_span_cache_stats_t *stats /* Place to store the statistics */
+);
+
+
+/*
+ * Resets the hit and miss counters of both span caches to 0.
+ */
+void zran_reset_span_cache_stats(void);
+
+
 /* Return codes for zran_seek. */
 enum {
     ZRAN_SEEK_CRC_ERROR       = -2,
@@ -326,13 +908,13 @@ int zran_seek(
   zran_index_t  *index,   /* The index                       */
   int64_t        offset,  /* Uncompressed offset to seek to  */
   uint8_t        whence,  /* SEEK_SET, SEEK_CUR, or SEEK_END */
-  zran_point_t **point    /* Optional place to store
-                             corresponding zran_point_t      */
+  zran_point_t  *point    /* Optional place to store a copy
+                             of the corresponding point      */
 );
 
 /*
  * Returns the current seek location in the uncompressed data stream
- * (just returns zran_index_t.uncmp_seek_offset).
+ * (just returns zran_index_t.reader.uncmp_seek_offset).
  */
 uint64_t zran_tell(
   zran_index_t *index /* The index */
@@ -375,6 +957,248 @@ int64_t zran_read(
   uint64_t       len    /* Number of bytes to read   */
 );
 
+
+/*
+ * Create a new reader for the given index. The reader has its own seek
+ * location, read buffer and z_stream, and uses the given file handle
+ * (which must be a separate handle to the same file that the index
+ * was created for, if the reader is to be used concurrently with other
+ * readers). The file handles may be NULL, in which case the fd or f
+ * field of the reader must be set before it is used.
+ *
+ * Readers never expand the index - they can be used to access any part
+ * of the uncompressed data that is covered by the index (and to read
+ * sequentially from the start of the data). Any number of readers may
+ * be used concurrently with each other, but the index must not be
+ * modified (e.g. by zran_build_index, zran_import_index, or by zran_seek
+ * and zran_read with ZRAN_AUTO_BUILD active) while a reader is in use.
+ *
+ * Returns a pointer to the new reader, or NULL on failure.
+ */
+zran_reader_t * zran_reader_create(
+  zran_index_t *index, /* The index                                 */
+  FILE         *fd,    /* Open handle to the compressed file        */
+  PyObject     *f      /* Open handle to the compressed file object */
+);
+
+
+/*
+ * Frees the memory used by the given reader, including the
+ * zran_reader_t struct itself. The file handle is not closed.
+ */
+void zran_reader_free(
+  zran_reader_t *reader /* The reader */
+);
+
+
+/*
+ * Seek the reader to the specified offset in the uncompressed data
+ * stream. Identical to zran_seek, except that the index is never
+ * expanded - ZRAN_SEEK_NOT_COVERED is returned if the index does
+ * not cover the offset.
+ */
+int zran_reader_seek(
+  zran_reader_t *reader,  /* The reader                      */
+  int64_t        offset,  /* Uncompressed offset to seek to  */
+  uint8_t        whence   /* SEEK_SET, SEEK_CUR, or SEEK_END */
+);
+
+
+/*
+ * Returns the current seek location of the reader in the
+ * uncompressed data stream.
+ */
+uint64_t zran_reader_tell(
+  zran_reader_t *reader /* The reader */
+);
+
+
+/*
+ * Read len bytes from the current location of the reader in the
+ * uncompressed data stream, storing them in buf. Identical to
+ * zran_read, except that the index is never expanded -
+ * ZRAN_READ_NOT_COVERED is returned if the index does not cover
+ * the current location.
+ */
+int64_t zran_reader_read(
+  zran_reader_t *reader, /* The reader                */
+  void          *buf,    /* Buffer to store len bytes */
+  uint64_t       len     /* Number of bytes to read   */
+);
+
+
+/*
+ * Starts a background readahead thread for the given reader, or for the
+ * index's own reader (used by zran_seek and zran_read) if reader is NULL.
+ *
+ * Every read made with the reader is compared with the previous one - if
+ * the reads are sequential, or are separated by a constant stride, the
+ * thread decompresses the data that is expected to be read next into one
+ * of two buffers, while the caller is busy with the data that it has
+ * already read. Reads which are satisfied by a buffer are copied from it;
+ * all other reads are performed as normal.
+ *
+ * The thread reads from fd, which must be a separate handle to the same
+ * file, and is not closed by zran_readahead_stop. The thread only uses
+ * a copy of the index points that it needs, so the index may be modified
+ * (e.g. by zran_read with ZRAN_AUTO_BUILD active) while readahead is
+ * active. Only data covered by the index is read ahead.
+ *
+ * Returns 0 on success, or -1 if the thread could not be started. If
+ * readahead is already active for the reader, nothing is done.
+ */
+int zran_readahead_start(
+  zran_index_t  *index,  /* The index                          */
+  zran_reader_t *reader, /* The reader, or NULL for the index's */
+  FILE          *fd      /* Open handle to the compressed file  */
+);
+
+
+/*
+ * Stops the readahead thread of the given reader (or of the index's own
+ * reader, if reader is NULL), waiting for it to finish, and frees its
+ * buffers. Readahead is stopped automatically by zran_reader_free and
+ * zran_free.
+ */
+void zran_readahead_stop(
+  zran_index_t  *index, /* The index                          */
+  zran_reader_t *reader /* The reader, or NULL for the index's */
+);
+
+
+/*
+ * Returns the number of bytes which have been copied from the readahead
+ * buffers of the given reader (or of the index's own reader, if reader
+ * is NULL), since readahead was started.
+ */
+uint64_t zran_readahead_bytes(
+  zran_index_t  *index, /* The index                          */
+  zran_reader_t *reader /* The reader, or NULL for the index's */
+);
+
+
+/* Return codes for zran_verify. */
+enum {
+    ZRAN_VERIFY_OK        =  0,
+    ZRAN_VERIFY_FAIL      = -1,
+    ZRAN_VERIFY_CRC_ERROR = -2
+};
+
+
+/*
+ * Verifies all of the compressed data. The data between each pair of
+ * index points is decompressed, and its CRC32 calculated - these are
+ * combined (with crc32_combine) to check the CRC32 and size in the footer
+ * of every gzip stream. As the data between index points can be
+ * decompressed independently, this is done concurrently, with one thread
+ * for each of the given readers (see zran_reader_create - each reader
+ * must have its own file handle). If nreaders is 0, the index's own file
+ * handle is used, and the data is verified in the calling thread.
+ *
+ * The index is built first, if it does not already cover the whole file.
+ * The CRC32 of the data between each pair of index points is stored in
+ * the index, if it does not already contain them (see zran_export_index).
+ *
+ * Returns ZRAN_VERIFY_OK if the data is intact, ZRAN_VERIFY_CRC_ERROR if
+ * a CRC or size does not match, or ZRAN_VERIFY_FAIL if an error occurs.
+ */
+int zran_verify(
+  zran_index_t   *index,   /* The index                           */
+  zran_reader_t **readers, /* Readers to use, one for each thread */
+  uint32_t        nreaders /* Number of readers                   */
+);
+
+
+/*
+ * Reads len bytes, starting at the given uncompressed offset, into buf.
+ * The range is divided into chunks of spans (the data between a pair of
+ * index points), which are decompressed concurrently, with one thread for
+ * each of the given readers (see zran_reader_create - each reader must
+ * have its own file handle), and written directly into their place in buf.
+ * If nreaders is 0, the index's own file handle is used, and the data is
+ * read in the calling thread. The seek location of the index is not
+ * changed.
+ *
+ * If the index was created with the ZRAN_AUTO_BUILD flag, it is first
+ * expanded (in the calling thread) so that it covers the whole range.
+ *
+ * Returns the number of bytes read, which is less than len only if the
+ * range extends past the end of the data, or one of the ZRAN_READ error
+ * codes (see zran_read) - ZRAN_READ_EOF is returned if offset is at or
+ * past the end of the data.
+ */
+int64_t zran_read_parallel(
+  zran_index_t   *index,    /* The index                            */
+  zran_reader_t **readers,  /* Readers to use, one for each thread  */
+  uint32_t        nreaders, /* Number of readers                    */
+  void           *buf,      /* Buffer to store len bytes            */
+  uint64_t        offset,   /* Uncompressed offset to start from    */
+  uint64_t        len       /* Number of bytes to read              */
+);
+
+
+/*
+ * A range of uncompressed data to be read by zran_read_multi.
+ */
+typedef struct _zran_range {
+    uint64_t  offset; /* Uncompressed offset of the range        */
+    uint64_t  len;    /* Number of bytes in the range            */
+    void     *buf;    /* Buffer to store len bytes               */
+    uint64_t  nread;  /* Set to the number of bytes that were read */
+} zran_range_t;
+
+
+/*
+ * Reads a set of ranges of uncompressed data, each into its own buffer.
+ * The ranges are sorted by offset, and coalesced into groups, so that
+ * ranges which overlap, or which start in the span (the data between a
+ * pair of index points) that the previous range ends in, are read in one
+ * pass - each part of the data is decompressed at most once, rather than
+ * once for each range. The groups are read concurrently, with one thread
+ * for each of the given readers, in the same way as zran_read_parallel.
+ * The seek location of the index is not changed.
+ *
+ * If the index was created with the ZRAN_AUTO_BUILD flag, it is first
+ * expanded so that it covers all of the ranges. Ranges which extend past
+ * the end of the data are truncated - the number of bytes read into each
+ * range is stored in its nread field.
+ *
+ * Returns the total number of bytes read, or one of the ZRAN_READ error
+ * codes (see zran_read).
+ */
+int64_t zran_read_multi(
+  zran_index_t   *index,    /* The index                           */
+  zran_reader_t **readers,  /* Readers to use, one for each thread */
+  uint32_t        nreaders, /* Number of readers                   */
+  zran_range_t   *ranges,   /* The ranges to read                  */
+  uint32_t        nranges   /* Number of ranges                    */
+);
+
+
+/*
+ * Builds the full index with one thread for each of the given readers
+ * (see zran_reader_create - each reader must have its own file handle).
+ * The compressed data is divided into chunks, and each thread searches
+ * for the first deflate block (or gzip stream) in a chunk, and decodes it
+ * without knowing the data that precedes it. The chunks are then joined
+ * together in order - a chunk which could not be decoded, or which does
+ * not start where the previous chunk ended, is decoded again
+ * sequentially. The data is then checked with zran_verify, unless
+ * ZRAN_SKIP_CRC_CHECK is set.
+ *
+ * Only seekable files are built in parallel - for other files, and when
+ * fewer than two readers are given, this function just calls
+ * zran_build_index.
+ *
+ * Returns the same values as zran_build_index.
+ */
+int zran_build_index_parallel(
+  zran_index_t   *index,   /* The index                           */
+  zran_reader_t **readers, /* Readers to use, one for each thread */
+  uint32_t        nreaders /* Number of readers                   */
+);
+
+
 /*
  * Identifier and version number for index files created by zran_export_index,
  * defined in zran.c.
@@ -385,7 +1209,15 @@ extern const uint8_t ZRAN_INDEX_FILE_VERSION;
 /* Return codes for zran_export_index. */
 enum {
     ZRAN_EXPORT_OK          =  0,
-    ZRAN_EXPORT_WRITE_ERROR = -1
+    ZRAN_EXPORT_WRITE_ERROR = -1,
+    ZRAN_EXPORT_UNSUPPORTED = -2
+};
+
+/* Flags for zran_export_index_flags. */
+enum {
+    ZRAN_EXPORT_COMPACT = 1,
+    ZRAN_EXPORT_BGZIP   = 2,
+    ZRAN_EXPORT_GZTOOL  = 4
 };
 
 /*
@@ -400,8 +1232,8 @@ enum {
  *
  * | Offset | Length | Description                           |
  * | 0      | 5      | File header (ascii, GZIDX)            |
- * | 5      | 1      | Version (uint8, currently 1)          |
- * | 6      | 1      | Reserved (uint8, currently must be 0) |
+ * | 5      | 1      | Version (uint8, 1, 2, 3 or 4)         |
+ * | 6      | 1      | Flags (uint8, see below)              |
  * | 7      | 8      | Compressed file size  (uint64)        |
  * | 15     | 8      | Uncompressed file size (uint64)       |
  * | 23     | 4      | Index point spacing (uint32)          |
@@ -415,20 +1247,74 @@ enum {
  * | 8      | 8      | Uncompressed offset for point 0 (uint64) |
  * | 16     | 1      | Bit offset for point 0 (uint8)           |
  * | 17     | 1      | Data flag - 1 if point has window data,  |
- * |        |        | 0 otherwise (uint8, added in file format |
+ * |        |        | 2 if point has sparse window data (added |
+ * |        |        | in file format version 2), 3 if point    |
+ * |        |        | shares the window of an earlier point    |
+ * |        |        | (added in file format version 3), 0      |
+ * |        |        | otherwise (uint8, added in file format   |
  * |        |        | version 1)                               |
  * | ...    | ...    | ...                                      |
  * | N*18   | 8      | Compressed offset for point N (uint64)   |
  * | ...    | ...    | ...                                      |
  *
  * Finally the window data for all index points that have data is
- * concatenated (W represents the index window size):
+ * concatenated. Each window is W bytes long (W represents the index window
+ * size), unless it is sparse or shared:
  *
  * | Offset | Length | Description                                 |
  * | 0      | W      | Window data for first index point with data |
  * | ...    | ...    | ...                                         |
  * | N*W    | W      | Window data for Nth index point with data   |
  *
+ * Sparse windows only contain the bytes of the window which are referenced
+ * by the compressed data following the point (see ZRAN_SPARSE_WINDOWS),
+ * stored as R ranges of bytes, with lengths L1, ..., LR:
+ *
+ * | Offset | Length | Description                                 |
+ * | 0      | 4      | Number of ranges R (uint32)                 |
+ * | 4      | 4      | Offset of range 1 into the window (uint32)  |
+ * | 8      | 4      | Length of range 1, L1 (uint32)              |
+ * | ...    | ...    | ...                                         |
+ * | 4+8R   | L1     | Bytes of range 1                            |
+ * | ...    | ...    | ...                                         |
+ *
+ * Points which have the same window as an earlier point only store the
+ * position of that point (uint32) - the window is only stored once, for the
+ * first point which uses it.
+ *
+ * Version 3 is only used if the index contains shared windows, and version
+ * 2 if it contains sparse windows - otherwise version 1 files are written.
+ *
+ * If bit 0 of the flags is set, the window data is followed by the CRC32
+ * of the uncompressed data between each point and the next, for the first
+ * S points (older versions of indexed_gzip ignore this, so it does not
+ * change the version of the file):
+ *
+ * | Offset | Length | Description                                 |
+ * | 0      | 4      | Number of spans S (uint32)                  |
+ * | 4      | 4      | CRC32 of data between points 0 and 1        |
+ * | ...    | ...    | ...                                         |
+ * | 4S     | 4      | CRC32 of data between points S-1 and S      |
+ *
+ * Compact index files (version 4, written by zran_export_index_flags with
+ * ZRAN_EXPORT_COMPACT) have the same header, followed by the length of the
+ * point table (uint64), the point table, and then the window record for
+ * each point which has one. All integers in the point table are stored
+ * as variable length integers (7 bits per byte, least significant first,
+ * with the high bit set on all but the last byte). For each point:
+ *
+ * | Length | Description                                            |
+ * | 1-10   | Compressed offset, minus that of the previous point    |
+ * | 1-10   | Uncompressed offset, minus that of the previous point  |
+ * | 1      | Bit offset (bits 0-2) and data flag (bits 3-5, uint8)  |
+ * | 0-5    | Window record length, or, for shared windows, position |
+ * |        | of the point which the window was written for          |
+ *
+ * The data flag has the same values as above, plus 4 if the window record
+ * has been compressed with zlib. A window record is otherwise a full
+ * window (W bytes), or a sparse window, so the position of any window in
+ * the file can be calculated from the point table alone.
+ *
  * Returns:
  *   - ZRAN_EXPORT_OK for success.
  *
@@ -442,6 +1328,32 @@ int zran_export_index(
 );
 
 
+/*
+ * Same as zran_export_index, but accepts flags which control the format of
+ * the exported file:
+ *
+ *   - ZRAN_EXPORT_COMPACT: Write a compact (version 4) index file.
+ *
+ *   - ZRAN_EXPORT_BGZIP:   Write a bgzip index (.gzi) file, as created by
+ *                          "bgzip -i". This is only possible for BGZF files,
+ *                          and ZRAN_EXPORT_UNSUPPORTED is returned if the
+ *                          index points are not at the start of BGZF
+ *                          blocks.
+ *
+ *   - ZRAN_EXPORT_GZTOOL:  Write a gztool index file. Windows which are
+ *                          larger than 32KB are truncated to 32KB.
+ *
+ * Index files written by other tools do not contain the CRCs of the data
+ * between points.
+ */
+int zran_export_index_flags(
+  zran_index_t  *index, /* The index                         */
+  FILE          *fd,    /* Open handle to export file        */
+  PyObject      *f,     /* Open handle to export file object */
+  uint16_t       flags  /* Flags controlling the file format */
+);
+
+
 /* Return codes for zran_import_index. */
 enum {
     ZRAN_IMPORT_OK                  =  0,
@@ -465,9 +1377,16 @@ enum {
  * Updating an index file is not supported currently. To update an index file,
  * first import it, create new checkpoints, and then export it again.
  *
- * CRC validation of uncompressed data from an imported index is not currently
- * supported - this function will enable the ZRAN_SKIP_CRC_CHECK flag on the
- * given zran_index_t struct.
+ * If the index file contains the CRC32 of the data between each of its
+ * points, uncompressed data is validated against them when it is read.
+ * Otherwise, CRC validation of uncompressed data from the imported index is
+ * not possible - this function will enable the ZRAN_SKIP_CRC_CHECK flag on
+ * the given zran_index_t struct.
+ *
+ * bgzip (.gzi) and gztool index files (see zran_export_index_flags) can also
+ * be imported, if the index file is seekable - the format is detected
+ * automatically. bgzip index files are checked against the block headers
+ * in the compressed file, which must be a BGZF file.
  *
  * See zran_export_index for exporting.
  *
@@ -502,4 +1421,35 @@ int zran_import_index(
   PyObject      *f      /* Open handle to import file object */
 );
 
+
+/* Flags for zran_import_index_flags. */
+enum {
+    ZRAN_IMPORT_LAZY = 1
+};
+
+
+/*
+ * Same as zran_import_index, but accepts flags which control how the index
+ * is imported. The only flag is ZRAN_IMPORT_LAZY - if given, the index
+ * file is mapped into memory, and only the point table is read. The window
+ * data for each point is left in the file, and is only read (and paged in
+ * by the operating system) when a seek starts from that point. The mapping
+ * is kept until the index is freed, or another index is imported, even if
+ * the file is closed. Index files must not be modified while they are
+ * mapped.
+ *
+ * Windows which are loaded this way are not counted against any window
+ * budget (see zran_set_window_budget), as they are not stored in memory
+ * by the index.
+ *
+ * Index files can only be mapped if fd is provided, and on platforms
+ * which support mmap - otherwise, the index is imported as normal.
+ */
+int zran_import_index_flags(
+  zran_index_t  *index, /* The index                         */
+  FILE          *fd,    /* Open handle to import file        */
+  PyObject      *f,     /* Open handle to import file object */
+  uint16_t       flags  /* Flags controlling the import      */
+);
+
 #endif /* __ZRAN_H__ */
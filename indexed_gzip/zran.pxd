@@ -15,11 +15,23 @@ cdef extern from "zran.h":
         PyObject     *f;
         size_t        compressed_size;
         size_t        uncompressed_size;
+        uint8_t       bgzf;
         uint32_t      spacing;
         uint32_t      window_size;
         uint32_t      readbuf_size;
         uint32_t      npoints;
-        zran_point_t *list;
+        uint64_t     *cmp_offsets;
+        uint64_t     *uncmp_offsets;
+        uint32_t     *span_crcs;
+        uint32_t      nspans;
+        uint64_t      window_budget;
+        uint64_t      window_bytes;
+        uint32_t      nmapped;
+        uint16_t      flags;
+
+    ctypedef struct zran_reader_t:
+        FILE         *fd;
+        PyObject     *f;
 
     ctypedef struct zran_point_t:
         uint64_t  cmp_offset;
@@ -29,8 +41,11 @@ cdef extern from "zran.h":
 
     enum:
         # flags for zran_init
-        ZRAN_AUTO_BUILD     =  1,
-        ZRAN_SKIP_CRC_CHECK =  2,
+        ZRAN_AUTO_BUILD       =  1,
+        ZRAN_SKIP_CRC_CHECK   =  2,
+        ZRAN_HUGE_PAGES       =  4,
+        ZRAN_COMPRESS_WINDOWS =  8,
+        ZRAN_SPARSE_WINDOWS   = 16,
 
         # return codes for zran_build_index
         ZRAN_BUILD_INDEX_OK        =  0,
@@ -51,9 +66,20 @@ cdef extern from "zran.h":
         ZRAN_READ_FAIL        = -3,
         ZRAN_READ_CRC_ERROR   = -4,
 
+        # return codes for zran_verify
+        ZRAN_VERIFY_OK        =  0,
+        ZRAN_VERIFY_FAIL      = -1,
+        ZRAN_VERIFY_CRC_ERROR = -2,
+
         # return codes for zran_export_index
         ZRAN_EXPORT_OK          =  0,
         ZRAN_EXPORT_WRITE_ERROR = -1,
+        ZRAN_EXPORT_UNSUPPORTED = -2,
+
+        # flags for zran_export_index_flags
+        ZRAN_EXPORT_COMPACT = 1,
+        ZRAN_EXPORT_BGZIP   = 2,
+        ZRAN_EXPORT_GZTOOL  = 4,
 
         # return codes for zran_import_index
         ZRAN_IMPORT_OK                  =  0,
@@ -63,7 +89,10 @@ cdef extern from "zran.h":
         ZRAN_IMPORT_INCONSISTENT        = -4,
         ZRAN_IMPORT_MEMORY_ERROR        = -5,
         ZRAN_IMPORT_UNKNOWN_FORMAT      = -6,
-        ZRAN_IMPORT_UNSUPPORTED_VERSION = -7
+        ZRAN_IMPORT_UNSUPPORTED_VERSION = -7,
+
+        # flags for zran_import_index_flags
+        ZRAN_IMPORT_LAZY = 1
 
     int zran_init(zran_index_t *index,
                   FILE         *fd,
@@ -79,21 +108,125 @@ cdef extern from "zran.h":
                          uint64_t      from_,
                          uint64_t      until) nogil;
 
+    int zran_get_point(zran_index_t *index,
+                       uint32_t      i,
+                       zran_point_t *point);
+
+    int zran_find_point(zran_index_t *index,
+                        uint64_t      offset,
+                        uint8_t       compressed,
+                        uint32_t     *hint,
+                        zran_point_t *point);
+
+    int zran_get_window(zran_index_t *index,
+                        uint32_t      i,
+                        uint8_t      *buf);
+
+    int zran_set_window_budget(zran_index_t *index,
+                               uint64_t      budget);
+
+    void zran_set_global_window_budget(uint64_t budget);
+
+    uint64_t zran_global_window_bytes();
+
+    ctypedef struct zran_span_cache_stats_t:
+        uint64_t budget
+        uint64_t bytes
+        uint64_t hits
+        uint64_t misses
+        uint32_t nspans
+        uint64_t disk_budget
+        uint64_t disk_bytes
+        uint64_t disk_hits
+        uint64_t disk_misses
+        uint32_t disk_nspans
+
+    void zran_set_span_cache_budget(uint64_t budget);
+
+    int zran_set_disk_cache(const char *dir, uint64_t budget);
+
+    void zran_span_cache_stats(zran_span_cache_stats_t *stats);
+
+    void zran_reset_span_cache_stats();
+
     uint64_t zran_tell(zran_index_t *index);
 
     int zran_seek(zran_index_t  *index,
                   int64_t        offset,
                   uint8_t        whence,
-                  zran_point_t **point) nogil;
+                  zran_point_t  *point) nogil;
 
     int64_t zran_read(zran_index_t *index,
                       void         *buf,
                       uint64_t      len) nogil;
 
+    zran_reader_t *zran_reader_create(zran_index_t *index,
+                                      FILE         *fd,
+                                      PyObject     *f);
+
+    void zran_reader_free(zran_reader_t *reader);
+
+    int zran_reader_seek(zran_reader_t *reader,
+                         int64_t        offset,
+                         uint8_t        whence) nogil;
+
+    uint64_t zran_reader_tell(zran_reader_t *reader);
+
+    int64_t zran_reader_read(zran_reader_t *reader,
+                             void          *buf,
+                             uint64_t       len) nogil;
+
+    int zran_readahead_start(zran_index_t  *index,
+                             zran_reader_t *reader,
+                             FILE          *fd);
+
+    void zran_readahead_stop(zran_index_t  *index,
+                             zran_reader_t *reader) nogil;
+
+    uint64_t zran_readahead_bytes(zran_index_t  *index,
+                                  zran_reader_t *reader);
+
+    int zran_verify(zran_index_t   *index,
+                    zran_reader_t **readers,
+                    uint32_t        nreaders) nogil;
+
+    int64_t zran_read_parallel(zran_index_t   *index,
+                               zran_reader_t **readers,
+                               uint32_t        nreaders,
+                               void           *buf,
+                               uint64_t        offset,
+                               uint64_t        len) nogil;
+
+    ctypedef struct zran_range_t:
+        uint64_t  offset
+        uint64_t  len
+        void     *buf
+        uint64_t  nread
+
+    int64_t zran_read_multi(zran_index_t   *index,
+                            zran_reader_t **readers,
+                            uint32_t        nreaders,
+                            zran_range_t   *ranges,
+                            uint32_t        nranges) nogil;
+
+    int zran_build_index_parallel(zran_index_t   *index,
+                                  zran_reader_t **readers,
+                                  uint32_t        nreaders) nogil;
+
     int zran_export_index(zran_index_t *index,
                           FILE         *fd,
                           PyObject     *f);
 
+    int zran_export_index_flags(zran_index_t *index,
+                                FILE         *fd,
+                                PyObject     *f,
+                                uint16_t      flags);
+
     int zran_import_index(zran_index_t *index,
                           FILE         *fd,
                           PyObject     *f);
+
+    int zran_import_index_flags(zran_index_t *index,
+                                FILE         *fd,
+                                PyObject     *f,
+                                uint16_t      flags);
@@ -0,0 +1,189 @@
+/*
+ * zran_arena.c - chunked arena allocator used by zran.c to store index
+ * point window data.
+ *
+ * See zran_arena.h for documentation.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "zran_arena.h"
+
+
+/*
+ * Allocations are rounded up to a multiple of this
+ * many bytes, so that every allocation is aligned.
+ */
+#define ZRAN_ARENA_ALIGN 16
+
+
+/*
+ * Allocates memory for a new chunk of the given size. If huge pages are
+ * requested, and supported on this platform, the memory is aligned to a
+ * huge page boundary, and the kernel is advised to back it with huge pages.
+ */
+static uint8_t * _zran_arena_alloc_chunk(
+    zran_arena_t *arena, /* The arena                  */
+    size_t        size   /* Size of the chunk in bytes */
+);
+
+
+/* Allocates memory for a new chunk. */
+uint8_t * _zran_arena_alloc_chunk(zran_arena_t *arena, size_t size) {
+
+    void *data = NULL;
+
+    #if !defined(_WIN32) && defined(MADV_HUGEPAGE)
+    if (arena->huge_pages) {
+        if (posix_memalign(&data, ZRAN_ARENA_CHUNK_SIZE, size) != 0)
+            return NULL;
+
+        /*
+         * madvise is only advice - if the kernel
+         * can't or won't use huge pages, the
+         * memory is still perfectly usable.
+         */
+        madvise(data, size, MADV_HUGEPAGE);
+        return data;
+    }
+    #endif
+
+    data = malloc(size);
+    return data;
+}
+
+
+/* Initialise an arena. */
+void zran_arena_init(zran_arena_t *arena,
+                     size_t        chunk_size,
+                     uint8_t       huge_pages) {
+
+    if (chunk_size == 0)
+        chunk_size = ZRAN_ARENA_CHUNK_SIZE;
+
+    arena->chunks     = NULL;
+    arena->nchunks    = 0;
+    arena->size       = 0;
+    arena->chunk_size = chunk_size;
+    arena->huge_pages = huge_pages;
+}
+
+
+/* Allocate some memory from the arena. */
+void * zran_arena_alloc(zran_arena_t *arena, size_t size) {
+
+    zran_arena_chunk_t *chunk;
+    zran_arena_chunk_t *new_chunks;
+    uint32_t            new_size;
+    size_t              chunk_size;
+    uint8_t            *ptr;
+
+    size = (size + ZRAN_ARENA_ALIGN - 1) & ~((size_t)ZRAN_ARENA_ALIGN - 1);
+
+    /* Is there space in the current chunk? */
+    if (arena->nchunks > 0) {
+        chunk = &(arena->chunks[arena->nchunks - 1]);
+
+        if (chunk->size - chunk->used >= size) {
+            ptr          = chunk->data + chunk->used;
+            chunk->used += size;
+            return ptr;
+        }
+    }
+
+    /* Make room for another chunk */
+    if (arena->nchunks == arena->size) {
+
+        if (arena->size == 0) new_size = 8;
+        else                  new_size = arena->size * 2;
+
+        new_chunks = realloc(arena->chunks,
+                             sizeof(zran_arena_chunk_t) * new_size);
+        if (new_chunks == NULL)
+            return NULL;
+
+        arena->chunks = new_chunks;
+        arena->size   = new_size;
+    }
+
+    /*
+     * Oversized allocations are given
+     * a chunk of their own.
+     */
+    if (size > arena->chunk_size) chunk_size = size;
+    else                          chunk_size = arena->chunk_size;
+
+    chunk       = &(arena->chunks[arena->nchunks]);
+    chunk->data = _zran_arena_alloc_chunk(arena, chunk_size);
+
+    if (chunk->data == NULL)
+        return NULL;
+
+    chunk->size = chunk_size;
+    chunk->used = size;
+
+    arena->nchunks++;
+
+    return chunk->data;
+}
+
+
+/* Release an allocation, and everything allocated after it. */
+void zran_arena_rewind(zran_arena_t *arena, void *ptr) {
+
+    uint8_t            *p = ptr;
+    zran_arena_chunk_t *chunk;
+    int64_t             i;
+
+    if (ptr == NULL)
+        return;
+
+    /*
+     * Find the chunk containing the allocation -
+     * we search backwards, as rewinds are usually
+     * to a recent allocation.
+     */
+    for (i = (int64_t)arena->nchunks - 1; i >= 0; i--) {
+        chunk = &(arena->chunks[i]);
+        if (p >= chunk->data && p < chunk->data + chunk->size)
+            break;
+    }
+
+    /* Not one of ours */
+    if (i < 0)
+        return;
+
+    chunk->used = p - chunk->data;
+
+    /*
+     * Release all subsequent chunks. The chunk
+     * containing ptr is kept, even if it is now
+     * empty, so it can be re-used.
+     */
+    while (arena->nchunks > i + 1) {
+        arena->nchunks--;
+        free(arena->chunks[arena->nchunks].data);
+    }
+}
+
+
+/* Release all memory owned by the arena. */
+void zran_arena_free(zran_arena_t *arena) {
+
+    uint32_t i;
+
+    for (i = 0; i < arena->nchunks; i++) {
+        free(arena->chunks[i].data);
+    }
+
+    free(arena->chunks);
+
+    arena->chunks  = NULL;
+    arena->nchunks = 0;
+    arena->size    = 0;
+}
@@ -0,0 +1,136 @@
+#ifndef __ZRAN_ARENA_H__
+#define __ZRAN_ARENA_H__
+
+/*
+ * A simple chunked arena allocator, used by zran.c to store the window
+ * data for index points. Memory is allocated from large chunks, in the
+ * order that it is requested, and is released all at once, or from a
+ * given allocation onwards, rather than one block at a time.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+
+/*
+ * Default size of each arena chunk - this is the size of a huge page
+ * on most x86-64 and aarch64 systems.
+ */
+#define ZRAN_ARENA_CHUNK_SIZE 2097152
+
+
+struct _zran_arena_chunk;
+struct _zran_arena;
+
+typedef struct _zran_arena_chunk zran_arena_chunk_t;
+typedef struct _zran_arena       zran_arena_t;
+
+
+/*
+ * A single chunk of memory owned by an arena.
+ */
+struct _zran_arena_chunk {
+
+    /*
+     * The chunk memory.
+     */
+    uint8_t *data;
+
+    /*
+     * Size of the chunk in bytes.
+     */
+    size_t size;
+
+    /*
+     * Number of bytes in the chunk which
+     * have been allocated. Allocations are
+     * made from the end of this region.
+     */
+    size_t used;
+};
+
+
+/*
+ * Struct representing an arena. None of the fields in this struct should
+ * ever need to be accessed or modified directly.
+ */
+struct _zran_arena {
+
+    /*
+     * Chunks owned by this arena. Allocations
+     * are only made from the last chunk - a
+     * new chunk is created when it is full.
+     */
+    zran_arena_chunk_t *chunks;
+
+    /*
+     * Number of chunks that have been created.
+     */
+    uint32_t nchunks;
+
+    /*
+     * Number of chunks that can be stored -
+     * i.e. the amount allocated to chunks.
+     */
+    uint32_t size;
+
+    /*
+     * Size of each new chunk. Allocations
+     * which are larger than this are given
+     * their own chunk.
+     */
+    size_t chunk_size;
+
+    /*
+     * If non-zero, chunks are aligned to
+     * chunk_size, and madvise(MADV_HUGEPAGE)
+     * is called on them (where supported).
+     */
+    uint8_t huge_pages;
+};
+
+
+/*
+ * Initialise an arena. Pass in 0 for the chunk_size to use
+ * ZRAN_ARENA_CHUNK_SIZE. No memory is allocated until the first
+ * call to zran_arena_alloc.
+ */
+void zran_arena_init(
+    zran_arena_t *arena,      /* The arena                             */
+    size_t        chunk_size, /* Size of each chunk                    */
+    uint8_t       huge_pages  /* Request transparent huge page backing */
+);
+
+
+/*
+ * Allocate size bytes from the arena. The memory is not initialised.
+ * Returns NULL on failure.
+ */
+void * zran_arena_alloc(
+    zran_arena_t *arena, /* The arena                  */
+    size_t        size   /* Number of bytes to allocate */
+);
+
+
+/*
+ * Releases the given allocation, and all allocations which were made
+ * after it. ptr must have been returned by zran_arena_alloc on this
+ * arena, and not already have been released. Passing NULL has no
+ * effect.
+ */
+void zran_arena_rewind(
+    zran_arena_t *arena, /* The arena                        */
+    void         *ptr    /* First allocation to be released  */
+);
+
+
+/*
+ * Releases all memory owned by the arena. The arena may be re-used
+ * afterwards.
+ */
+void zran_arena_free(
+    zran_arena_t *arena /* The arena */
+);
+
+
+#endif /* __ZRAN_ARENA_H__ */
@@ -0,0 +1,743 @@
+/*
+ * zran_deflate.c - minimal deflate parser used by zran.c to find the
+ * window bytes which are referenced after an index point, and to decode
+ * deflate data from an unknown starting point when building an index in
+ * parallel.
+ *
+ * The decoding logic follows the structure of puff.c, the reference
+ * deflate decoder which is distributed with zlib. Canonical Huffman codes
+ * are decoded one bit at a time, which is slow, but simple - only a
+ * small amount of data is parsed for each index point, and for each
+ * chunk of a parallel index build.
+ *
+ * See zran_deflate.h for documentation.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "zran_deflate.h"
+
+
+#define MAXBITS  15  /* Maximum bits in a code                */
+#define MAXLCODES 286 /* Maximum number of literal/length codes */
+#define MAXDCODES 30  /* Maximum number of distance codes       */
+#define MAXCODES (MAXLCODES + MAXDCODES)
+#define FIXLCODES 288 /* Number of fixed literal/length codes   */
+
+
+/*
+ * Parser state.
+ */
+typedef struct {
+    const uint8_t *in;      /* Input buffer                          */
+    size_t         inlen;   /* Length of input buffer                */
+    size_t         incnt;   /* Bytes read from input buffer          */
+    uint32_t       bitbuf;  /* Bit buffer                            */
+    uint32_t       bitcnt;  /* Number of bits in bit buffer          */
+    uint64_t       outcnt;  /* Uncompressed bytes parsed so far      */
+    uint8_t       *refs;    /* Referenced window bytes               */
+    zran_deflate_markers_t
+                  *markers; /* If not NULL, data is decoded into the
+                               markers window, rather than just
+                               being parsed                          */
+    int            err;     /* Set to a ZRAN_DEFLATE_SCAN_* code on
+                               error                                 */
+} zran_deflate_state_t;
+
+
+/*
+ * Canonical Huffman code - count[i] is the number of symbols with an
+ * i-bit code, and symbol contains the symbols ordered by code.
+ */
+typedef struct {
+    short *count;
+    short *symbol;
+} zran_huffman_t;
+
+
+/*
+ * Sentinel returned by _zran_deflate_codes when the
+ * ZRAN_DEFLATE_WINDOW limit has been reached.
+ */
+#define ZRAN_DEFLATE_DONE 1
+
+
+/* Length and distance base values and extra bits. */
+static const short LBASE[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const short LEXT[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const short DBASE[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577};
+static const short DEXT[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11,
+    12, 12, 13, 13};
+
+
+/*
+ * Initialises the state to start parsing the input from the given bit
+ * offset.
+ */
+static void _zran_deflate_init(zran_deflate_state_t *s,
+                               const uint8_t        *in,
+                               size_t                inlen,
+                               uint64_t              bitpos);
+
+
+/* Returns the bit offset of the next bit to be read from the input. */
+static uint64_t _zran_deflate_bitpos(zran_deflate_state_t *s);
+
+
+/*
+ * Appends a symbol to the markers window, keeping track of the number of
+ * markers in the window.
+ */
+static void _zran_deflate_put(zran_deflate_state_t *s, uint16_t sym);
+
+
+/*
+ * Reads need bits from the input. Sets s->err, and returns 0,
+ * if the input is exhausted.
+ */
+static uint32_t _zran_deflate_bits(zran_deflate_state_t *s, uint32_t need);
+
+
+/*
+ * Builds a canonical Huffman code from the given code lengths. Returns 0
+ * for a complete code, a positive value for an incomplete code, and a
+ * negative value for an over-subscribed code.
+ */
+static int _zran_deflate_construct(zran_huffman_t *h,
+                                   const short    *length,
+                                   int             n);
+
+
+/*
+ * Decodes a symbol using the given Huffman code. Returns a negative value
+ * on failure.
+ */
+static int _zran_deflate_decode(zran_deflate_state_t *s,
+                                const zran_huffman_t *h);
+
+
+/*
+ * Parses the codes of a fixed or dynamic block, marking any window
+ * bytes which are referenced. Returns 0 at the end of the block,
+ * ZRAN_DEFLATE_DONE if the ZRAN_DEFLATE_WINDOW limit was reached, or a
+ * negative value on failure.
+ */
+static int _zran_deflate_codes(zran_deflate_state_t *s,
+                               const zran_huffman_t *lencode,
+                               const zran_huffman_t *distcode);
+
+
+/* Parses a stored block. */
+static int _zran_deflate_stored(zran_deflate_state_t *s);
+
+
+/* Parses a block compressed with the fixed Huffman codes. */
+static int _zran_deflate_fixed(zran_deflate_state_t *s);
+
+
+/*
+ * Parses the header of a block compressed with dynamic Huffman codes, and
+ * builds its codes. Returns 0 on success, or -1 if the header is invalid.
+ */
+static int _zran_deflate_dynamic_header(zran_deflate_state_t *s,
+                                        zran_huffman_t       *lencode,
+                                        zran_huffman_t       *distcode);
+
+
+/* Parses a block compressed with dynamic Huffman codes. */
+static int _zran_deflate_dynamic(zran_deflate_state_t *s);
+
+
+/* Start parsing from a bit offset. */
+void _zran_deflate_init(zran_deflate_state_t *s,
+                        const uint8_t        *in,
+                        size_t                inlen,
+                        uint64_t              bitpos) {
+
+    memset(s, 0, sizeof(zran_deflate_state_t));
+
+    s->in    = in;
+    s->inlen = inlen;
+    s->incnt = bitpos / 8;
+
+    if (s->incnt >= inlen) {
+        s->incnt = inlen;
+        s->err   = ZRAN_DEFLATE_SCAN_NO_INPUT;
+    }
+    else if (bitpos % 8 != 0) {
+        s->bitbuf = in[s->incnt++] >> (bitpos % 8);
+        s->bitcnt = 8 - (bitpos % 8);
+    }
+}
+
+
+/* Current bit offset. */
+uint64_t _zran_deflate_bitpos(zran_deflate_state_t *s) {
+    return (uint64_t)s->incnt * 8 - s->bitcnt;
+}
+
+
+/* Append a symbol to the markers window. */
+void _zran_deflate_put(zran_deflate_state_t *s, uint16_t sym) {
+
+    uint16_t *slot = &(s->markers->window[s->outcnt % ZRAN_DEFLATE_WINDOW]);
+
+    if (*slot >= 256) s->markers->nmarkers--;
+    if (sym   >= 256) s->markers->nmarkers++;
+
+    *slot = sym;
+    s->outcnt++;
+}
+
+
+/* Read bits from the input. */
+uint32_t _zran_deflate_bits(zran_deflate_state_t *s, uint32_t need) {
+
+    uint64_t val = s->bitbuf;
+
+    while (s->bitcnt < need) {
+        if (s->incnt == s->inlen) {
+            s->err = ZRAN_DEFLATE_SCAN_NO_INPUT;
+            return 0;
+        }
+        val       |= (uint64_t)(s->in[s->incnt++]) << s->bitcnt;
+        s->bitcnt += 8;
+    }
+
+    s->bitbuf  = (uint32_t)(val >> need);
+    s->bitcnt -= need;
+
+    return (uint32_t)(val & ((1ull << need) - 1));
+}
+
+
+/* Build a canonical Huffman code. */
+int _zran_deflate_construct(zran_huffman_t *h, const short *length, int n) {
+
+    int   symbol;
+    int   len;
+    int   left;
+    short offs[MAXBITS + 1];
+
+    for (len = 0; len <= MAXBITS; len++)
+        h->count[len] = 0;
+    for (symbol = 0; symbol < n; symbol++)
+        h->count[length[symbol]]++;
+
+    /* No codes - complete, but decoding will fail */
+    if (h->count[0] == n)
+        return 0;
+
+    /* Check for an over-subscribed or incomplete set of lengths */
+    left = 1;
+    for (len = 1; len <= MAXBITS; len++) {
+        left <<= 1;
+        left  -= h->count[len];
+        if (left < 0)
+            return left;
+    }
+
+    offs[1] = 0;
+    for (len = 1; len < MAXBITS; len++)
+        offs[len + 1] = offs[len] + h->count[len];
+
+    for (symbol = 0; symbol < n; symbol++) {
+        if (length[symbol] != 0)
+            h->symbol[offs[length[symbol]]++] = symbol;
+    }
+
+    return left;
+}
+
+
+/* Decode a symbol. */
+int _zran_deflate_decode(zran_deflate_state_t *s, const zran_huffman_t *h) {
+
+    int len;
+    int code  = 0;
+    int first = 0;
+    int index = 0;
+    int count;
+
+    for (len = 1; len <= MAXBITS; len++) {
+
+        code |= _zran_deflate_bits(s, 1);
+
+        if (s->err)
+            return -1;
+
+        count = h->count[len];
+
+        if (code - count < first)
+            return h->symbol[index + (code - first)];
+
+        index  += count;
+        first  += count;
+        first <<= 1;
+        code  <<= 1;
+    }
+
+    /* Ran out of codes */
+    s->err = ZRAN_DEFLATE_SCAN_ERROR;
+    return -1;
+}
+
+
+/* Parse the codes of a block. */
+int _zran_deflate_codes(zran_deflate_state_t *s,
+                        const zran_huffman_t *lencode,
+                        const zran_huffman_t *distcode) {
+
+    int      symbol;
+    uint32_t len;
+    uint32_t dist;
+    uint32_t i;
+
+    while (1) {
+
+        symbol = _zran_deflate_decode(s, lencode);
+
+        if (symbol < 0)
+            return -1;
+
+        /* Literal */
+        if (symbol < 256) {
+            if (s->markers != NULL) _zran_deflate_put(s, symbol);
+            else                    s->outcnt++;
+        }
+
+        /* End of block */
+        else if (symbol == 256) {
+            return 0;
+        }
+
+        /* Length/distance pair */
+        else {
+            symbol -= 257;
+            if (symbol >= 29) {
+                s->err = ZRAN_DEFLATE_SCAN_ERROR;
+                return -1;
+            }
+
+            len    = LBASE[symbol] + _zran_deflate_bits(s, LEXT[symbol]);
+            symbol = _zran_deflate_decode(s, distcode);
+
+            if (symbol < 0)
+                return -1;
+            if (symbol >= 30) {
+                s->err = ZRAN_DEFLATE_SCAN_ERROR;
+                return -1;
+            }
+
+            dist = DBASE[symbol] + _zran_deflate_bits(s, DEXT[symbol]);
+
+            if (s->err)
+                return -1;
+
+            if (dist > ZRAN_DEFLATE_WINDOW) {
+                s->err = ZRAN_DEFLATE_SCAN_ERROR;
+                return -1;
+            }
+
+            /*
+             * The window always holds the preceding
+             * ZRAN_DEFLATE_WINDOW symbols (markers,
+             * before the start of the data).
+             */
+            if (s->markers != NULL) {
+                for (i = 0; i < len; i++) {
+                    _zran_deflate_put(s, s->markers->window[
+                        (s->outcnt - dist) % ZRAN_DEFLATE_WINDOW]);
+                }
+                continue;
+            }
+
+            /*
+             * Does the match refer to data from before
+             * the start? If so, mark the referenced
+             * window bytes. The window index for a byte
+             * at relative position p (p < 0) is
+             * ZRAN_DEFLATE_WINDOW + p.
+             */
+            if (dist > s->outcnt) {
+                for (i = 0; i < len && s->outcnt + i < dist; i++) {
+                    s->refs[ZRAN_DEFLATE_WINDOW - dist + s->outcnt + i] = 1;
+                }
+            }
+
+            s->outcnt += len;
+        }
+
+        /*
+         * Nothing beyond this point
+         * can refer to the window.
+         */
+        if (s->markers == NULL && s->outcnt >= ZRAN_DEFLATE_WINDOW)
+            return ZRAN_DEFLATE_DONE;
+    }
+}
+
+
+/* Parse a stored block. */
+int _zran_deflate_stored(zran_deflate_state_t *s) {
+
+    uint32_t len;
+    uint32_t i;
+
+    /* Discard leftover bits from the current byte */
+    s->bitbuf = 0;
+    s->bitcnt = 0;
+
+    if (s->incnt + 4 > s->inlen) {
+        s->err = ZRAN_DEFLATE_SCAN_NO_INPUT;
+        return -1;
+    }
+
+    len = s->in[s->incnt] | ((uint32_t)s->in[s->incnt + 1] << 8);
+
+    if (s->in[s->incnt + 2] != (~len & 0xff) ||
+        s->in[s->incnt + 3] != ((~len >> 8) & 0xff)) {
+        s->err = ZRAN_DEFLATE_SCAN_ERROR;
+        return -1;
+    }
+
+    s->incnt += 4;
+
+    if (s->markers != NULL) {
+
+        if (s->incnt + len > s->inlen) {
+            s->err = ZRAN_DEFLATE_SCAN_NO_INPUT;
+            return -1;
+        }
+
+        for (i = 0; i < len; i++)
+            _zran_deflate_put(s, s->in[s->incnt + i]);
+
+        s->incnt += len;
+        return 0;
+    }
+
+    s->outcnt += len;
+
+    /*
+     * Stored blocks cannot refer to the window,
+     * so we don't need the data if this block
+     * takes us past the limit.
+     */
+    if (s->outcnt >= ZRAN_DEFLATE_WINDOW)
+        return ZRAN_DEFLATE_DONE;
+
+    if (s->incnt + len > s->inlen) {
+        s->err = ZRAN_DEFLATE_SCAN_NO_INPUT;
+        return -1;
+    }
+
+    s->incnt += len;
+    return 0;
+}
+
+
+/* Parse a fixed Huffman block. */
+int _zran_deflate_fixed(zran_deflate_state_t *s) {
+
+    short          lencnt[MAXBITS + 1];
+    short          lensym[FIXLCODES];
+    short          distcnt[MAXBITS + 1];
+    short          distsym[MAXDCODES];
+    short          lengths[FIXLCODES];
+    zran_huffman_t lencode  = {lencnt,  lensym};
+    zran_huffman_t distcode = {distcnt, distsym};
+    int            symbol;
+
+    /*
+     * Rebuilding the fixed tables for every block is
+     * wasteful, but keeps this function re-entrant.
+     */
+    for (symbol = 0;   symbol < 144;       symbol++) lengths[symbol] = 8;
+    for (;             symbol < 256;       symbol++) lengths[symbol] = 9;
+    for (;             symbol < 280;       symbol++) lengths[symbol] = 7;
+    for (;             symbol < FIXLCODES; symbol++) lengths[symbol] = 8;
+    _zran_deflate_construct(&lencode, lengths, FIXLCODES);
+
+    for (symbol = 0; symbol < MAXDCODES; symbol++) lengths[symbol] = 5;
+    _zran_deflate_construct(&distcode, lengths, MAXDCODES);
+
+    return _zran_deflate_codes(s, &lencode, &distcode);
+}
+
+
+/* Parse the header of a dynamic Huffman block. */
+int _zran_deflate_dynamic_header(zran_deflate_state_t *s,
+                                 zran_huffman_t       *lencode,
+                                 zran_huffman_t       *distcode) {
+
+    static const short order[19] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+    int   nlen;
+    int   ndist;
+    int   ncode;
+    int   index;
+    int   err;
+    int   symbol;
+    int   len;
+    short lengths[MAXCODES];
+
+    nlen  = _zran_deflate_bits(s, 5) + 257;
+    ndist = _zran_deflate_bits(s, 5) + 1;
+    ncode = _zran_deflate_bits(s, 4) + 4;
+
+    if (s->err)
+        return -1;
+
+    if (nlen > MAXLCODES || ndist > MAXDCODES) {
+        s->err = ZRAN_DEFLATE_SCAN_ERROR;
+        return -1;
+    }
+
+    /* Code length code lengths */
+    for (index = 0; index < ncode; index++)
+        lengths[order[index]] = _zran_deflate_bits(s, 3);
+    for (; index < 19; index++)
+        lengths[order[index]] = 0;
+
+    if (s->err)
+        return -1;
+
+    if (_zran_deflate_construct(lencode, lengths, 19) != 0) {
+        s->err = ZRAN_DEFLATE_SCAN_ERROR;
+        return -1;
+    }
+
+    /* Literal/length and distance code lengths */
+    index = 0;
+    while (index < nlen + ndist) {
+
+        symbol = _zran_deflate_decode(s, lencode);
+
+        if (symbol < 0)
+            return -1;
+
+        if (symbol < 16) {
+            lengths[index++] = symbol;
+            continue;
+        }
+
+        len = 0;
+        if (symbol == 16) {
+            if (index == 0) {
+                s->err = ZRAN_DEFLATE_SCAN_ERROR;
+                return -1;
+            }
+            len    = lengths[index - 1];
+            symbol = 3 + _zran_deflate_bits(s, 2);
+        }
+        else if (symbol == 17) symbol = 3  + _zran_deflate_bits(s, 3);
+        else                   symbol = 11 + _zran_deflate_bits(s, 7);
+
+        if (s->err)
+            return -1;
+
+        if (index + symbol > nlen + ndist) {
+            s->err = ZRAN_DEFLATE_SCAN_ERROR;
+            return -1;
+        }
+
+        while (symbol--)
+            lengths[index++] = len;
+    }
+
+    /* A block must have an end-of-block code */
+    if (lengths[256] == 0) {
+        s->err = ZRAN_DEFLATE_SCAN_ERROR;
+        return -1;
+    }
+
+    /* Incomplete codes are only allowed for a single length 1 code */
+    err = _zran_deflate_construct(lencode, lengths, nlen);
+    if (err < 0 || (err > 0 && nlen - lencode->count[0] != 1)) {
+        s->err = ZRAN_DEFLATE_SCAN_ERROR;
+        return -1;
+    }
+
+    err = _zran_deflate_construct(distcode, lengths + nlen, ndist);
+    if (err < 0 || (err > 0 && ndist - distcode->count[0] != 1)) {
+        s->err = ZRAN_DEFLATE_SCAN_ERROR;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* Parse a dynamic Huffman block. */
+int _zran_deflate_dynamic(zran_deflate_state_t *s) {
+
+    short          lencnt[MAXBITS + 1];
+    short          lensym[MAXLCODES];
+    short          distcnt[MAXBITS + 1];
+    short          distsym[MAXDCODES];
+    zran_huffman_t lencode  = {lencnt,  lensym};
+    zran_huffman_t distcode = {distcnt, distsym};
+
+    if (_zran_deflate_dynamic_header(s, &lencode, &distcode) != 0)
+        return -1;
+
+    return _zran_deflate_codes(s, &lencode, &distcode);
+}
+
+
+/* Find the window bytes referenced by some deflate data. */
+int zran_deflate_scan_refs(const uint8_t *in,
+                           size_t         inlen,
+                           uint8_t        first_bits,
+                           uint8_t        nbits,
+                           uint8_t       *refs) {
+
+    zran_deflate_state_t s;
+    uint32_t             last;
+    uint32_t             type;
+    int                  ret;
+
+    _zran_deflate_init(&s, in, inlen, 0);
+
+    s.bitbuf = first_bits & ((1u << nbits) - 1);
+    s.bitcnt = nbits;
+    s.refs   = refs;
+
+    do {
+        last = _zran_deflate_bits(&s, 1);
+        type = _zran_deflate_bits(&s, 2);
+
+        if (s.err)
+            return s.err;
+
+        if      (type == 0) ret = _zran_deflate_stored( &s);
+        else if (type == 1) ret = _zran_deflate_fixed(  &s);
+        else if (type == 2) ret = _zran_deflate_dynamic(&s);
+        else                return ZRAN_DEFLATE_SCAN_ERROR;
+
+        if (ret == ZRAN_DEFLATE_DONE) return ZRAN_DEFLATE_SCAN_OK;
+        if (ret < 0)                  return s.err ? s.err :
+                                                     ZRAN_DEFLATE_SCAN_ERROR;
+    } while (!last);
+
+    return ZRAN_DEFLATE_SCAN_OK;
+}
+
+
+/* Start decoding with an unknown window. */
+void zran_deflate_markers_init(zran_deflate_markers_t *markers,
+                               uint64_t                bitpos) {
+
+    uint32_t i;
+
+    for (i = 0; i < ZRAN_DEFLATE_WINDOW; i++)
+        markers->window[i] = 256 + i;
+
+    markers->nmarkers = ZRAN_DEFLATE_WINDOW;
+    markers->outcnt   = 0;
+    markers->bitpos   = bitpos;
+}
+
+
+/* Decode blocks, replacing unknown window bytes with markers. */
+int zran_deflate_decode_markers(const uint8_t          *in,
+                                size_t                  inlen,
+                                uint64_t                limit,
+                                uint64_t                outlimit,
+                                zran_deflate_markers_t *markers) {
+
+    zran_deflate_state_t s;
+    uint32_t             last;
+    uint32_t             type;
+    int                  ret;
+
+    _zran_deflate_init(&s, in, inlen, markers->bitpos);
+
+    s.outcnt  = markers->outcnt;
+    s.markers = markers;
+
+    while (1) {
+
+        last = _zran_deflate_bits(&s, 1);
+        type = _zran_deflate_bits(&s, 2);
+
+        if (s.err)
+            return s.err;
+
+        if      (type == 0) ret = _zran_deflate_stored( &s);
+        else if (type == 1) ret = _zran_deflate_fixed(  &s);
+        else if (type == 2) ret = _zran_deflate_dynamic(&s);
+        else                return ZRAN_DEFLATE_SCAN_ERROR;
+
+        if (ret < 0)
+            return s.err ? s.err : ZRAN_DEFLATE_SCAN_ERROR;
+
+        /*
+         * Only the outcome of complete blocks is
+         * recorded, so the caller can pick up from
+         * the last block boundary that was reached.
+         */
+        markers->outcnt = s.outcnt;
+        markers->bitpos = _zran_deflate_bitpos(&s);
+
+        if (last)                        return ZRAN_DEFLATE_DECODE_LAST;
+        if (markers->bitpos >= limit)    return ZRAN_DEFLATE_DECODE_LIMIT;
+        if (markers->nmarkers == 0)      return ZRAN_DEFLATE_DECODE_CLEAN;
+        if (markers->outcnt >= outlimit) return ZRAN_DEFLATE_DECODE_OUTPUT;
+    }
+}
+
+
+/* Find a possible dynamic block header. */
+int zran_deflate_find_block(const uint8_t *in,
+                            size_t         inlen,
+                            uint64_t       from,
+                            uint64_t       to,
+                            uint64_t      *found) {
+
+    zran_deflate_state_t s;
+    short                lencnt[MAXBITS + 1];
+    short                lensym[MAXLCODES];
+    short                distcnt[MAXBITS + 1];
+    short                distsym[MAXDCODES];
+    zran_huffman_t       lencode  = {lencnt,  lensym};
+    zran_huffman_t       distcode = {distcnt, distsym};
+    uint64_t             pos;
+
+    for (pos = from; pos < to && pos / 8 + 1 < inlen; pos++) {
+
+        /*
+         * Non-final dynamic blocks only - the
+         * header bits are 0 (not final), then
+         * 0, 1 (type 2, LSB first).
+         */
+        if (((in[pos / 8]       >> (pos       % 8)) & 1) != 0 ||
+            ((in[(pos + 1) / 8] >> ((pos + 1) % 8)) & 1) != 0)
+            continue;
+
+        _zran_deflate_init(&s, in, inlen, pos);
+
+        if (_zran_deflate_bits(&s, 3) != 4 || s.err)
+            continue;
+
+        if (_zran_deflate_dynamic_header(&s, &lencode, &distcode) == 0) {
+            *found = pos;
+            return ZRAN_DEFLATE_SCAN_OK;
+        }
+    }
+
+    return ZRAN_DEFLATE_SCAN_NO_INPUT;
+}
@@ -0,0 +1,153 @@
+#ifndef __ZRAN_DEFLATE_H__
+#define __ZRAN_DEFLATE_H__
+
+/*
+ * A minimal deflate stream parser, used by zran.c to determine which bytes
+ * of the window preceding an index point are actually referenced by the
+ * compressed data following the point. The parser decodes block headers,
+ * Huffman codes and match lengths/distances, but does not produce any
+ * uncompressed output.
+ *
+ * The parser can also decode data which starts at a block boundary in the
+ * middle of a deflate stream, without knowing the window which precedes
+ * it (see zran_deflate_decode_markers). This is used to build an index in
+ * parallel.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+
+/*
+ * Size of the deflate history window - a back-reference can refer to at
+ * most this many bytes before the current position.
+ */
+#define ZRAN_DEFLATE_WINDOW 32768
+
+
+/* Return codes for zran_deflate_scan_refs. */
+enum {
+    ZRAN_DEFLATE_SCAN_OK       =  0,
+    ZRAN_DEFLATE_SCAN_NO_INPUT = -1,
+    ZRAN_DEFLATE_SCAN_ERROR    = -2
+};
+
+
+/*
+ * Parses the raw deflate data in the given buffer, which must start at a
+ * block boundary, and marks the bytes of the preceding window which are
+ * referenced by back-references in the data.
+ *
+ * Deflate data is not necessarily byte-aligned - the data starts with the
+ * nbits least significant bits of first_bits, followed by the contents of
+ * the buffer.
+ *
+ * On return, refs[i] is non-zero if the byte located ZRAN_DEFLATE_WINDOW - i
+ * bytes before the start of the data is referenced. Parsing stops once
+ * ZRAN_DEFLATE_WINDOW bytes of uncompressed data would have been produced
+ * (as nothing after that can refer back to the window), or at the end of
+ * the final block of the stream.
+ *
+ * Returns:
+ *   - ZRAN_DEFLATE_SCAN_OK on success.
+ *   - ZRAN_DEFLATE_SCAN_NO_INPUT if the end of the buffer was reached
+ *     before parsing could finish.
+ *   - ZRAN_DEFLATE_SCAN_ERROR if the data is not valid deflate data.
+ */
+int zran_deflate_scan_refs(
+    const uint8_t *in,         /* Compressed data                          */
+    size_t         inlen,      /* Length of compressed data                */
+    uint8_t        first_bits, /* Bits preceding in                        */
+    uint8_t        nbits,      /* Number of bits in first_bits (0-7)       */
+    uint8_t       *refs        /* Array of ZRAN_DEFLATE_WINDOW bytes, which
+                                  must be initialised to 0 by the caller   */
+);
+
+
+/* Return codes for zran_deflate_decode_markers. */
+enum {
+    ZRAN_DEFLATE_DECODE_CLEAN  = 0,
+    ZRAN_DEFLATE_DECODE_LIMIT  = 1,
+    ZRAN_DEFLATE_DECODE_LAST   = 2,
+    ZRAN_DEFLATE_DECODE_OUTPUT = 3
+};
+
+
+/*
+ * State for zran_deflate_decode_markers. The window is a ring buffer
+ * containing the last ZRAN_DEFLATE_WINDOW decoded symbols - symbol
+ * outcnt - 1 is at window[(outcnt - 1) % ZRAN_DEFLATE_WINDOW]. A symbol
+ * less than 256 is a decoded byte. A symbol s >= 256 is a marker which
+ * refers to byte s - 256 of the (unknown) ZRAN_DEFLATE_WINDOW bytes which
+ * precede the start of the data, oldest first.
+ */
+typedef struct _zran_deflate_markers {
+    uint16_t window[ZRAN_DEFLATE_WINDOW]; /* Last decoded symbols        */
+    uint32_t nmarkers;                    /* Number of markers in window */
+    uint64_t outcnt;                      /* Symbols decoded so far      */
+    uint64_t bitpos;                      /* Bit offset into the input of
+                                             the next block              */
+} zran_deflate_markers_t;
+
+
+/*
+ * Initialises the given state to start decoding from the block at bit
+ * offset bitpos, with a window that contains nothing but markers.
+ */
+void zran_deflate_markers_init(
+    zran_deflate_markers_t *markers, /* State to initialise          */
+    uint64_t                bitpos   /* Bit offset of the first block */
+);
+
+
+/*
+ * Decodes the deflate blocks in the given buffer, starting from the block
+ * at markers->bitpos. Decoding stops at the end of a block, when:
+ *
+ *   - the block is the final block of the deflate stream
+ *     (ZRAN_DEFLATE_DECODE_LAST),
+ *   - the bit offset of the next block is >= limit
+ *     (ZRAN_DEFLATE_DECODE_LIMIT),
+ *   - the window no longer contains any markers, so the rest of the
+ *     stream can be decoded normally (ZRAN_DEFLATE_DECODE_CLEAN), or
+ *   - at least outlimit symbols have been decoded in total
+ *     (ZRAN_DEFLATE_DECODE_OUTPUT).
+ *
+ * On return, markers->bitpos and markers->outcnt refer to the end of the
+ * last block which was successfully decoded. If an error is returned, the
+ * contents of markers->window are undefined.
+ *
+ * Returns one of the codes above, ZRAN_DEFLATE_SCAN_NO_INPUT if the end of
+ * the buffer was reached, or ZRAN_DEFLATE_SCAN_ERROR if the data is not
+ * valid deflate data.
+ */
+int zran_deflate_decode_markers(
+    const uint8_t          *in,     /* Compressed data                    */
+    size_t                  inlen,  /* Length of compressed data          */
+    uint64_t                limit,    /* Bit offset to stop decoding at   */
+    uint64_t                outlimit, /* Output count to stop decoding at */
+    zran_deflate_markers_t *markers   /* Decoder state                    */
+);
+
+
+/*
+ * Searches the given buffer, from bit offset from up to (but not including)
+ * bit offset to, for something which looks like the start of a non-final
+ * deflate block with dynamic Huffman codes - the header must describe a
+ * valid set of codes. Stored and fixed Huffman blocks are not searched
+ * for, as their headers are too easily matched by chance.
+ *
+ * Returns ZRAN_DEFLATE_SCAN_OK if a candidate was found, in which case its
+ * bit offset is stored in found, or ZRAN_DEFLATE_SCAN_NO_INPUT otherwise.
+ * A candidate may be a false positive, so must be confirmed by decoding it.
+ */
+int zran_deflate_find_block(
+    const uint8_t *in,    /* Compressed data                      */
+    size_t         inlen, /* Length of compressed data            */
+    uint64_t       from,  /* Bit offset to start searching from   */
+    uint64_t       to,    /* Bit offset to stop searching at      */
+    uint64_t      *found  /* Place to store the candidate offset  */
+);
+
+
+#endif /* __ZRAN_DEFLATE_H__ */
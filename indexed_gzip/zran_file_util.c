@@ -156,6 +156,16 @@ int _ferror_python(PyObject *f) {
     else                return 0;
 }
 
+/*
+ * Implements a method analogous to clearerr that is performed on Python
+ * file-like objects.
+ */
+void _clearerr_python(PyObject *f) {
+    _ZRAN_FILE_UTIL_ACQUIRE_GIL
+    PyErr_Clear();
+    _ZRAN_FILE_UTIL_RELEASE_GIL
+}
+
 /*
  * Implements a method analogous to fflush that is performed on Python
  * file-like objects.
@@ -281,6 +291,15 @@ int ferror_(FILE *fd, PyObject *f) {
     return fd != NULL ? ferror(fd) : _ferror_python(f);
 }
 
+/*
+ * Calls clearerr on fd if specified, otherwise the Python-specific method on
+ * f.
+ */
+void clearerr_(FILE *fd, PyObject *f) {
+    if (fd != NULL) clearerr(fd);
+    else            _clearerr_python(f);
+}
+
 /*
  * Calls fseek on fd if specified, otherwise the Python-specific method on f.
  */
@@ -42,6 +42,12 @@ int _feof_python(PyObject *f, size_t f_ret);
  */
 int _ferror_python(PyObject *f);
 
+/*
+ * Implements a method analogous to clearerr that is performed on Python
+ * file-like objects, by clearing any pending Python exception.
+ */
+void _clearerr_python(PyObject *f);
+
 /*
  * Implements a method analogous to fflush that is performed on Python
  * file-like objects.
@@ -70,6 +76,12 @@ int _seekable_python(PyObject *f);
  */
 int ferror_(FILE *fd, PyObject *f);
 
+/*
+ * Calls clearerr on fd if specified, otherwise the Python-specific method on
+ * f.
+ */
+void clearerr_(FILE *fd, PyObject *f);
+
 /*
  * Calls fseek on fd if specified, otherwise the Python-specific method on f.
  */
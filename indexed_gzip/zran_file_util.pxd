@@ -20,6 +20,8 @@ cdef extern from "zran_file_util.h":
     
     int _ferror_python(PyObject *f)
     
+    void _clearerr_python(PyObject *f)
+    
     int _fflush_python(PyObject *f)
     
     size_t _fwrite_python(const void *ptr, size_t size, size_t nmemb, PyObject *f)
@@ -30,6 +32,8 @@ cdef extern from "zran_file_util.h":
 
     int ferror_(FILE *fd, PyObject *f)
 
+    void clearerr_(FILE *fd, PyObject *f)
+
     int fseek_(FILE *fd, PyObject *f, int64_t offset, int whence)
 
     int64_t ftell_(FILE *fd, PyObject *f)
@@ -62,6 +62,8 @@ class Clean(Command):
             op.join(igzbase, 'indexed_gzip.c'),
             op.join(igzbase, 'zran.o'),
             op.join(igzbase, 'zran_file_util.o'),
+            op.join(igzbase, 'zran_arena.o'),
+            op.join(igzbase, 'zran_deflate.o'),
             op.join(igzbase, '*.pyc'),
             op.join(igzbase, '*.so'),
             op.join(igzbase, 'tests', '*.so'),
@@ -193,7 +195,9 @@ igzip_ext = Extension(
     'indexed_gzip.indexed_gzip',
     [op.join('indexed_gzip', 'indexed_gzip.{}'.format(pyx_ext)),
      op.join('indexed_gzip', 'zran.c'),
-     op.join('indexed_gzip', 'zran_file_util.c')] + extra_srcs,
+     op.join('indexed_gzip', 'zran_file_util.c'),
+     op.join('indexed_gzip', 'zran_arena.c'),
+     op.join('indexed_gzip', 'zran_deflate.c')] + extra_srcs,
     libraries=libs,
     library_dirs=lib_dirs,
     include_dirs=include_dirs,
@@ -211,7 +215,9 @@ if not windows:
         'indexed_gzip.tests.ctest_zran',
         [op.join('indexed_gzip', 'tests', 'ctest_zran.{}'.format(pyx_ext)),
          op.join('indexed_gzip', 'zran.c'),
-         op.join('indexed_gzip', 'zran_file_util.c')] + extra_srcs,
+         op.join('indexed_gzip', 'zran_file_util.c'),
+         op.join('indexed_gzip', 'zran_arena.c'),
+         op.join('indexed_gzip', 'zran_deflate.c')] + extra_srcs,
         libraries=libs,
         library_dirs=lib_dirs,
         include_dirs=include_dirs,